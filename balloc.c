@@ -25,7 +25,14 @@
 
 #include <linux/fs.h>
 #include <linux/bitops.h>
+#include <linux/sort.h>
+#include <linux/kthread.h>
+#include <linux/mm.h>
+#include <linux/genhd.h>
+#include <linux/topology.h>
+#include <linux/memory_hotplug.h>
 #include "nova.h"
+#include "nova_trace.h"
 
 int nova_alloc_block_free_lists(struct super_block *sb)
 {
@@ -42,10 +49,32 @@ int nova_alloc_block_free_lists(struct super_block *sb)
 	for (i = 0; i < sbi->cpus; i++) {
 		free_list = nova_get_free_list(sb, i);
 		free_list->block_free_tree = RB_ROOT;
+		nova_init_size_classes(free_list);
 		spin_lock_init(&free_list->s_lock);
 	}
 
+	sbi->magazines = kzalloc(sbi->cpus * sizeof(struct block_magazine),
+							GFP_KERNEL);
+	if (!sbi->magazines)
+		goto out_free_lists;
+
+	sbi->cpu_free_list = kcalloc(sbi->cpus, sizeof(int), GFP_KERNEL);
+	if (!sbi->cpu_free_list)
+		goto out_magazines;
+
+	/* Identity mapping until the NUMA layout is known */
+	for (i = 0; i < sbi->cpus; i++)
+		sbi->cpu_free_list[i] = i;
+
 	return 0;
+
+out_magazines:
+	kfree(sbi->magazines);
+	sbi->magazines = NULL;
+out_free_lists:
+	kfree(sbi->free_lists);
+	sbi->free_lists = NULL;
+	return -ENOMEM;
 }
 
 void nova_delete_free_lists(struct super_block *sb)
@@ -55,6 +84,116 @@ void nova_delete_free_lists(struct super_block *sb)
 	/* Each tree is freed in save_blocknode_mappings */
 	kfree(sbi->free_lists);
 	sbi->free_lists = NULL;
+	kfree(sbi->magazines);
+	sbi->magazines = NULL;
+	kfree(sbi->cpu_free_list);
+	sbi->cpu_free_list = NULL;
+}
+
+/*
+ * NUMA node of the NVMM backing block range [low, high]. The range is
+ * sampled at its midpoint; if the pages have no memmap, fall back to the
+ * node of the pmem device holding it, then to the physical address lookup.
+ */
+static int nova_range_to_nid(struct super_block *sb, unsigned long low,
+	unsigned long high)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	u64 block = (u64)(low + (high - low) / 2) << PAGE_SHIFT;
+	struct nova_device *dev = nova_block_device(sbi, block);
+	unsigned long pfn = nova_get_pfn(sb, block);
+	u64 phys = (u64)pfn << PAGE_SHIFT;
+	int nid = NUMA_NO_NODE;
+
+	if (pfn_valid(pfn))
+		nid = pfn_to_nid(pfn);
+
+	if (nid == NUMA_NO_NODE && dev->bdev)
+		nid = dev_to_node(disk_to_dev(dev->bdev->bd_disk));
+
+#ifdef CONFIG_MEMORY_HOTPLUG
+	if (nid == NUMA_NO_NODE)
+		nid = memory_add_physaddr_to_nid(phys);
+#endif
+
+	if (nid == NUMA_NO_NODE || !node_online(nid))
+		nid = first_online_node;
+
+	return nid;
+}
+
+/* Closest node to @nid that backs at least one per-CPU free list */
+static int nova_nearest_list_node(struct super_block *sb, int nid)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list *free_list;
+	int best = -1;
+	int best_dist = INT_MAX;
+	int dist;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		free_list = nova_get_free_list(sb, i);
+		if (free_list->nid == nid)
+			return nid;
+
+		dist = node_distance(nid, free_list->nid);
+		if (dist < best_dist) {
+			best_dist = dist;
+			best = free_list->nid;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Bind each CPU to a free list on its own NUMA node, spreading the CPUs of
+ * a node round-robin over that node's lists. Nodes without NVMM use the
+ * nearest node that has some. Without NUMA this is the identity mapping.
+ */
+static void nova_map_cpu_free_lists(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list *free_list;
+	int *target;
+	int rank, nlists, pick;
+	int i, j;
+
+	target = kcalloc(sbi->cpus, sizeof(int), GFP_KERNEL);
+	if (!target)
+		return;
+
+	for (i = 0; i < sbi->cpus; i++)
+		target[i] = nova_nearest_list_node(sb, cpu_to_node(i));
+
+	for (i = 0; i < sbi->cpus; i++) {
+		rank = 0;
+		nlists = 0;
+		for (j = 0; j < i; j++)
+			if (target[j] == target[i])
+				rank++;
+		for (j = 0; j < sbi->cpus; j++) {
+			free_list = nova_get_free_list(sb, j);
+			if (free_list->nid == target[i])
+				nlists++;
+		}
+
+		pick = rank % nlists;
+		for (j = 0; j < sbi->cpus; j++) {
+			free_list = nova_get_free_list(sb, j);
+			if (free_list->nid != target[i])
+				continue;
+			if (pick-- == 0)
+				break;
+		}
+
+		sbi->cpu_free_list[i] = j;
+		nova_dbgv("%s: cpu %d (node %d) -> free list %d (node %d)\n",
+			__func__, i, cpu_to_node(i), j, target[i]);
+	}
+
+	kfree(target);
 }
 
 void nova_init_blockmap(struct super_block *sb, int recovery)
@@ -69,6 +208,8 @@ void nova_init_blockmap(struct super_block *sb, int recovery)
 	int ret;
 
 	num_used_block = sbi->reserved_blocks;
+	if (sbi->num_devs > 1)
+		nova_layout_device_lists(sb);
 
 	/* Divide the block range among per-CPU free lists */
 	per_list_blocks = sbi->num_blocks / sbi->cpus;
@@ -76,16 +217,29 @@ void nova_init_blockmap(struct super_block *sb, int recovery)
 	for (i = 0; i < sbi->cpus; i++) {
 		free_list = nova_get_free_list(sb, i);
 		tree = &(free_list->block_free_tree);
-		free_list->block_start = per_list_blocks * i;
-		free_list->block_end = free_list->block_start +
+		if (sbi->num_devs > 1) {
+			nova_device_list_range(sb, i, &free_list->block_start,
+						&free_list->block_end);
+		} else {
+			free_list->block_start = per_list_blocks * i;
+			free_list->block_end = free_list->block_start +
 						per_list_blocks - 1;
+		}
+		free_list->nid = nova_range_to_nid(sb, free_list->block_start,
+						free_list->block_end);
 
 		/* For recovery, update these fields later */
 		if (recovery == 0) {
-			free_list->num_free_blocks = per_list_blocks;
+			free_list->num_free_blocks = free_list->block_end -
+						free_list->block_start + 1;
 			if (i == 0) {
 				free_list->block_start += num_used_block;
 				free_list->num_free_blocks -= num_used_block;
+			} else if (nova_list_has_dev_header(sb, i)) {
+				free_list->block_start +=
+						NOVA_DEV_HEADER_BLOCKS;
+				free_list->num_free_blocks -=
+						NOVA_DEV_HEADER_BLOCKS;
 			}
 
 			blknode = nova_alloc_blocknode(sb);
@@ -109,7 +263,12 @@ void nova_init_blockmap(struct super_block *sb, int recovery)
 		/* Shared free list gets any remaining blocks */
 		sbi->shared_free_list.block_start = free_list->block_end + 1;
 		sbi->shared_free_list.block_end = sbi->num_blocks - 1;
+		sbi->shared_free_list.nid = nova_range_to_nid(sb,
+					sbi->shared_free_list.block_start,
+					sbi->shared_free_list.block_end);
 	}
+
+	nova_map_cpu_free_lists(sb);
 }
 
 static inline int nova_rbtree_compare_rangenode(struct nova_range_node *curr,
@@ -202,16 +361,95 @@ static int nova_insert_range_node(struct nova_sb_info *sbi,
 	return 0;
 }
 
+/* ======================= Size classes ========================= */
+
+void nova_init_size_classes(struct free_list *free_list)
+{
+	int i;
+
+	for (i = 0; i < NOVA_SIZE_CLASSES; i++)
+		INIT_LIST_HEAD(&free_list->size_class[i]);
+	free_list->size_class_map = 0;
+}
+
+static inline unsigned long nova_range_blocks(struct nova_range_node *node)
+{
+	return node->range_high - node->range_low + 1;
+}
+
+static inline int nova_size_class(unsigned long num_blocks)
+{
+	return fls_long(num_blocks) - 1;
+}
+
+static void nova_size_class_add(struct free_list *free_list,
+	struct nova_range_node *node)
+{
+	int class = nova_size_class(nova_range_blocks(node));
+
+	list_add(&node->size_list, &free_list->size_class[class]);
+	__set_bit(class, &free_list->size_class_map);
+}
+
+static void nova_size_class_del(struct free_list *free_list,
+	struct nova_range_node *node)
+{
+	int class = nova_size_class(nova_range_blocks(node));
+
+	list_del(&node->size_list);
+	if (list_empty(&free_list->size_class[class]))
+		__clear_bit(class, &free_list->size_class_map);
+}
+
+/* Change a free range in place, moving it to its new size class */
+static void nova_resize_blocknode(struct free_list *free_list,
+	struct nova_range_node *node, unsigned long low, unsigned long high)
+{
+	if (nova_size_class(high - low + 1) ==
+			nova_size_class(nova_range_blocks(node))) {
+		node->range_low = low;
+		node->range_high = high;
+		return;
+	}
+
+	nova_size_class_del(free_list, node);
+	node->range_low = low;
+	node->range_high = high;
+	nova_size_class_add(free_list, node);
+}
+
+/* Take a free range off the tree; the caller frees the node */
+static void nova_erase_blocknode(struct free_list *free_list,
+	struct nova_range_node *node)
+{
+	struct rb_node *next;
+
+	if (free_list->first_node == node) {
+		next = rb_next(&node->node);
+		free_list->first_node = next ?
+			container_of(next, struct nova_range_node, node) : NULL;
+	}
+
+	rb_erase(&node->node, &free_list->block_free_tree);
+	nova_size_class_del(free_list, node);
+	free_list->num_blocknode--;
+}
+
 inline int nova_insert_blocktree(struct nova_sb_info *sbi,
 	struct rb_root *tree, struct nova_range_node *new_node)
 {
+	struct free_list *free_list;
 	int ret;
 
 	ret = nova_insert_range_node(sbi, tree, new_node);
-	if (ret)
+	if (ret) {
 		nova_dbg("ERROR: %s failed %d\n", __func__, ret);
+		return ret;
+	}
 
-	return ret;
+	free_list = container_of(tree, struct free_list, block_free_tree);
+	nova_size_class_add(free_list, new_node);
+	return 0;
 }
 
 inline int nova_insert_inodetree(struct nova_sb_info *sbi,
@@ -272,8 +510,8 @@ int nova_find_free_slot(struct nova_sb_info *sbi,
 	return 0;
 }
 
-static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
-	int num, unsigned short btype, int log_page)
+static int __nova_free_blocks(struct super_block *sb, unsigned long blocknr,
+	int num, unsigned short btype, enum alloc_type atype)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct rb_root *tree;
@@ -293,9 +531,7 @@ static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
 		return -EINVAL;
 	}
 
-	cpuid = blocknr / sbi->per_list_blocks;
-	if (cpuid >= sbi->cpus)
-		cpuid = SHARED_CPU;
+	cpuid = nova_free_list_id(sbi, blocknr);
 
 	/* Pre-allocate blocknode */
 	curr_node = nova_alloc_blocknode(sb);
@@ -328,20 +564,22 @@ static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
 	if (prev && next && (block_low == prev->range_high + 1) &&
 			(block_high + 1 == next->range_low)) {
 		/* fits the hole */
-		rb_erase(&next->node, tree);
-		free_list->num_blocknode--;
-		prev->range_high = next->range_high;
+		nova_erase_blocknode(free_list, next);
+		nova_resize_blocknode(free_list, prev, prev->range_low,
+					next->range_high);
 		nova_free_blocknode(sb, next);
 		goto block_found;
 	}
 	if (prev && (block_low == prev->range_high + 1)) {
 		/* Aligns left */
-		prev->range_high += num_blocks;
+		nova_resize_blocknode(free_list, prev, prev->range_low,
+					block_high);
 		goto block_found;
 	}
 	if (next && (block_high + 1 == next->range_low)) {
 		/* Aligns right */
-		next->range_low -= num_blocks;
+		nova_resize_blocknode(free_list, next, block_low,
+					next->range_high);
 		goto block_found;
 	}
 
@@ -361,10 +599,10 @@ static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
 block_found:
 	free_list->num_free_blocks += num_blocks;
 
-	if (log_page) {
+	if (atype == LOG) {
 		free_list->free_log_count++;
 		free_list->freed_log_pages += num_blocks;
-	} else {
+	} else if (atype == DATA) {
 		free_list->free_data_count++;
 		free_list->freed_data_pages += num_blocks;
 	}
@@ -377,8 +615,272 @@ out:
 	return ret;
 }
 
-int nova_free_data_blocks(struct super_block *sb, struct nova_inode *pi,
-	unsigned long blocknr, int num)
+/* ======================= Block magazines ========================= */
+
+static int nova_cmp_blocknr(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	if (x < y)
+		return -1;
+	return x > y ? 1 : 0;
+}
+
+/* Return cached blocks to their free lists in contiguous runs */
+static void nova_release_magazine_blocks(struct super_block *sb,
+	unsigned long *blocks, int num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long start;
+	int count;
+	int i;
+
+	if (num == 0)
+		return;
+
+	sort(blocks, num, sizeof(unsigned long), nova_cmp_blocknr, NULL);
+
+	/* Frees were already accounted by the magazine */
+	start = blocks[0];
+	count = 1;
+	for (i = 1; i < num; i++) {
+		if (blocks[i] == start + count &&
+				nova_free_list_id(sbi, blocks[i]) ==
+				nova_free_list_id(sbi, start)) {
+			count++;
+			continue;
+		}
+
+		__nova_free_blocks(sb, start, count, NOVA_BLOCK_TYPE_4K, 0);
+		start = blocks[i];
+		count = 1;
+	}
+
+	__nova_free_blocks(sb, start, count, NOVA_BLOCK_TYPE_4K, 0);
+}
+
+/*
+ * Cache a freed 4K block in the local magazine. A full magazine drains its
+ * oldest batch to the free lists. Returns 1 if the block is cached.
+ */
+static int nova_magazine_free(struct super_block *sb, unsigned long blocknr,
+	enum alloc_type atype)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct block_magazine *magazine;
+	unsigned long drain[FREE_BATCH];
+	int num_drain = 0;
+	int cpu;
+
+	if (!sbi->magazines || nova_magazines_paused(sbi))
+		return 0;
+
+	cpu = get_cpu();
+	if (cpu >= sbi->cpus) {
+		put_cpu();
+		return 0;
+	}
+
+	magazine = &sbi->magazines[cpu];
+	if (magazine->count == MAGAZINE_SIZE) {
+		num_drain = FREE_BATCH;
+		memcpy(drain, magazine->blocks, sizeof(drain));
+		memmove(magazine->blocks, magazine->blocks + FREE_BATCH,
+			(MAGAZINE_SIZE - FREE_BATCH) * sizeof(unsigned long));
+		magazine->count -= FREE_BATCH;
+		NOVA_STATS_ADD(magazine_drain, 1);
+	}
+
+	magazine->blocks[magazine->count++] = blocknr;
+	if (atype == LOG)
+		magazine->free_log_count++;
+	else if (atype == DATA)
+		magazine->free_data_count++;
+	NOVA_STATS_ADD(magazine_free_hit, 1);
+	put_cpu();
+
+	nova_release_magazine_blocks(sb, drain, num_drain);
+	return 1;
+}
+
+/* Flush all magazines back to the free lists and stop caching */
+void nova_drain_block_magazines(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct block_magazine *magazines = sbi->magazines;
+	int i;
+
+	if (!magazines)
+		return;
+
+	sbi->magazines = NULL;
+	for (i = 0; i < sbi->cpus; i++) {
+		nova_release_magazine_blocks(sb, magazines[i].blocks,
+						magazines[i].count);
+		magazines[i].count = 0;
+	}
+
+	kfree(magazines);
+}
+
+/*
+ * Return all cached blocks to the free lists. The caller guarantees that
+ * nobody is using the magazines, see nova_magazines_paused().
+ */
+void nova_flush_block_magazines(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct block_magazine *magazine;
+	int i;
+
+	for (i = 0; sbi->magazines && i < sbi->cpus; i++) {
+		magazine = &sbi->magazines[i];
+		nova_release_magazine_blocks(sb, magazine->blocks,
+						magazine->count);
+		magazine->count = 0;
+	}
+}
+
+static int nova_log_pool_recycle(struct super_block *sb,
+	unsigned long blocknr, int num);
+
+/*
+ * The free delta is recorded before the blocks become visible to other
+ * allocators, so a later alloc of the same blocks always gets a higher
+ * sequence number.
+ */
+static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
+	int num, unsigned short btype, enum alloc_type atype)
+{
+	struct nova_checkpoint *ckpt = NOVA_SB(sb)->ckpt;
+	int taken;
+	int idx = 0;
+	int ret;
+
+	if (ckpt) {
+		idx = srcu_read_lock(&ckpt->srcu);
+		nova_ckpt_record_blocks(sb, NOVA_DELTA_BLOCK_FREE, blocknr,
+					num * nova_get_numblocks(btype), 0);
+	}
+
+	/* Whatever the log pool cannot take goes the usual way */
+	if (atype == LOG && nova_get_numblocks(btype) == 1) {
+		taken = nova_log_pool_recycle(sb, blocknr, num);
+		blocknr += taken;
+		num -= taken;
+	}
+
+	if (num == 0)
+		ret = 0;
+	else if (num == 1 && nova_get_numblocks(btype) == 1 &&
+			nova_magazine_free(sb, blocknr, atype))
+		ret = 0;
+	else
+		ret = __nova_free_blocks(sb, blocknr, num, btype, atype);
+
+	if (ckpt)
+		srcu_read_unlock(&ckpt->srcu, idx);
+	return ret;
+}
+
+/*
+ * Remove [@blocknr, @blocknr + @num) from its free list, whatever part of
+ * it is currently free.
+ */
+static int nova_claim_free_range(struct super_block *sb,
+	unsigned long blocknr, unsigned long num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long low = blocknr, high = blocknr + num - 1;
+	struct nova_range_node *curr, *found, *spare;
+	struct free_list *free_list;
+	struct rb_node *temp;
+
+	spare = nova_alloc_blocknode(sb);
+	if (!spare)
+		return -ENOMEM;
+
+	free_list = nova_get_free_list(sb, nova_free_list_id(sbi, blocknr));
+	spin_lock(&free_list->s_lock);
+	while (1) {
+		/* Lowest free range ending at or above low */
+		found = NULL;
+		temp = free_list->block_free_tree.rb_node;
+		while (temp) {
+			curr = container_of(temp, struct nova_range_node, node);
+			if (curr->range_high < low) {
+				temp = temp->rb_right;
+			} else {
+				found = curr;
+				temp = temp->rb_left;
+			}
+		}
+
+		if (!found || found->range_low > high)
+			break;
+
+		free_list->num_free_blocks -=
+			min(found->range_high, high) -
+			max(found->range_low, low) + 1;
+
+		if (found->range_low >= low && found->range_high <= high) {
+			nova_erase_blocknode(free_list, found);
+			nova_free_blocknode(sb, found);
+		} else if (found->range_low < low && found->range_high > high) {
+			spare->range_low = high + 1;
+			spare->range_high = found->range_high;
+			nova_resize_blocknode(free_list, found,
+						found->range_low, low - 1);
+			nova_insert_blocktree(sbi, &free_list->block_free_tree,
+						spare);
+			free_list->num_blocknode++;
+			spare = NULL;
+			break;
+		} else if (found->range_low < low) {
+			nova_resize_blocknode(free_list, found,
+						found->range_low, low - 1);
+		} else {
+			nova_resize_blocknode(free_list, found,
+						high + 1, found->range_high);
+			break;
+		}
+	}
+
+	temp = rb_first(&free_list->block_free_tree);
+	free_list->first_node = temp ?
+		container_of(temp, struct nova_range_node, node) : NULL;
+	spin_unlock(&free_list->s_lock);
+
+	if (spare)
+		nova_free_blocknode(sb, spare);
+	return 0;
+}
+
+/*
+ * Apply one delta record during recovery. Both directions are idempotent,
+ * so a record whose effect already made it into the checkpoint is harmless.
+ */
+int nova_replay_block_delta(struct super_block *sb, unsigned long blocknr,
+	unsigned long num, int free)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int ret;
+
+	if (num == 0 || blocknr + num > sbi->num_blocks ||
+			nova_free_list_id(sbi, blocknr) !=
+			nova_free_list_id(sbi, blocknr + num - 1))
+		return -EINVAL;
+
+	ret = nova_claim_free_range(sb, blocknr, num);
+	if (ret == 0 && free)
+		ret = __nova_free_blocks(sb, blocknr, num,
+					NOVA_BLOCK_TYPE_4K, 0);
+	return ret;
+}
+
+static int __nova_free_data_blocks(struct super_block *sb,
+	struct nova_inode *pi, unsigned long blocknr, int num)
 {
 	int ret;
 	timing_t free_time;
@@ -390,16 +892,31 @@ int nova_free_data_blocks(struct super_block *sb, struct nova_inode *pi,
 		return -EINVAL;
 	}
 	NOVA_START_TIMING(free_data_t, free_time);
-	ret = nova_free_blocks(sb, blocknr, num, pi->i_blk_type, 0);
+	ret = nova_free_blocks(sb, blocknr, num, pi->i_blk_type, DATA);
+	if (ret == 0)
+		nova_qos_uncharge_blocks(sb, pi, num);
 	if (ret)
 		nova_err(sb, "Inode %llu: free %d data block from %lu to %lu "
 				"failed!\n", pi->nova_ino, num, blocknr,
 				blocknr + num - 1);
 	NOVA_END_TIMING(free_data_t, free_time);
+	trace_nova_free_blocks(sb, pi->nova_ino, DATA, blocknr, num, ret);
 
 	return ret;
 }
 
+/* Blocks shared by clones are only freed with their last owner */
+int nova_free_data_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned long blocknr, int num)
+{
+	if (nova_has_shared_blocks(sb) &&
+			pi->i_blk_type == NOVA_BLOCK_TYPE_4K)
+		return nova_put_shared_blocks(sb, pi, blocknr, num,
+						__nova_free_data_blocks);
+
+	return __nova_free_data_blocks(sb, pi, blocknr, num);
+}
+
 int nova_free_log_blocks(struct super_block *sb, struct nova_inode *pi,
 	unsigned long blocknr, int num)
 {
@@ -413,118 +930,862 @@ int nova_free_log_blocks(struct super_block *sb, struct nova_inode *pi,
 		return -EINVAL;
 	}
 	NOVA_START_TIMING(free_log_t, free_time);
-	ret = nova_free_blocks(sb, blocknr, num, pi->i_blk_type, 1);
+	ret = nova_free_blocks(sb, blocknr, num, pi->i_blk_type, LOG);
 	if (ret)
 		nova_err(sb, "Inode %llu: free %d log block from %lu to %lu "
 				"failed!\n", pi->nova_ino, num, blocknr,
 				blocknr + num - 1);
 	NOVA_END_TIMING(free_log_t, free_time);
+	trace_nova_free_blocks(sb, pi->nova_ino, LOG, blocknr, num, ret);
 
 	return ret;
 }
 
-static unsigned long nova_alloc_blocks_in_free_list(struct super_block *sb,
-	struct free_list *free_list, unsigned short btype,
-	unsigned long num_blocks, unsigned long *new_blocknr)
-{
-	struct rb_root *tree;
-	struct nova_range_node *curr, *next = NULL;
-	struct rb_node *temp, *next_node;
-	unsigned long curr_blocks;
-	bool found = 0;
-	unsigned long step = 0;
-
-	tree = &(free_list->block_free_tree);
-	temp = &(free_list->first_node->node);
-
-	while (temp) {
-		step++;
-		curr = container_of(temp, struct nova_range_node, node);
+/* ======================= Deferred frees ========================= */
 
-		curr_blocks = curr->range_high - curr->range_low + 1;
+static int nova_cmp_free_range(const void *a, const void *b)
+{
+	const struct nova_free_range *x = a;
+	const struct nova_free_range *y = b;
 
-		if (num_blocks >= curr_blocks) {
-			/* Superpage allocation must succeed */
-			if (btype > 0 && num_blocks > curr_blocks) {
-				temp = rb_next(temp);
-				continue;
-			}
+	if (x->blocknr < y->blocknr)
+		return -1;
+	return x->blocknr > y->blocknr ? 1 : 0;
+}
 
-			/* Otherwise, allocate the whole blocknode */
-			if (curr == free_list->first_node) {
-				next_node = rb_next(temp);
-				if (next_node)
-					next = container_of(next_node,
-						struct nova_range_node, node);
-				free_list->first_node = next;
-			}
+/* Free one batch in block order, merging runs within each free list */
+static void nova_release_free_batch(struct super_block *sb,
+	struct nova_free_batch *batch)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_free_range *range;
+	unsigned long start, count, total = 0;
+	int i;
 
-			rb_erase(&curr->node, tree);
-			free_list->num_blocknode--;
-			num_blocks = curr_blocks;
-			*new_blocknr = curr->range_low;
-			nova_free_blocknode(sb, curr);
-			found = 1;
-			break;
+	if (batch->num == 0)
+		return;
+
+	for (i = 0; i < batch->num; i++)
+		total += batch->ranges[i].num;
+
+	sort(batch->ranges, batch->num, sizeof(struct nova_free_range),
+			nova_cmp_free_range, NULL);
+
+	/* Frees were already accounted when the ranges were queued */
+	start = batch->ranges[0].blocknr;
+	count = batch->ranges[0].num;
+	for (i = 1; i < batch->num; i++) {
+		range = &batch->ranges[i];
+		if (range->blocknr == start + count &&
+				nova_free_list_id(sbi, range->blocknr) ==
+				nova_free_list_id(sbi, start)) {
+			count += range->num;
+			continue;
 		}
 
-		/* Allocate partial blocknode */
-		*new_blocknr = curr->range_low;
-		curr->range_low += num_blocks;
-		found = 1;
-		break;
+		__nova_free_blocks(sb, start, count, NOVA_BLOCK_TYPE_4K, DATA);
+		NOVA_STATS_ADD(deferred_free_runs, 1);
+		start = range->blocknr;
+		count = range->num;
 	}
 
-	free_list->num_free_blocks -= num_blocks;
-
-	NOVA_STATS_ADD(alloc_steps, step);
-
-	if (found == 0)
-		return -ENOSPC;
-
-	return num_blocks;
+	__nova_free_blocks(sb, start, count, NOVA_BLOCK_TYPE_4K, DATA);
+	NOVA_STATS_ADD(deferred_free_runs, 1);
+	atomic_long_sub(total, &sbi->deferred_free_blocks);
 }
 
-/* Find out the free list with most free blocks */
-static int nova_get_candidate_free_list(struct super_block *sb)
+/*
+ * Free everything queued so far, after a grace period of dax_read_srcu.
+ * Like a log pool refill, the batches are in flight only inside the
+ * checkpoint SRCU section.
+ */
+void nova_drain_deferred_frees(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct free_list *free_list;
-	int cpuid = 0;
-	int num_free_blocks = 0;
+	struct nova_checkpoint *ckpt = sbi->ckpt;
+	struct nova_free_queue *queue;
+	struct nova_free_batch *batch, *next;
+	LIST_HEAD(batches);
+	int idx = 0;
 	int i;
+	timing_t drain_time;
+
+	if (!sbi->free_queues)
+		return;
+
+	mutex_lock(&sbi->deferred_free_mutex);
+	if (ckpt)
+		idx = srcu_read_lock(&ckpt->srcu);
 
 	for (i = 0; i < sbi->cpus; i++) {
-		free_list = nova_get_free_list(sb, i);
-		if (free_list->num_free_blocks > num_free_blocks) {
-			cpuid = i;
-			num_free_blocks = free_list->num_free_blocks;
+		queue = &sbi->free_queues[i];
+		spin_lock(&queue->lock);
+		list_splice_tail_init(&queue->full, &batches);
+		if (queue->open && queue->open->num) {
+			list_add_tail(&queue->open->list, &batches);
+			queue->open = NULL;
 		}
+		spin_unlock(&queue->lock);
+	}
+
+	if (list_empty(&batches))
+		goto out;
+
+	NOVA_START_TIMING(deferred_free_t, drain_time);
+	synchronize_srcu(&sbi->dax_read_srcu);
+
+	list_for_each_entry_safe(batch, next, &batches, list) {
+		list_del(&batch->list);
+		nova_release_free_batch(sb, batch);
+		kfree(batch);
 	}
+	NOVA_END_TIMING(deferred_free_t, drain_time);
 
-	return cpuid;
+out:
+	if (ckpt)
+		srcu_read_unlock(&ckpt->srcu, idx);
+	sbi->deferred_free_drains++;
+	mutex_unlock(&sbi->deferred_free_mutex);
+	wake_up_all(&sbi->deferred_free_wait);
 }
 
-/* Return how many blocks allocated */
-static int nova_new_blocks(struct super_block *sb, unsigned long *blocknr,
-	unsigned int num, unsigned short btype, int zero,
-	enum alloc_type atype)
+/* Blocks freed but still waiting for readers, free to statfs */
+unsigned long nova_count_deferred_free_blocks(struct super_block *sb)
 {
-	struct free_list *free_list;
-	void *bp;
-	unsigned long num_blocks = 0;
-	unsigned long ret_blocks = 0;
-	unsigned long new_blocknr = 0;
-	struct rb_node *temp;
-	struct nova_range_node *first;
-	int cpuid;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (!sbi->free_queues)
+		return 0;
+	return atomic_long_read(&sbi->deferred_free_blocks);
+}
+
+/*
+ * Let an allocation that ran out of space wait for the queued frees to be
+ * released. The drain is left to the work item and the wait is bounded,
+ * because the caller may be inside a dax_read_srcu section itself, e.g.
+ * faulting on a NOVA mapping while copying out a read. Returns 1 if
+ * there was anything to wait for.
+ */
+static int nova_wait_deferred_frees(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long drains;
+
+	if (nova_count_deferred_free_blocks(sb) == 0)
+		return 0;
+
+	NOVA_STATS_ADD(deferred_free_waits, 1);
+	drains = READ_ONCE(sbi->deferred_free_drains);
+	mod_delayed_work(system_long_wq, &sbi->deferred_free_work, 0);
+	/* A drain already running may have missed the latest frees */
+	wait_event_timeout(sbi->deferred_free_wait,
+			atomic_long_read(&sbi->deferred_free_blocks) == 0 ||
+			READ_ONCE(sbi->deferred_free_drains) - drains >= 2,
+			DEFERRED_FREE_WAIT);
+	return 1;
+}
+
+static void nova_deferred_free_work(struct work_struct *work)
+{
+	struct nova_sb_info *sbi = container_of(to_delayed_work(work),
+				struct nova_sb_info, deferred_free_work);
+
+	nova_drain_deferred_frees(sbi->sb);
+}
+
+/* Queue [@blocknr, @blocknr + @num) on the local CPU; 0 on success */
+static int nova_queue_free_range(struct super_block *sb,
+	unsigned long blocknr, unsigned long num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_free_queue *queue;
+	struct nova_free_batch *batch, *spare = NULL;
+	struct nova_free_range *last;
+	int cpu = raw_smp_processor_id();
+	int full = 0;
+
+	if (!sbi->free_queues || cpu >= sbi->cpus)
+		return -EINVAL;
+
+	queue = &sbi->free_queues[cpu];
+retry:
+	spin_lock(&queue->lock);
+	batch = queue->open;
+	if (!batch || batch->num == DEFERRED_FREE_RANGES) {
+		if (!spare) {
+			spin_unlock(&queue->lock);
+			spare = kmalloc(sizeof(struct nova_free_batch),
+							GFP_NOFS);
+			if (!spare)
+				return -ENOMEM;
+			goto retry;
+		}
+		if (batch) {
+			list_add_tail(&batch->list, &queue->full);
+			full = 1;
+		}
+		spare->num = 0;
+		queue->open = batch = spare;
+		spare = NULL;
+	}
+
+	last = batch->num ? &batch->ranges[batch->num - 1] : NULL;
+	if (last && last->blocknr + last->num == blocknr) {
+		last->num += num;
+	} else {
+		batch->ranges[batch->num].blocknr = blocknr;
+		batch->ranges[batch->num].num = num;
+		batch->num++;
+	}
+	atomic_long_add(num, &sbi->deferred_free_blocks);
+	spin_unlock(&queue->lock);
+
+	kfree(spare);
+	if (full)
+		mod_delayed_work(system_long_wq, &sbi->deferred_free_work, 0);
+	else
+		queue_delayed_work(system_long_wq, &sbi->deferred_free_work,
+					DEFERRED_FREE_DELAY);
+	return 0;
+}
+
+/*
+ * Free data blocks that a lockless reader may still be copying from. The
+ * free delta is recorded up front, so to the checkpoint queued blocks are
+ * free like magazine blocks. If no batch can be allocated the blocks are
+ * freed at once, as they were before deferral.
+ */
+static int __nova_defer_free_data_blocks(struct super_block *sb,
+	struct nova_inode *pi, unsigned long blocknr, int num)
+{
+	struct nova_checkpoint *ckpt = NOVA_SB(sb)->ckpt;
+	unsigned long num_blocks = num * nova_get_numblocks(pi->i_blk_type);
+	int idx = 0;
+	int ret;
+
+	if (blocknr == 0 || num <= 0) {
+		nova_dbg("%s: ERROR: %lu, %d\n", __func__, blocknr, num);
+		return -EINVAL;
+	}
+
+	if (ckpt) {
+		idx = srcu_read_lock(&ckpt->srcu);
+		nova_ckpt_record_blocks(sb, NOVA_DELTA_BLOCK_FREE, blocknr,
+					num_blocks, 0);
+	}
+
+	ret = nova_queue_free_range(sb, blocknr, num_blocks);
+	if (ret) {
+		NOVA_STATS_ADD(deferred_free_overflow, 1);
+		ret = __nova_free_blocks(sb, blocknr, num, pi->i_blk_type,
+						DATA);
+	} else {
+		NOVA_STATS_ADD(deferred_free_ranges, 1);
+	}
+	/* Queued blocks no longer count against the tenant */
+	if (ret == 0)
+		nova_qos_uncharge_blocks(sb, pi, num);
+
+	if (ckpt)
+		srcu_read_unlock(&ckpt->srcu, idx);
+
+	trace_nova_free_blocks(sb, pi->nova_ino, DATA, blocknr, num, ret);
+	return ret;
+}
+
+int nova_defer_free_data_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned long blocknr, int num)
+{
+	if (nova_has_shared_blocks(sb) &&
+			pi->i_blk_type == NOVA_BLOCK_TYPE_4K)
+		return nova_put_shared_blocks(sb, pi, blocknr, num,
+						__nova_defer_free_data_blocks);
+
+	return __nova_defer_free_data_blocks(sb, pi, blocknr, num);
+}
+
+int nova_init_deferred_free(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_free_queue *queues;
+	int ret;
+	int i;
+
+	queues = kcalloc(sbi->cpus, sizeof(struct nova_free_queue),
+							GFP_KERNEL);
+	if (!queues)
+		return -ENOMEM;
+
+	ret = init_srcu_struct(&sbi->dax_read_srcu);
+	if (ret) {
+		kfree(queues);
+		return ret;
+	}
+
+	for (i = 0; i < sbi->cpus; i++) {
+		spin_lock_init(&queues[i].lock);
+		INIT_LIST_HEAD(&queues[i].full);
+	}
+
+	mutex_init(&sbi->deferred_free_mutex);
+	atomic_long_set(&sbi->deferred_free_blocks, 0);
+	init_waitqueue_head(&sbi->deferred_free_wait);
+	INIT_DELAYED_WORK(&sbi->deferred_free_work, nova_deferred_free_work);
+	sbi->free_queues = queues;
+	return 0;
+}
+
+/* Queued blocks must reach the free lists before they are saved */
+void nova_destroy_deferred_free(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int i;
+
+	if (!sbi->free_queues)
+		return;
+
+	cancel_delayed_work_sync(&sbi->deferred_free_work);
+	nova_drain_deferred_frees(sb);
+
+	for (i = 0; i < sbi->cpus; i++)
+		kfree(sbi->free_queues[i].open);
+	kfree(sbi->free_queues);
+	sbi->free_queues = NULL;
+	cleanup_srcu_struct(&sbi->dax_read_srcu);
+}
+
+/*
+ * Look through at most @limit ranges (0 for all) of each size class in
+ * [@lo_class, @hi_class) for one holding @num_blocks from an @align-block
+ * physical boundary, whose first block is returned in *low.
+ */
+static struct nova_range_node *nova_scan_size_classes(
+	struct free_list *free_list, int lo_class, int hi_class,
+	unsigned long num_blocks, unsigned long align, unsigned long base,
+	int limit, unsigned long *low, unsigned long *step)
+{
+	struct nova_range_node *curr;
+	int class, tried;
+
+	for (class = lo_class; class < hi_class; class++) {
+		tried = 0;
+		list_for_each_entry(curr, &free_list->size_class[class],
+					size_list) {
+			if (limit && tried++ == limit)
+				break;
+			(*step)++;
+			*low = ALIGN(curr->range_low + base, align) - base;
+			if (*low + num_blocks - 1 <= curr->range_high)
+				return curr;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Best fit by size class. Every range of fit_class and above holds the
+ * request at any alignment, so the smallest non-empty one of those is
+ * found with one bitmap search. The classes below it may hold a fit too:
+ * a few of their ranges are tried first, and all of them only when no
+ * larger range exists. Small requests thus eat small fragments and leave
+ * the large ranges to the superpage and huge page paths.
+ */
+static struct nova_range_node *nova_find_fit(struct super_block *sb,
+	struct free_list *free_list, unsigned long num_blocks,
+	unsigned long align, unsigned long *low)
+{
+	/* Physical frame of block 0 as seen from this list's device */
+	unsigned long base = nova_get_pfn(sb,
+			(u64)free_list->block_start << PAGE_SHIFT) -
+			free_list->block_start;
+	struct nova_range_node *curr;
+	int lo_class = nova_size_class(num_blocks);
+	int fit_class = nova_size_class(num_blocks + align - 1) + 1;
+	unsigned long step = 0;
+	int class;
+
+	curr = nova_scan_size_classes(free_list, lo_class, fit_class,
+			num_blocks, align, base, NOVA_CLASS_SCAN, low, &step);
+	if (curr)
+		goto out;
+
+	class = fit_class < NOVA_SIZE_CLASSES ?
+		find_next_bit(&free_list->size_class_map, NOVA_SIZE_CLASSES,
+				fit_class) : NOVA_SIZE_CLASSES;
+	if (class < NOVA_SIZE_CLASSES) {
+		step++;
+		curr = list_first_entry(&free_list->size_class[class],
+					struct nova_range_node, size_list);
+		*low = ALIGN(curr->range_low + base, align) - base;
+		goto out;
+	}
+
+	curr = nova_scan_size_classes(free_list, lo_class, fit_class,
+			num_blocks, align, base, 0, low, &step);
+out:
+	NOVA_STATS_ADD(alloc_steps, step);
+	return curr;
+}
+
+static unsigned long nova_alloc_blocks_in_free_list(struct super_block *sb,
+	struct free_list *free_list, unsigned short btype,
+	unsigned long num_blocks, unsigned long *new_blocknr)
+{
+	struct nova_range_node *curr;
+	unsigned long low;
+	int class;
+
+	curr = nova_find_fit(sb, free_list, num_blocks, 1, &low);
+	if (!curr) {
+		/* Superpage allocation must succeed */
+		if (btype > 0 || !free_list->size_class_map)
+			return -ENOSPC;
+
+		/* Otherwise, allocate the largest blocknode whole */
+		class = fls_long(free_list->size_class_map) - 1;
+		curr = list_first_entry(&free_list->size_class[class],
+					struct nova_range_node, size_list);
+		num_blocks = nova_range_blocks(curr);
+	}
+
+	*new_blocknr = curr->range_low;
+	if (num_blocks == nova_range_blocks(curr)) {
+		nova_erase_blocknode(free_list, curr);
+		nova_free_blocknode(sb, curr);
+	} else {
+		nova_resize_blocknode(free_list, curr,
+				curr->range_low + num_blocks, curr->range_high);
+	}
+
+	free_list->num_free_blocks -= num_blocks;
+	return num_blocks;
+}
+
+/*
+ * Serve a single 4K block from the local magazine, refilling it with one
+ * batch from the local free list when empty. Returns 0 on miss.
+ */
+static unsigned long nova_magazine_alloc(struct super_block *sb,
+	enum alloc_type atype)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct block_magazine *magazine;
+	struct free_list *free_list;
+	unsigned long new_blocknr = 0;
+	unsigned long blocknr = 0;
+	long allocated = 0;
+	int cpu;
+
+	if (!sbi->magazines || nova_magazines_paused(sbi))
+		return 0;
+
+	cpu = get_cpu();
+	if (cpu >= sbi->cpus)
+		goto out;
+
+	magazine = &sbi->magazines[cpu];
+	if (magazine->count == 0) {
+		free_list = nova_get_free_list(sb,
+					nova_home_free_list(sb, cpu));
+		spin_lock(&free_list->s_lock);
+		if (free_list->first_node &&
+				free_list->num_free_blocks >= FREE_BATCH)
+			allocated = nova_alloc_blocks_in_free_list(sb,
+					free_list, NOVA_BLOCK_TYPE_4K,
+					FREE_BATCH, &new_blocknr);
+		spin_unlock(&free_list->s_lock);
+
+		/* Hand out the lowest block first */
+		while (allocated > 0) {
+			allocated--;
+			magazine->blocks[magazine->count++] =
+						new_blocknr + allocated;
+		}
+		NOVA_STATS_ADD(magazine_alloc_miss, 1);
+	} else {
+		NOVA_STATS_ADD(magazine_alloc_hit, 1);
+	}
+
+	if (magazine->count) {
+		blocknr = magazine->blocks[--magazine->count];
+		if (atype == LOG)
+			magazine->alloc_log_count++;
+		else if (atype == DATA)
+			magazine->alloc_data_count++;
+	}
+out:
+	put_cpu();
+	return blocknr;
+}
+
+/* ======================= Log page pool ========================= */
+
+static inline void nova_kick_log_pool(struct nova_sb_info *sbi)
+{
+	if (!READ_ONCE(sbi->log_pool_kick)) {
+		WRITE_ONCE(sbi->log_pool_kick, 1);
+		wake_up_interruptible(&sbi->log_pool_wait);
+	}
+}
+
+static inline struct nova_log_pool *nova_get_log_pool(
+	struct nova_sb_info *sbi, int cpuid)
+{
+	if (!sbi->log_pools || nova_magazines_paused(sbi))
+		return NULL;
+
+	if (cpuid == ANY_CPU)
+		cpuid = raw_smp_processor_id();
+
+	return cpuid < sbi->cpus ? &sbi->log_pools[cpuid] : NULL;
+}
+
+/* Take a zeroed page from @cpuid's pool. Returns 0 if it is empty. */
+static unsigned long nova_log_pool_alloc(struct super_block *sb, int cpuid)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_pool *pool;
+	unsigned long blocknr = 0;
+	int low;
+
+	pool = nova_get_log_pool(sbi, cpuid);
+	if (!pool)
+		return 0;
+
+	spin_lock(&pool->lock);
+	if (pool->num_clean) {
+		blocknr = pool->clean[--pool->num_clean];
+		pool->alloc_count++;
+	}
+	low = pool->num_clean < LOG_POOL_LOW;
+	spin_unlock(&pool->lock);
+
+	if (low)
+		nova_kick_log_pool(sbi);
+
+	if (blocknr) {
+		NOVA_STATS_ADD(log_pool_hit, 1);
+	} else {
+		NOVA_STATS_ADD(log_pool_miss, 1);
+	}
+	return blocknr;
+}
+
+/*
+ * Park freed log pages in the local pool for the refill thread to zero.
+ * Returns how many of the @num pages from @blocknr were taken.
+ */
+static int nova_log_pool_recycle(struct super_block *sb,
+	unsigned long blocknr, int num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_pool *pool;
+	int taken = 0;
+	int kick;
+
+	pool = nova_get_log_pool(sbi, ANY_CPU);
+	if (!pool)
+		return 0;
+
+	spin_lock(&pool->lock);
+	while (taken < num && pool->num_dirty < LOG_POOL_SIZE)
+		pool->dirty[pool->num_dirty++] = blocknr + taken++;
+	pool->free_count += taken;
+	kick = pool->num_dirty >= LOG_POOL_BATCH;
+	spin_unlock(&pool->lock);
+
+	if (kick)
+		nova_kick_log_pool(sbi);
+
+	NOVA_STATS_ADD(log_pool_recycled, taken);
+	return taken;
+}
+
+/*
+ * Zero one batch of recycled pages, or of fresh pages from the home free
+ * list when there are none, and move it to clean[]. The whole move runs in
+ * the checkpoint SRCU section so that a checkpoint never flushes the pools
+ * while pages are in flight. Returns the number of pages added.
+ */
+static int nova_refill_log_pool(struct super_block *sb, int cpu)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_checkpoint *ckpt = sbi->ckpt;
+	struct nova_log_pool *pool = &sbi->log_pools[cpu];
+	unsigned long batch[LOG_POOL_BATCH];
+	struct free_list *free_list;
+	unsigned long new_blocknr = 0;
+	long allocated = 0;
+	int fresh;
+	int num = 0;
+	int idx = 0;
+	int i;
+
+	if (ckpt)
+		idx = srcu_read_lock(&ckpt->srcu);
+	if (nova_magazines_paused(sbi))
+		goto out;
+
+	spin_lock(&pool->lock);
+	num = min3(pool->num_dirty, LOG_POOL_SIZE - pool->num_clean,
+			LOG_POOL_BATCH);
+	pool->num_dirty -= num;
+	memcpy(batch, pool->dirty + pool->num_dirty,
+			num * sizeof(unsigned long));
+	fresh = num == 0 && pool->num_clean < LOG_POOL_TARGET;
+	spin_unlock(&pool->lock);
+
+	if (fresh) {
+		free_list = nova_get_free_list(sb,
+					nova_home_free_list(sb, cpu));
+		spin_lock(&free_list->s_lock);
+		if (free_list->first_node &&
+				free_list->num_free_blocks >= LOG_POOL_BATCH)
+			allocated = nova_alloc_blocks_in_free_list(sb,
+					free_list, NOVA_BLOCK_TYPE_4K,
+					LOG_POOL_BATCH, &new_blocknr);
+		spin_unlock(&free_list->s_lock);
+
+		while (num < allocated) {
+			batch[num] = new_blocknr + num;
+			num++;
+		}
+	}
+
+	if (num == 0)
+		goto out;
+
+	for (i = 0; i < num; i++)
+		memset_nt(nova_get_block(sb, nova_get_block_off(sb,
+				batch[i], NOVA_BLOCK_TYPE_4K)), 0, PAGE_SIZE);
+	PERSISTENT_BARRIER();
+
+	/* Allocators only shrink clean[], so the room is still there */
+	spin_lock(&pool->lock);
+	memcpy(pool->clean + pool->num_clean, batch,
+			num * sizeof(unsigned long));
+	pool->num_clean += num;
+	spin_unlock(&pool->lock);
+
+out:
+	if (ckpt)
+		srcu_read_unlock(&ckpt->srcu, idx);
+	return num;
+}
+
+static int nova_log_pool_func(void *data)
+{
+	struct super_block *sb = data;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int added;
+	int i;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible_timeout(sbi->log_pool_wait,
+				READ_ONCE(sbi->log_pool_kick) ||
+				kthread_should_stop(), HZ);
+		WRITE_ONCE(sbi->log_pool_kick, 0);
+
+		do {
+			added = 0;
+			for (i = 0; i < sbi->cpus && !kthread_should_stop();
+					i++)
+				added += nova_refill_log_pool(sb, i);
+			cond_resched();
+		} while (added && !kthread_should_stop());
+	}
+
+	return 0;
+}
+
+int nova_start_log_pool(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_pool *pools;
+	struct task_struct *task;
+	int i;
+
+	pools = kcalloc(sbi->cpus, sizeof(struct nova_log_pool), GFP_KERNEL);
+	if (!pools)
+		return -ENOMEM;
+
+	for (i = 0; i < sbi->cpus; i++)
+		spin_lock_init(&pools[i].lock);
+
+	init_waitqueue_head(&sbi->log_pool_wait);
+	sbi->log_pool_kick = 1;
+	sbi->log_pools = pools;
+
+	task = kthread_run(nova_log_pool_func, sb, "nova_log_pool");
+	if (IS_ERR(task)) {
+		sbi->log_pools = NULL;
+		kfree(pools);
+		return PTR_ERR(task);
+	}
+
+	sbi->log_pool_task = task;
+	return 0;
+}
+
+/*
+ * Return all pooled pages to the free lists. The caller guarantees that
+ * nobody is using the pools, as for nova_flush_block_magazines().
+ */
+void nova_flush_log_pools(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_pool *pool;
+	int i;
+
+	for (i = 0; sbi->log_pools && i < sbi->cpus; i++) {
+		pool = &sbi->log_pools[i];
+		nova_release_magazine_blocks(sb, pool->clean, pool->num_clean);
+		pool->num_clean = 0;
+		nova_release_magazine_blocks(sb, pool->dirty, pool->num_dirty);
+		pool->num_dirty = 0;
+	}
+}
+
+/* Stop the refill thread before the checkpoint thread goes away */
+void nova_stop_log_pool(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (!sbi->log_pools)
+		return;
+
+	kthread_stop(sbi->log_pool_task);
+	sbi->log_pool_task = NULL;
+
+	nova_flush_log_pools(sb);
+	kfree(sbi->log_pools);
+	sbi->log_pools = NULL;
+}
+
+/*
+ * Free list for data at file block @start_blk of @pi under the stripe
+ * placement policy, or -1 to allocate from the local CPU's list. Stripe
+ * units rotate over the devices from one picked by inode number, and
+ * *num is trimmed in @align steps so the allocation ends with its unit.
+ */
+static int nova_stripe_free_list(struct super_block *sb,
+	struct nova_inode *pi, unsigned long start_blk, unsigned int *num,
+	unsigned long align)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long stripe = sbi->stripe_blocks;
+	struct nova_device *dev;
+	unsigned long left;
+
+	if (sbi->num_devs < 2 || stripe == 0 ||
+			pi->i_blk_type != NOVA_BLOCK_TYPE_4K)
+		return -1;
+
+	left = stripe - start_blk % stripe;
+	left = max(round_down(left, align), align);
+	if (*num > left)
+		*num = left;
+
+	dev = &sbi->devs[(start_blk / stripe + le64_to_cpu(pi->nova_ino)) %
+				sbi->num_devs];
+	NOVA_STATS_ADD(striped_allocs, 1);
+	return dev->first_list + raw_smp_processor_id() % dev->num_lists;
+}
+
+/*
+ * Pick a free list to retry on when @cpuid's list is short: the one with
+ * the most free blocks among those closest to @cpuid's NUMA node that can
+ * satisfy the request, or the one with most free blocks overall.
+ */
+static int nova_get_candidate_free_list(struct super_block *sb, int cpuid,
+	unsigned long num_blocks)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list *free_list;
+	int nid = nova_get_free_list(sb, cpuid)->nid;
+	int candidate = -1;
+	int best_dist = INT_MAX;
+	unsigned long best_free = 0;
+	int dist;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		free_list = nova_get_free_list(sb, i);
+		if (i == cpuid || free_list->num_free_blocks < num_blocks)
+			continue;
+
+		dist = node_distance(nid, free_list->nid);
+		if (dist < best_dist || (dist == best_dist &&
+				free_list->num_free_blocks > best_free)) {
+			candidate = i;
+			best_dist = dist;
+			best_free = free_list->num_free_blocks;
+		}
+	}
+
+	if (candidate >= 0)
+		return candidate;
+
+	/* Nobody can satisfy it alone; take the fullest list */
+	candidate = 0;
+	for (i = 0; i < sbi->cpus; i++) {
+		free_list = nova_get_free_list(sb, i);
+		if (free_list->num_free_blocks > best_free) {
+			candidate = i;
+			best_free = free_list->num_free_blocks;
+		}
+	}
+
+	return candidate;
+}
+
+/*
+ * Return how many blocks allocated. Blocks come from free list @list, or
+ * if it is negative from the home free list of @cpuid, which is on the
+ * same NUMA node; ANY_CPU means the local CPU.
+ */
+static int __nova_new_blocks(struct super_block *sb, unsigned long *blocknr,
+	unsigned int num, unsigned short btype, int zero,
+	enum alloc_type atype, int cpuid, int list)
+{
+	struct free_list *free_list;
+	void *bp;
+	unsigned long num_blocks = 0;
+	unsigned long ret_blocks = 0;
+	unsigned long new_blocknr = 0;
+	struct rb_node *temp;
+	struct nova_range_node *first;
 	int retried = 0;
 
 	num_blocks = num * nova_get_numblocks(btype);
 	if (num_blocks == 0)
 		return -EINVAL;
 
-	cpuid = smp_processor_id();
+	if (list >= 0) {
+		cpuid = list;
+		goto retry;
+	}
+
+	if (num_blocks == 1 && atype == LOG) {
+		new_blocknr = nova_log_pool_alloc(sb, cpuid);
+		if (new_blocknr) {
+			/* Pool pages are already zero */
+			ret_blocks = 1;
+			zero = 0;
+			goto alloc_done;
+		}
+	}
+
+	if (num_blocks == 1 && cpuid == ANY_CPU) {
+		new_blocknr = nova_magazine_alloc(sb, atype);
+		if (new_blocknr) {
+			ret_blocks = 1;
+			goto alloc_done;
+		}
+	}
+
+	cpuid = nova_home_free_list(sb, cpuid);
 
 retry:
 	free_list = nova_get_free_list(sb, cpuid);
@@ -545,7 +1806,8 @@ retry:
 			spin_unlock(&free_list->s_lock);
 			if (retried >= 3)
 				return -ENOSPC;
-			cpuid = nova_get_candidate_free_list(sb);
+			cpuid = nova_get_candidate_free_list(sb, cpuid,
+							num_blocks);
 			retried++;
 			goto retry;
 		}
@@ -567,6 +1829,7 @@ retry:
 	if (ret_blocks <= 0 || new_blocknr == 0)
 		return -ENOSPC;
 
+alloc_done:
 	if (zero) {
 		bp = nova_get_block(sb, nova_get_block_off(sb,
 						new_blocknr, btype));
@@ -578,16 +1841,67 @@ retry:
 	return ret_blocks / nova_get_numblocks(btype);
 }
 
+/* Allocations are recorded with their owner, see nova_ckpt_reclaim() */
+static int nova_try_new_blocks(struct super_block *sb, u64 ino,
+	unsigned long *blocknr, unsigned int num, unsigned short btype,
+	int zero, enum alloc_type atype, int cpuid, int list)
+{
+	struct nova_checkpoint *ckpt = NOVA_SB(sb)->ckpt;
+	int allocated;
+	int idx;
+
+	if (!ckpt)
+		return __nova_new_blocks(sb, blocknr, num, btype, zero,
+						atype, cpuid, list);
+
+	idx = srcu_read_lock(&ckpt->srcu);
+	allocated = __nova_new_blocks(sb, blocknr, num, btype, zero,
+						atype, cpuid, list);
+	if (allocated > 0)
+		nova_ckpt_record_blocks(sb, NOVA_DELTA_BLOCK_ALLOC, *blocknr,
+				allocated * nova_get_numblocks(btype), ino);
+	srcu_read_unlock(&ckpt->srcu, idx);
+
+	return allocated;
+}
+
+/* Data blocks freed moments ago may only be waiting for readers */
+static int nova_new_blocks(struct super_block *sb, u64 ino,
+	unsigned long *blocknr, unsigned int num, unsigned short btype,
+	int zero, enum alloc_type atype, int cpuid, int list)
+{
+	int allocated;
+
+	allocated = nova_try_new_blocks(sb, ino, blocknr, num, btype, zero,
+					atype, cpuid, list);
+	if (allocated == -ENOSPC && atype == DATA &&
+			nova_wait_deferred_frees(sb))
+		allocated = nova_try_new_blocks(sb, ino, blocknr, num, btype,
+					zero, atype, cpuid, list);
+	return allocated;
+}
+
 inline int nova_new_data_blocks(struct super_block *sb, struct nova_inode *pi,
 	unsigned long *blocknr,	unsigned int num, unsigned long start_blk,
 	int zero, int cow)
 {
 	int allocated;
+	int reserved;
+	int list;
 	timing_t alloc_time;
 	NOVA_START_TIMING(new_data_blocks_t, alloc_time);
-	allocated = nova_new_blocks(sb, blocknr, num,
-					pi->i_blk_type, zero, DATA);
+	list = nova_stripe_free_list(sb, pi, start_blk, &num, 1);
+	reserved = nova_qos_charge_blocks(sb, pi, num);
+	if (reserved < 0) {
+		NOVA_END_TIMING(new_data_blocks_t, alloc_time);
+		return reserved;
+	}
+	allocated = nova_new_blocks(sb, le64_to_cpu(pi->nova_ino), blocknr,
+			reserved, pi->i_blk_type, zero, DATA, ANY_CPU, list);
+	nova_qos_uncharge_blocks(sb, pi, allocated > 0 ?
+					reserved - allocated : reserved);
 	NOVA_END_TIMING(new_data_blocks_t, alloc_time);
+	trace_nova_new_blocks(sb, pi->nova_ino, DATA, *blocknr, num, allocated);
 	nova_dbgv("Inode %llu, start blk %lu, cow %d, "
 			"alloc %d data blocks from %lu to %lu\n",
 			pi->nova_ino, start_blk, cow, allocated, *blocknr,
@@ -595,15 +1909,159 @@ inline int nova_new_data_blocks(struct super_block *sb, struct nova_inode *pi,
 	return allocated;
 }
 
+/*
+ * Carve @num_blocks starting on an @align-block physical boundary out of
+ * the best fitting free range. Splitting a range in the middle consumes
+ * *spare, which the caller allocates outside the spinlock.
+ */
+static long nova_alloc_aligned_in_free_list(struct super_block *sb,
+	struct free_list *free_list, unsigned long num_blocks,
+	unsigned long align, struct nova_range_node **spare,
+	unsigned long *new_blocknr)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_range_node *curr, *next;
+	unsigned long low = 0;
+	unsigned long high;
+
+	curr = nova_find_fit(sb, free_list, num_blocks, align, &low);
+	if (!curr)
+		return -ENOSPC;
+
+	high = curr->range_high;
+	if (low == curr->range_low && low + num_blocks - 1 == high) {
+		nova_erase_blocknode(free_list, curr);
+		nova_free_blocknode(sb, curr);
+	} else if (low == curr->range_low) {
+		nova_resize_blocknode(free_list, curr, low + num_blocks, high);
+	} else if (low + num_blocks - 1 == high) {
+		nova_resize_blocknode(free_list, curr, curr->range_low,
+					low - 1);
+	} else {
+		next = *spare;
+		*spare = NULL;
+		next->range_low = low + num_blocks;
+		next->range_high = high;
+		nova_resize_blocknode(free_list, curr, curr->range_low,
+					low - 1);
+		nova_insert_blocktree(sbi, &free_list->block_free_tree, next);
+		free_list->num_blocknode++;
+	}
+
+	free_list->num_free_blocks -= num_blocks;
+	*new_blocknr = low;
+	return num_blocks;
+}
+
+/*
+ * Allocate @num data blocks, a multiple of HUGE_PAGE_BLOCKS, aligned on a
+ * 2M physical boundary so that DAX can map them with PMDs. Never returns
+ * a partial allocation; callers fall back to 4K blocks on -ENOSPC.
+ */
+int nova_new_huge_data_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned long *blocknr, unsigned int num, unsigned long start_blk,
+	int zero)
+{
+	struct nova_checkpoint *ckpt = NOVA_SB(sb)->ckpt;
+	struct free_list *free_list;
+	struct nova_range_node *spare;
+	unsigned long new_blocknr = 0;
+	long ret_blocks = -ENOSPC;
+	int reserved;
+	int retried = 0;
+	int cpuid;
+	int idx = 0;
+	void *bp;
+	timing_t alloc_time;
+
+	if (num == 0 || (num & (HUGE_PAGE_BLOCKS - 1)))
+		return -EINVAL;
+
+	/* Trim to the stripe unit first, so the tenant is charged for that */
+	cpuid = nova_stripe_free_list(sb, pi, start_blk, &num,
+					HUGE_PAGE_BLOCKS);
+	if (cpuid < 0)
+		cpuid = nova_home_free_list(sb, ANY_CPU);
+
+	/* A partial reservation can't hold a huge page; fall back to 4K */
+	reserved = nova_qos_charge_blocks(sb, pi, num);
+	if (reserved != num) {
+		if (reserved > 0)
+			nova_qos_uncharge_blocks(sb, pi, reserved);
+		return -EDQUOT;
+	}
+
+	NOVA_START_TIMING(new_data_blocks_t, alloc_time);
+	if (ckpt)
+		idx = srcu_read_lock(&ckpt->srcu);
+	spare = nova_alloc_blocknode(sb);
+	if (!spare) {
+		ret_blocks = -ENOMEM;
+		goto out;
+	}
+
+	while (1) {
+		free_list = nova_get_free_list(sb, cpuid);
+		spin_lock(&free_list->s_lock);
+		if (free_list->first_node && free_list->num_free_blocks >= num)
+			ret_blocks = nova_alloc_aligned_in_free_list(sb,
+					free_list, num, HUGE_PAGE_BLOCKS,
+					&spare, &new_blocknr);
+		if (ret_blocks > 0) {
+			free_list->alloc_data_count++;
+			free_list->alloc_data_pages += ret_blocks;
+		}
+		spin_unlock(&free_list->s_lock);
+
+		if (ret_blocks > 0 || retried >= 3)
+			break;
+		cpuid = nova_get_candidate_free_list(sb, cpuid, num);
+		retried++;
+	}
+
+	if (spare)
+		nova_free_blocknode(sb, spare);
+
+	if (ret_blocks <= 0) {
+		NOVA_STATS_ADD(huge_alloc_miss, 1);
+		goto out;
+	}
+
+	if (zero) {
+		bp = nova_get_block(sb, nova_get_block_off(sb,
+					new_blocknr, NOVA_BLOCK_TYPE_4K));
+		memset_nt(bp, 0, PAGE_SIZE * ret_blocks);
+	}
+	*blocknr = new_blocknr;
+	NOVA_STATS_ADD(huge_alloc_blocks, ret_blocks);
+	if (ckpt)
+		nova_ckpt_record_blocks(sb, NOVA_DELTA_BLOCK_ALLOC,
+				new_blocknr, ret_blocks,
+				le64_to_cpu(pi->nova_ino));
+
+	nova_dbgv("Inode %llu, alloc %ld huge data blocks from %lu\n",
+			pi->nova_ino, ret_blocks, new_blocknr);
+out:
+	nova_qos_uncharge_blocks(sb, pi, ret_blocks > 0 ?
+					reserved - ret_blocks : reserved);
+	if (ckpt)
+		srcu_read_unlock(&ckpt->srcu, idx);
+	NOVA_END_TIMING(new_data_blocks_t, alloc_time);
+	trace_nova_new_blocks(sb, pi->nova_ino, DATA, new_blocknr, num,
+				ret_blocks);
+	return ret_blocks;
+}
+
 inline int nova_new_log_blocks(struct super_block *sb, struct nova_inode *pi,
-	unsigned long *blocknr, unsigned int num, int zero)
+	unsigned long *blocknr, unsigned int num, int zero, int cpuid)
 {
 	int allocated;
 	timing_t alloc_time;
 	NOVA_START_TIMING(new_log_blocks_t, alloc_time);
-	allocated = nova_new_blocks(sb, blocknr, num,
-					pi->i_blk_type, zero, LOG);
+	allocated = nova_new_blocks(sb, le64_to_cpu(pi->nova_ino), blocknr,
+					num, pi->i_blk_type, zero, LOG, cpuid, -1);
 	NOVA_END_TIMING(new_log_blocks_t, alloc_time);
+	trace_nova_new_blocks(sb, pi->nova_ino, LOG, *blocknr, num, allocated);
 	nova_dbgv("Inode %llu, alloc %d log blocks from %lu to %lu\n",
 			pi->nova_ino, allocated, *blocknr,
 			*blocknr + allocated - 1);
@@ -624,6 +2082,10 @@ unsigned long nova_count_free_blocks(struct super_block *sb)
 
 	free_list = nova_get_free_list(sb, SHARED_CPU);
 	num_free_blocks += free_list->num_free_blocks;
+
+	for (i = 0; sbi->magazines && i < sbi->cpus; i++)
+		num_free_blocks += sbi->magazines[i].count;
+
 	return num_free_blocks;
 }
 
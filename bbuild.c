@@ -28,7 +28,10 @@
 #include <linux/slab.h>
 #include <linux/random.h>
 #include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/vmalloc.h>
 #include "nova.h"
+#include "nova_trace.h"
 
 static inline void set_scan_bm(unsigned long bit,
 	struct single_scan_bm *scan_bm)
@@ -56,17 +59,10 @@ inline void set_bm(unsigned long bit, struct scan_bitmap *bm,
 
 static int get_cpuid(struct nova_sb_info *sbi, unsigned long blocknr)
 {
-	int cpuid;
-
-	cpuid = blocknr / sbi->per_list_blocks;
-
-	if (cpuid >= sbi->cpus)
-		cpuid = SHARED_CPU;
-
-	return cpuid;
+	return nova_free_list_id(sbi, blocknr);
 }
 
-static int nova_failure_insert_inodetree(struct super_block *sb,
+int nova_failure_insert_inodetree(struct super_block *sb,
 	unsigned long ino_low, unsigned long ino_high)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
@@ -165,6 +161,7 @@ static void nova_destroy_blocknode_tree(struct super_block *sb, int cpu)
 
 	free_list = nova_get_free_list(sb, cpu);
 	nova_destroy_range_node_tree(sb, &free_list->block_free_tree);
+	nova_init_size_classes(free_list);
 }
 
 static void nova_destroy_blocknode_trees(struct super_block *sb)
@@ -179,157 +176,434 @@ static void nova_destroy_blocknode_trees(struct super_block *sb)
 	nova_destroy_blocknode_tree(sb, SHARED_CPU);
 }
 
-static int nova_init_blockmap_from_inode(struct super_block *sb)
+static void nova_destroy_inode_trees(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		nova_destroy_range_node_tree(sb,
+					&inode_map->inode_inuse_tree);
+	}
+}
+
+/* Forget a partially rebuilt allocator state before the full scan */
+static void nova_reset_allocator_trees(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list *free_list;
+	int i;
+
+	nova_destroy_blocknode_trees(sb);
+	nova_destroy_inode_trees(sb);
+
+	for (i = 0; i <= sbi->cpus; i++) {
+		free_list = nova_get_free_list(sb,
+					i < sbi->cpus ? i : SHARED_CPU);
+		free_list->first_node = NULL;
+		free_list->num_free_blocks = 0;
+		free_list->num_blocknode = 0;
+	}
+
+	for (i = 0; i < sbi->cpus; i++) {
+		sbi->inode_maps[i].first_inode_range = NULL;
+		sbi->inode_maps[i].num_range_node_inode = 0;
+	}
+}
+
+#define CPUID_MASK 0xff00000000000000
+
+/*
+ * Range nodes saved at unmount are replayed by one worker per free list
+ * (inode map). Each log page goes to the worker owning its first entry;
+ * entries of a page that spills into the next list are inserted under
+ * that list's lock, so the split needs no exact boundaries.
+ */
+enum nova_replay_type {
+	REPLAY_BLOCKNODE,
+	REPLAY_INODE_LIST,
+};
+
+struct nova_replay_worker {
+	struct super_block *sb;
+	struct task_struct *task;
+	struct completion done;
+	enum nova_replay_type type;
+	u64 *pages;
+	int *owners;
+	unsigned long num_pages;
+	u64 log_tail;
+	int id;
+	int ret;
+	unsigned long num_nodes;
+	unsigned long inodes_used;
+};
+
+static int nova_replay_entry_owner(struct super_block *sb,
+	enum nova_replay_type type, struct nova_range_node_lowhigh *entry)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	u64 range_low = le64_to_cpu(entry->range_low);
+	unsigned long cpuid;
+
+	if (type == REPLAY_BLOCKNODE)
+		cpuid = get_cpuid(sbi, range_low);
+	else
+		cpuid = (range_low & CPUID_MASK) >> 56;
+
+	/* The shared list and bad entries are replayed by worker 0 */
+	return cpuid < sbi->cpus ? cpuid : 0;
+}
+
+static int nova_replay_blocknode(struct super_block *sb,
+	struct nova_range_node_lowhigh *entry)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
 	struct free_list *free_list;
-	struct nova_range_node_lowhigh *entry;
 	struct nova_range_node *blknode;
-	size_t size = sizeof(struct nova_range_node_lowhigh);
-	u64 curr_p;
-	u64 cpuid;
-	int ret = 0;
+	int ret;
 
-	curr_p = pi->log_head;
-	if (curr_p == 0) {
-		nova_dbg("%s: pi head is 0!\n", __func__);
+	blknode = nova_alloc_blocknode(sb);
+	if (blknode == NULL)
+		return -ENOMEM;
+
+	blknode->range_low = le64_to_cpu(entry->range_low);
+	blknode->range_high = le64_to_cpu(entry->range_high);
+
+	/* FIXME: Assume NR_CPUS not change */
+	free_list = nova_get_free_list(sb,
+				get_cpuid(sbi, blknode->range_low));
+	spin_lock(&free_list->s_lock);
+	ret = nova_insert_blocktree(sbi, &free_list->block_free_tree, blknode);
+	if (ret == 0) {
+		free_list->num_blocknode++;
+		free_list->num_free_blocks +=
+			blknode->range_high - blknode->range_low + 1;
+	}
+	spin_unlock(&free_list->s_lock);
+
+	if (ret) {
+		nova_err(sb, "%s failed\n", __func__);
+		nova_free_blocknode(sb, blknode);
+	}
+
+	return ret;
+}
+
+static int nova_replay_inode_node(struct super_block *sb,
+	struct nova_range_node_lowhigh *entry, unsigned long *inodes_used)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_range_node *range_node;
+	struct inode_map *inode_map;
+	unsigned long cpuid;
+	int ret;
+
+	cpuid = (entry->range_low & CPUID_MASK) >> 56;
+	if (cpuid >= sbi->cpus) {
+		nova_err(sb, "Invalid cpuid %lu\n", cpuid);
 		return -EINVAL;
 	}
 
-	while (curr_p != pi->log_tail) {
-		if (is_last_entry(curr_p, size)) {
-			curr_p = next_log_page(sb, curr_p);
+	range_node = nova_alloc_inode_node(sb);
+	if (range_node == NULL)
+		return -ENOMEM;
+
+	range_node->range_low = entry->range_low & ~CPUID_MASK;
+	range_node->range_high = entry->range_high;
+
+	inode_map = &sbi->inode_maps[cpuid];
+	mutex_lock(&inode_map->inode_table_mutex);
+	ret = nova_insert_inodetree(sbi, range_node, cpuid);
+	if (ret == 0)
+		inode_map->num_range_node_inode++;
+	mutex_unlock(&inode_map->inode_table_mutex);
+
+	if (ret) {
+		nova_err(sb, "%s failed, %lu\n", __func__, cpuid);
+		nova_free_inode_node(sb, range_node);
+		return ret;
+	}
+
+	*inodes_used += range_node->range_high - range_node->range_low + 1;
+	return 0;
+}
+
+static int nova_replay_pages(struct nova_replay_worker *worker)
+{
+	struct super_block *sb = worker->sb;
+	struct nova_range_node_lowhigh *entry;
+	size_t size = sizeof(struct nova_range_node_lowhigh);
+	unsigned long i;
+	u64 curr_p;
+	int ret;
+
+	for (i = 0; i < worker->num_pages; i++) {
+		if (worker->owners[i] != worker->id)
+			continue;
+
+		curr_p = worker->pages[i];
+		while (curr_p != worker->log_tail &&
+				!is_last_entry(curr_p, size)) {
+			entry = (struct nova_range_node_lowhigh *)
+					nova_get_block(sb, curr_p);
+			if (worker->type == REPLAY_BLOCKNODE)
+				ret = nova_replay_blocknode(sb, entry);
+			else
+				ret = nova_replay_inode_node(sb, entry,
+						&worker->inodes_used);
+			if (ret)
+				return ret;
+
+			worker->num_nodes++;
+			curr_p += size;
 		}
+	}
 
-		if (curr_p == 0) {
-			nova_dbg("%s: curr_p is NULL!\n", __func__);
-			NOVA_ASSERT(0);
-			ret = -EINVAL;
+	return 0;
+}
+
+static int nova_replay_thread_func(void *data)
+{
+	struct nova_replay_worker *worker = data;
+
+	worker->ret = nova_replay_pages(worker);
+	complete(&worker->done);
+	return 0;
+}
+
+/* Collect the log pages up to the one holding the tail */
+static long nova_collect_replay_pages(struct super_block *sb,
+	u64 log_head, u64 log_tail, u64 *pages)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	u64 tail_page = log_tail & PAGE_MASK;
+	u64 curr_p = log_head & PAGE_MASK;
+	long num_pages = 0;
+
+	while (curr_p) {
+		if (pages)
+			pages[num_pages] = curr_p;
+		num_pages++;
+		if (curr_p == tail_page)
+			return num_pages;
+		if (num_pages >= sbi->num_blocks)
 			break;
-		}
+		curr_p = next_log_page(sb, curr_p);
+	}
 
-		entry = (struct nova_range_node_lowhigh *)nova_get_block(sb,
-							curr_p);
-		blknode = nova_alloc_blocknode(sb);
-		if (blknode == NULL)
-			NOVA_ASSERT(0);
-		blknode->range_low = le64_to_cpu(entry->range_low);
-		blknode->range_high = le64_to_cpu(entry->range_high);
-		cpuid = get_cpuid(sbi, blknode->range_low);
-
-		/* FIXME: Assume NR_CPUS not change */
-		free_list = nova_get_free_list(sb, cpuid);
-		ret = nova_insert_blocktree(sbi,
-				&free_list->block_free_tree, blknode);
-		if (ret) {
-			nova_err(sb, "%s failed\n", __func__);
-			nova_free_blocknode(sb, blknode);
-			NOVA_ASSERT(0);
-			nova_destroy_blocknode_trees(sb);
-			goto out;
+	nova_dbg("%s: log tail 0x%llx not found\n", __func__, log_tail);
+	return -EINVAL;
+}
+
+static int nova_replay_range_nodes(struct super_block *sb,
+	u64 log_head, u64 log_tail, enum nova_replay_type type,
+	unsigned long *num_nodes, unsigned long *inodes_used)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_replay_worker *workers, *worker;
+	struct nova_range_node_lowhigh *entry;
+	long num_pages;
+	u64 *pages = NULL;
+	int *owners = NULL;
+	long i;
+	int ret = 0;
+
+	num_pages = nova_collect_replay_pages(sb, log_head, log_tail, NULL);
+	if (num_pages < 0)
+		return num_pages;
+
+	workers = kcalloc(sbi->cpus, sizeof(struct nova_replay_worker),
+						GFP_KERNEL);
+	pages = vmalloc(num_pages * sizeof(u64));
+	owners = vmalloc(num_pages * sizeof(int));
+	if (!workers || !pages || !owners) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	nova_collect_replay_pages(sb, log_head, log_tail, pages);
+	for (i = 0; i < num_pages; i++) {
+		entry = (struct nova_range_node_lowhigh *)
+				nova_get_block(sb, pages[i]);
+		owners[i] = nova_replay_entry_owner(sb, type, entry);
+	}
+
+	for (i = 0; i < sbi->cpus; i++) {
+		worker = &workers[i];
+		worker->sb = sb;
+		worker->type = type;
+		worker->pages = pages;
+		worker->owners = owners;
+		worker->num_pages = num_pages;
+		worker->log_tail = log_tail;
+		worker->id = i;
+		init_completion(&worker->done);
+
+		if (sbi->cpus == 1)
+			continue;
+
+		worker->task = kthread_create(nova_replay_thread_func,
+					worker, "nova_replay/%ld", i);
+		if (IS_ERR(worker->task)) {
+			worker->task = NULL;
+			continue;
 		}
-		free_list->num_blocknode++;
-		if (free_list->num_blocknode == 1)
-			free_list->first_node = blknode;
-		free_list->num_free_blocks +=
-			blknode->range_high - blknode->range_low + 1;
-		curr_p += sizeof(struct nova_range_node_lowhigh);
+		kthread_bind(worker->task, i);
+		wake_up_process(worker->task);
 	}
+
+	/* Do the share of any worker that could not be started */
+	for (i = 0; i < sbi->cpus; i++) {
+		worker = &workers[i];
+		if (!worker->task)
+			worker->ret = nova_replay_pages(worker);
+	}
+
+	for (i = 0; i < sbi->cpus; i++) {
+		worker = &workers[i];
+		if (worker->task)
+			wait_for_completion(&worker->done);
+		if (worker->ret && !ret)
+			ret = worker->ret;
+		*num_nodes += worker->num_nodes;
+		*inodes_used += worker->inodes_used;
+	}
+
 out:
-	nova_free_inode_log(sb, pi);
+	vfree(owners);
+	vfree(pages);
+	kfree(workers);
 	return ret;
 }
 
-static void nova_destroy_inode_trees(struct super_block *sb)
+static inline struct nova_range_node *nova_first_range_node(
+	struct rb_root *tree)
+{
+	struct rb_node *temp = rb_first(tree);
+
+	return temp ? container_of(temp, struct nova_range_node, node) : NULL;
+}
+
+/* Build the free lists from a range log of free blocks */
+int nova_load_blockmap_from_log(struct super_block *sb, u64 log_head,
+	u64 log_tail)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct inode_map *inode_map;
+	struct free_list *free_list;
+	unsigned long num_blocknode = 0;
+	unsigned long unused = 0;
+	int ret;
 	int i;
 
+	ret = nova_replay_range_nodes(sb, log_head, log_tail,
+				REPLAY_BLOCKNODE, &num_blocknode, &unused);
+	if (ret) {
+		nova_err(sb, "%s failed %d\n", __func__, ret);
+		nova_destroy_blocknode_trees(sb);
+		return ret;
+	}
+
 	for (i = 0; i < sbi->cpus; i++) {
-		inode_map = &sbi->inode_maps[i];
-		nova_destroy_range_node_tree(sb,
-					&inode_map->inode_inuse_tree);
+		free_list = nova_get_free_list(sb, i);
+		free_list->first_node =
+			nova_first_range_node(&free_list->block_free_tree);
 	}
-}
+	free_list = nova_get_free_list(sb, SHARED_CPU);
+	free_list->first_node =
+		nova_first_range_node(&free_list->block_free_tree);
 
-#define CPUID_MASK 0xff00000000000000
+	nova_dbg("%s: %lu block nodes\n", __func__, num_blocknode);
+	return 0;
+}
 
-static int nova_init_inode_list_from_inode(struct super_block *sb)
+/* Build the inode maps from a range log of used inodes */
+int nova_load_inode_list_from_log(struct super_block *sb, u64 log_head,
+	u64 log_tail)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_INODELIST1_INO);
-	struct nova_range_node_lowhigh *entry;
-	struct nova_range_node *range_node;
 	struct inode_map *inode_map;
-	size_t size = sizeof(struct nova_range_node_lowhigh);
 	unsigned long num_inode_node = 0;
-	u64 curr_p;
-	unsigned long cpuid;
 	int ret;
+	int i;
 
 	sbi->s_inodes_used_count = 0;
-	curr_p = pi->log_head;
-	if (curr_p == 0) {
-		nova_dbg("%s: pi head is 0!\n", __func__);
-		return -EINVAL;
+	ret = nova_replay_range_nodes(sb, log_head, log_tail,
+				REPLAY_INODE_LIST, &num_inode_node,
+				&sbi->s_inodes_used_count);
+	if (ret) {
+		nova_err(sb, "%s failed %d\n", __func__, ret);
+		nova_destroy_inode_trees(sb);
+		return ret;
 	}
 
-	while (curr_p != pi->log_tail) {
-		if (is_last_entry(curr_p, size)) {
-			curr_p = next_log_page(sb, curr_p);
-		}
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		inode_map->first_inode_range =
+			nova_first_range_node(&inode_map->inode_inuse_tree);
+	}
 
-		if (curr_p == 0) {
-			nova_dbg("%s: curr_p is NULL!\n", __func__);
-			NOVA_ASSERT(0);
-		}
+	nova_dbg("%s: %lu inode nodes\n", __func__, num_inode_node);
+	return 0;
+}
 
-		entry = (struct nova_range_node_lowhigh *)nova_get_block(sb,
-							curr_p);
-		range_node = nova_alloc_inode_node(sb);
-		if (range_node == NULL)
-			NOVA_ASSERT(0);
-
-		cpuid = (entry->range_low & CPUID_MASK) >> 56;
-		if (cpuid >= sbi->cpus) {
-			nova_err(sb, "Invalid cpuid %lu\n", cpuid);
-			nova_free_inode_node(sb, range_node);
-			NOVA_ASSERT(0);
-			nova_destroy_inode_trees(sb);
-			goto out;
-		}
+static int nova_init_blockmap_from_inode(struct super_block *sb)
+{
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
+	int ret;
 
-		range_node->range_low = entry->range_low & ~CPUID_MASK;
-		range_node->range_high = entry->range_high;
-		ret = nova_insert_inodetree(sbi, range_node, cpuid);
-		if (ret) {
-			nova_err(sb, "%s failed, %d\n", __func__, cpuid);
-			nova_free_inode_node(sb, range_node);
-			NOVA_ASSERT(0);
-			nova_destroy_inode_trees(sb);
-			goto out;
-		}
+	if (pi->log_head == 0) {
+		nova_dbg("%s: pi head is 0!\n", __func__);
+		return -EINVAL;
+	}
 
-		sbi->s_inodes_used_count +=
-			range_node->range_high - range_node->range_low + 1;
-		num_inode_node++;
+	ret = nova_load_blockmap_from_log(sb, pi->log_head, pi->log_tail);
+	nova_free_inode_log(sb, pi);
+	return ret;
+}
 
-		inode_map = &sbi->inode_maps[cpuid];
-		inode_map->num_range_node_inode++;
-		if (!inode_map->first_inode_range)
-			inode_map->first_inode_range = range_node;
+static int nova_init_inode_list_from_inode(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_INODELIST1_INO);
+	int ret;
 
-		curr_p += sizeof(struct nova_range_node_lowhigh);
+	sbi->s_inodes_used_count = 0;
+	if (pi->log_head == 0) {
+		nova_dbg("%s: pi head is 0!\n", __func__);
+		return -EINVAL;
 	}
 
-	nova_dbg("%s: %lu inode nodes\n", __func__, num_inode_node);
-out:
+	ret = nova_load_inode_list_from_log(sb, pi->log_head, pi->log_tail);
 	nova_free_inode_log(sb, pi);
 	return ret;
 }
 
+/*
+ * force_recovery: forget the free list and inode list saved at the last
+ * clean unmount so that the mount rebuilds both from a full scan. Their
+ * log pages are reclaimed by that scan like the rest of the free space.
+ */
+static void nova_drop_clean_shutdown_logs(struct super_block *sb)
+{
+	struct nova_inode *pi;
+	unsigned long ino[] = { NOVA_BLOCKNODE_INO, NOVA_INODELIST1_INO,
+				NOVA_SHARED_INO };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ino); i++) {
+		pi = nova_get_inode_by_ino(sb, ino[i]);
+		nova_memunlock_inode(sb, pi);
+		pi->log_head = 0;
+		pi->log_tail = 0;
+		nova_memlock_inode(sb, pi);
+		nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+	}
+	PERSISTENT_BARRIER();
+}
+
 static bool nova_can_skip_full_scan(struct super_block *sb)
 {
 	struct nova_inode *pi =  nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
@@ -353,6 +627,14 @@ static bool nova_can_skip_full_scan(struct super_block *sb)
 		return false;
 	}
 
+	ret = nova_load_shared_blocks(sb);
+	if (ret) {
+		nova_err(sb, "init shared blocks failed, "
+				"fall back to failure recovery\n");
+		nova_reset_allocator_trees(sb);
+		return false;
+	}
+
 	return true;
 }
 
@@ -418,6 +700,7 @@ static u64 nova_save_free_list_blocknodes(struct super_block *sb, int cpu,
 	free_list = nova_get_free_list(sb, cpu);
 	temp_tail = nova_save_range_nodes_to_log(sb, &free_list->block_free_tree,
 								temp_tail, 0);
+	nova_init_size_classes(free_list);
 	return temp_tail;
 }
 
@@ -701,6 +984,9 @@ static int nova_build_blocknode_map(struct super_block *sb,
 	num_used_block = sbi->reserved_blocks;
 	for (i = 0; i < num_used_block; i++)
 		set_bm(i, final_bm, BM_4K);
+	for (i = 1; i < sbi->num_devs; i++)
+		for (j = 0; j < NOVA_DEV_HEADER_BLOCKS; j++)
+			set_bm(sbi->devs[i].start_block + j, final_bm, BM_4K);
 
 	ret = __nova_build_blocknode_map(sb, final_bm->scan_bm_4K.bitmap,
 			final_bm->scan_bm_4K.bitmap_size * 8, PAGE_SHIFT - 12);
@@ -767,6 +1053,8 @@ static int alloc_bm(struct super_block *sb, unsigned long initsize)
 /************************** NOVA recovery ****************************/
 
 #define MAX_PGOFF	262144
+/* Tags ring entries from shared write entries; above any block number */
+#define RING_SHARED	(1ULL << 63)
 
 struct task_ring {
 	u64 addr[512];
@@ -784,14 +1072,24 @@ void nova_init_header(struct super_block *sb,
 	struct nova_inode_info_header *sih, u16 i_mode)
 {
 	sih->log_pages = 0;
-	sih->mmap_pages = 0;
-	sih->low_dirty = ULONG_MAX;
-	sih->high_dirty = 0;
 	sih->i_size = 0;
 	sih->pi_addr = 0;
-	INIT_RADIX_TREE(&sih->tree, GFP_ATOMIC);
-	INIT_RADIX_TREE(&sih->cache_tree, GFP_ATOMIC);
+	sih->dir_tree = RB_ROOT;
+	sih->dir_buckets = NULL;
+	sih->dir_bits = 0;
+	sih->num_dentries = 0;
+	sih->readdir_cache = NULL;
+	sih->extent_tree = RB_ROOT;
+	init_rwsem(&sih->extent_sem);
+	sih->num_extents = 0;
 	sih->i_mode = i_mode;
+	sih->valid_bytes = 0;
+	sih->inline_entry = 0;
+	sih->inline_len = 0;
+	INIT_LIST_HEAD(&sih->gc_list);
+	spin_lock_init(&sih->range_lock);
+	INIT_LIST_HEAD(&sih->write_ranges);
+	init_waitqueue_head(&sih->range_wait);
 }
 
 int nova_rebuild_inode(struct super_block *sb, struct nova_inode_info *si,
@@ -884,9 +1182,16 @@ static int nova_set_ring_array(struct super_block *sb,
 	if (end > base + MAX_PGOFF)
 		end = base + MAX_PGOFF;
 
-	for (pgoff = start; pgoff < end; pgoff++)
-		ring->array[pgoff - base] = (u64)(entry->block >> PAGE_SHIFT)
-						+ pgoff - entry->pgoff;
+	for (pgoff = start; pgoff < end; pgoff++) {
+		if (nova_entry_hole(entry))
+			ring->array[pgoff - base] = 0;
+		else
+			ring->array[pgoff - base] =
+				(u64)(entry->block >> PAGE_SHIFT) +
+				pgoff - entry->pgoff;
+		if (nova_entry_shared(entry))
+			ring->array[pgoff - base] |= RING_SHARED;
+	}
 
 	return 0;
 }
@@ -896,6 +1201,7 @@ static int nova_set_file_bm(struct super_block *sb,
 	struct scan_bitmap *bm, unsigned long base, unsigned long last_blocknr)
 {
 	unsigned long nvmm, pgoff;
+	unsigned long shared_low = 0, shared_num = 0;
 
 	if (last_blocknr >= base + MAX_PGOFF)
 		last_blocknr = MAX_PGOFF - 1;
@@ -904,12 +1210,28 @@ static int nova_set_file_bm(struct super_block *sb,
 
 	for (pgoff = 0; pgoff <= last_blocknr; pgoff++) {
 		nvmm = ring->array[pgoff];
+		if (nvmm & RING_SHARED) {
+			/* Count the owners of contiguous shared blocks */
+			nvmm &= ~RING_SHARED;
+			if (shared_num && shared_low + shared_num == nvmm) {
+				shared_num++;
+			} else {
+				if (shared_num)
+					nova_count_shared_blocks(sb, shared_low,
+								shared_num);
+				shared_low = nvmm;
+				shared_num = 1;
+			}
+		}
 		if (nvmm) {
 			set_bm(nvmm, bm, BM_4K);
 			ring->array[pgoff] = 0;
 		}
 	}
 
+	if (shared_num)
+		nova_count_shared_blocks(sb, shared_low, shared_num);
+
 	return 0;
 }
 
@@ -955,6 +1277,8 @@ static int nova_traverse_file_inode_log(struct super_block *sb,
 {
 	struct nova_file_write_entry *entry = NULL;
 	struct nova_setattr_logentry *attr_entry = NULL;
+	struct nova_setattr_logentry attr_buf;
+	struct nova_inline_data_entry *inline_entry;
 	struct nova_inode_log_page *curr_page;
 	unsigned long base = 0;
 	unsigned long last_blocknr;
@@ -1000,14 +1324,23 @@ again:
 		type = nova_get_entry_type(addr);
 		switch (type) {
 			case SET_ATTR:
-				attr_entry =
-					(struct nova_setattr_logentry *)addr;
+			case SET_ATTR_COMPACT:
+				attr_entry = nova_read_setattr_entry(addr,
+								&attr_buf);
 				nova_ring_setattr_entry(sb, sih, attr_entry,
 							ring, base, data_bits);
-				curr_p += sizeof(struct nova_setattr_logentry);
+				curr_p += nova_setattr_entry_len(addr);
 				continue;
 			case LINK_CHANGE:
-				curr_p += sizeof(struct nova_link_change_entry);
+			case LINK_CHANGE_COMPACT:
+				curr_p += nova_link_change_entry_len(addr);
+				continue;
+			case FILE_INLINE:
+				inline_entry =
+					(struct nova_inline_data_entry *)addr;
+				sih->i_size = le64_to_cpu(inline_entry->size);
+				curr_p += NOVA_INLINE_ENTRY_LEN(
+					le16_to_cpu(inline_entry->data_len));
 				continue;
 			case FILE_WRITE:
 				break;
@@ -1169,6 +1502,54 @@ static void wait_to_finish(int cpus)
 	}
 }
 
+/*
+ * Mark in @bm the blocks the committed logs of @inos reference, the way
+ * the full scan does, so that checkpoint recovery can tell which blocks
+ * allocated for them since never made it into a log.
+ */
+int nova_mark_logged_blocks(struct super_block *sb, u64 *inos, long num,
+	struct scan_bitmap *bm)
+{
+	struct nova_inode_info_header sih;
+	struct task_ring *ring;
+	unsigned long max_size = 0;
+	u64 pi_addr;
+	long i;
+	int ret = 0;
+
+	ring = kzalloc(sizeof(struct task_ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->array = vzalloc(sizeof(u64) * MAX_PGOFF);
+	if (!ring->array) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+
+	nova_init_header(sb, &sih, 0);
+	for (i = 0; i < num; i++) {
+		if (inos[i] == NOVA_ROOT_INO)
+			pi_addr = NOVA_ROOT_INO_START;
+		else
+			ret = nova_get_inode_address(sb, inos[i], &pi_addr, 0);
+		if (ret)
+			break;
+
+		nova_recover_inode_pages(sb, &sih, ring, pi_addr, bm);
+		if (sih.i_size > max_size)
+			max_size = sih.i_size;
+	}
+
+	if (max_size)
+		nova_delete_file_tree(sb, &sih, 0,
+				(max_size - 1) >> PAGE_SHIFT, false);
+
+	vfree(ring->array);
+	kfree(ring);
+	return ret;
+}
+
 /*********************** Failure recovery *************************/
 
 static inline int nova_failure_update_inodetree(struct super_block *sb,
@@ -1248,7 +1629,7 @@ static int failure_thread_func(void *data)
 	/* Free radix tree */
 	if (max_size) {
 		last_blocknr = (max_size - 1) >> PAGE_SHIFT;
-		nova_delete_file_tree(sb, &sih, 0, last_blocknr, false, false);
+		nova_delete_file_tree(sb, &sih, 0, last_blocknr, false);
 	}
 
 	finished[cpuid] = 1;
@@ -1328,6 +1709,17 @@ int nova_failure_recovery(struct super_block *sb)
 	pi->log_head = pi->log_tail = 0;
 	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
 
+	/* The scan reclaims the checkpoint pages as well */
+	pi = nova_get_inode_by_ino(sb, NOVA_CHECKPOINT_INO);
+	pi->log_head = pi->log_tail = 0;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+
+	/* Shared block counts are rebuilt from the file logs */
+	nova_destroy_shared_blocks(sb);
+	pi = nova_get_inode_by_ino(sb, NOVA_SHARED_INO);
+	pi->log_head = pi->log_tail = 0;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+
 	for (i = 0; i < sbi->cpus; i++) {
 		pair = nova_get_journal_pointers(sb, i);
 		if (!pair)
@@ -1352,6 +1744,9 @@ int nova_failure_recovery(struct super_block *sb)
 
 	free_resources(sb);
 
+	if (ret == 0)
+		nova_prune_shared_blocks(sb);
+
 	nova_dbg("Failure recovery total recovered %lu\n",
 				sbi->s_inodes_used_count);
 	return ret;
@@ -1379,11 +1774,29 @@ int nova_recovery(struct super_block *sb)
 
 	/* initialize free list info */
 	nova_init_blockmap(sb, 1);
+	trace_nova_recovery_phase(sb, "init_blockmap", 0);
+
+	if (test_opt(sb, FORCE_RECOVERY)) {
+		nova_info("NOVA: Forced failure recovery\n");
+		nova_drop_clean_shutdown_logs(sb);
+		ret = -EINVAL;
+	} else {
+		value = nova_can_skip_full_scan(sb);
+		trace_nova_recovery_phase(sb, "clean_shutdown",
+					value ? 0 : -EINVAL);
+		if (!value) {
+			ret = nova_recover_from_checkpoint(sb);
+			trace_nova_recovery_phase(sb, "checkpoint", ret);
+		}
+	}
 
-	value = nova_can_skip_full_scan(sb);
 	if (value) {
 		nova_dbg("NOVA: Normal shutdown\n");
+	} else if (ret == 0) {
+		nova_dbg("NOVA: Recovered from allocator checkpoint\n");
+		value = true;
 	} else {
+		nova_reset_allocator_trees(sb);
 		nova_dbg("NOVA: Failure recovery\n");
 		ret = alloc_bm(sb, initsize);
 		if (ret)
@@ -1391,10 +1804,12 @@ int nova_recovery(struct super_block *sb)
 
 		sbi->s_inodes_used_count = 0;
 		ret = nova_failure_recovery(sb);
+		trace_nova_recovery_phase(sb, "inode_scan", ret);
 		if (ret)
 			goto out;
 
 		ret = nova_build_blocknode_map(sb, initsize);
+		trace_nova_recovery_phase(sb, "blocknode_map", ret);
 	}
 
 out:
@@ -1410,3 +1825,189 @@ out:
 		free_bm(sb);
 	return ret;
 }
+
+/*********************** Mount-time prefetch *************************/
+
+/*
+ * Inodes are rebuilt lazily on first iget. With prefetch=N, a small pool
+ * walks the namespace breadth first from the root after mount and rebuilds
+ * up to N inodes in the background, so the shallow, most likely used part
+ * of the tree is already in DRAM when the first lookups arrive.
+ */
+static void nova_prefetch_push_children(struct nova_prefetch *pf,
+	struct inode *dir)
+{
+	struct super_block *sb = pf->sb;
+	struct nova_inode_info_header *sih = &NOVA_I(dir)->header;
+	struct nova_dir_node *curr;
+	struct rb_node *temp;
+
+	mutex_lock(&dir->i_mutex);
+	spin_lock(&pf->lock);
+	for (temp = rb_first(&sih->dir_tree); temp; temp = rb_next(temp)) {
+		if (pf->tail >= pf->limit)
+			break;
+		curr = rb_entry(temp, struct nova_dir_node, node);
+		if (is_dir_init_entry(sb, curr->direntry))
+			continue;
+		pf->queue[pf->tail++] = le64_to_cpu(curr->direntry->ino);
+	}
+	spin_unlock(&pf->lock);
+	mutex_unlock(&dir->i_mutex);
+}
+
+static void nova_prefetch_inode(struct nova_prefetch *pf, unsigned long ino)
+{
+	struct inode *inode;
+
+	/* The inode may be gone by now, which is fine */
+	inode = nova_iget(pf->sb, ino);
+	if (IS_ERR(inode))
+		return;
+
+	NOVA_STATS_ADD(prefetch_inodes, 1);
+	if (S_ISDIR(inode->i_mode))
+		nova_prefetch_push_children(pf, inode);
+
+	iput(inode);
+}
+
+static unsigned long nova_prefetch_pop(struct nova_prefetch *pf, bool *idle)
+{
+	unsigned long ino = 0;
+
+	spin_lock(&pf->lock);
+	if (pf->head < pf->tail) {
+		ino = pf->queue[pf->head++];
+		pf->active++;
+	}
+	*idle = pf->active == 0;
+	spin_unlock(&pf->lock);
+
+	return ino;
+}
+
+static bool nova_prefetch_wait_cond(struct nova_prefetch *pf)
+{
+	bool ret;
+
+	spin_lock(&pf->lock);
+	ret = pf->head < pf->tail || pf->active == 0;
+	spin_unlock(&pf->lock);
+
+	return ret || kthread_should_stop();
+}
+
+static int nova_prefetch_func(void *data)
+{
+	struct nova_prefetch *pf = data;
+	struct super_block *sb = pf->sb;
+	unsigned long ino;
+	bool idle;
+
+	/* Inodes released before the sb goes active would be evicted */
+	while (!(sb->s_flags & MS_ACTIVE) && !kthread_should_stop())
+		msleep_interruptible(10);
+
+	while (!kthread_should_stop()) {
+		ino = nova_prefetch_pop(pf, &idle);
+		if (!ino) {
+			if (idle)
+				break;
+			wait_event_interruptible(pf->wait,
+					nova_prefetch_wait_cond(pf));
+			continue;
+		}
+
+		nova_prefetch_inode(pf, ino);
+
+		spin_lock(&pf->lock);
+		pf->active--;
+		spin_unlock(&pf->lock);
+		wake_up_interruptible_all(&pf->wait);
+		cond_resched();
+	}
+
+	/* Done; stay around until unmount stops us */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+int nova_start_prefetch(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_prefetch *pf;
+	int ret = 0;
+	int i;
+
+	if (!sbi->prefetch_inodes)
+		return 0;
+
+	pf = kzalloc(sizeof(struct nova_prefetch), GFP_KERNEL);
+	if (!pf)
+		return -ENOMEM;
+
+	pf->sb = sb;
+	pf->limit = sbi->prefetch_inodes;
+	pf->num_tasks = min_t(int, sbi->cpus, PREFETCH_THREADS);
+	spin_lock_init(&pf->lock);
+	init_waitqueue_head(&pf->wait);
+
+	pf->queue = vmalloc(pf->limit * sizeof(unsigned long));
+	pf->tasks = kcalloc(pf->num_tasks, sizeof(struct task_struct *),
+						GFP_KERNEL);
+	if (!pf->queue || !pf->tasks) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	pf->queue[pf->tail++] = NOVA_ROOT_INO;
+
+	for (i = 0; i < pf->num_tasks; i++) {
+		pf->tasks[i] = kthread_run(nova_prefetch_func, pf,
+						"nova_prefetch/%d", i);
+		if (IS_ERR(pf->tasks[i])) {
+			ret = PTR_ERR(pf->tasks[i]);
+			pf->tasks[i] = NULL;
+			goto out;
+		}
+	}
+
+	sbi->prefetch = pf;
+	return 0;
+
+out:
+	for (i = 0; pf->tasks && i < pf->num_tasks; i++)
+		if (pf->tasks[i])
+			kthread_stop(pf->tasks[i]);
+	kfree(pf->tasks);
+	vfree(pf->queue);
+	kfree(pf);
+	return ret;
+}
+
+/* Pending inodes are dropped; they are rebuilt on demand as before */
+void nova_stop_prefetch(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_prefetch *pf = sbi->prefetch;
+	int i;
+
+	if (!pf)
+		return;
+
+	for (i = 0; i < pf->num_tasks; i++)
+		kthread_stop(pf->tasks[i]);
+
+	nova_dbg("%s: prefetched %lu inodes\n", __func__, pf->head);
+	sbi->prefetch = NULL;
+	kfree(pf->tasks);
+	vfree(pf->queue);
+	kfree(pf);
+}
@@ -0,0 +1,528 @@
+/*
+ * novabench: microbenchmarks for the NOVA hot paths.
+ *
+ * Each invocation runs one workload against a directory on a mounted NOVA
+ * instance and prints one JSON object on stdout. With -p, the per-mount
+ * timing stats are cleared before the timed section and the counters that
+ * moved are embedded in the result, so a regression can be traced to the
+ * kernel path that got slower.
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Keep in sync with nova.h */
+#define NOVA_CLEAR_STATS	0xBCD00011
+#define NOVA_SET_HUGE_ALLOC	0xBCD00019
+
+#define PAGE_SZ		4096UL
+#define HUGE_SZ		(2UL << 20)
+
+struct bench_opts {
+	const char *dir;
+	const char *proc;
+	const char *workload;
+	size_t bs;
+	size_t size;
+	unsigned long count;
+	unsigned long populate;
+	unsigned long iters;
+	unsigned long long elapsed;
+	unsigned int seed;
+	int write_fault;
+	int keep;
+};
+
+struct bench_result {
+	unsigned long ops;
+	unsigned long long bytes;
+	unsigned long long elapsed;
+	unsigned long long *lat;
+	unsigned long nlat;
+};
+
+static void die(const char *what)
+{
+	fprintf(stderr, "novabench: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (!p)
+		die("malloc");
+	return p;
+}
+
+static void path_of(char *buf, size_t len, const struct bench_opts *o,
+	const char *name, unsigned long i)
+{
+	snprintf(buf, len, "%s/%s.%lu", o->dir, name, i);
+}
+
+static void lat_init(struct bench_result *r, unsigned long ops)
+{
+	r->lat = xmalloc(ops * sizeof(*r->lat));
+	r->nlat = 0;
+}
+
+static inline void lat_add(struct bench_result *r, unsigned long long ns)
+{
+	r->lat[r->nlat++] = ns;
+}
+
+/* Write the whole file once so that timed passes only overwrite */
+static void prefill(int fd, size_t size, size_t bs)
+{
+	char *buf = xmalloc(bs);
+	size_t off;
+
+	memset(buf, 0xa5, bs);
+	for (off = 0; off < size; off += bs)
+		if (pwrite(fd, buf, bs, off) != (ssize_t)bs)
+			die("prefill");
+	free(buf);
+}
+
+static void clear_stats(const struct bench_opts *o)
+{
+	char path[512];
+	int fd;
+
+	if (!o->proc)
+		return;
+
+	snprintf(path, sizeof(path), "%s/timing_stats", o->proc);
+	fd = open(path, O_WRONLY);
+	if (fd >= 0) {
+		if (write(fd, "1", 1) != 1)
+			die("clear timing_stats");
+		close(fd);
+		return;
+	}
+
+	/* Older modules only clear through the ioctl */
+	fd = open(o->dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || ioctl(fd, NOVA_CLEAR_STATS, 0) < 0)
+		die("NOVA_CLEAR_STATS");
+	close(fd);
+}
+
+/* Embed timing_stats lines whose count is non-zero */
+static void print_timing(const struct bench_opts *o)
+{
+	unsigned long long count, total;
+	char path[512], line[256], name[64];
+	int first = 1;
+	FILE *f;
+	int n;
+
+	if (!o->proc)
+		return;
+
+	snprintf(path, sizeof(path), "%s/timing_stats", o->proc);
+	f = fopen(path, "r");
+	if (!f)
+		die(path);
+
+	printf(", \"timing\": {");
+	while (fgets(line, sizeof(line), f)) {
+		total = 0;
+		n = sscanf(line, "%63[^:]: count %llu, timing %llu",
+				name, &count, &total);
+		if (n < 2 || count == 0)
+			continue;
+		printf("%s\"%s\": {\"count\": %llu, \"ns\": %llu}",
+			first ? "" : ", ", name, count, total);
+		first = 0;
+	}
+	printf("}");
+	fclose(f);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_result(const struct bench_opts *o, struct bench_result *r)
+{
+	double secs = r->elapsed / 1e9;
+
+	printf("{\"workload\": \"%s\", \"bs\": %zu, \"size\": %zu, "
+		"\"ops\": %lu, \"bytes\": %llu, \"elapsed_ns\": %llu",
+		o->workload, o->bs, o->size, r->ops, r->bytes, r->elapsed);
+	if (secs > 0)
+		printf(", \"ops_per_sec\": %.1f, \"mib_per_sec\": %.1f",
+			r->ops / secs, r->bytes / secs / (1 << 20));
+
+	if (r->nlat) {
+		qsort(r->lat, r->nlat, sizeof(*r->lat), cmp_u64);
+		printf(", \"lat_ns\": {\"p50\": %llu, \"p99\": %llu, "
+			"\"max\": %llu}",
+			r->lat[r->nlat / 2], r->lat[r->nlat * 99 / 100],
+			r->lat[r->nlat - 1]);
+	}
+
+	print_timing(o);
+	printf("}\n");
+	fflush(stdout);
+}
+
+/* seqwrite, randwrite, append, seqread, randread */
+static void run_rw(const struct bench_opts *o, struct bench_result *r)
+{
+	int rand_off = !strncmp(o->workload, "rand", 4);
+	int is_read = strstr(o->workload, "read") != NULL;
+	int is_append = !strcmp(o->workload, "append");
+	unsigned long blocks = o->size / o->bs;
+	unsigned long i, ops;
+	unsigned long long t0, t;
+	char path[512];
+	char *buf;
+	off_t off;
+	ssize_t ret;
+	int fd;
+
+	path_of(path, sizeof(path), o, "rw", 0);
+	unlink(path);
+	fd = open(path, O_CREAT | O_RDWR | (is_append ? O_APPEND : 0), 0644);
+	if (fd < 0)
+		die(path);
+
+	/* Random writes and all reads need existing blocks */
+	if (is_read || (rand_off && !is_append))
+		prefill(fd, blocks * o->bs, o->bs);
+
+	ops = is_append ? o->count : blocks;
+	buf = xmalloc(o->bs);
+	memset(buf, 0x5a, o->bs);
+	lat_init(r, ops);
+	srand(o->seed);
+
+	clear_stats(o);
+	t0 = now_ns();
+	for (i = 0; i < ops; i++) {
+		off = rand_off ? (off_t)(rand() % blocks) * o->bs :
+				(off_t)i * o->bs;
+		t = now_ns();
+		if (is_append)
+			ret = write(fd, buf, o->bs);
+		else if (is_read)
+			ret = pread(fd, buf, o->bs, off);
+		else
+			ret = pwrite(fd, buf, o->bs, off);
+		lat_add(r, now_ns() - t);
+		if (ret != (ssize_t)o->bs)
+			die(o->workload);
+	}
+	r->elapsed = now_ns() - t0;
+	r->ops = ops;
+	r->bytes = (unsigned long long)ops * o->bs;
+
+	free(buf);
+	close(fd);
+	unlink(path);
+}
+
+/*
+ * mmap4k, mmappmd: fault in every page of a prefilled file. The PMD case
+ * asks for 2M-aligned extents and maps at a 2M-aligned address; the 4K
+ * case deliberately misaligns the mapping so it can only use PTEs.
+ */
+static void run_mmap(const struct bench_opts *o, struct bench_result *r)
+{
+	int pmd = !strcmp(o->workload, "mmappmd");
+	size_t size = (o->size + HUGE_SZ - 1) & ~(HUGE_SZ - 1);
+	volatile char *p;
+	unsigned long long t0, t;
+	unsigned long i, pages = size / PAGE_SZ;
+	unsigned long addr;
+	char path[512];
+	void *area, *map;
+	int prot = PROT_READ | (o->write_fault ? PROT_WRITE : 0);
+	int fd;
+
+	path_of(path, sizeof(path), o, "mmap", 0);
+	unlink(path);
+	fd = open(path, O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+		die(path);
+	if (pmd && ioctl(fd, NOVA_SET_HUGE_ALLOC, &pmd) < 0)
+		die("NOVA_SET_HUGE_ALLOC");
+	prefill(fd, size, HUGE_SZ);
+
+	area = mmap(NULL, size + 2 * HUGE_SZ, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (area == MAP_FAILED)
+		die("reserve");
+	addr = ((unsigned long)area + HUGE_SZ - 1) & ~(HUGE_SZ - 1);
+	if (!pmd)
+		addr += PAGE_SZ;
+
+	lat_init(r, pages);
+	clear_stats(o);
+	t0 = now_ns();
+	map = mmap((void *)addr, size, prot, MAP_SHARED | MAP_FIXED, fd, 0);
+	if (map == MAP_FAILED)
+		die("mmap");
+	p = map;
+	for (i = 0; i < pages; i++) {
+		t = now_ns();
+		if (o->write_fault)
+			p[i * PAGE_SZ] = 1;
+		else
+			(void)p[i * PAGE_SZ];
+		lat_add(r, now_ns() - t);
+	}
+	r->elapsed = now_ns() - t0;
+	r->ops = pages;
+	r->bytes = size;
+
+	munmap(area, size + 2 * HUGE_SZ);
+	close(fd);
+	unlink(path);
+}
+
+static void create_files(const struct bench_opts *o, const char *name,
+	unsigned long first, unsigned long n)
+{
+	char path[512];
+	unsigned long i;
+	int fd;
+
+	for (i = first; i < first + n; i++) {
+		path_of(path, sizeof(path), o, name, i);
+		fd = open(path, O_CREAT | O_WRONLY, 0644);
+		if (fd < 0)
+			die(path);
+		close(fd);
+	}
+}
+
+static void unlink_files(const struct bench_opts *o, const char *name,
+	unsigned long first, unsigned long n)
+{
+	char path[512];
+	unsigned long i;
+
+	for (i = first; i < first + n; i++) {
+		path_of(path, sizeof(path), o, name, i);
+		unlink(path);
+	}
+}
+
+/*
+ * create, unlink, rename: o->count operations in a directory that already
+ * holds o->populate other entries.
+ */
+static void run_namespace(const struct bench_opts *o, struct bench_result *r)
+{
+	unsigned long long t0, t;
+	char path[512], newpath[512];
+	unsigned long i;
+	int fd, ret;
+
+	create_files(o, "pop", 0, o->populate);
+	if (strcmp(o->workload, "create"))
+		create_files(o, "f", 0, o->count);
+
+	lat_init(r, o->count);
+	clear_stats(o);
+	t0 = now_ns();
+	for (i = 0; i < o->count; i++) {
+		path_of(path, sizeof(path), o, "f", i);
+		t = now_ns();
+		if (!strcmp(o->workload, "create")) {
+			fd = open(path, O_CREAT | O_WRONLY, 0644);
+			ret = fd < 0 ? -1 : close(fd);
+		} else if (!strcmp(o->workload, "unlink")) {
+			ret = unlink(path);
+		} else {
+			path_of(newpath, sizeof(newpath), o, "r", i);
+			ret = rename(path, newpath);
+		}
+		lat_add(r, now_ns() - t);
+		if (ret < 0)
+			die(o->workload);
+	}
+	r->elapsed = now_ns() - t0;
+	r->ops = o->count;
+
+	if (o->keep)
+		return;
+	unlink_files(o, "f", 0, o->count);
+	unlink_files(o, "r", 0, o->count);
+	unlink_files(o, "pop", 0, o->populate);
+}
+
+/* readdir: o->iters full scans of a directory with o->populate entries */
+static void run_readdir(const struct bench_opts *o, struct bench_result *r)
+{
+	unsigned long long t0, t;
+	unsigned long i, seen = 0;
+	struct dirent *de;
+	DIR *d;
+
+	create_files(o, "pop", 0, o->populate);
+
+	lat_init(r, o->iters);
+	clear_stats(o);
+	t0 = now_ns();
+	for (i = 0; i < o->iters; i++) {
+		t = now_ns();
+		d = opendir(o->dir);
+		if (!d)
+			die(o->dir);
+		while ((de = readdir(d)) != NULL)
+			seen++;
+		closedir(d);
+		lat_add(r, now_ns() - t);
+	}
+	r->elapsed = now_ns() - t0;
+	r->ops = seen;
+
+	if (!o->keep)
+		unlink_files(o, "pop", 0, o->populate);
+}
+
+/* mount-clean, mount-failure: report a mount timed by the caller */
+static void run_mount(const struct bench_opts *o, struct bench_result *r)
+{
+	r->elapsed = o->elapsed;
+	r->ops = 1;
+}
+
+static const struct {
+	const char *name;
+	void (*run)(const struct bench_opts *, struct bench_result *);
+} workloads[] = {
+	{ "seqwrite",		run_rw },
+	{ "randwrite",		run_rw },
+	{ "append",		run_rw },
+	{ "seqread",		run_rw },
+	{ "randread",		run_rw },
+	{ "mmap4k",		run_mmap },
+	{ "mmappmd",		run_mmap },
+	{ "create",		run_namespace },
+	{ "unlink",		run_namespace },
+	{ "rename",		run_namespace },
+	{ "readdir",		run_readdir },
+	{ "mount-clean",	run_mount },
+	{ "mount-failure",	run_mount },
+};
+
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		v <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		v <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		v <<= 10;
+	}
+	return v;
+}
+
+static void usage(void)
+{
+	unsigned int i;
+
+	fprintf(stderr,
+		"usage: novabench -d dir [-p /proc/fs/NOVA/<dev>] [-b bs] "
+		"[-s size]\n"
+		"         [-n count] [-P populate] [-i iters] [-e ns] "
+		"[-S seed] [-w] [-k] workload\n"
+		"workloads:");
+	for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+		fprintf(stderr, " %s", workloads[i].name);
+	fprintf(stderr, "\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts o = {
+		.bs = 4096,
+		.size = 64UL << 20,
+		.count = 10000,
+		.populate = 0,
+		.iters = 100,
+		.seed = 1,
+	};
+	struct bench_result r = { 0 };
+	unsigned int i;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:p:b:s:n:P:i:e:S:wk")) != -1) {
+		switch (c) {
+		case 'd': o.dir = optarg; break;
+		case 'p': o.proc = optarg; break;
+		case 'b': o.bs = parse_size(optarg); break;
+		case 's': o.size = parse_size(optarg); break;
+		case 'n': o.count = strtoul(optarg, NULL, 0); break;
+		case 'P': o.populate = strtoul(optarg, NULL, 0); break;
+		case 'i': o.iters = strtoul(optarg, NULL, 0); break;
+		case 'e': o.elapsed = strtoull(optarg, NULL, 0); break;
+		case 'S': o.seed = strtoul(optarg, NULL, 0); break;
+		case 'w': o.write_fault = 1; break;
+		case 'k': o.keep = 1; break;
+		default: usage();
+		}
+	}
+
+	if (optind != argc - 1 || !o.dir || o.bs == 0 || o.size < o.bs)
+		usage();
+	o.workload = argv[optind];
+
+	for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		if (strcmp(workloads[i].name, o.workload))
+			continue;
+		workloads[i].run(&o, &r);
+		print_result(&o, &r);
+		free(r.lat);
+		return 0;
+	}
+
+	usage();
+	return 2;
+}
@@ -0,0 +1,95 @@
+#!/bin/sh
+#
+# Run the NOVA microbenchmark matrix on a freshly formatted pmem device and
+# write one JSON object per run to $OUT. The module is reloaded first, so
+# the device is reformatted and everything on it is lost.
+#
+# Environment:
+#   DEV		pmem device to reformat, required
+#   MNT		mount point (default /mnt/ramdisk)
+#   OUT		result file (default bench/results-<version>-<date>.json)
+#   OPTS	extra mount options, e.g. "concurrent_write"
+#   SIZE	file size for the data workloads (default 256M)
+#   FILES	directory size for the namespace workloads (default 100000)
+#   MEASURE_TIMING  measure_timing module parameter (default 1)
+
+if [ -z "$DEV" ]; then
+	echo "DEV is not set; the benchmark reformats it, so name it explicitly" >&2
+	exit 2
+fi
+MNT=${MNT:-/mnt/ramdisk}
+SIZE=${SIZE:-256M}
+FILES=${FILES:-100000}
+MEASURE_TIMING=${MEASURE_TIMING:-1}
+
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+BENCH=$TOP/bench/novabench
+VERSION=$(git -C "$TOP" describe --always --dirty 2>/dev/null || echo unknown)
+OUT=${OUT:-$TOP/bench/results-$VERSION-$(date +%Y%m%d-%H%M%S).json}
+PROC=/proc/fs/NOVA/$(basename "$DEV")
+DIR=$MNT/bench
+
+set -e
+
+nova_mount() {
+	mount -t NOVA -o "$1${OPTS:+,$OPTS}" "$DEV" "$MNT"
+	mkdir -p "$DIR"
+}
+
+run() {
+	"$BENCH" -d "$DIR" -p "$PROC" "$@" | \
+		sed "s/^{/{\"version\": \"$VERSION\", \"opts\": \"$OPTS\", /" \
+		>> "$OUT"
+}
+
+# Time one remount; $1 is the report name, $2 extra mount options
+time_mount() {
+	echo 1 > "$PROC/timing_stats"
+	umount "$MNT"
+	opts=$2${OPTS:+,$OPTS}
+	opts=${opts#,}
+	start=$(date +%s%N)
+	mount -t NOVA ${opts:+-o "$opts"} "$DEV" "$MNT"
+	end=$(date +%s%N)
+	run -e $((end - start)) "$1"
+}
+
+[ -x "$BENCH" ] || make -C "$TOP" bench/novabench
+
+umount "$MNT" 2>/dev/null || true
+rmmod nova 2>/dev/null || true
+insmod "$TOP/nova.ko" measure_timing=$MEASURE_TIMING
+nova_mount init
+
+echo "Writing results to $OUT"
+: > "$OUT"
+
+for bs in 4K 64K 1M; do
+	for w in seqwrite randwrite seqread randread; do
+		run -b $bs -s $SIZE $w
+	done
+done
+
+for bs in 64 512; do
+	run -b $bs -n 100000 append
+done
+
+for w in mmap4k mmappmd; do
+	run -s $SIZE $w
+	run -s $SIZE -w $w
+done
+
+for w in create unlink rename; do
+	run -n 10000 -P $FILES $w
+done
+run -P $FILES -i 20 readdir
+
+# Leave a populated namespace behind so that recovery has work to do
+"$BENCH" -d "$DIR" -n $FILES -k create > /dev/null
+for i in 1 2 3; do
+	time_mount mount-clean
+	time_mount mount-failure force_recovery
+done
+
+umount "$MNT"
+echo "Done: $(wc -l < "$OUT") runs"
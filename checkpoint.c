@@ -0,0 +1,1088 @@
+/*
+ * NOVA allocator checkpoints.
+ *
+ * The free lists and inode maps only reach NVMM at clean unmount, so any
+ * crash used to cost a scan of every inode log. With checkpoint=<secs>, a
+ * background thread writes them out periodically as range logs, and each
+ * block and inode allocation or free since is appended to a per-CPU delta
+ * area. Recovery loads the last committed checkpoint and replays the
+ * deltas on top of it.
+ *
+ * A checkpoint flips the generation new records are tagged with, waits for
+ * the block operations that may still use the old one, and only then
+ * copies the trees. Every record is an absolute "allocated" or "free"
+ * statement, so replaying one whose effect the copy already holds is
+ * harmless. Records are flushed but not fenced; the fence of the inode
+ * log commit that makes an allocation reachable orders them.
+ *
+ * Block allocations are recorded with the inode they are for. Blocks
+ * allocated by an operation that never committed before a crash are in no
+ * log, so after the replay, recovery walks the committed logs of those
+ * owners and frees what they do not reference, as the full scan would.
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/sort.h>
+#include "nova.h"
+
+#define	CKPT_CPUID_SHIFT	56
+#define	DELTAS_PER_PAGE		(LAST_ENTRY / sizeof(struct nova_delta_entry))
+
+static inline struct nova_inode *nova_ckpt_inode(struct super_block *sb)
+{
+	return nova_get_inode_by_ino(sb, NOVA_CHECKPOINT_INO);
+}
+
+static struct nova_ckpt_header *nova_ckpt_header(struct super_block *sb)
+{
+	struct nova_inode *pi = nova_ckpt_inode(sb);
+
+	if (pi->log_head == 0)
+		return NULL;
+	return (struct nova_ckpt_header *)nova_get_block(sb, pi->log_head);
+}
+
+/* Block and inode areas per CPU for each of three generations */
+static inline int nova_ckpt_areas(int cpus)
+{
+	return 6 * cpus;
+}
+
+static void nova_ckpt_seal_slot(struct nova_ckpt_slot *slot)
+{
+	slot->csum = cpu_to_le16(crc16(~0, (u8 *)slot + sizeof(__le16),
+				sizeof(struct nova_ckpt_slot) - sizeof(__le16)));
+	nova_flush_buffer(slot, sizeof(struct nova_ckpt_slot), 1);
+}
+
+static inline bool nova_ckpt_slot_sane(struct nova_ckpt_slot *slot)
+{
+	return nova_calc_checksum((u8 *)slot,
+				sizeof(struct nova_ckpt_slot)) == 0;
+}
+
+/* The committed slot with the highest generation, if any */
+static struct nova_ckpt_slot *nova_ckpt_last_slot(
+	struct nova_ckpt_header *hdr)
+{
+	struct nova_ckpt_slot *best = NULL;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (!nova_ckpt_slot_sane(&hdr->slot[i]) ||
+				le64_to_cpu(hdr->slot[i].gen) == 0)
+			continue;
+		if (!best || le64_to_cpu(hdr->slot[i].gen) >
+				le64_to_cpu(best->gen))
+			best = &hdr->slot[i];
+	}
+
+	return best;
+}
+
+/* Free the range logs of a committed or pending slot and clear it */
+static void nova_ckpt_clear_slot(struct super_block *sb,
+	struct nova_ckpt_slot *slot)
+{
+	struct nova_inode *pi = nova_ckpt_inode(sb);
+	u64 block_head = 0, inode_head = 0;
+
+	if (nova_ckpt_slot_sane(slot)) {
+		block_head = le64_to_cpu(slot->block_head);
+		inode_head = le64_to_cpu(slot->inode_head);
+	}
+
+	memset(slot, 0, sizeof(struct nova_ckpt_slot));
+	nova_flush_buffer(slot, sizeof(struct nova_ckpt_slot), 1);
+
+	if (block_head)
+		nova_free_contiguous_log_blocks(sb, pi, block_head);
+	if (inode_head)
+		nova_free_contiguous_log_blocks(sb, pi, inode_head);
+}
+
+/* Drop the header and everything it points to */
+static void nova_ckpt_free_pages(struct super_block *sb)
+{
+	struct nova_ckpt_header *hdr = nova_ckpt_header(sb);
+	struct nova_inode *pi = nova_ckpt_inode(sb);
+	u64 head = pi->log_head;
+	int cpus;
+	int i;
+
+	if (!hdr)
+		return;
+
+	if (le32_to_cpu(hdr->magic) == NOVA_CKPT_MAGIC) {
+		nova_ckpt_clear_slot(sb, &hdr->slot[0]);
+		nova_ckpt_clear_slot(sb, &hdr->slot[1]);
+
+		cpus = min_t(int, le32_to_cpu(hdr->cpus), NOVA_CKPT_MAX_CPUS);
+		for (i = 0; i < nova_ckpt_areas(cpus); i++)
+			if (hdr->areas[i])
+				nova_free_contiguous_log_blocks(sb, pi,
+					le64_to_cpu(hdr->areas[i]));
+	}
+
+	pi->log_head = pi->log_tail = 0;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 1);
+	nova_free_contiguous_log_blocks(sb, pi, head);
+}
+
+/* ======================= Delta records ========================= */
+
+static void nova_append_delta(struct super_block *sb,
+	struct nova_checkpoint *ckpt, struct nova_delta_area *area,
+	enum nova_delta_op op, u64 gen, u64 seq, u64 low, u64 high, u64 ino)
+{
+	size_t size = sizeof(struct nova_delta_entry);
+	struct nova_delta_entry *entry;
+
+	if (area->full)
+		return;
+
+	/* The last record of an area marks it incomplete */
+	if (area->count + 1 == area->capacity) {
+		op = NOVA_DELTA_OVERFLOW;
+		area->full = 1;
+		NOVA_STATS_ADD(ckpt_overflows, 1);
+	}
+
+	if (is_last_entry(area->curr, size))
+		area->curr = next_log_page(sb, area->curr);
+
+	entry = (struct nova_delta_entry *)nova_get_block(sb, area->curr);
+	entry->seq = cpu_to_le64(seq);
+	entry->low = cpu_to_le64(low);
+	entry->high = cpu_to_le64(high);
+	entry->ino = cpu_to_le64(ino);
+	entry->op = cpu_to_le32(op);
+	barrier();
+	entry->gen = cpu_to_le32(gen);
+	nova_flush_buffer(entry, size, 0);
+
+	area->curr += size;
+	area->count++;
+	NOVA_STATS_ADD(ckpt_deltas, 1);
+
+	if (area->count == area->capacity / 2) {
+		ckpt->urgent = 1;
+		wake_up_interruptible(&ckpt->wait);
+	}
+}
+
+/* Caller holds the checkpoint SRCU read lock */
+void nova_ckpt_record_blocks(struct super_block *sb, enum nova_delta_op op,
+	unsigned long blocknr, unsigned long num, u64 ino)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_checkpoint *ckpt = sbi->ckpt;
+	struct nova_delta_area *area;
+	u64 gen;
+	int cpu;
+
+	if (!ckpt)
+		return;
+
+	cpu = get_cpu();
+	if (cpu >= sbi->cpus)
+		cpu = cpu % sbi->cpus;
+
+	gen = READ_ONCE(ckpt->gen);
+	area = &ckpt->areas[nova_delta_index(sbi->cpus, gen,
+					NOVA_DELTA_BLOCKS, cpu)];
+	spin_lock(&area->lock);
+	nova_append_delta(sb, ckpt, area, op, gen,
+			atomic64_inc_return(&ckpt->seq),
+			blocknr, blocknr + num - 1, ino);
+	spin_unlock(&area->lock);
+	put_cpu();
+}
+
+/* Caller holds the inode_table_mutex of the inode's map */
+void nova_ckpt_record_inode(struct super_block *sb, enum nova_delta_op op,
+	unsigned long ino)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_checkpoint *ckpt = sbi->ckpt;
+	struct nova_delta_area *area;
+	u64 gen;
+
+	if (!ckpt)
+		return;
+
+	gen = READ_ONCE(ckpt->gen);
+	area = &ckpt->areas[nova_delta_index(sbi->cpus, gen,
+				NOVA_DELTA_INODES, ino % sbi->cpus)];
+	spin_lock(&area->lock);
+	nova_append_delta(sb, ckpt, area, op, gen, 0, ino, ino, 0);
+	spin_unlock(&area->lock);
+}
+
+/* ======================= Taking a checkpoint ========================= */
+
+static int nova_ckpt_grow_buf(struct nova_checkpoint *ckpt,
+	unsigned long num)
+{
+	struct nova_range_node_lowhigh *buf;
+
+	if (num <= ckpt->buf_size)
+		return 0;
+
+	num += num / 4 + RANGENODE_PER_PAGE;
+	buf = vmalloc(num * sizeof(struct nova_range_node_lowhigh));
+	if (!buf)
+		return -ENOMEM;
+
+	vfree(ckpt->buf);
+	ckpt->buf = buf;
+	ckpt->buf_size = num;
+	return 0;
+}
+
+static unsigned long nova_ckpt_copy_tree(struct rb_root *tree,
+	struct nova_range_node_lowhigh *buf, unsigned long room, u64 tag)
+{
+	struct nova_range_node *curr;
+	struct rb_node *temp;
+	unsigned long num = 0;
+
+	for (temp = rb_first(tree); temp; temp = rb_next(temp)) {
+		if (num == room)
+			return room + 1;
+		curr = container_of(temp, struct nova_range_node, node);
+		buf[num].range_low = cpu_to_le64(curr->range_low | tag);
+		buf[num].range_high = cpu_to_le64(curr->range_high);
+		num++;
+	}
+
+	return num;
+}
+
+/* Copy all free block ranges; nothing is cached or queued outside them */
+static long nova_ckpt_snapshot_blocks(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_checkpoint *ckpt = sbi->ckpt;
+	struct free_list *free_list;
+	unsigned long total, num, room;
+	int i;
+
+retry:
+	total = 0;
+	for (i = 0; i <= sbi->cpus; i++)
+		total += nova_get_free_list(sb, i < sbi->cpus ?
+					i : SHARED_CPU)->num_blocknode;
+	if (nova_ckpt_grow_buf(ckpt, total))
+		return -ENOMEM;
+
+	total = 0;
+	for (i = 0; i <= sbi->cpus; i++) {
+		free_list = nova_get_free_list(sb, i < sbi->cpus ?
+						i : SHARED_CPU);
+		room = ckpt->buf_size - total;
+		spin_lock(&free_list->s_lock);
+		num = nova_ckpt_copy_tree(&free_list->block_free_tree,
+					ckpt->buf + total, room, 0);
+		spin_unlock(&free_list->s_lock);
+		if (num > room) {
+			if (nova_ckpt_grow_buf(ckpt, ckpt->buf_size + 1))
+				return -ENOMEM;
+			goto retry;
+		}
+		total += num;
+	}
+
+	return total;
+}
+
+/* Copy all used inode ranges, tagged with their map like at unmount */
+static long nova_ckpt_snapshot_inodes(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_checkpoint *ckpt = sbi->ckpt;
+	struct inode_map *inode_map;
+	unsigned long total, num, room;
+	u64 i;
+
+retry:
+	total = 0;
+	for (i = 0; i < sbi->cpus; i++)
+		total += sbi->inode_maps[i].num_range_node_inode;
+	if (nova_ckpt_grow_buf(ckpt, total))
+		return -ENOMEM;
+
+	total = 0;
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		room = ckpt->buf_size - total;
+		mutex_lock(&inode_map->inode_table_mutex);
+		num = nova_ckpt_copy_tree(&inode_map->inode_inuse_tree,
+				ckpt->buf + total, room,
+				i << CKPT_CPUID_SHIFT);
+		mutex_unlock(&inode_map->inode_table_mutex);
+		if (num > room) {
+			if (nova_ckpt_grow_buf(ckpt, ckpt->buf_size + 1))
+				return -ENOMEM;
+			goto retry;
+		}
+		total += num;
+	}
+
+	return total;
+}
+
+/* Write the staged ranges as a range log of fresh pages */
+static int nova_ckpt_write_ranges(struct super_block *sb, unsigned long num,
+	u64 *head, u64 *tail)
+{
+	struct nova_checkpoint *ckpt = NOVA_SB(sb)->ckpt;
+	size_t size = sizeof(struct nova_range_node_lowhigh);
+	struct nova_range_node_lowhigh *entry;
+	unsigned long num_pages;
+	unsigned long i;
+	int allocated;
+	u64 curr_p;
+
+	num_pages = DIV_ROUND_UP(num, RANGENODE_PER_PAGE);
+	if (num_pages == 0)
+		num_pages = 1;
+
+	allocated = nova_allocate_inode_log_pages(sb, nova_ckpt_inode(sb),
+						num_pages, head);
+	if (allocated != num_pages) {
+		if (allocated > 0)
+			nova_free_contiguous_log_blocks(sb,
+					nova_ckpt_inode(sb), *head);
+		return allocated < 0 ? allocated : -ENOSPC;
+	}
+
+	curr_p = *head;
+	for (i = 0; i < num; i++) {
+		if (is_last_entry(curr_p, size))
+			curr_p = next_log_page(sb, curr_p);
+		entry = (struct nova_range_node_lowhigh *)
+				nova_get_block(sb, curr_p);
+		*entry = ckpt->buf[i];
+		nova_flush_buffer(entry, size, 0);
+		curr_p += size;
+	}
+
+	*tail = curr_p;
+	return 0;
+}
+
+static void nova_ckpt_reset_areas(struct nova_checkpoint *ckpt, int cpus,
+	u64 gen)
+{
+	struct nova_delta_area *area;
+	int i;
+
+	for (i = 0; i < 2 * cpus; i++) {
+		area = &ckpt->areas[nova_delta_index(cpus, gen, 0, i)];
+		spin_lock(&area->lock);
+		area->curr = area->head;
+		area->count = 0;
+		area->full = 0;
+		spin_unlock(&area->lock);
+	}
+}
+
+static int nova_write_checkpoint(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_checkpoint *ckpt = sbi->ckpt;
+	struct nova_ckpt_header *hdr = nova_ckpt_header(sb);
+	struct nova_ckpt_slot *slot, *old;
+	u64 block_head = 0, block_tail = 0;
+	u64 inode_head = 0, inode_tail = 0;
+	long num_blocks, num_inodes;
+	u64 gen = ckpt->gen + 1;
+	int ret;
+	timing_t ckpt_time;
+
+	NOVA_START_TIMING(checkpoint_t, ckpt_time);
+	ckpt->urgent = 0;
+
+	/* Reuse the areas of gen - 3, which no checkpoint replays any more */
+	nova_ckpt_reset_areas(ckpt, sbi->cpus, gen);
+	hdr->gen = cpu_to_le64(gen);
+	nova_flush_buffer(&hdr->gen, sizeof(hdr->gen), 1);
+
+	WRITE_ONCE(ckpt->pause_magazines, 1);
+	WRITE_ONCE(ckpt->gen, gen);
+	synchronize_srcu(&ckpt->srcu);
+
+	nova_flush_block_magazines(sb);
+	nova_flush_log_pools(sb);
+	nova_drain_deferred_frees(sb);
+	num_blocks = nova_ckpt_snapshot_blocks(sb);
+	WRITE_ONCE(ckpt->pause_magazines, 0);
+	if (num_blocks < 0) {
+		ret = num_blocks;
+		goto fail;
+	}
+
+	ret = nova_ckpt_write_ranges(sb, num_blocks, &block_head, &block_tail);
+	if (ret)
+		goto fail;
+
+	num_inodes = nova_ckpt_snapshot_inodes(sb);
+	if (num_inodes < 0) {
+		ret = num_inodes;
+		goto fail;
+	}
+
+	ret = nova_ckpt_write_ranges(sb, num_inodes, &inode_head, &inode_tail);
+	if (ret)
+		goto fail;
+
+	/* Pending first, so the pages can be found if we crash before commit */
+	slot = &hdr->slot[gen & 1];
+	slot->gen = 0;
+	slot->num_block_nodes = cpu_to_le32(num_blocks);
+	slot->block_head = cpu_to_le64(block_head);
+	slot->block_tail = cpu_to_le64(block_tail);
+	slot->inode_head = cpu_to_le64(inode_head);
+	slot->inode_tail = cpu_to_le64(inode_tail);
+	slot->time = cpu_to_le64(get_seconds());
+	nova_ckpt_seal_slot(slot);
+
+	slot->gen = cpu_to_le64(gen);
+	nova_ckpt_seal_slot(slot);
+	ckpt->committed = gen;
+
+	old = &hdr->slot[(gen - 1) & 1];
+	nova_ckpt_clear_slot(sb, old);
+
+	nova_dbgv("%s: gen %llu, %ld block nodes, %ld inode nodes\n",
+			__func__, gen, num_blocks, num_inodes);
+	NOVA_END_TIMING(checkpoint_t, ckpt_time);
+	return 0;
+
+fail:
+	/*
+	 * The next attempt reuses areas the committed checkpoint replays,
+	 * so it cannot be trusted any more. Full scan until the next one.
+	 */
+	nova_err(sb, "%s: gen %llu failed %d\n", __func__, gen, ret);
+	if (block_head)
+		nova_free_contiguous_log_blocks(sb, nova_ckpt_inode(sb),
+						block_head);
+	if (inode_head)
+		nova_free_contiguous_log_blocks(sb, nova_ckpt_inode(sb),
+						inode_head);
+	nova_ckpt_clear_slot(sb, &hdr->slot[0]);
+	nova_ckpt_clear_slot(sb, &hdr->slot[1]);
+	ckpt->committed = 0;
+	NOVA_END_TIMING(checkpoint_t, ckpt_time);
+	return ret;
+}
+
+static int nova_checkpoint_func(void *data)
+{
+	struct nova_checkpoint *ckpt = data;
+	struct super_block *sb = ckpt->sb;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible_timeout(ckpt->wait,
+				ckpt->urgent || kthread_should_stop(),
+				sbi->ckpt_interval * HZ);
+		if (kthread_should_stop())
+			break;
+
+		nova_write_checkpoint(sb);
+	}
+
+	return 0;
+}
+
+/* ======================= Setup and teardown ========================= */
+
+/* Allocate and zero a delta area, so that no stale record looks valid */
+static u64 nova_ckpt_new_area(struct super_block *sb, unsigned long pages)
+{
+	struct nova_inode *pi = nova_ckpt_inode(sb);
+	u64 head, curr_p;
+	int allocated;
+
+	allocated = nova_allocate_inode_log_pages(sb, pi, pages, &head);
+	if (allocated != pages) {
+		if (allocated > 0)
+			nova_free_contiguous_log_blocks(sb, pi, head);
+		return 0;
+	}
+
+	for (curr_p = head; curr_p; curr_p = next_log_page(sb, curr_p))
+		memset_nt(nova_get_block(sb, curr_p), 0, LAST_ENTRY);
+
+	return head;
+}
+
+static int nova_ckpt_new_header(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_ckpt_inode(sb);
+	struct nova_ckpt_header *hdr;
+	unsigned long pages;
+	u64 head;
+	int i;
+
+	if (nova_allocate_inode_log_pages(sb, pi, 1, &head) != 1)
+		return -ENOSPC;
+
+	hdr = (struct nova_ckpt_header *)nova_get_block(sb, head);
+	memset(hdr, 0, LAST_ENTRY);
+	hdr->magic = cpu_to_le32(NOVA_CKPT_MAGIC);
+	hdr->cpus = cpu_to_le32(sbi->cpus);
+
+	pi->log_head = pi->log_tail = head;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+
+	for (i = 0; i < nova_ckpt_areas(sbi->cpus); i++) {
+		pages = (i / sbi->cpus) % 2 == NOVA_DELTA_BLOCKS ?
+				DELTA_BLOCK_PAGES : DELTA_INODE_PAGES;
+		hdr->areas[i] = cpu_to_le64(nova_ckpt_new_area(sb, pages));
+		if (hdr->areas[i] == 0) {
+			nova_flush_buffer(hdr, LAST_ENTRY, 1);
+			nova_ckpt_free_pages(sb);
+			return -ENOSPC;
+		}
+	}
+
+	nova_flush_buffer(hdr, LAST_ENTRY, 1);
+	return 0;
+}
+
+/*
+ * Reuse the delta areas of a previous mount. Its checkpoints describe a
+ * state the mount has moved past, so they are dropped.
+ */
+static int nova_ckpt_setup_header(struct super_block *sb,
+	struct nova_checkpoint *ckpt)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_ckpt_header *hdr = nova_ckpt_header(sb);
+	struct nova_delta_area *area;
+	int ret;
+	int i;
+
+	if (hdr && (le32_to_cpu(hdr->magic) != NOVA_CKPT_MAGIC ||
+			le32_to_cpu(hdr->cpus) != sbi->cpus)) {
+		nova_ckpt_free_pages(sb);
+		hdr = NULL;
+	}
+
+	if (hdr) {
+		nova_ckpt_clear_slot(sb, &hdr->slot[0]);
+		nova_ckpt_clear_slot(sb, &hdr->slot[1]);
+	} else {
+		ret = nova_ckpt_new_header(sb);
+		if (ret)
+			return ret;
+		hdr = nova_ckpt_header(sb);
+	}
+
+	for (i = 0; i < nova_ckpt_areas(sbi->cpus); i++) {
+		area = &ckpt->areas[i];
+		spin_lock_init(&area->lock);
+		area->head = area->curr = le64_to_cpu(hdr->areas[i]);
+		area->capacity = DELTAS_PER_PAGE *
+			((i / sbi->cpus) % 2 == NOVA_DELTA_BLOCKS ?
+				DELTA_BLOCK_PAGES : DELTA_INODE_PAGES);
+	}
+
+	/* Generations keep growing across mounts; old records never match */
+	ckpt->gen = le64_to_cpu(hdr->gen) + 1;
+	hdr->gen = cpu_to_le64(ckpt->gen);
+	nova_flush_buffer(&hdr->gen, sizeof(hdr->gen), 1);
+	return 0;
+}
+
+static void nova_free_checkpoint(struct nova_checkpoint *ckpt)
+{
+	cleanup_srcu_struct(&ckpt->srcu);
+	vfree(ckpt->buf);
+	kfree(ckpt->areas);
+	kfree(ckpt);
+}
+
+int nova_start_checkpoint(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_checkpoint *ckpt;
+	int ret;
+
+	if (sbi->ckpt_interval && sbi->cpus > NOVA_CKPT_MAX_CPUS) {
+		nova_info("NOVA: checkpoints support at most %lu CPUs\n",
+				NOVA_CKPT_MAX_CPUS);
+		sbi->ckpt_interval = 0;
+	}
+
+	if (sbi->ckpt_interval == 0) {
+		nova_ckpt_free_pages(sb);
+		return 0;
+	}
+
+	ckpt = kzalloc(sizeof(struct nova_checkpoint), GFP_KERNEL);
+	if (!ckpt)
+		return -ENOMEM;
+
+	ckpt->sb = sb;
+	init_waitqueue_head(&ckpt->wait);
+	atomic64_set(&ckpt->seq, 0);
+	ret = init_srcu_struct(&ckpt->srcu);
+	if (ret) {
+		kfree(ckpt);
+		return ret;
+	}
+
+	ckpt->areas = kcalloc(nova_ckpt_areas(sbi->cpus),
+				sizeof(struct nova_delta_area), GFP_KERNEL);
+	if (!ckpt->areas) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ckpt->task = kthread_create(nova_checkpoint_func, ckpt, "nova_ckpt");
+	if (IS_ERR(ckpt->task)) {
+		ret = PTR_ERR(ckpt->task);
+		goto out;
+	}
+
+	ret = nova_ckpt_setup_header(sb, ckpt);
+	if (ret) {
+		kthread_stop(ckpt->task);
+		goto out;
+	}
+
+	/* Record from here on, and cover the mount state right away */
+	sbi->ckpt = ckpt;
+	nova_write_checkpoint(sb);
+	wake_up_process(ckpt->task);
+	return 0;
+
+out:
+	nova_free_checkpoint(ckpt);
+	return ret;
+}
+
+/*
+ * Stop recording. Unmount saves the allocator state on its own; until then
+ * the checkpoint is already stale, so it is dropped rather than trusted.
+ */
+void nova_stop_checkpoint(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_checkpoint *ckpt = sbi->ckpt;
+	struct nova_ckpt_header *hdr;
+
+	if (!ckpt)
+		return;
+
+	kthread_stop(ckpt->task);
+	sbi->ckpt = NULL;
+	synchronize_srcu(&ckpt->srcu);
+
+	hdr = nova_ckpt_header(sb);
+	nova_ckpt_clear_slot(sb, &hdr->slot[0]);
+	nova_ckpt_clear_slot(sb, &hdr->slot[1]);
+
+	nova_free_checkpoint(ckpt);
+}
+
+/* ======================= Recovery ========================= */
+
+/* Records of @gen at the start of an area; -EINVAL if it overflowed */
+static long nova_ckpt_scan_area(struct super_block *sb, u64 head, u64 gen,
+	struct nova_delta_entry *out)
+{
+	size_t size = sizeof(struct nova_delta_entry);
+	struct nova_delta_entry *entry;
+	u64 curr_p = head;
+	long num = 0;
+
+	while (curr_p) {
+		if (is_last_entry(curr_p, size)) {
+			curr_p = next_log_page(sb, curr_p);
+			continue;
+		}
+
+		entry = (struct nova_delta_entry *)nova_get_block(sb, curr_p);
+		if (le32_to_cpu(entry->gen) != (u32)gen || entry->op == 0)
+			break;
+		if (le32_to_cpu(entry->op) == NOVA_DELTA_OVERFLOW)
+			return -EINVAL;
+
+		if (out)
+			out[num] = *entry;
+		num++;
+		curr_p += size;
+	}
+
+	return num;
+}
+
+/*
+ * Gather the records of the committed generation and of the ones that were
+ * active before and after it, from the areas of @kind owned by CPUs
+ * [@first, @last). The earlier ones are already in the checkpoint; they
+ * tell which blocks operations still running at the time had allocated.
+ */
+static long nova_ckpt_collect(struct super_block *sb,
+	struct nova_ckpt_header *hdr, u64 gen, enum nova_delta_kind kind,
+	int first, int last, struct nova_delta_entry **entries)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_delta_entry *buf = NULL;
+	long total, num;
+	u64 g;
+	int pass, cpu;
+
+	/* First pass counts, second one copies */
+	for (pass = 0; pass < 2; pass++) {
+		total = 0;
+		for (g = gen - 1; g <= gen + 1; g++) {
+			for (cpu = first; cpu < last; cpu++) {
+				num = nova_ckpt_scan_area(sb, le64_to_cpu(
+					hdr->areas[nova_delta_index(sbi->cpus,
+						g, kind, cpu)]), g,
+					buf ? buf + total : NULL);
+				if (num < 0) {
+					vfree(buf);
+					return num;
+				}
+				total += num;
+			}
+		}
+
+		if (pass == 0) {
+			buf = vmalloc(max(total, 1L) *
+					sizeof(struct nova_delta_entry));
+			if (!buf)
+				return -ENOMEM;
+		}
+	}
+
+	*entries = buf;
+	return total;
+}
+
+static int nova_cmp_delta_seq(const void *a, const void *b)
+{
+	u64 x = le64_to_cpu(((const struct nova_delta_entry *)a)->seq);
+	u64 y = le64_to_cpu(((const struct nova_delta_entry *)b)->seq);
+
+	if (x < y)
+		return -1;
+	return x > y ? 1 : 0;
+}
+
+static int nova_cmp_ino(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
+
+	if (x < y)
+		return -1;
+	return x > y ? 1 : 0;
+}
+
+/* Internal inodes commit their blocks as they allocate them */
+static inline bool nova_ckpt_owner_checked(u64 ino)
+{
+	return ino == NOVA_ROOT_INO || ino >= NOVA_NORMAL_INODE_START;
+}
+
+/*
+ * Free the blocks whose last record in @entries, in sequence order, hands
+ * them to an inode whose committed log does not reference them: the
+ * operation they were for never committed.
+ */
+static int nova_ckpt_reclaim(struct super_block *sb,
+	struct nova_delta_entry *entries, long num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long size = BITS_TO_LONGS(sbi->num_blocks) * sizeof(long);
+	unsigned long *seen = NULL, *checked = NULL, *logged;
+	struct nova_delta_entry *entry;
+	struct scan_bitmap bm;
+	unsigned long blocknr, end;
+	unsigned long reclaimed = 0;
+	u64 *inos = NULL;
+	long i, owners = 0;
+	bool owned, counted;
+	int ret = -ENOMEM;
+
+	memset(&bm, 0, sizeof(struct scan_bitmap));
+	seen = vzalloc(size);
+	checked = vzalloc(size);
+	bm.scan_bm_4K.bitmap_size = size;
+	bm.scan_bm_4K.bitmap = vzalloc(size);
+	inos = vmalloc(max(num, 1L) * sizeof(u64));
+	if (!seen || !checked || !bm.scan_bm_4K.bitmap || !inos)
+		goto out;
+	logged = bm.scan_bm_4K.bitmap;
+
+	/* Newest first, so that only the last record of a block counts */
+	for (i = num - 1; i >= 0; i--) {
+		entry = &entries[i];
+		owned = le32_to_cpu(entry->op) == NOVA_DELTA_BLOCK_ALLOC &&
+				nova_ckpt_owner_checked(le64_to_cpu(entry->ino));
+		counted = false;
+		end = le64_to_cpu(entry->high);
+		for (blocknr = le64_to_cpu(entry->low); blocknr <= end;
+				blocknr++) {
+			if (test_and_set_bit(blocknr, seen) || !owned)
+				continue;
+			set_bit(blocknr, checked);
+			counted = true;
+		}
+		if (counted)
+			inos[owners++] = le64_to_cpu(entry->ino);
+	}
+
+	ret = 0;
+	if (owners == 0)
+		goto out;
+
+	sort(inos, owners, sizeof(u64), nova_cmp_ino, NULL);
+	for (i = 1, num = 1; i < owners; i++)
+		if (inos[i] != inos[num - 1])
+			inos[num++] = inos[i];
+
+	ret = nova_mark_logged_blocks(sb, inos, num, &bm);
+	if (ret)
+		goto out;
+
+	blocknr = find_first_bit(checked, sbi->num_blocks);
+	while (blocknr < sbi->num_blocks) {
+		end = blocknr;
+		while (end < sbi->num_blocks && test_bit(end, checked) &&
+				!test_bit(end, logged) &&
+				nova_free_list_id(sbi, end) ==
+				nova_free_list_id(sbi, blocknr))
+			end++;
+
+		if (end > blocknr) {
+			ret = nova_replay_block_delta(sb, blocknr,
+						end - blocknr, 1);
+			if (ret)
+				goto out;
+			reclaimed += end - blocknr;
+		} else {
+			end++;
+		}
+		blocknr = find_next_bit(checked, sbi->num_blocks, end);
+	}
+
+	nova_dbg("%s: %ld owners, reclaimed %lu blocks\n",
+			__func__, num, reclaimed);
+	NOVA_STATS_ADD(ckpt_reclaimed, reclaimed);
+out:
+	vfree(inos);
+	vfree(bm.scan_bm_4K.bitmap);
+	vfree(checked);
+	vfree(seen);
+	return ret;
+}
+
+static int nova_ckpt_replay_blocks(struct super_block *sb,
+	struct nova_ckpt_header *hdr, u64 gen)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_delta_entry *entries, *entry;
+	unsigned long low, high;
+	long num, i;
+	int ret = 0;
+
+	num = nova_ckpt_collect(sb, hdr, gen, NOVA_DELTA_BLOCKS,
+				0, sbi->cpus, &entries);
+	if (num < 0)
+		return num;
+
+	/* Per-CPU areas interleave; the global sequence restores order */
+	sort(entries, num, sizeof(struct nova_delta_entry),
+				nova_cmp_delta_seq, NULL);
+
+	for (i = 0; i < num && ret == 0; i++) {
+		entry = &entries[i];
+		low = le64_to_cpu(entry->low);
+		high = le64_to_cpu(entry->high);
+		if (high < low) {
+			ret = -EINVAL;
+			break;
+		}
+
+		switch (le32_to_cpu(entry->op)) {
+		case NOVA_DELTA_BLOCK_ALLOC:
+			ret = nova_replay_block_delta(sb, low,
+						high - low + 1, 0);
+			break;
+		case NOVA_DELTA_BLOCK_FREE:
+			ret = nova_replay_block_delta(sb, low,
+						high - low + 1, 1);
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	if (ret == 0)
+		ret = nova_ckpt_reclaim(sb, entries, num);
+
+	nova_dbg("%s: %ld records, ret %d\n", __func__, num, ret);
+	vfree(entries);
+	return ret;
+}
+
+static int nova_ckpt_replay_inodes(struct super_block *sb,
+	struct nova_ckpt_header *hdr, u64 gen)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_delta_entry *entries;
+	struct nova_range_node *node;
+	unsigned long ino;
+	long num, i;
+	int found;
+	int ret = 0;
+	int cpu;
+
+	/* A map's records are ordered by its mutex; replay them in place */
+	for (cpu = 0; cpu < sbi->cpus && ret == 0; cpu++) {
+		num = nova_ckpt_collect(sb, hdr, gen, NOVA_DELTA_INODES,
+					cpu, cpu + 1, &entries);
+		if (num < 0)
+			return num;
+
+		for (i = 0; i < num && ret == 0; i++) {
+			ino = le64_to_cpu(entries[i].low);
+			if (ino % sbi->cpus != cpu) {
+				ret = -EINVAL;
+				break;
+			}
+
+			found = nova_search_inodetree(sbi, ino, &node);
+			switch (le32_to_cpu(entries[i].op)) {
+			case NOVA_DELTA_INODE_ALLOC:
+				if (!found)
+					ret = nova_failure_insert_inodetree(sb,
+								ino, ino);
+				break;
+			case NOVA_DELTA_INODE_FREE:
+				if (found)
+					ret = nova_free_inuse_inode(sb, ino);
+				break;
+			default:
+				ret = -EINVAL;
+				break;
+			}
+		}
+
+		vfree(entries);
+	}
+
+	return ret;
+}
+
+static void nova_ckpt_fixup_maps(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list *free_list;
+	struct inode_map *inode_map;
+	struct nova_range_node *curr;
+	struct rb_node *temp;
+	int i;
+
+	for (i = 0; i <= sbi->cpus; i++) {
+		free_list = nova_get_free_list(sb, i < sbi->cpus ?
+						i : SHARED_CPU);
+		temp = rb_first(&free_list->block_free_tree);
+		free_list->first_node = temp ?
+			container_of(temp, struct nova_range_node, node) : NULL;
+	}
+
+	sbi->s_inodes_used_count = 0;
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		temp = rb_first(&inode_map->inode_inuse_tree);
+		inode_map->first_inode_range = temp ?
+			container_of(temp, struct nova_range_node, node) : NULL;
+		for (; temp; temp = rb_next(temp)) {
+			curr = container_of(temp, struct nova_range_node, node);
+			sbi->s_inodes_used_count +=
+				curr->range_high - curr->range_low + 1;
+		}
+	}
+}
+
+/*
+ * Rebuild the free lists and inode maps from the last checkpoint and the
+ * deltas since. On error the caller discards the trees and does a full
+ * scan.
+ */
+int nova_recover_from_checkpoint(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_ckpt_header *hdr = nova_ckpt_header(sb);
+	struct nova_ckpt_slot *slot;
+	u64 gen;
+	int ret;
+
+	if (!hdr || le32_to_cpu(hdr->magic) != NOVA_CKPT_MAGIC ||
+			le32_to_cpu(hdr->cpus) != sbi->cpus)
+		return -ENOENT;
+
+	/* Shared block counts are not checkpointed; only a scan rebuilds them */
+	if (nova_shared_blocks_logged(sb)) {
+		nova_dbg("%s: shared blocks, need a full scan\n", __func__);
+		return -EINVAL;
+	}
+
+	slot = nova_ckpt_last_slot(hdr);
+	if (!slot)
+		return -ENOENT;
+
+	gen = le64_to_cpu(slot->gen);
+	nova_dbg("%s: checkpoint gen %llu\n", __func__, gen);
+
+	ret = nova_load_blockmap_from_log(sb, le64_to_cpu(slot->block_head),
+					le64_to_cpu(slot->block_tail));
+	if (ret)
+		return ret;
+
+	ret = nova_load_inode_list_from_log(sb, le64_to_cpu(slot->inode_head),
+					le64_to_cpu(slot->inode_tail));
+	if (ret)
+		return ret;
+
+	ret = nova_ckpt_replay_blocks(sb, hdr, gen);
+	if (ret)
+		return ret;
+
+	ret = nova_ckpt_replay_inodes(sb, hdr, gen);
+	if (ret)
+		return ret;
+
+	nova_ckpt_fixup_maps(sb);
+	return 0;
+}
@@ -14,35 +14,122 @@
  */
 
 #include <linux/buffer_head.h>
+#include <linux/falloc.h>
+#include <linux/pagemap.h>
+#include <linux/prefetch.h>
+#include <linux/uaccess.h>
 #include <asm/cpufeature.h>
 #include <asm/pgtable.h>
 #include <linux/version.h>
 #include "nova.h"
+#include "nova_trace.h"
 
+/*
+ * Copy [pos, pos + len) of an inline file to the iterator. Bytes past the
+ * valid inline data, left by a truncate that grew the file, read as zeros.
+ */
+static ssize_t nova_inline_read(struct super_block *sb,
+	struct nova_inode_info_header *sih, struct iov_iter *iter,
+	loff_t pos, size_t len, u64 curr_p)
+{
+	struct nova_inline_data_entry *entry = nova_get_block(sb, curr_p);
+	size_t valid, nr = 0;
+
+	valid = min_t(size_t, READ_ONCE(sih->inline_len),
+			le16_to_cpu(entry->data_len));
+	if (pos < valid) {
+		nr = min_t(size_t, len, valid - pos);
+		if (copy_to_iter(entry->data + pos, nr, iter) != nr)
+			return -EFAULT;
+	}
+
+	if (len > nr && iov_iter_zero(len - nr, iter) != len - nr)
+		return -EFAULT;
+
+	return len;
+}
+
+/* Sequential read engine */
+#define	NOVA_READ_RUNS		16	/* Runs per extent tree walk */
+#define	NOVA_PREFETCH_BYTES	1024	/* Prefetched head of the next page */
+#define	NOVA_STREAM_READ_MIN	(64 * 1024)
+
+/*
+ * Copy @bytes of NVMM at @src to the iterator a page at a time, prefetching
+ * the head of the next page before each copy, since the hardware
+ * prefetcher stops at page boundaries. The last page prefetches @next,
+ * the start of the following run, instead. The copy itself is the arch's
+ * copy_to_iter(), already a string copy tuned for large sizes.
+ */
+static size_t nova_stream_copy(void *src, size_t bytes, void *next,
+	struct iov_iter *iter)
+{
+	size_t done = 0;
+	size_t n, c;
+
+	while (done < bytes) {
+		n = min_t(size_t, bytes - done,
+			PAGE_SIZE - ((unsigned long)(src + done) & ~PAGE_MASK));
+		if (done + n < bytes)
+			prefetch_range(src + done + n, min_t(size_t,
+				NOVA_PREFETCH_BYTES, bytes - done - n));
+		else if (next)
+			prefetch_range(next, NOVA_PREFETCH_BYTES);
+
+		c = copy_to_iter(src + done, n, iter);
+		done += c;
+		if (c != n)
+			break;
+	}
+
+	return done;
+}
+
+/*
+ * A read continuing where the last one on this file ended, or a large one,
+ * is part of a stream. The DAX path has no readahead, so f_ra only keeps
+ * the position for this.
+ */
+static bool nova_stream_read(struct file *filp, loff_t pos, size_t len)
+{
+	return filp && (pos == filp->f_ra.prev_pos ||
+			len >= NOVA_STREAM_READ_MIN);
+}
+
+/*
+ * Copy [*ppos, *ppos + count) to the iterator. Each pass takes one walk
+ * over the extent tree for up to NOVA_READ_RUNS runs of the range, with
+ * adjacent NVMM extents and adjacent holes coalesced, then copies them
+ * without further lookups. Streaming reads prefetch ahead while copying.
+ */
 static ssize_t
-do_dax_mapping_read(struct file *filp, char __user *buf,
-	size_t len, loff_t *ppos)
+do_dax_mapping_read(struct file *filp, struct iov_iter *iter, loff_t *ppos)
 {
 	struct inode *inode = filp->f_mapping->host;
 	struct super_block *sb = inode->i_sb;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct nova_inode_info *si = NOVA_I(inode);
 	struct nova_inode_info_header *sih = &si->header;
-	struct nova_file_write_entry *entry;
+	struct nova_read_run runs[NOVA_READ_RUNS];
+	struct nova_read_run *run;
 	pgoff_t index, end_index;
 	unsigned long offset;
 	loff_t isize, pos;
+	size_t len = iov_iter_count(iter);
 	size_t copied = 0, error = 0;
+	size_t nr, left;
+	void *dax_mem, *next;
+	u64 inline_entry;
+	bool stream;
+	ssize_t ret;
+	int nruns, i;
+	int idx;
 	timing_t memcpy_time;
 
 	pos = *ppos;
 	index = pos >> PAGE_SHIFT;
 	offset = pos & ~PAGE_MASK;
 
-	if (!access_ok(VERIFY_WRITE, buf, len)) {
-		error = -EFAULT;
-		goto out;
-	}
-
 	isize = i_size_read(inode);
 	if (!isize)
 		goto out;
@@ -56,84 +143,86 @@ do_dax_mapping_read(struct file *filp, char __user *buf,
 	if (len <= 0)
 		goto out;
 
-	end_index = (isize - 1) >> PAGE_SHIFT;
-	do {
-		unsigned long nr, left;
-		unsigned long nvmm;
-		void *dax_mem = NULL;
-		int zero = 0;
-
-		/* nr is the maximum number of bytes to copy from this page */
-		if (index >= end_index) {
-			if (index > end_index)
-				goto out;
-			nr = ((isize - 1) & ~PAGE_MASK) + 1;
-			if (nr <= offset) {
-				goto out;
-			}
-		}
-
-		entry = nova_get_write_entry(sb, si, index);
-		if (unlikely(entry == NULL)) {
-			nova_dbgv("Required extent not found: pgoff %lu, "
-				"inode size %lld\n", index, isize);
-			nr = PAGE_SIZE;
-			zero = 1;
-			goto memcpy;
-		}
-
-		/* Find contiguous blocks */
-		if (index < entry->pgoff ||
-			index - entry->pgoff >= entry->num_pages) {
-			nova_err(sb, "%s ERROR: %lu, entry pgoff %llu, num %u, "
-				"blocknr %llu\n", __func__, index, entry->pgoff,
-				entry->num_pages, entry->block >> PAGE_SHIFT);
-			return -EINVAL;
-		}
-		if (entry->invalid_pages == 0) {
-			nr = (entry->num_pages - (index - entry->pgoff))
-				* PAGE_SIZE;
-		} else {
-			nr = PAGE_SIZE;
-		}
-
-		nvmm = get_nvmm(sb, sih, entry, index);
-		dax_mem = nova_get_block(sb, (nvmm << PAGE_SHIFT));
-
-memcpy:
-		nr = nr - offset;
-		if (nr > len - copied)
-			nr = len - copied;
-
+	inline_entry = READ_ONCE(sih->inline_entry);
+	if (inline_entry) {
 		NOVA_START_TIMING(memcpy_r_nvmm_t, memcpy_time);
-
-		if (!zero)
-			left = __copy_to_user(buf + copied,
-						dax_mem + offset, nr);
+		ret = nova_inline_read(sb, sih, iter, pos, len, inline_entry);
+		NOVA_END_TIMING(memcpy_r_nvmm_t, memcpy_time);
+		if (ret < 0)
+			error = ret;
 		else
-			left = __clear_user(buf + copied, nr);
+			copied = ret;
+		goto out;
+	}
 
-		NOVA_END_TIMING(memcpy_r_nvmm_t, memcpy_time);
+	stream = nova_stream_read(filp, pos, len);
+	if (stream)
+		NOVA_STATS_ADD(stream_reads, 1);
 
-		if (left) {
-			nova_dbg("%s ERROR!: bytes %lu, left %lu\n",
-				__func__, nr, left);
-			error = -EFAULT;
+	end_index = (pos + len - 1) >> PAGE_SHIFT;
+	do {
+		/* Blocks found here are not reused until the unlock */
+		idx = srcu_read_lock(&sbi->dax_read_srcu);
+		nruns = nova_find_read_runs(sb, sih, index, end_index,
+						runs, NOVA_READ_RUNS);
+		if (nruns <= 0) {
+			srcu_read_unlock(&sbi->dax_read_srcu, idx);
+			error = nruns ? nruns : -EINVAL;
 			goto out;
 		}
-
-		copied += (nr - left);
-		offset += (nr - left);
-		index += offset >> PAGE_SHIFT;
-		offset &= ~PAGE_MASK;
-	} while (copied < len);
+		NOVA_STATS_ADD(read_runs, nruns);
+
+		for (i = 0; i < nruns; i++) {
+			run = &runs[i];
+			nr = run->num_pages * PAGE_SIZE - offset;
+			if (nr > len - copied)
+				nr = len - copied;
+
+			NOVA_START_TIMING(memcpy_r_nvmm_t, memcpy_time);
+			if (run->nvmm) {
+				dax_mem = nova_get_block(sb,
+						run->nvmm << PAGE_SHIFT);
+				next = NULL;
+				if (stream && i + 1 < nruns && runs[i + 1].nvmm)
+					next = nova_get_block(sb,
+						runs[i + 1].nvmm << PAGE_SHIFT);
+				if (stream)
+					left = nr - nova_stream_copy(
+						dax_mem + offset, nr, next,
+						iter);
+				else
+					left = nr - copy_to_iter(
+						dax_mem + offset, nr, iter);
+			} else {
+				left = nr - iov_iter_zero(nr, iter);
+			}
+			NOVA_END_TIMING(memcpy_r_nvmm_t, memcpy_time);
+
+			copied += nr - left;
+			offset += nr - left;
+			index += offset >> PAGE_SHIFT;
+			offset &= ~PAGE_MASK;
+
+			if (left) {
+				nova_dbg("%s ERROR!: bytes %lu, left %lu\n",
+					__func__, nr, left);
+				error = -EFAULT;
+				break;
+			}
+		}
+		srcu_read_unlock(&sbi->dax_read_srcu, idx);
+	} while (!error && copied < len);
 
 out:
 	*ppos = pos + copied;
-	if (filp)
+	if (filp) {
+		filp->f_ra.prev_pos = *ppos;
 		file_accessed(filp);
+	}
 
 	NOVA_STATS_ADD(read_bytes, copied);
+	if (copied)
+		nova_update_hot_inode(sb, inode->i_ino, copied, 0);
 
 	nova_dbgv("%s returned %zu\n", __func__, copied);
 	return (copied ? copied : error);
@@ -147,17 +236,35 @@ out:
 ssize_t nova_dax_file_read(struct file *filp, char __user *buf,
 			    size_t len, loff_t *ppos)
 {
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct iov_iter iter;
 	ssize_t res;
 	timing_t dax_read_time;
 
+	if (!access_ok(VERIFY_WRITE, buf, len))
+		return -EFAULT;
+
+	iov_iter_init(&iter, READ, &iov, 1, len);
+
 	NOVA_START_TIMING(dax_read_t, dax_read_time);
 //	rcu_read_lock();
-	res = do_dax_mapping_read(filp, buf, len, ppos);
+	res = do_dax_mapping_read(filp, &iter, ppos);
 //	rcu_read_unlock();
 	NOVA_END_TIMING(dax_read_t, dax_read_time);
 	return res;
 }
 
+ssize_t nova_dax_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t res;
+	timing_t dax_read_time;
+
+	NOVA_START_TIMING(dax_read_t, dax_read_time);
+	res = do_dax_mapping_read(iocb->ki_filp, to, &iocb->ki_pos);
+	NOVA_END_TIMING(dax_read_t, dax_read_time);
+	return res;
+}
+
 static inline int nova_copy_partial_block(struct super_block *sb,
 	struct nova_inode_info_header *sih,
 	struct nova_file_write_entry *entry, unsigned long index,
@@ -170,10 +277,10 @@ static inline int nova_copy_partial_block(struct super_block *sb,
 	ptr = nova_get_block(sb, (nvmm << PAGE_SHIFT));
 	if (ptr != NULL) {
 		if (is_end_blk)
-			memcpy(kmem + offset, ptr + offset,
+			nova_memcpy_nt(kmem + offset, ptr + offset,
 				sb->s_blocksize - offset);
-		else 
-			memcpy(kmem, ptr, offset);
+		else
+			nova_memcpy_nt(kmem, ptr, offset);
 	}
 
 	return 0;
@@ -210,15 +317,15 @@ static void nova_handle_head_tail_blocks(struct super_block *sb,
 				offset, start_blk, kmem);
 	if (offset != 0) {
 		entry = nova_get_write_entry(sb, si, start_blk);
-		if (entry == NULL) {
+		if (entry == NULL || nova_entry_unwritten(entry)) {
 			/* Fill zero */
 		    	memset(kmem, 0, offset);
+			nova_flush_buffer(kmem, offset, 0);
 		} else {
-			/* Copy from original block */
+			/* Copy from original block, bypassing the cache */
 			nova_copy_partial_block(sb, sih, entry, start_blk,
 					offset, kmem, false);
 		}
-		nova_flush_buffer(kmem, offset, 0);
 	}
 
 	kmem = (void *)((char *)kmem +
@@ -228,17 +335,17 @@ static void nova_handle_head_tail_blocks(struct super_block *sb,
 				eblk_offset, end_blk, kmem);
 	if (eblk_offset != 0) {
 		entry = nova_get_write_entry(sb, si, end_blk);
-		if (entry == NULL) {
+		if (entry == NULL || nova_entry_unwritten(entry)) {
 			/* Fill zero */
 		    	memset(kmem + eblk_offset, 0,
 					sb->s_blocksize - eblk_offset);
+			nova_flush_buffer(kmem + eblk_offset,
+					sb->s_blocksize - eblk_offset, 0);
 		} else {
 			/* Copy from original block */
 			nova_copy_partial_block(sb, sih, entry, end_blk,
 					eblk_offset, kmem, true);
 		}
-		nova_flush_buffer(kmem + eblk_offset,
-					sb->s_blocksize - eblk_offset, 0);
 	}
 
 	NOVA_END_TIMING(partial_block_t, partial_time);
@@ -283,7 +390,7 @@ static int nova_cleanup_incomplete_write(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode_info_header *sih,
 	unsigned long blocknr, int allocated, u64 begin_tail, u64 end_tail)
 {
-	struct nova_file_write_entry *entry;
+	struct nova_file_write_entry *entry, *old;
 	u64 curr_p = begin_tail;
 	size_t entry_size = sizeof(struct nova_file_write_entry);
 
@@ -313,16 +420,336 @@ static int nova_cleanup_incomplete_write(struct super_block *sb,
 			continue;
 		}
 
+		/* Preallocated blocks still belong to their unwritten entry */
 		blocknr = entry->block >> PAGE_SHIFT;
-		nova_free_data_blocks(sb, pi, blocknr, entry->num_pages);
+		old = nova_find_extent(sih, entry->pgoff, NULL);
+		if (!old || get_nvmm(sb, sih, old, entry->pgoff) != blocknr)
+			nova_free_data_blocks(sb, pi, blocknr,
+						entry->num_pages);
 		curr_p += entry_size;
 	}
 
 	return 0;
 }
 
-ssize_t nova_cow_file_write(struct file *filp,
-	const char __user *buf,	size_t len, loff_t *ppos, bool need_mutex)
+static void nova_prefault_user_buf(const char __user *buf, size_t len)
+{
+	size_t bytes;
+
+	while (len) {
+		bytes = min_t(size_t, len, INT_MAX & PAGE_MASK);
+		if (fault_in_multipages_readable(buf, bytes))
+			return;
+		buf += bytes;
+		len -= bytes;
+	}
+}
+
+/*
+ * Allocate data blocks for file blocks [start_blk, start_blk + num_blocks).
+ * Under the huge policy, runs covering whole 2M-aligned file regions get
+ * 2M-aligned NVMM so that PMD faults can map them, and unaligned runs stop
+ * at the next 2M boundary so that the following run starts aligned.
+ * Partial overwrites of a huge extent still go through 4K COW, which is
+ * the only thing that splits it.
+ */
+static int nova_new_file_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned long *blocknr, unsigned long num_blocks,
+	unsigned long start_blk, int zero)
+{
+	unsigned long huge_blocks;
+	unsigned long boundary;
+	int allocated;
+
+	if (!nova_huge_alloc(sb, pi))
+		goto alloc_4k;
+
+	if (start_blk & (HUGE_PAGE_BLOCKS - 1)) {
+		boundary = ALIGN(start_blk, HUGE_PAGE_BLOCKS);
+		if (start_blk + num_blocks > boundary)
+			num_blocks = boundary - start_blk;
+		goto alloc_4k;
+	}
+
+	huge_blocks = num_blocks & ~(HUGE_PAGE_BLOCKS - 1);
+	if (huge_blocks == 0)
+		goto alloc_4k;
+
+	allocated = nova_new_huge_data_blocks(sb, pi, blocknr,
+						huge_blocks, start_blk, zero);
+	if (allocated <= 0 && huge_blocks > HUGE_PAGE_BLOCKS)
+		allocated = nova_new_huge_data_blocks(sb, pi, blocknr,
+					HUGE_PAGE_BLOCKS, start_blk, zero);
+	if (allocated > 0)
+		return allocated;
+
+alloc_4k:
+	return nova_new_data_blocks(sb, pi, blocknr, num_blocks,
+						start_blk, zero, 1);
+}
+
+/* Fault in every user segment of the iterator, see nova_cow_write_iter */
+static void nova_prefault_iter(struct iov_iter *from)
+{
+	const struct iovec *iov = from->iov;
+	size_t skip = from->iov_offset;
+	size_t left = iov_iter_count(from);
+	size_t bytes;
+	unsigned long seg;
+
+	if (!iter_is_iovec(from))
+		return;
+
+	for (seg = 0; seg < from->nr_segs && left; seg++, iov++) {
+		bytes = min_t(size_t, iov->iov_len - skip, left);
+		nova_prefault_user_buf(iov->iov_base + skip, bytes);
+		left -= bytes;
+		skip = 0;
+	}
+}
+
+/* ======================= Inline data ========================= */
+
+/*
+ * With inline_data, a regular file that never gets larger than
+ * NOVA_INLINE_MAX keeps its contents in a FILE_INLINE log entry: every
+ * write logs the whole new contents, so no data block is allocated and a
+ * read is a copy out of the log page. The first write, mmap fault or
+ * fallocate that needs blocks converts the file, after which it behaves
+ * like any other.
+ */
+static bool nova_inline_write_ok(struct super_block *sb, struct inode *inode,
+	struct nova_inode_info_header *sih, loff_t pos, size_t count)
+{
+	if (!test_opt(sb, INLINE_DATA))
+		return false;
+
+	if (pos + count > NOVA_INLINE_MAX || inode->i_size > NOVA_INLINE_MAX)
+		return false;
+
+	if (sih->inline_entry)
+		return true;
+
+	/* Faults would map blocks under a new inline entry */
+	return inode->i_size == 0 && sih->num_extents == 0 &&
+		!mapping_mapped(inode->i_mapping);
+}
+
+/* Fill [start, end) of a new inline entry from the old one, or zeros */
+static void nova_inline_fill(char *data, struct nova_inline_data_entry *old,
+	size_t old_len, size_t start, size_t end)
+{
+	size_t mid = clamp(old_len, start, end);
+
+	if (mid > start)
+		memcpy_to_pmem_nocache(data + start, old->data + start,
+					mid - start);
+	if (end > mid) {
+		memset(data + mid, 0, end - mid);
+		nova_flush_buffer(data + mid, end - mid, 0);
+	}
+}
+
+/*
+ * Log the contents of the file with the iterator written at @pos as a new
+ * inline entry. Returns bytes written or a negative errno. Caller holds
+ * i_mutex and has checked nova_inline_write_ok().
+ */
+static ssize_t nova_inline_write(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode, struct iov_iter *from,
+	loff_t pos, u32 time)
+{
+	struct nova_inode_info_header *sih = &NOVA_I(inode)->header;
+	struct nova_inline_data_entry *old = NULL, *entry;
+	size_t count = iov_iter_count(from);
+	size_t old_len = 0, size, copied;
+	u64 curr_p;
+
+	if (sih->inline_entry) {
+		old = nova_get_block(sb, sih->inline_entry);
+		old_len = min_t(size_t, sih->inline_len,
+				le16_to_cpu(old->data_len));
+	}
+
+	size = max_t(size_t, pos + count, inode->i_size);
+	curr_p = nova_get_append_head(sb, pi, sih, 0,
+				NOVA_INLINE_ENTRY_LEN(size), NULL);
+	if (curr_p == 0)
+		return -ENOSPC;
+
+	entry = nova_get_block(sb, curr_p);
+	nova_inline_fill(entry->data, old, old_len, 0, pos);
+	pagefault_disable();
+	copied = copy_from_iter_nocache(entry->data + pos, count, from);
+	pagefault_enable();
+	if (copied == 0)
+		return -EFAULT;
+
+	/* A short copy only logs what made it */
+	size = max_t(size_t, pos + copied, inode->i_size);
+	nova_inline_fill(entry->data, old, old_len, pos + copied, size);
+
+	entry->entry_type = FILE_INLINE;
+	entry->padding = 0;
+	entry->data_len = cpu_to_le16(size);
+	entry->mtime = cpu_to_le32(time);
+	entry->size = cpu_to_le64(size);
+	nova_flush_buffer(entry, sizeof(*entry), 0);
+
+	nova_memunlock_window(sb);
+	nova_update_tail(pi, curr_p + NOVA_INLINE_ENTRY_LEN(size));
+	nova_memlock_window(sb);
+
+	/* Lockless readers must see the entry before the pointer */
+	smp_wmb();
+	WRITE_ONCE(sih->inline_len, size);
+	WRITE_ONCE(sih->inline_entry, curr_p);
+
+	NOVA_STATS_ADD(inline_writes, 1);
+	return copied;
+}
+
+/*
+ * Move the contents of an inline file into a data block mapped by a
+ * regular write entry. Caller holds i_mutex.
+ */
+int nova_convert_inline_data(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode)
+{
+	struct nova_inode_info_header *sih = &NOVA_I(inode)->header;
+	struct nova_inline_data_entry *old;
+	struct nova_file_write_entry entry_data;
+	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
+	unsigned long blocknr = 0;
+	size_t len;
+	u64 curr_entry;
+	void *kmem;
+	int allocated;
+	int ret;
+
+	if (!sih->inline_entry)
+		return 0;
+
+	old = nova_get_block(sb, sih->inline_entry);
+	len = min_t(size_t, sih->inline_len, le16_to_cpu(old->data_len));
+	len = min_t(size_t, len, inode->i_size);
+	if (len == 0)
+		goto done;
+
+	allocated = nova_new_data_blocks(sb, pi, &blocknr, 1, 0, 1, 0);
+	if (allocated <= 0)
+		return allocated ? allocated : -ENOSPC;
+
+	kmem = nova_get_block(sb, nova_get_block_off(sb, blocknr,
+							pi->i_blk_type));
+	memcpy_to_pmem_nocache(kmem, old->data, len);
+
+	entry_data.pgoff = 0;
+	entry_data.num_pages = cpu_to_le32(1);
+	entry_data.invalid_pages = 0;
+	entry_data.block = cpu_to_le64(nova_get_block_off(sb, blocknr,
+							pi->i_blk_type));
+	entry_data.mtime = cpu_to_le32(inode->i_mtime.tv_sec);
+	entry_data.padding = 0;
+	entry_data.size = cpu_to_le64(inode->i_size);
+	nova_set_entry_type((void *)&entry_data, FILE_WRITE);
+
+	curr_entry = nova_append_file_write_entry(sb, pi, inode,
+							&entry_data, 0);
+	if (curr_entry == 0) {
+		nova_free_data_blocks(sb, pi, blocknr, 1);
+		return -ENOSPC;
+	}
+
+	nova_memunlock_window(sb);
+	le64_add_cpu(&pi->i_blocks, 1 << (data_bits - sb->s_blocksize_bits));
+	nova_update_tail(pi, curr_entry + sizeof(entry_data));
+	nova_memlock_window(sb);
+
+	ret = nova_reassign_file_tree(sb, pi, sih, curr_entry);
+	if (ret)
+		return ret;
+	inode->i_blocks = le64_to_cpu(pi->i_blocks);
+
+done:
+	/* Readers that still see the inline entry copy the same bytes */
+	smp_wmb();
+	WRITE_ONCE(sih->inline_entry, 0);
+	sih->inline_len = 0;
+	NOVA_STATS_ADD(inline_conversions, 1);
+	return 0;
+}
+
+/*
+ * Append that stays inside the current tail block, written in place.
+ * The new bytes land past EOF, where no reader looks, and only then is
+ * the size of the write entry mapping the block bumped in place. This is
+ * only done when that entry is the last one in the log, so consecutive
+ * appends keep extending one entry instead of logging a COW block each.
+ * Unless the write is synchronous the size update is left unfenced: the
+ * next write or fsync orders it. Returns bytes written, 0 to fall back
+ * to COW. Caller holds i_mutex.
+ */
+static size_t nova_inplace_append(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode, struct iov_iter *from,
+	loff_t pos, u32 time, bool sync)
+{
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	struct nova_file_write_entry *entry;
+	size_t count = iov_iter_count(from);
+	size_t offset = pos & (sb->s_blocksize - 1);
+	unsigned long blk = pos >> sb->s_blocksize_bits;
+	unsigned long nvmm;
+	size_t copied;
+	void *kmem;
+
+	if (offset == 0 || offset + count > sb->s_blocksize)
+		return 0;
+
+	/* The block may be shared with a clone */
+	entry = nova_get_write_entry(sb, si, blk);
+	if (!entry || nova_get_entry_type(entry) != FILE_WRITE ||
+			nova_entry_unwritten(entry) || nova_entry_shared(entry))
+		return 0;
+
+	/* The size must be updated by a single 8-byte store */
+	if (nova_get_addr_off(NOVA_SB(sb), entry) + sizeof(*entry) !=
+			pi->log_tail || ((unsigned long)&entry->size & 7))
+		return 0;
+
+	nvmm = get_nvmm(sb, sih, entry, blk);
+	kmem = nova_get_block(sb, nvmm << PAGE_SHIFT);
+
+	pagefault_disable();
+	copied = copy_from_iter_nocache(kmem + offset, count, from);
+	pagefault_enable();
+	if (copied == 0)
+		return 0;
+
+	nova_flush_buffer(kmem + offset, copied, 1);
+
+	entry->mtime = cpu_to_le32(time);
+	entry->size = cpu_to_le64(pos + copied);
+	nova_flush_buffer(&entry->mtime, sizeof(entry->mtime) +
+		sizeof(entry->padding) + sizeof(entry->size), sync);
+
+	/* COW would have written a whole block plus a new entry */
+	NOVA_STATS_ADD(inplace_appends, 1);
+	NOVA_STATS_ADD(inplace_saved_bytes, sb->s_blocksize - copied +
+				sizeof(struct nova_file_write_entry));
+	if (!sync)
+		NOVA_STATS_ADD(inplace_saved_fences, 1);
+	return copied;
+}
+
+/*
+ * COW write of the whole iterator. Blocks are allocated for the full
+ * range up front, so a vectored write that gets a contiguous allocation
+ * is logged as one write entry, and the log tail is committed once.
+ */
+static ssize_t __nova_cow_write_iter(struct file *filp, struct iov_iter *from,
+	loff_t *ppos, bool append, bool need_mutex)
 {
 	struct address_space *mapping = filp->f_mapping;
 	struct inode    *inode = mapping->host;
@@ -331,14 +758,17 @@ ssize_t nova_cow_file_write(struct file *filp,
 	struct super_block *sb = inode->i_sb;
 	struct nova_inode *pi;
 	struct nova_file_write_entry entry_data;
+	struct nova_file_write_entry *prealloc;
 	ssize_t     written = 0;
-	loff_t pos;
+	loff_t pos, start_pos;
 	size_t count, offset, copied, ret;
 	unsigned long start_blk, num_blocks;
 	unsigned long total_blocks;
+	unsigned long prealloc_pages, reused = 0;
 	unsigned long blocknr = 0;
 	unsigned int data_bits;
 	int allocated = 0;
+	int new_blocks = 0;
 	void* kmem;
 	u64 curr_entry;
 	size_t bytes;
@@ -346,34 +776,30 @@ ssize_t nova_cow_file_write(struct file *filp,
 	timing_t cow_write_time, memcpy_time;
 	unsigned long step = 0;
 	u64 temp_tail = 0, begin_tail = 0;
+	ssize_t inline_ret;
 	u32 time;
 
-	if (len == 0)
+	count = iov_iter_count(from);
+	if (count == 0)
 		return 0;
 
-	/*
-	 * We disallow writing to a mmaped file,
-	 * since write is copy-on-write while mmap is DAX (in-place).
-	 */
-	if (mapping_mapped(mapping))
-		return -EACCES;
-
 	NOVA_START_TIMING(cow_write_t, cow_write_time);
 
 	sb_start_write(inode->i_sb);
+	/*
+	 * The source may be a DAX mapping of this very file, and faults on
+	 * it take i_mutex. Fault it in now and copy with faults disabled.
+	 */
+	nova_prefault_iter(from);
 	if (need_mutex)
 		mutex_lock(&inode->i_mutex);
 
-	if (!access_ok(VERIFY_READ, buf, len)) {
-		ret = -EFAULT;
-		goto out;
-	}
 	pos = *ppos;
 
-	if (filp->f_flags & O_APPEND)
+	if (append)
 		pos = i_size_read(inode);
 
-	count = len;
+	start_pos = pos;
 
 	pi = nova_get_inode(sb, inode);
 
@@ -392,14 +818,53 @@ ssize_t nova_cow_file_write(struct file *filp,
 	nova_dbgv("%s: inode %lu, offset %lld, count %lu\n",
 			__func__, inode->i_ino,	pos, count);
 
+	if (nova_inline_write_ok(sb, inode, sih, pos, count)) {
+		inline_ret = nova_inline_write(sb, pi, inode, from, pos, time);
+		if (inline_ret < 0) {
+			ret = inline_ret;
+			goto out;
+		}
+		written = inline_ret;
+		pos += written;
+		goto update_size;
+	}
+
+	inline_ret = nova_convert_inline_data(sb, pi, inode);
+	if (inline_ret < 0) {
+		ret = inline_ret;
+		goto out;
+	}
+
+	if (test_opt(sb, APPEND_INPLACE) && pos == inode->i_size) {
+		written = nova_inplace_append(sb, pi, inode, from, pos, time,
+				IS_SYNC(inode) || (filp->f_flags & O_DSYNC));
+		if (written) {
+			pos += written;
+			goto update_size;
+		}
+	}
+
 	temp_tail = pi->log_tail;
 	while (num_blocks > 0) {
 		offset = pos & (nova_inode_blk_size(pi) - 1);
 		start_blk = pos >> sb->s_blocksize_bits;
 
-		/* don't zero-out the allocated blocks */
-		allocated = nova_new_data_blocks(sb, pi, &blocknr, num_blocks,
-						start_blk, 0, 1);
+		/*
+		 * Preallocated blocks are written in place: they read as
+		 * zeros until the new entry replaces the unwritten one.
+		 */
+		prealloc = nova_find_extent(sih, start_blk, &prealloc_pages);
+		if (prealloc && nova_entry_unwritten(prealloc)) {
+			blocknr = get_nvmm(sb, sih, prealloc, start_blk);
+			allocated = min(prealloc_pages, num_blocks);
+			reused += allocated;
+			new_blocks = 0;
+		} else {
+			/* don't zero-out the allocated blocks */
+			allocated = nova_new_file_blocks(sb, pi, &blocknr,
+						num_blocks, start_blk, 0);
+			new_blocks = allocated;
+		}
 		nova_dbg_verbose("%s: alloc %d blocks @ %lu\n", __func__,
 						allocated, blocknr);
 
@@ -425,8 +890,9 @@ ssize_t nova_cow_file_write(struct file *filp,
 		/* Now copy from user buf */
 //		nova_dbg("Write: %p\n", kmem);
 		NOVA_START_TIMING(memcpy_w_nvmm_t, memcpy_time);
-		copied = bytes - memcpy_to_pmem_nocache(kmem + offset,
-						buf, bytes);
+		pagefault_disable();
+		copied = copy_from_iter_nocache(kmem + offset, bytes, from);
+		pagefault_enable();
 		NOVA_END_TIMING(memcpy_w_nvmm_t, memcpy_time);
 
 		entry_data.pgoff = cpu_to_le64(start_blk);
@@ -456,7 +922,6 @@ ssize_t nova_cow_file_write(struct file *filp,
 			status = copied;
 			written += copied;
 			pos += copied;
-			buf += copied;
 			count -= copied;
 			num_blocks -= allocated;
 		}
@@ -474,13 +939,22 @@ ssize_t nova_cow_file_write(struct file *filp,
 		temp_tail = curr_entry + sizeof(struct nova_file_write_entry);
 	}
 
-	nova_memunlock_inode(sb, pi);
+	/* One protection window for the whole commit */
+	nova_memunlock_window(sb);
 	data_bits = blk_type_to_shift[pi->i_blk_type];
-	le64_add_cpu(&pi->i_blocks,
-			(total_blocks << (data_bits - sb->s_blocksize_bits)));
-	nova_memlock_inode(sb, pi);
-
+	le64_add_cpu(&pi->i_blocks, ((total_blocks - reused) <<
+				(data_bits - sb->s_blocksize_bits)));
 	nova_update_tail(pi, temp_tail);
+	nova_memlock_window(sb);
+
+	/*
+	 * Mappings of the overwritten range still point at the old blocks.
+	 * Zap them before the blocks are freed; faults wait on i_mutex and
+	 * then map the new blocks.
+	 */
+	if (written && mapping_mapped(mapping))
+		unmap_mapping_range(mapping, start_pos & PAGE_MASK,
+				PAGE_ALIGN(pos) - (start_pos & PAGE_MASK), 0);
 
 	/* Free the overlap blocks after the write is committed */
 	ret = nova_reassign_file_tree(sb, pi, sih, begin_tail);
@@ -489,10 +963,11 @@ ssize_t nova_cow_file_write(struct file *filp,
 
 	inode->i_blocks = le64_to_cpu(pi->i_blocks);
 
-	ret = written;
 	NOVA_STATS_ADD(write_breaks, step);
 	nova_dbgv("blocks: %lu, %llu\n", inode->i_blocks, pi->i_blocks);
 
+update_size:
+	ret = written;
 	*ppos = pos;
 	if (pos > inode->i_size) {
 		i_size_write(inode, pos);
@@ -501,7 +976,7 @@ ssize_t nova_cow_file_write(struct file *filp,
 
 out:
 	if (ret < 0)
-		nova_cleanup_incomplete_write(sb, pi, sih, blocknr, allocated,
+		nova_cleanup_incomplete_write(sb, pi, sih, blocknr, new_blocks,
 						begin_tail, temp_tail);
 
 	if (need_mutex)
@@ -512,519 +987,793 @@ out:
 	return ret;
 }
 
-ssize_t nova_dax_file_write(struct file *filp, const char __user *buf,
-	size_t len, loff_t *ppos)
-{
-	return nova_cow_file_write(filp, buf, len, ppos, true);
-}
+/* ======================= Concurrent writes ========================= */
 
 /*
- * return > 0, # of blocks mapped or allocated.
- * return = 0, if plain lookup failed.
- * return < 0, error case.
+ * With concurrent_write, positional writes copy their data without
+ * i_mutex. A write first locks its block range, so writes to overlapping
+ * blocks still run one at a time, then allocates fresh blocks and copies
+ * into them. Only the commit takes i_mutex: the partial head and tail
+ * blocks are filled from the current tree, the entries are appended and
+ * the tail is committed. Until then the new blocks are private to the
+ * write, so truncate, fallocate and serialized writers never wait for a
+ * copy in progress; whichever commits last wins, as under i_mutex.
  */
-static int nova_dax_get_blocks(struct inode *inode, sector_t iblock,
-	unsigned long max_blocks, struct buffer_head *bh, int create)
+#define	RANGE_WRITE_CHUNKS	16
+
+struct nova_write_chunk {
+	loff_t		pos;
+	size_t		copied;
+	unsigned long	start_blk;
+	unsigned long	blocknr;
+	unsigned long	allocated;
+};
+
+static bool nova_try_lock_write_range(struct nova_inode_info_header *sih,
+	struct nova_write_range *range)
 {
-	struct super_block *sb = inode->i_sb;
-	struct nova_inode *pi;
+	struct nova_write_range *curr;
+	bool locked = false;
+
+	spin_lock(&sih->range_lock);
+	list_for_each_entry(curr, &sih->write_ranges, list) {
+		if (curr->first <= range->last && range->first <= curr->last)
+			goto out;
+	}
+	list_add(&range->list, &sih->write_ranges);
+	locked = true;
+out:
+	spin_unlock(&sih->range_lock);
+	return locked;
+}
+
+static void nova_lock_write_range(struct nova_inode_info_header *sih,
+	struct nova_write_range *range)
+{
+	wait_event(sih->range_wait, nova_try_lock_write_range(sih, range));
+}
+
+static void nova_unlock_write_range(struct nova_inode_info_header *sih,
+	struct nova_write_range *range)
+{
+	spin_lock(&sih->range_lock);
+	list_del(&range->list);
+	spin_unlock(&sih->range_lock);
+	wake_up_all(&sih->range_wait);
+}
+
+/* Commit copied chunks under i_mutex; returns bytes committed */
+static ssize_t nova_commit_write_chunks(struct file *filp,
+	struct nova_write_chunk *chunks, int num)
+{
+	struct address_space *mapping = filp->f_mapping;
+	struct inode *inode = mapping->host;
 	struct nova_inode_info *si = NOVA_I(inode);
 	struct nova_inode_info_header *sih = &si->header;
-	struct nova_file_write_entry *entry = NULL;
+	struct super_block *sb = inode->i_sb;
+	struct nova_inode *pi = nova_get_inode(sb, inode);
 	struct nova_file_write_entry entry_data;
-	u64 temp_tail = 0;
-	u64 curr_entry;
-	u32 time;
+	struct nova_write_chunk *chunk;
+	unsigned long blocks = 0;
 	unsigned int data_bits;
-	unsigned long nvmm = 0;
-	unsigned long next_pgoff;
-	unsigned long blocknr = 0;
-	int num_blocks = 0;
-	int allocated = 0;
-	int ret = 0;
+	u64 curr_entry, begin_tail = 0, temp_tail;
+	loff_t end = 0;
+	ssize_t written = 0;
+	ssize_t ret;
+	void *kmem;
+	u32 time;
+	int i = 0;
 
-	if (max_blocks == 0)
-		return 0;
+	mutex_lock(&inode->i_mutex);
 
-	nova_dbgv("%s: pgoff %lu, num %lu, create %d\n",
-				__func__, iblock, max_blocks, create);
+	ret = file_remove_privs(filp);
+	if (ret)
+		goto out;
+	inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
+	time = CURRENT_TIME_SEC.tv_sec;
 
-	entry = nova_get_write_entry(sb, si, iblock);
-	if (entry) {
-		/* Find contiguous blocks */
-		if (entry->invalid_pages == 0)
-			num_blocks = entry->num_pages - (iblock - entry->pgoff);
-		else
-			num_blocks = 1;
-
-		if (num_blocks > max_blocks)
-			num_blocks = max_blocks;
-
-		nvmm = get_nvmm(sb, sih, entry, iblock);
-		clear_buffer_new(bh);
-		nova_dbgv("%s: pgoff %lu, block %lu\n", __func__, iblock, nvmm);
+	/* The file went inline after the chunks were checked */
+	ret = nova_convert_inline_data(sb, pi, inode);
+	if (ret)
 		goto out;
-	}
 
-	if (create == 0)
-		return 0;
+	temp_tail = pi->log_tail;
+	for (i = 0; i < num; i++) {
+		chunk = &chunks[i];
+		kmem = nova_get_block(sb, nova_get_block_off(sb,
+					chunk->blocknr, pi->i_blk_type));
+		if ((chunk->pos & (sb->s_blocksize - 1)) ||
+				((chunk->pos + chunk->copied) &
+				 (PAGE_SIZE - 1)) != 0)
+			nova_handle_head_tail_blocks(sb, pi, inode,
+					chunk->pos, chunk->copied, kmem);
+
+		entry_data.pgoff = cpu_to_le64(chunk->start_blk);
+		entry_data.num_pages = cpu_to_le32(chunk->allocated);
+		entry_data.invalid_pages = 0;
+		entry_data.block = cpu_to_le64(nova_get_block_off(sb,
+					chunk->blocknr, pi->i_blk_type));
+		entry_data.mtime = cpu_to_le32(time);
+		/* Set entry type after set block */
+		nova_set_entry_type((void *)&entry_data, FILE_WRITE);
 
-	pi = nova_get_inode(sb, inode);
-	num_blocks = max_blocks;
-	inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
-	time = CURRENT_TIME_SEC.tv_sec;
+		end = chunk->pos + chunk->copied;
+		if (end > inode->i_size)
+			entry_data.size = cpu_to_le64(end);
+		else
+			entry_data.size = cpu_to_le64(inode->i_size);
 
-	/* Fill the hole */
-	entry = nova_find_next_entry(sb, sih, iblock);
-	if (entry) {
-		next_pgoff = entry->pgoff;
-		if (next_pgoff <= iblock) {
-			BUG();
-			ret = -EINVAL;
+		curr_entry = nova_append_file_write_entry(sb, pi, inode,
+						&entry_data, temp_tail);
+		if (curr_entry == 0) {
+			nova_dbg("%s: append inode entry failed\n", __func__);
+			ret = -ENOSPC;
 			goto out;
 		}
 
-		num_blocks = next_pgoff - iblock;
-		if (num_blocks > max_blocks)
-			num_blocks = max_blocks;
-	}
-
-	/* Return initialized blocks to the user */
-	allocated = nova_new_data_blocks(sb, pi, &blocknr, num_blocks,
-						iblock, 1, 1);
-	if (allocated <= 0) {
-		nova_dbg("%s alloc blocks failed %d\n", __func__,
-							allocated);
-		ret = allocated;
-		goto out;
-	}
-
-	num_blocks = allocated;
-	entry_data.pgoff = cpu_to_le64(iblock);
-	entry_data.num_pages = cpu_to_le32(num_blocks);
-	entry_data.invalid_pages = 0;
-	entry_data.block = cpu_to_le64(nova_get_block_off(sb, blocknr,
-							pi->i_blk_type));
-	/* Set entry type after set block */
-	nova_set_entry_type((void *)&entry_data, FILE_WRITE);
-	entry_data.mtime = cpu_to_le32(time);
-
-	/* Do not extend file size */
-	entry_data.size = cpu_to_le64(inode->i_size);
-
-	curr_entry = nova_append_file_write_entry(sb, pi, inode,
-						&entry_data, pi->log_tail);
-	if (curr_entry == 0) {
-		nova_dbg("%s: append inode entry failed\n", __func__);
-		ret = -ENOSPC;
-		goto out;
+		if (begin_tail == 0)
+			begin_tail = curr_entry;
+		temp_tail = curr_entry + sizeof(struct nova_file_write_entry);
+		blocks += chunk->allocated;
+		written += chunk->copied;
 	}
 
-	nvmm = blocknr;
+	nova_memunlock_window(sb);
 	data_bits = blk_type_to_shift[pi->i_blk_type];
 	le64_add_cpu(&pi->i_blocks,
-			(num_blocks << (data_bits - sb->s_blocksize_bits)));
-
-	temp_tail = curr_entry + sizeof(struct nova_file_write_entry);
+			blocks << (data_bits - sb->s_blocksize_bits));
 	nova_update_tail(pi, temp_tail);
+	nova_memlock_window(sb);
 
-	ret = nova_reassign_file_tree(sb, pi, sih, curr_entry);
+	if (mapping_mapped(mapping))
+		unmap_mapping_range(mapping, chunks[0].pos & PAGE_MASK,
+			PAGE_ALIGN(end) - (chunks[0].pos & PAGE_MASK), 0);
+
+	ret = nova_reassign_file_tree(sb, pi, sih, begin_tail);
 	if (ret)
-		goto out;
+		goto unlock;
 
 	inode->i_blocks = le64_to_cpu(pi->i_blocks);
-
-//	set_buffer_new(bh);
-
-out:
-	if (ret < 0) {
-		nova_cleanup_incomplete_write(sb, pi, sih, blocknr, allocated,
-						0, temp_tail);
-		return ret;
+	if (end > inode->i_size) {
+		i_size_write(inode, end);
+		sih->i_size = end;
 	}
+	ret = written;
+	goto unlock;
 
-	map_bh(bh, inode->i_sb, nvmm);
-	if (num_blocks > 1)
-		bh->b_size = sb->s_blocksize * num_blocks;
-
-	return num_blocks;
-}
-
-int nova_dax_get_block(struct inode *inode, sector_t iblock,
-	struct buffer_head *bh, int create)
-{
-	unsigned long max_blocks = bh->b_size >> inode->i_blkbits;
-	int ret;
-	timing_t gb_time;
-
-	NOVA_START_TIMING(dax_get_block_t, gb_time);
-
-	ret = nova_dax_get_blocks(inode, iblock, max_blocks, bh, create);
-	if (ret > 0) {
-		bh->b_size = ret << inode->i_blkbits;
-		ret = 0;
-	}
-	NOVA_END_TIMING(dax_get_block_t, gb_time);
+out:
+	/* Entries appended so far are not committed */
+	nova_cleanup_incomplete_write(sb, pi, sih, 0, 0,
+					begin_tail, temp_tail);
+	for (; i < num; i++)
+		nova_free_data_blocks(sb, pi, chunks[i].blocknr,
+					chunks[i].allocated);
+unlock:
+	mutex_unlock(&inode->i_mutex);
 	return ret;
 }
 
-#if 0
-static ssize_t nova_flush_mmap_to_nvmm(struct super_block *sb,
-	struct inode *inode, struct nova_inode *pi, loff_t pos,
-	size_t count, void *kmem)
+/*
+ * Write as much of the iterator as possible concurrently. Stops early at
+ * a preallocated extent, which is written in place by the serialized
+ * path. Returns the bytes written or an error if nothing was written.
+ */
+static ssize_t nova_range_write_iter(struct file *filp, struct iov_iter *from,
+	loff_t *ppos)
 {
+	struct inode *inode = filp->f_mapping->host;
 	struct nova_inode_info *si = NOVA_I(inode);
 	struct nova_inode_info_header *sih = &si->header;
-	unsigned long start_blk;
-	unsigned long cache_addr;
-	u64 nvmm_block;
-	void *nvmm_addr;
-	loff_t offset;
-	size_t bytes, copied;
-	ssize_t written = 0;
-	int status = 0;
-	ssize_t ret;
+	struct super_block *sb = inode->i_sb;
+	struct nova_inode *pi = nova_get_inode(sb, inode);
+	struct nova_write_chunk chunks[RANGE_WRITE_CHUNKS];
+	struct nova_file_write_entry *prealloc;
+	struct nova_write_range range;
+	unsigned long start_blk, num_blocks, blocknr;
+	size_t count = iov_iter_count(from);
+	size_t offset, bytes, copied;
+	loff_t pos = *ppos;
+	ssize_t written = 0, committed;
+	ssize_t ret = 0;
+	timing_t memcpy_time;
+	bool stop = false;
+	int allocated;
+	int num;
+
+	range.first = pos >> sb->s_blocksize_bits;
+	range.last = (pos + count - 1) >> sb->s_blocksize_bits;
+	nova_lock_write_range(sih, &range);
+
+	while (count && !stop) {
+		for (num = 0; num < RANGE_WRITE_CHUNKS && count; num++) {
+			offset = pos & (sb->s_blocksize - 1);
+			start_blk = pos >> sb->s_blocksize_bits;
+			num_blocks = ((count + offset - 1) >>
+					sb->s_blocksize_bits) + 1;
+
+			prealloc = nova_find_extent(sih, start_blk, NULL);
+			if (prealloc && nova_entry_unwritten(prealloc)) {
+				stop = true;
+				break;
+			}
 
-	while (count) {
-		start_blk = pos >> sb->s_blocksize_bits;
-		offset = pos & (sb->s_blocksize - 1);
-		bytes = sb->s_blocksize - offset;
-		if (bytes > count)
-			bytes = count;
+			/* don't zero-out the allocated blocks */
+			allocated = nova_new_file_blocks(sb, pi, &blocknr,
+						num_blocks, start_blk, 0);
+			if (allocated <= 0) {
+				ret = allocated;
+				stop = true;
+				break;
+			}
 
-		cache_addr = nova_get_cache_addr(sb, si, start_blk);
-		if (cache_addr == 0) {
-			nova_dbg("%s: ino %lu %lu mmap page %lu not found!\n",
-					__func__, inode->i_ino, sih->ino, start_blk);
-			nova_dbg("mmap pages %lu\n", sih->mmap_pages);
-			ret = -EINVAL;
-			goto out;
-		}
+			bytes = sb->s_blocksize * allocated - offset;
+			if (bytes > count)
+				bytes = count;
 
-		nvmm_block = MMAP_ADDR(cache_addr);
-		nvmm_addr = nova_get_block(sb, nvmm_block);
-		copied = bytes - memcpy_to_pmem_nocache(kmem + offset,
-				nvmm_addr + offset, bytes);
+			NOVA_START_TIMING(memcpy_w_nvmm_t, memcpy_time);
+			copied = copy_from_iter_nocache(nova_get_block(sb,
+				nova_get_block_off(sb, blocknr,
+					pi->i_blk_type)) + offset, bytes, from);
+			NOVA_END_TIMING(memcpy_w_nvmm_t, memcpy_time);
 
-		if (copied > 0) {
-			status = copied;
-			written += copied;
+			if (copied == 0) {
+				nova_free_data_blocks(sb, pi, blocknr,
+							allocated);
+				ret = -EFAULT;
+				stop = true;
+				break;
+			}
+
+			chunks[num].pos = pos;
+			chunks[num].copied = copied;
+			chunks[num].start_blk = start_blk;
+			chunks[num].blocknr = blocknr;
+			chunks[num].allocated = allocated;
 			pos += copied;
 			count -= copied;
-			kmem += offset + copied;
-		}
-		if (unlikely(copied != bytes)) {
-			nova_dbg("%s ERROR!: %p, bytes %lu, copied %lu\n",
-				__func__, kmem, bytes, copied);
-			if (status >= 0)
-				status = -EFAULT;
+			if (copied != bytes) {
+				ret = -EFAULT;
+				stop = true;
+				num++;
+				break;
+			}
 		}
-		if (status < 0) {
-			ret = status;
-			goto out;
+
+		if (num == 0)
+			break;
+
+		committed = nova_commit_write_chunks(filp, chunks, num);
+		if (committed < 0) {
+			ret = committed;
+			break;
 		}
+		written += committed;
+		*ppos = chunks[num - 1].pos + chunks[num - 1].copied;
+		NOVA_STATS_ADD(range_write_commits, 1);
 	}
-	ret = written;
-out:
-	return ret;
+
+	nova_unlock_write_range(sih, &range);
+	return written ? written : ret;
 }
 
-ssize_t nova_copy_to_nvmm(struct super_block *sb, struct inode *inode,
-	struct nova_inode *pi, loff_t pos, size_t count, u64 *begin,
-	u64 *end)
+static ssize_t nova_cow_write_iter(struct file *filp, struct iov_iter *from,
+	loff_t *ppos, bool append, bool need_mutex)
 {
-	struct nova_file_write_entry entry_data;
-	unsigned long start_blk, num_blocks;
-	unsigned long blocknr = 0;
-	unsigned long total_blocks;
-	unsigned int data_bits;
-	int allocated = 0;
-	u64 curr_entry;
+	struct inode *inode = filp->f_mapping->host;
+	struct super_block *sb = inode->i_sb;
 	ssize_t written = 0;
-	int ret;
-	void *kmem;
-	size_t bytes, copied;
-	loff_t offset;
-	int status = 0;
-	u64 temp_tail = 0, begin_tail = 0;
-	u32 time;
-	timing_t memcpy_time, copy_to_nvmm_time;
+	ssize_t ret;
 
-	NOVA_START_TIMING(copy_to_nvmm_t, copy_to_nvmm_time);
-	sb_start_write(inode->i_sb);
+	nova_qos_throttle_write(sb, inode, iov_iter_count(from));
+
+	if (need_mutex && !append && test_opt(sb, CONCURRENT_WRITE) &&
+			iov_iter_count(from) && !(test_opt(sb, APPEND_INPLACE)
+				&& *ppos == i_size_read(inode)) &&
+			!READ_ONCE(NOVA_I(inode)->header.inline_entry) &&
+			!(test_opt(sb, INLINE_DATA) && *ppos +
+				iov_iter_count(from) <= NOVA_INLINE_MAX)) {
+		timing_t cow_write_time;
+
+		NOVA_START_TIMING(cow_write_t, cow_write_time);
+		sb_start_write(sb);
+		written = nova_range_write_iter(filp, from, ppos);
+		sb_end_write(sb);
+		NOVA_END_TIMING(cow_write_t, cow_write_time);
+		if (written < 0)
+			return written;
+		NOVA_STATS_ADD(cow_write_bytes, written);
+		if (iov_iter_count(from) == 0)
+			goto out;
+	}
 
-	offset = pos & (sb->s_blocksize - 1);
-	num_blocks = ((count + offset - 1) >> sb->s_blocksize_bits) + 1;
-	total_blocks = num_blocks;
-	inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
-	time = CURRENT_TIME_SEC.tv_sec;
+	ret = __nova_cow_write_iter(filp, from, ppos, append, need_mutex);
+	if (ret < 0 && written == 0)
+		return ret;
+	if (ret > 0)
+		written += ret;
+out:
+	nova_update_hot_inode(sb, inode->i_ino, written, 1);
+	return written;
+}
 
-	nova_dbgv("%s: ino %lu, block %llu, offset %lu, count %lu\n",
-		__func__, inode->i_ino, pos >> sb->s_blocksize_bits,
-		(unsigned long)offset, count);
+ssize_t nova_cow_file_write(struct file *filp,
+	const char __user *buf,	size_t len, loff_t *ppos, bool need_mutex)
+{
+	struct iovec iov = { .iov_base = (void __user *)buf, .iov_len = len };
+	struct iov_iter from;
 
-	temp_tail = *end;
-	while (num_blocks > 0) {
-		offset = pos & (nova_inode_blk_size(pi) - 1);
-		start_blk = pos >> sb->s_blocksize_bits;
-		allocated = nova_new_data_blocks(sb, pi, &blocknr, num_blocks,
-						start_blk, 0, 0);
-		if (allocated <= 0) {
-			nova_dbg("%s alloc blocks failed %d\n", __func__,
-								allocated);
-			ret = allocated;
-			goto out;
-		}
+	if (!access_ok(VERIFY_READ, buf, len))
+		return -EFAULT;
 
-		bytes = sb->s_blocksize * allocated - offset;
-		if (bytes > count)
-			bytes = count;
+	iov_iter_init(&from, WRITE, &iov, 1, len);
+	return nova_cow_write_iter(filp, &from, ppos,
+				filp->f_flags & O_APPEND, need_mutex);
+}
 
-		kmem = nova_get_block(inode->i_sb,
-			nova_get_block_off(sb, blocknr,	pi->i_blk_type));
+ssize_t nova_dax_file_write(struct file *filp, const char __user *buf,
+	size_t len, loff_t *ppos)
+{
+	return nova_cow_file_write(filp, buf, len, ppos, true);
+}
 
-		if (offset || ((offset + bytes) & (PAGE_SIZE - 1)))
-			nova_handle_head_tail_blocks(sb, pi, inode, pos,
-							bytes, kmem);
+ssize_t nova_dax_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	return nova_cow_write_iter(iocb->ki_filp, from, &iocb->ki_pos,
+				iocb->ki_flags & IOCB_APPEND, true);
+}
 
-		NOVA_START_TIMING(memcpy_w_wb_t, memcpy_time);
-		copied = nova_flush_mmap_to_nvmm(sb, inode, pi, pos, bytes,
-							kmem);
-		NOVA_END_TIMING(memcpy_w_wb_t, memcpy_time);
+/*
+ * Log unwritten extents over [first, last]. Without overwrite only the
+ * holes get blocks. The blocks are not zeroed; they read as zeros until
+ * written. What was logged is committed even if the allocation runs out
+ * of space halfway.
+ */
+static int nova_prealloc_blocks(struct super_block *sb, struct inode *inode,
+	struct nova_inode *pi, unsigned long first, unsigned long last,
+	bool overwrite, u32 time)
+{
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	struct nova_file_write_entry entry_data;
+	struct nova_file_write_entry *entry;
+	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
+	unsigned long pgoff = first, next_pgoff, num_pages, num;
+	unsigned long blocknr = 0, total = 0;
+	u64 temp_tail = pi->log_tail, begin_tail = 0, curr_entry;
+	int allocated;
+	int ret = 0, err;
+
+	while (pgoff <= last) {
+		num = last - pgoff + 1;
+		if (!overwrite) {
+			entry = nova_find_extent(sih, pgoff, &num_pages);
+			if (entry) {
+				pgoff += num_pages;
+				continue;
+			}
 
-		entry_data.pgoff = cpu_to_le64(start_blk);
+			entry = nova_find_next_extent(sih, pgoff,
+						&next_pgoff, NULL);
+			if (entry && next_pgoff <= last)
+				num = next_pgoff - pgoff;
+		}
+
+		allocated = nova_new_file_blocks(sb, pi, &blocknr, num,
+						pgoff, 0);
+		if (allocated <= 0) {
+			nova_dbg("%s alloc blocks failed %d\n", __func__,
+							allocated);
+			ret = allocated ? allocated : -ENOSPC;
+			break;
+		}
+
+		entry_data.pgoff = cpu_to_le64(pgoff);
 		entry_data.num_pages = cpu_to_le32(allocated);
 		entry_data.invalid_pages = 0;
 		entry_data.block = cpu_to_le64(nova_get_block_off(sb, blocknr,
-							pi->i_blk_type));
-		/* FIXME: should we use the page cache write time? */
-		entry_data.mtime = cpu_to_le32(time);
+					pi->i_blk_type) | NOVA_WRITE_UNWRITTEN);
 		/* Set entry type after set block */
 		nova_set_entry_type((void *)&entry_data, FILE_WRITE);
-
+		entry_data.mtime = cpu_to_le32(time);
 		entry_data.size = cpu_to_le64(inode->i_size);
 
 		curr_entry = nova_append_file_write_entry(sb, pi, inode,
 						&entry_data, temp_tail);
 		if (curr_entry == 0) {
 			nova_dbg("%s: append inode entry failed\n", __func__);
+			nova_free_data_blocks(sb, pi, blocknr, allocated);
 			ret = -ENOSPC;
-			goto out;
-		}
-
-		nova_dbgv("Write: %p, %ld\n", kmem, copied);
-		if (copied > 0) {
-			status = copied;
-			written += copied;
-			pos += copied;
-			count -= copied;
-			num_blocks -= allocated;
-		}
-		if (unlikely(copied != bytes)) {
-			nova_dbg("%s ERROR!: %p, bytes %lu, copied %lu\n",
-				__func__, kmem, bytes, copied);
-			if (status >= 0)
-				status = -EFAULT;
-		}
-		if (status < 0) {
-			ret = status;
-			goto out;
+			break;
 		}
 
 		if (begin_tail == 0)
 			begin_tail = curr_entry;
 		temp_tail = curr_entry + sizeof(struct nova_file_write_entry);
+		total += allocated;
+		pgoff += allocated;
 	}
 
-	nova_memunlock_inode(sb, pi);
-	data_bits = blk_type_to_shift[pi->i_blk_type];
+	if (begin_tail == 0)
+		return ret;
+
+	nova_memunlock_window(sb);
 	le64_add_cpu(&pi->i_blocks,
-			(total_blocks << (data_bits - sb->s_blocksize_bits)));
-	nova_memlock_inode(sb, pi);
-	inode->i_blocks = le64_to_cpu(pi->i_blocks);
+			(total << (data_bits - sb->s_blocksize_bits)));
+	nova_update_tail(pi, temp_tail);
+	nova_memlock_window(sb);
 
-	*begin = begin_tail;
-	*end = temp_tail;
+	if (overwrite && mapping_mapped(inode->i_mapping))
+		unmap_mapping_range(inode->i_mapping,
+				(loff_t)first << PAGE_SHIFT,
+				(loff_t)(last - first + 1) << PAGE_SHIFT, 0);
 
-	ret = written;
-out:
-	if (ret < 0)
-		nova_cleanup_incomplete_write(sb, pi, sih, blocknr, allocated,
-						begin_tail, temp_tail);
+	err = nova_reassign_file_tree(sb, pi, sih, begin_tail);
+	inode->i_blocks = le64_to_cpu(pi->i_blocks);
 
-	sb_end_write(inode->i_sb);
-	NOVA_END_TIMING(copy_to_nvmm_t, copy_to_nvmm_time);
-	return ret;
+	return ret ? ret : err;
 }
 
-static int nova_get_nvmm_pfn(struct super_block *sb, struct nova_inode *pi,
-	struct nova_inode_info *si, u64 nvmm, pgoff_t pgoff,
-	vm_flags_t vm_flags, void **kmem, unsigned long *pfn)
+/* Drop the blocks of [first, last] by logging a hole entry over them */
+static int nova_punch_hole(struct super_block *sb, struct inode *inode,
+	struct nova_inode *pi, unsigned long first, unsigned long last,
+	u32 time)
 {
+	struct nova_inode_info *si = NOVA_I(inode);
 	struct nova_inode_info_header *sih = &si->header;
-	u64 mmap_block;
-	unsigned long cache_addr = 0;
-	unsigned long blocknr = 0;
-	void *mmap_addr;
-	void *nvmm_addr;
+	struct nova_file_write_entry entry_data;
+	unsigned long next_pgoff, last_pgoff;
+	u64 curr_entry;
 	int ret;
 
-	cache_addr = nova_get_cache_addr(sb, si, pgoff);
+	if (!nova_find_next_extent(sih, first, &next_pgoff, NULL) ||
+			next_pgoff > last)
+		return 0;
 
-	if (cache_addr) {
-		mmap_block = MMAP_ADDR(cache_addr);
-		mmap_addr = nova_get_block(sb, mmap_block);
-	} else {
-		ret = nova_new_data_blocks(sb, pi, &blocknr, 1,
-						pgoff, 0, 1);
+	/* Do not log pages past the last extent */
+	first = next_pgoff;
+	if (nova_find_last_extent(sih, &last_pgoff) && last > last_pgoff)
+		last = last_pgoff;
 
-		if (ret <= 0) {
-			nova_dbg("%s alloc blocks failed %d\n",
-					__func__, ret);
-			return ret;
-		}
+	entry_data.pgoff = cpu_to_le64(first);
+	entry_data.num_pages = cpu_to_le32(last - first + 1);
+	entry_data.invalid_pages = 0;
+	entry_data.block = cpu_to_le64(NOVA_WRITE_HOLE);
+	nova_set_entry_type((void *)&entry_data, FILE_WRITE);
+	entry_data.mtime = cpu_to_le32(time);
+	entry_data.size = cpu_to_le64(inode->i_size);
 
-		mmap_block = blocknr << PAGE_SHIFT;
-		mmap_addr = nova_get_block(sb, mmap_block);
+	curr_entry = nova_append_file_write_entry(sb, pi, inode,
+					&entry_data, pi->log_tail);
+	if (curr_entry == 0) {
+		nova_dbg("%s: append inode entry failed\n", __func__);
+		return -ENOSPC;
+	}
 
-		if (vm_flags & VM_WRITE)
-			mmap_block |= MMAP_WRITE_BIT;
+	nova_update_tail(pi, curr_entry +
+				sizeof(struct nova_file_write_entry));
 
-		nova_dbgv("%s: inode %lu, pgoff %lu, mmap block 0x%llx\n",
-			__func__, sih->ino, pgoff, mmap_block);
+	if (mapping_mapped(inode->i_mapping))
+		unmap_mapping_range(inode->i_mapping,
+				(loff_t)first << PAGE_SHIFT,
+				(loff_t)(last - first + 1) << PAGE_SHIFT, 0);
 
-		ret = radix_tree_insert(&sih->cache_tree, pgoff,
-					(void *)mmap_block);
-		if (ret) {
-			nova_dbg("%s: ERROR %d\n", __func__, ret);
-			return ret;
-		}
+	/* Frees the blocks in batches and invalidates the old entries */
+	ret = nova_reassign_file_tree(sb, pi, sih, curr_entry);
+	inode->i_blocks = le64_to_cpu(pi->i_blocks);
 
-		sih->mmap_pages++;
-		if (nvmm) {
-			/* Copy from NVMM to dram */
-			nvmm_addr = nova_get_block(sb, nvmm);
-			memcpy(mmap_addr, nvmm_addr, PAGE_SIZE);
-		} else {
-			memset(mmap_addr, 0, PAGE_SIZE);
-		}
-	}
+	return ret;
+}
 
-	*kmem = mmap_addr;
-	*pfn = nova_get_pfn(sb, mmap_block);
+/*
+ * Zero part of a block in place, unless it already reads as zeros. A
+ * block shared with a clone is copied first.
+ */
+static int nova_zero_partial_block(struct super_block *sb,
+	struct inode *inode, loff_t pos, size_t len)
+{
+	struct nova_inode_info_header *sih = &NOVA_I(inode)->header;
+	struct nova_file_write_entry *entry;
+	unsigned long pgoff = pos >> PAGE_SHIFT;
+	unsigned long nvmm;
+	void *kmem;
+	int ret;
+
+	ret = nova_unshare_block(sb, inode, pgoff, inode->i_size);
+	if (ret)
+		return ret;
 
+	entry = nova_find_extent(sih, pgoff, NULL);
+	if (!entry || nova_entry_unwritten(entry))
+		return 0;
+
+	nvmm = get_nvmm(sb, sih, entry, pgoff);
+	kmem = nova_get_block(sb, nvmm << PAGE_SHIFT) + (pos & ~PAGE_MASK);
+	memset(kmem, 0, len);
+	nova_flush_buffer(kmem, len, 0);
 	return 0;
 }
 
-static int nova_get_mmap_addr(struct inode *inode, struct vm_area_struct *vma,
-	pgoff_t pgoff, int create, void **kmem, unsigned long *pfn)
+long nova_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
 {
+	struct inode *inode = file_inode(file);
 	struct super_block *sb = inode->i_sb;
-	struct nova_inode_info *si = NOVA_I(inode);
-	struct nova_inode_info_header *sih = &si->header;
 	struct nova_inode *pi;
-	u64 nvmm;
-	vm_flags_t vm_flags = vma->vm_flags;
-	int ret;
+	loff_t end = offset + len;
+	loff_t head_end, tail_start;
+	unsigned long first, last;
+	bool grow;
+	u32 time;
+	long ret = 0;
+	timing_t fallocate_time;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EOPNOTSUPP;
+
+	NOVA_START_TIMING(fallocate_t, fallocate_time);
+	mutex_lock(&inode->i_mutex);
 
 	pi = nova_get_inode(sb, inode);
+	if (!pi) {
+		ret = -EACCES;
+		goto out;
+	}
 
-	nvmm = nova_find_nvmm_block(sb, si, NULL, pgoff);
+	ret = nova_convert_inline_data(sb, pi, inode);
+	if (ret)
+		goto out;
 
-	ret = nova_get_nvmm_pfn(sb, pi, si, nvmm, pgoff, vm_flags,
-						kmem, pfn);
+	/*
+	 * The size only grows once the blocks are in, so a failed
+	 * allocation leaves no size without blocks behind it. The huge
+	 * block policy is told about the new size up front.
+	 */
+	grow = !(mode & FALLOC_FL_KEEP_SIZE) && end > inode->i_size;
+	if (grow) {
+		ret = inode_newsize_ok(inode, end);
+		if (ret)
+			goto out;
+		nova_set_blocksize_hint(sb, inode, pi, end);
+	}
 
-	if (vm_flags & VM_WRITE) {
-		if (pgoff < sih->low_dirty)
-			sih->low_dirty = pgoff;
-		if (pgoff > sih->high_dirty)
-			sih->high_dirty = pgoff;
+	inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
+	time = CURRENT_TIME_SEC.tv_sec;
+
+	if (!(mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))) {
+		first = offset >> PAGE_SHIFT;
+		last = (end - 1) >> PAGE_SHIFT;
+		ret = nova_prealloc_blocks(sb, inode, pi, first, last,
+						false, time);
+		goto set_size;
 	}
 
+	/* Partial blocks at both ends are zeroed in place */
+	first = (offset + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	head_end = min_t(loff_t, end, (loff_t)first << PAGE_SHIFT);
+	if (offset < head_end)
+		ret = nova_zero_partial_block(sb, inode, offset,
+						head_end - offset);
+
+	tail_start = max_t(loff_t, end & PAGE_MASK, head_end);
+	if (end > tail_start && ret == 0)
+		ret = nova_zero_partial_block(sb, inode, tail_start,
+						end - tail_start);
+	PERSISTENT_BARRIER();
+	if (ret)
+		goto out;
+
+	if ((end >> PAGE_SHIFT) <= first)
+		goto set_size;
+
+	last = (end >> PAGE_SHIFT) - 1;
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+		ret = nova_punch_hole(sb, inode, pi, first, last, time);
+	else
+		ret = nova_prealloc_blocks(sb, inode, pi, first, last,
+						true, time);
+
+set_size:
+	if (ret == 0 && grow) {
+		struct iattr attr = {
+			.ia_valid = ATTR_SIZE,
+			.ia_size = end,
+		};
+
+		ret = nova_notify_change(file->f_path.dentry, &attr);
+	}
+out:
+	mutex_unlock(&inode->i_mutex);
+	NOVA_END_TIMING(fallocate_t, fallocate_time);
 	return ret;
 }
 
-/* OOM err return with dax file fault handlers doesn't mean anything.
- * It would just cause the OS to go an unnecessary killing spree !
+/*
+ * return > 0, # of blocks mapped or allocated.
+ * return = 0, if plain lookup failed.
+ * return < 0, error case.
  */
-static int __nova_dax_file_fault(struct vm_area_struct *vma,
-				  struct vm_fault *vmf)
+static int nova_dax_get_blocks(struct inode *inode, sector_t iblock,
+	unsigned long max_blocks, struct buffer_head *bh, int create)
 {
-	struct address_space *mapping = vma->vm_file->f_mapping;
-	struct inode *inode = mapping->host;
-	pgoff_t size;
-	void *dax_mem;
-	unsigned long dax_pfn = 0;
-	int err;
-	int ret = VM_FAULT_SIGBUS;
+	struct super_block *sb = inode->i_sb;
+	struct nova_inode *pi;
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	struct nova_file_write_entry *entry = NULL;
+	struct nova_file_write_entry entry_data;
+	u64 temp_tail = 0;
+	u64 curr_entry;
+	u32 time;
+	unsigned int data_bits;
+	unsigned long nvmm = 0;
+	unsigned long next_pgoff;
+	unsigned long num_pages;
+	unsigned long blocknr = 0;
+	int num_blocks = 0;
+	int allocated = 0;
+	int ret = 0;
 
-	mutex_lock(&inode->i_mutex);
-	size = (i_size_read(inode) + PAGE_SIZE - 1) >> PAGE_SHIFT;
-	if (vmf->pgoff >= size) {
-		nova_dbg("[%s:%d] pgoff >= size(SIGBUS). vm_start(0x%lx),"
-			" vm_end(0x%lx), pgoff(0x%lx), VA(%lx), size 0x%lx\n",
-			__func__, __LINE__, vma->vm_start, vma->vm_end,
-			vmf->pgoff, (unsigned long)vmf->virtual_address, size);
+	if (max_blocks == 0)
+		return 0;
+
+	nova_dbgv("%s: pgoff %lu, num %lu, create %d\n",
+				__func__, iblock, max_blocks, create);
+
+	entry = nova_find_extent(sih, iblock, &num_pages);
+	if (entry && !nova_entry_unwritten(entry)) {
+		/* Find contiguous blocks */
+		num_blocks = num_pages;
+		if (num_blocks > max_blocks)
+			num_blocks = max_blocks;
+
+		nvmm = get_nvmm(sb, sih, entry, iblock);
+		clear_buffer_new(bh);
+		nova_dbgv("%s: pgoff %lu, block %lu\n", __func__, iblock, nvmm);
 		goto out;
 	}
 
-	err = nova_get_mmap_addr(inode, vma, vmf->pgoff, 1,
-						&dax_mem, &dax_pfn);
-	if (unlikely(err)) {
-		nova_dbg("[%s:%d] get_mmap_addr failed. vm_start(0x%lx),"
-			" vm_end(0x%lx), pgoff(0x%lx), VA(%lx)\n",
-			__func__, __LINE__, vma->vm_start, vma->vm_end,
-			vmf->pgoff, (unsigned long)vmf->virtual_address);
+	if (create == 0)
+		return 0;
+
+	pi = nova_get_inode(sb, inode);
+	num_blocks = max_blocks;
+	inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
+	time = CURRENT_TIME_SEC.tv_sec;
+
+	if (entry) {
+		/* Zero preallocated blocks now and log them as written */
+		num_blocks = num_pages;
+		if (num_blocks > max_blocks)
+			num_blocks = max_blocks;
+
+		blocknr = get_nvmm(sb, sih, entry, iblock);
+		memset_nt(nova_get_block(sb, blocknr << PAGE_SHIFT), 0,
+				num_blocks << sb->s_blocksize_bits);
+		goto log_entry;
+	}
+
+	/* Fill the hole */
+	entry = nova_find_next_extent(sih, iblock, &next_pgoff, NULL);
+	if (entry) {
+		if (next_pgoff <= iblock) {
+			BUG();
+			ret = -EINVAL;
+			goto out;
+		}
+
+		num_blocks = next_pgoff - iblock;
+		if (num_blocks > max_blocks)
+			num_blocks = max_blocks;
+	}
+
+	/* Return initialized blocks to the user */
+	allocated = nova_new_file_blocks(sb, pi, &blocknr, num_blocks,
+						iblock, 1);
+	if (allocated <= 0) {
+		nova_dbg("%s alloc blocks failed %d\n", __func__,
+							allocated);
+		ret = allocated;
 		goto out;
 	}
 
-	nova_dbgv("%s flags: vma 0x%lx, vmf 0x%x\n",
-			__func__, vma->vm_flags, vmf->flags);
+	num_blocks = allocated;
+log_entry:
+	entry_data.pgoff = cpu_to_le64(iblock);
+	entry_data.num_pages = cpu_to_le32(num_blocks);
+	entry_data.invalid_pages = 0;
+	entry_data.block = cpu_to_le64(nova_get_block_off(sb, blocknr,
+							pi->i_blk_type));
+	/* Set entry type after set block */
+	nova_set_entry_type((void *)&entry_data, FILE_WRITE);
+	entry_data.mtime = cpu_to_le32(time);
 
-	nova_dbgv("DAX mmap: inode %lu, vm_start(0x%lx), vm_end(0x%lx), "
-			"pgoff(0x%lx), vma pgoff(0x%lx), "
-			"VA(0x%lx)->PA(0x%lx)\n",
-			inode->i_ino, vma->vm_start, vma->vm_end, vmf->pgoff,
-			vma->vm_pgoff, (unsigned long)vmf->virtual_address,
-			(unsigned long)dax_pfn << PAGE_SHIFT);
+	/* Do not extend file size */
+	entry_data.size = cpu_to_le64(inode->i_size);
 
-	if (dax_pfn == 0)
+	curr_entry = nova_append_file_write_entry(sb, pi, inode,
+						&entry_data, pi->log_tail);
+	if (curr_entry == 0) {
+		nova_dbg("%s: append inode entry failed\n", __func__);
+		ret = -ENOSPC;
 		goto out;
+	}
+
+	nvmm = blocknr;
+	data_bits = blk_type_to_shift[pi->i_blk_type];
+	le64_add_cpu(&pi->i_blocks,
+			(allocated << (data_bits - sb->s_blocksize_bits)));
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
-	err = vm_insert_mixed(vma, (unsigned long)vmf->virtual_address,
-		__pfn_to_pfn_t(dax_pfn, PFN_DEV));
-#else
-	err = vm_insert_mixed(vma, (unsigned long)vmf->virtual_address, dax_pfn);
-#endif
+	temp_tail = curr_entry + sizeof(struct nova_file_write_entry);
+	nova_update_tail(pi, temp_tail);
 
-	if (err == -ENOMEM)
+	ret = nova_reassign_file_tree(sb, pi, sih, curr_entry);
+	if (ret)
 		goto out;
-	/*
-	 * err == -EBUSY is fine, we've raced against another thread
-	 * that faulted-in the same page
-	 */
-	if (err != -EBUSY)
-		BUG_ON(err);
 
-	ret = VM_FAULT_NOPAGE;
+	inode->i_blocks = le64_to_cpu(pi->i_blocks);
+
+//	set_buffer_new(bh);
 
 out:
-	mutex_unlock(&inode->i_mutex);
-	return ret;
+	if (ret < 0) {
+		nova_cleanup_incomplete_write(sb, pi, sih, blocknr, allocated,
+						0, temp_tail);
+		return ret;
+	}
+
+	map_bh(bh, inode->i_sb, nvmm);
+	if (num_blocks > 1)
+		bh->b_size = sb->s_blocksize * num_blocks;
+
+	return num_blocks;
 }
 
-static int nova_dax_file_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+int nova_dax_get_block(struct inode *inode, sector_t iblock,
+	struct buffer_head *bh, int create)
 {
-	int ret = 0;
-	timing_t fault_time;
+	unsigned long max_blocks = bh->b_size >> inode->i_blkbits;
+	int ret;
+	timing_t gb_time;
 
-	NOVA_START_TIMING(mmap_fault_t, fault_time);
-	ret = __nova_dax_file_fault(vma, vmf);
-	NOVA_END_TIMING(mmap_fault_t, fault_time);
+	NOVA_START_TIMING(dax_get_block_t, gb_time);
+
+	ret = nova_dax_get_blocks(inode, iblock, max_blocks, bh, create);
+	if (ret > 0) {
+		bh->b_size = ret << inode->i_blkbits;
+		ret = 0;
+	}
+	NOVA_END_TIMING(dax_get_block_t, gb_time);
 	return ret;
 }
-#endif
+
+/* Mappings need blocks: convert an inline file first. Holds i_mutex. */
+static int nova_dax_fault_inline(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	int err;
+
+	if (likely(!NOVA_I(inode)->header.inline_entry))
+		return 0;
+
+	err = nova_convert_inline_data(sb, nova_get_inode(sb, inode), inode);
+	if (err == -ENOMEM)
+		return VM_FAULT_OOM;
+	return err ? VM_FAULT_SIGBUS : 0;
+}
+
+/* A write must not reach a block shared with a clone. Holds i_mutex. */
+static int nova_dax_fault_unshare(struct inode *inode, pgoff_t pgoff)
+{
+	int err;
+
+	err = nova_unshare_block(inode->i_sb, inode, pgoff, inode->i_size);
+	if (err == -ENOMEM)
+		return VM_FAULT_OOM;
+	return err ? VM_FAULT_SIGBUS : 0;
+}
 
 static int nova_dax_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
@@ -1035,8 +1784,14 @@ static int nova_dax_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	NOVA_START_TIMING(mmap_fault_t, fault_time);
 
 	mutex_lock(&inode->i_mutex);
-	ret = dax_fault(vma, vmf, nova_dax_get_block, NULL);
+	ret = nova_dax_fault_inline(inode);
+	if (!ret && (vmf->flags & FAULT_FLAG_WRITE))
+		ret = nova_dax_fault_unshare(inode, vmf->pgoff);
+	if (!ret)
+		ret = dax_fault(vma, vmf, nova_dax_get_block, NULL);
 	mutex_unlock(&inode->i_mutex);
+	trace_nova_dax_fault(inode, vma, (unsigned long)vmf->virtual_address,
+				vmf->flags, 0, ret);
 
 	NOVA_END_TIMING(mmap_fault_t, fault_time);
 	return ret;
@@ -1052,8 +1807,16 @@ static int nova_dax_pmd_fault(struct vm_area_struct *vma, unsigned long addr,
 	NOVA_START_TIMING(mmap_fault_t, fault_time);
 
 	mutex_lock(&inode->i_mutex);
-	ret = dax_pmd_fault(vma, addr, pmd, flags, nova_dax_get_block, NULL);
+	ret = nova_dax_fault_inline(inode);
+	/* Shared blocks are mapped, and unshared, one page at a time */
+	if (!ret && nova_range_shared(inode->i_sb, &NOVA_I(inode)->header,
+			linear_page_index(vma, addr & PMD_MASK), PTRS_PER_PMD))
+		ret = VM_FAULT_FALLBACK;
+	if (!ret)
+		ret = dax_pmd_fault(vma, addr, pmd, flags,
+					nova_dax_get_block, NULL);
 	mutex_unlock(&inode->i_mutex);
+	trace_nova_dax_fault(inode, vma, addr & PMD_MASK, flags, 1, ret);
 
 	NOVA_END_TIMING(mmap_fault_t, fault_time);
 	return ret;
@@ -1074,6 +1837,9 @@ static int nova_dax_pfn_mkwrite(struct vm_area_struct *vma,
 	if (vmf->pgoff >= size)
 		ret = VM_FAULT_SIGBUS;
 	else
+		ret = nova_dax_fault_unshare(inode, vmf->pgoff);
+	/* If the page was copied it is unmapped, and refaults writable */
+	if (!ret)
 		ret = dax_pfn_mkwrite(vma, vmf);
 	mutex_unlock(&inode->i_mutex);
 
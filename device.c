@@ -0,0 +1,382 @@
+/*
+ * NOVA multi-device instances.
+ *
+ * With devices=<dev>:<dev>:..., the pmem devices listed are appended to
+ * the one being mounted and the whole set forms a single block address
+ * space: each device is mapped for DAX on its own, and nova_get_block()
+ * translates a block address into the device holding it. Every device
+ * also gets its own run of the per-CPU free lists, whose NUMA node is the
+ * device's, so no free range or extent ever crosses a device boundary.
+ *
+ * Placement then falls out of the free lists. Logs, inodes and directory
+ * blocks come from the home list of the allocating CPU, which is on a
+ * device of its own socket. File data is striped over all devices in
+ * units of stripe=<pages> (2MB by default, 0 to allocate it locally too).
+ *
+ * The super block on the first device records the size of every member,
+ * and each further member starts with a nova_dev_header naming its slot,
+ * so a mount with the devices missing, reordered or swapped is refused.
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/random.h>
+#include "nova.h"
+
+#define	NOVA_DEV_MODE	(FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+/* Map all of @bdev for DAX into @dev */
+int nova_map_device(struct super_block *sb, struct block_device *bdev,
+	struct nova_device *dev)
+{
+	void *virt_addr = NULL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	pfn_t __pfn_t;
+#else
+	unsigned long pfn;
+#endif
+	long size;
+
+	if (!bdev->bd_disk->fops->direct_access) {
+		nova_err(sb, "device %s does not support DAX\n",
+			bdev->bd_disk->disk_name);
+		return -EINVAL;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	size = bdev->bd_disk->fops->direct_access(bdev, 0, &virt_addr,
+							&__pfn_t);
+#else
+	size = bdev->bd_disk->fops->direct_access(bdev, 0, &virt_addr, &pfn);
+#endif
+
+	if (size <= 0) {
+		nova_err(sb, "direct_access failed on %s\n",
+			bdev->bd_disk->disk_name);
+		return -EINVAL;
+	}
+
+	dev->bdev = bdev;
+	dev->virt_addr = virt_addr;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	dev->phys_addr = pfn_t_to_pfn(__pfn_t) << PAGE_SHIFT;
+#else
+	dev->phys_addr = pfn << PAGE_SHIFT;
+#endif
+	dev->size = size;
+
+	nova_dbg("%s: dev %s, phys_addr 0x%llx, virt_addr %p, size %lu\n",
+		__func__, bdev->bd_disk->disk_name,
+		(u64)dev->phys_addr, dev->virt_addr, dev->size);
+
+	return 0;
+}
+
+/* Lay the devices out back to back from their sizes */
+static void nova_set_device_starts(struct nova_sb_info *sbi)
+{
+	struct nova_device *dev;
+	u64 start = 0;
+	int i;
+
+	for (i = 0; i < sbi->num_devs; i++) {
+		dev = &sbi->devs[i];
+		dev->start = start;
+		dev->start_block = start >> PAGE_SHIFT;
+		dev->num_blocks = dev->size >> PAGE_SHIFT;
+		start += dev->size;
+	}
+
+	sbi->initsize = start;
+}
+
+/*
+ * Open and map the devices= list after the mounted device. Each member is
+ * used in whole 2MB units, so every device starts on a huge page boundary
+ * of the address space.
+ */
+int nova_open_devices(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct block_device *bdev;
+	struct nova_device *dev;
+	char *paths, *p, *path;
+	int ret = 0;
+	int i;
+
+	if (!sbi->dev_paths)
+		return 0;
+
+	paths = kstrdup(sbi->dev_paths, GFP_KERNEL);
+	if (!paths)
+		return -ENOMEM;
+
+	p = paths;
+	while ((path = strsep(&p, ":")) != NULL) {
+		if (!*path)
+			continue;
+		if (sbi->num_devs >= NOVA_MAX_DEVICES) {
+			nova_err(sb, "at most %d devices are supported\n",
+				NOVA_MAX_DEVICES);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		bdev = blkdev_get_by_path(path, NOVA_DEV_MODE, sbi);
+		if (IS_ERR(bdev)) {
+			nova_err(sb, "cannot open device %s\n", path);
+			ret = PTR_ERR(bdev);
+			goto out;
+		}
+
+		dev = &sbi->devs[sbi->num_devs];
+		ret = nova_map_device(sb, bdev, dev);
+		if (ret) {
+			blkdev_put(bdev, NOVA_DEV_MODE);
+			goto out;
+		}
+		sbi->num_devs++;
+	}
+
+	if (sbi->num_devs == 1)
+		goto out;
+
+	if (sbi->num_devs > sbi->cpus) {
+		nova_err(sb, "%d devices need as many free lists, "
+			"but there are only %d cpus\n",
+			sbi->num_devs, sbi->cpus);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < sbi->num_devs; i++) {
+		dev = &sbi->devs[i];
+		dev->size = round_down(dev->size, PMD_SIZE);
+		if (dev->size == 0) {
+			nova_err(sb, "device %s is smaller than 2MB\n",
+				dev->bdev->bd_disk->disk_name);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	nova_set_device_starts(sbi);
+	nova_info("NOVA: %d devices, %lu bytes in total\n",
+		sbi->num_devs, sbi->initsize);
+out:
+	kfree(paths);
+	return ret;
+}
+
+void nova_close_devices(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int i;
+
+	for (i = 1; i < sbi->num_devs; i++) {
+		blkdev_put(sbi->devs[i].bdev, NOVA_DEV_MODE);
+		sbi->devs[i].bdev = NULL;
+	}
+	sbi->num_devs = 1;
+
+	kfree(sbi->dev_paths);
+	sbi->dev_paths = NULL;
+}
+
+/* Record the member devices in a new super block and stamp their headers */
+void nova_format_devices(struct super_block *sb,
+	struct nova_super_block *super)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	size_t len = NOVA_DEV_HEADER_BLOCKS * PAGE_SIZE;
+	struct nova_dev_header *hdr;
+	struct nova_device *dev;
+	u64 fs_id;
+	int i;
+
+	if (sbi->num_devs <= 1)
+		return;
+
+	get_random_bytes(&fs_id, sizeof(fs_id));
+	super->s_num_devices = cpu_to_le32(sbi->num_devs);
+	super->s_fs_id = cpu_to_le64(fs_id);
+
+	for (i = 0; i < sbi->num_devs; i++) {
+		dev = &sbi->devs[i];
+		super->s_dev_size[i] = cpu_to_le64(dev->size);
+		if (i == 0)
+			continue;
+
+		hdr = dev->virt_addr;
+		nova_memunlock_range(sb, hdr, len);
+		memset_nt(hdr, 0, len);
+		hdr->h_magic = cpu_to_le32(NOVA_DEV_MAGIC);
+		hdr->h_index = cpu_to_le32(i);
+		hdr->h_fs_id = cpu_to_le64(fs_id);
+		hdr->h_size = cpu_to_le64(dev->size);
+		nova_memlock_range(sb, hdr, len);
+		nova_flush_buffer(hdr, sizeof(*hdr), false);
+	}
+}
+
+/*
+ * Match the opened devices against the layout recorded at format time and
+ * adopt the recorded sizes, which may be smaller than the devices now.
+ */
+int nova_check_devices(struct super_block *sb, struct nova_super_block *super)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int count = le32_to_cpu(super->s_num_devices);
+	u64 fs_id = le64_to_cpu(super->s_fs_id);
+	struct nova_dev_header *hdr;
+	struct nova_device *dev;
+	unsigned long size;
+	int i;
+
+	if (count <= 1) {
+		if (sbi->num_devs == 1)
+			return 0;
+		nova_err(sb, "image was formatted on a single device\n");
+		return -EINVAL;
+	}
+
+	if (count > NOVA_MAX_DEVICES || count != sbi->num_devs) {
+		nova_err(sb, "image spans %d devices, %d given\n",
+			count, sbi->num_devs);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < count; i++) {
+		dev = &sbi->devs[i];
+		size = le64_to_cpu(super->s_dev_size[i]);
+		if (size > dev->size) {
+			nova_err(sb, "device %s is smaller than at format\n",
+				dev->bdev->bd_disk->disk_name);
+			return -EINVAL;
+		}
+
+		if (i > 0) {
+			hdr = dev->virt_addr;
+			if (le32_to_cpu(hdr->h_magic) != NOVA_DEV_MAGIC ||
+					le32_to_cpu(hdr->h_index) != i ||
+					le64_to_cpu(hdr->h_fs_id) != fs_id ||
+					le64_to_cpu(hdr->h_size) != size) {
+				nova_err(sb, "device %s is not member %d "
+					"of this image\n",
+					dev->bdev->bd_disk->disk_name, i);
+				return -EINVAL;
+			}
+		}
+		dev->size = size;
+	}
+
+	nova_set_device_starts(sbi);
+	if (sbi->initsize != le64_to_cpu(super->s_size)) {
+		nova_err(sb, "devices add up to %lu bytes, image has %llu\n",
+			sbi->initsize, le64_to_cpu(super->s_size));
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Spread the per-CPU free lists over the devices in proportion to their
+ * size, with at least one list per device.
+ */
+void nova_layout_device_lists(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_device *dev, *pick;
+	int assigned = 0;
+	int first = 0;
+	int i;
+
+	for (i = 0; i < sbi->num_devs; i++) {
+		dev = &sbi->devs[i];
+		dev->num_lists = max_t(int, 1,
+			(u64)sbi->cpus * dev->num_blocks / sbi->num_blocks);
+		assigned += dev->num_lists;
+	}
+
+	/* Take from the device with most lists, give to the least served */
+	while (assigned > sbi->cpus) {
+		pick = &sbi->devs[0];
+		for (i = 1; i < sbi->num_devs; i++)
+			if (sbi->devs[i].num_lists > pick->num_lists)
+				pick = &sbi->devs[i];
+		pick->num_lists--;
+		assigned--;
+	}
+
+	while (assigned < sbi->cpus) {
+		pick = &sbi->devs[0];
+		for (i = 1; i < sbi->num_devs; i++)
+			if (sbi->devs[i].num_blocks / sbi->devs[i].num_lists >
+					pick->num_blocks / pick->num_lists)
+				pick = &sbi->devs[i];
+		pick->num_lists++;
+		assigned++;
+	}
+
+	for (i = 0; i < sbi->num_devs; i++) {
+		dev = &sbi->devs[i];
+		dev->first_list = first;
+		dev->per_list_blocks = dev->num_blocks / dev->num_lists;
+		first += dev->num_lists;
+		nova_dbgv("%s: device %d, blocks %lu - %lu, lists %d - %d\n",
+			__func__, i, dev->start_block,
+			dev->start_block + dev->num_blocks - 1,
+			dev->first_list, first - 1);
+	}
+}
+
+/* Block range of free list @list; the last list of a device gets the rest */
+void nova_device_list_range(struct super_block *sb, int list,
+	unsigned long *start, unsigned long *end)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_device *dev = &sbi->devs[0];
+	int idx;
+	int i;
+
+	for (i = 1; i < sbi->num_devs; i++)
+		if (sbi->devs[i].first_list <= list)
+			dev = &sbi->devs[i];
+
+	idx = list - dev->first_list;
+	*start = dev->start_block + idx * dev->per_list_blocks;
+	if (idx == dev->num_lists - 1)
+		*end = dev->start_block + dev->num_blocks - 1;
+	else
+		*end = *start + dev->per_list_blocks - 1;
+}
+
+/* Does free list @list begin with the header of a member device? */
+int nova_list_has_dev_header(struct super_block *sb, int list)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int i;
+
+	for (i = 1; i < sbi->num_devs; i++)
+		if (sbi->devs[i].first_list == list)
+			return 1;
+
+	return 0;
+}
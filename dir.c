@@ -16,11 +16,137 @@
  */
 
 #include <linux/fs.h>
+#include <linux/compat.h>
 #include <linux/pagemap.h>
+#include <linux/hash.h>
+#include <linux/prefetch.h>
+#include <linux/vmalloc.h>
 #include "nova.h"
 
-#define DT2IF(dt) (((dt) << 12) & S_IFMT)
-#define IF2DT(sif) (((sif) & S_IFMT) >> 12)
+#define DIR_INDEX_BUCKETS(bits)	(1UL << (bits))
+
+static inline struct nova_dir_node *nova_rb_dir_node(struct rb_node *node)
+{
+	return node ? rb_entry(node, struct nova_dir_node, node) : NULL;
+}
+
+static inline struct hlist_head *nova_dir_bucket(struct hlist_head *buckets,
+	unsigned int bits, u64 hash)
+{
+	return &buckets[hash_64(hash, bits)];
+}
+
+/* Freed with kvfree() */
+static void *nova_dir_zalloc(size_t size)
+{
+	if (size <= PAGE_SIZE)
+		return kzalloc(size, GFP_NOFS);
+
+	return __vmalloc(size, GFP_NOFS | __GFP_HIGHMEM | __GFP_ZERO,
+				PAGE_KERNEL);
+}
+
+static struct hlist_head *nova_alloc_dir_buckets(unsigned int bits)
+{
+	return nova_dir_zalloc(DIR_INDEX_BUCKETS(bits) *
+				sizeof(struct hlist_head));
+}
+
+/*
+ * Double the hash table once the average chain exceeds two entries.
+ * Failure to grow is not fatal: lookups just walk longer chains.
+ */
+static void nova_grow_dir_index(struct super_block *sb,
+	struct nova_inode_info_header *sih)
+{
+	struct hlist_head *buckets;
+	struct nova_dir_node *curr;
+	struct rb_node *temp;
+	unsigned int bits;
+
+	if (sih->dir_buckets &&
+	    (sih->num_dentries <= 2 * DIR_INDEX_BUCKETS(sih->dir_bits) ||
+	     sih->dir_bits >= DIR_INDEX_MAX_BITS))
+		return;
+
+	bits = sih->dir_buckets ? sih->dir_bits + 1 : DIR_INDEX_MIN_BITS;
+	buckets = nova_alloc_dir_buckets(bits);
+	if (!buckets) {
+		nova_dbgv("%s: failed to grow dir index to %u bits\n",
+				__func__, bits);
+		return;
+	}
+
+	/* Every indexed node is in the rbtree, so rehash from there */
+	for (temp = rb_first(&sih->dir_tree); temp; temp = rb_next(temp)) {
+		curr = nova_rb_dir_node(temp);
+		hlist_add_head(&curr->hnode,
+				nova_dir_bucket(buckets, bits, curr->hash));
+	}
+
+	kvfree(sih->dir_buckets);
+	sih->dir_buckets = buckets;
+	sih->dir_bits = bits;
+}
+
+static int nova_check_dentry_match(struct super_block *sb,
+	struct nova_dentry *dentry, const char *name, int namelen)
+{
+	if (dentry->name_len != namelen)
+		return -EINVAL;
+
+	return strncmp(dentry->name, name, namelen);
+}
+
+/* First node in hash order whose hash is not below @pos */
+static struct nova_dir_node *nova_find_dir_node_from(
+	struct nova_inode_info_header *sih, u64 pos)
+{
+	struct nova_dir_node *curr, *next = NULL;
+	struct rb_node *temp;
+
+	temp = sih->dir_tree.rb_node;
+	while (temp) {
+		curr = nova_rb_dir_node(temp);
+		if (curr->hash >= pos) {
+			next = curr;
+			temp = temp->rb_left;
+		} else {
+			temp = temp->rb_right;
+		}
+	}
+
+	return next;
+}
+
+static struct nova_dir_node *nova_find_dir_node(struct super_block *sb,
+	struct nova_inode_info_header *sih, const char *name, int namelen,
+	u64 hash)
+{
+	struct nova_dir_node *curr;
+
+	if (!sih->dir_buckets) {
+		/* Table allocation failed, fall back to the rbtree */
+		curr = nova_find_dir_node_from(sih, hash);
+		for (; curr && curr->hash == hash;
+		     curr = nova_rb_dir_node(rb_next(&curr->node))) {
+			if (nova_check_dentry_match(sb, curr->direntry,
+						name, namelen) == 0)
+				return curr;
+		}
+		return NULL;
+	}
+
+	hlist_for_each_entry(curr,
+			nova_dir_bucket(sih->dir_buckets, sih->dir_bits, hash),
+			hnode) {
+		if (curr->hash == hash && nova_check_dentry_match(sb,
+					curr->direntry, name, namelen) == 0)
+			return curr;
+	}
+
+	return NULL;
+}
 
 struct nova_dentry *nova_find_dentry(struct super_block *sb,
 	struct nova_inode *pi, struct inode *inode, const char *name,
@@ -28,63 +154,127 @@ struct nova_dentry *nova_find_dentry(struct super_block *sb,
 {
 	struct nova_inode_info *si = NOVA_I(inode);
 	struct nova_inode_info_header *sih = &si->header;
-	struct nova_dentry *direntry;
-	unsigned long hash;
+	struct nova_dir_node *curr;
 
-	hash = BKDRHash(name, name_len);
-	direntry = radix_tree_lookup(&sih->tree, hash);
+	curr = nova_find_dir_node(sb, sih, name, name_len,
+				nova_dentry_hash(name, name_len));
 
-	return direntry;
+	return curr ? curr->direntry : NULL;
 }
 
-static int nova_insert_dir_radix_tree(struct super_block *sb,
+/* Point the index node of @old_dentry at its copy @new_dentry */
+int nova_replace_dir_index_entry(struct super_block *sb,
+	struct nova_inode_info_header *sih, struct nova_dentry *old_dentry,
+	struct nova_dentry *new_dentry)
+{
+	struct nova_dir_node *curr;
+
+	curr = nova_find_dir_node(sb, sih, old_dentry->name,
+			old_dentry->name_len,
+			nova_dentry_hash(old_dentry->name,
+					old_dentry->name_len));
+	if (curr && curr->direntry == old_dentry)
+		curr->direntry = new_dentry;
+
+	return 0;
+}
+
+/* Any change to the index makes the readdir array stale */
+static inline void nova_drop_readdir_cache(struct nova_inode_info_header *sih)
+{
+	if (sih->readdir_cache) {
+		kvfree(sih->readdir_cache);
+		sih->readdir_cache = NULL;
+	}
+}
+
+/*
+ * Entries with equal hashes are kept to the right of each other in the
+ * rbtree, so an in-order walk visits every entry once.
+ */
+static int nova_insert_dir_index(struct super_block *sb,
 	struct nova_inode_info_header *sih, const char *name,
 	int namelen, struct nova_dentry *direntry)
 {
-	unsigned long hash;
-	int ret;
+	struct nova_dir_node *new_node, *curr;
+	struct rb_node **temp, *parent = NULL;
+	u64 hash;
 
-	hash = BKDRHash(name, namelen);
-	nova_dbgv("%s: insert %s hash %lu\n", __func__, name, hash);
+	hash = nova_dentry_hash(name, namelen);
+	nova_dbgv("%s: insert %s hash %llu\n", __func__, name, hash);
 
-	/* FIXME: hash collision ignored here */
-	ret = radix_tree_insert(&sih->tree, hash, direntry);
-	if (ret)
-		nova_dbg("%s ERROR %d: %s\n", __func__, ret, name);
+	if (nova_find_dir_node(sb, sih, name, namelen, hash)) {
+		nova_dbg("%s ERROR %d: %s\n", __func__, -EEXIST, name);
+		return -EEXIST;
+	}
 
-	return ret;
+	new_node = nova_alloc_dir_node(sb);
+	if (!new_node)
+		return -ENOMEM;
+
+	new_node->hash = hash;
+	new_node->direntry = direntry;
+	INIT_HLIST_NODE(&new_node->hnode);
+
+	sih->num_dentries++;
+	nova_grow_dir_index(sb, sih);
+
+	temp = &sih->dir_tree.rb_node;
+	while (*temp) {
+		curr = container_of(*temp, struct nova_dir_node, node);
+		parent = *temp;
+		if (hash < curr->hash)
+			temp = &((*temp)->rb_left);
+		else
+			temp = &((*temp)->rb_right);
+	}
+
+	rb_link_node(&new_node->node, parent, temp);
+	rb_insert_color(&new_node->node, &sih->dir_tree);
+	nova_drop_readdir_cache(sih);
+
+	if (sih->dir_buckets)
+		hlist_add_head(&new_node->hnode,
+			nova_dir_bucket(sih->dir_buckets, sih->dir_bits, hash));
+
+	return 0;
 }
 
-static int nova_check_dentry_match(struct super_block *sb,
-	struct nova_dentry *dentry, const char *name, int namelen)
+static void nova_erase_dir_node(struct nova_inode_info_header *sih,
+	struct nova_dir_node *curr)
 {
-	if (dentry->name_len != namelen)
-		return -EINVAL;
-
-	return strncmp(dentry->name, name, namelen);
+	if (!hlist_unhashed(&curr->hnode))
+		hlist_del(&curr->hnode);
+	rb_erase(&curr->node, &sih->dir_tree);
+	sih->num_dentries--;
+	nova_free_dir_node(curr);
+	nova_drop_readdir_cache(sih);
 }
 
-static int nova_remove_dir_radix_tree(struct super_block *sb,
+static int nova_remove_dir_index(struct super_block *sb,
 	struct nova_inode_info_header *sih, const char *name, int namelen,
 	int replay)
 {
+	struct nova_dir_node *curr;
 	struct nova_dentry *entry;
-	unsigned long hash;
+	u64 hash;
 
-	hash = BKDRHash(name, namelen);
-	entry = radix_tree_delete(&sih->tree, hash);
+	hash = nova_dentry_hash(name, namelen);
+	curr = nova_find_dir_node(sb, sih, name, namelen, hash);
+	entry = curr ? curr->direntry : NULL;
+	if (curr)
+		nova_erase_dir_node(sih, curr);
 
 	if (replay == 0) {
 		if (!entry) {
-			nova_dbg("%s ERROR: %s, length %d, hash %lu\n",
+			nova_dbg("%s ERROR: %s, length %d, hash %llu\n",
 					__func__, name, namelen, hash);
 			return -EINVAL;
 		}
 
-		if (entry->ino == 0 || entry->invalid ||
-		    nova_check_dentry_match(sb, entry, name, namelen)) {
+		if (entry->ino == 0 || entry->invalid) {
 			nova_dbg("%s dentry not match: %s, length %d, "
-					"hash %lu\n", __func__, name,
+					"hash %llu\n", __func__, name,
 					namelen, hash);
 			nova_dbg("dentry: type %d, inode %llu, name %s, "
 					"namelen %u, rec len %u\n",
@@ -105,37 +295,25 @@ static int nova_remove_dir_radix_tree(struct super_block *sb,
 void nova_delete_dir_tree(struct super_block *sb,
 	struct nova_inode_info_header *sih)
 {
-	struct nova_dentry *direntry;
-	unsigned long pos = 0;
-	struct nova_dentry *entries[FREE_BATCH];
+	struct nova_dir_node *curr;
+	struct rb_node *temp;
 	timing_t delete_time;
-	int nr_entries;
-	int i;
-	void *ret;
 
 	NOVA_START_TIMING(delete_dir_tree_t, delete_time);
 
-	do {
-		nr_entries = radix_tree_gang_lookup(&sih->tree,
-					(void **)entries, pos, FREE_BATCH);
-		for (i = 0; i < nr_entries; i++) {
-			direntry = entries[i];
-			BUG_ON(!direntry);
-			pos = BKDRHash(direntry->name, direntry->name_len);
-			ret = radix_tree_delete(&sih->tree, pos);
-			if (!ret || ret != direntry) {
-				nova_err(sb, "dentry: type %d, inode %llu, "
-					"name %s, namelen %u, rec len %u\n",
-					direntry->entry_type,
-					le64_to_cpu(direntry->ino),
-					direntry->name, direntry->name_len,
-					le16_to_cpu(direntry->de_len));
-				if (!ret)
-					nova_dbg("ret is NULL\n");
-			}
-		}
-		pos++;
-	} while (nr_entries == FREE_BATCH);
+	temp = rb_first(&sih->dir_tree);
+	while (temp) {
+		curr = nova_rb_dir_node(temp);
+		temp = rb_next(temp);
+		rb_erase(&curr->node, &sih->dir_tree);
+		nova_free_dir_node(curr);
+	}
+
+	kvfree(sih->dir_buckets);
+	sih->dir_buckets = NULL;
+	sih->dir_bits = 0;
+	sih->num_dentries = 0;
+	nova_drop_readdir_cache(sih);
 
 	NOVA_END_TIMING(delete_dir_tree_t, delete_time);
 	return;
@@ -150,8 +328,8 @@ void nova_delete_dir_tree(struct super_block *sb,
  */
 static u64 nova_append_dir_inode_entry(struct super_block *sb,
 	struct nova_inode *pidir, struct inode *dir,
-	u64 ino, struct dentry *dentry, unsigned short de_len, u64 tail,
-	int link_change, u64 *curr_tail)
+	u64 ino, u8 file_type, struct dentry *dentry, unsigned short de_len,
+	u64 tail, int link_change, u64 *curr_tail)
 {
 	struct nova_inode_info *si = NOVA_I(dir);
 	struct nova_inode_info_header *sih = &si->header;
@@ -175,7 +353,7 @@ static u64 nova_append_dir_inode_entry(struct super_block *sb,
 	memcpy_to_pmem_nocache(entry->name, dentry->d_name.name,
 				dentry->d_name.len);
 	entry->name[dentry->d_name.len] = '\0';
-	entry->file_type = 0;
+	entry->file_type = file_type;
 	entry->invalid = 0;
 	entry->mtime = cpu_to_le32(dir->i_mtime.tv_sec);
 	entry->size = cpu_to_le64(dir->i_size);
@@ -231,6 +409,7 @@ int nova_append_dir_init_entries(struct super_block *sb,
 	de_entry->entry_type = DIR_LOG;
 	de_entry->ino = cpu_to_le64(self_ino);
 	de_entry->name_len = 1;
+	de_entry->file_type = DT_DIR;
 	de_entry->de_len = cpu_to_le16(NOVA_DIR_LOG_REC_LEN(1));
 	de_entry->mtime = CURRENT_TIME_SEC.tv_sec;
 	de_entry->size = sb->s_blocksize;
@@ -245,6 +424,7 @@ int nova_append_dir_init_entries(struct super_block *sb,
 	de_entry->entry_type = DIR_LOG;
 	de_entry->ino = cpu_to_le64(parent_ino);
 	de_entry->name_len = 2;
+	de_entry->file_type = DT_DIR;
 	de_entry->de_len = cpu_to_le16(NOVA_DIR_LOG_REC_LEN(2));
 	de_entry->mtime = CURRENT_TIME_SEC.tv_sec;
 	de_entry->size = sb->s_blocksize;
@@ -261,8 +441,8 @@ int nova_append_dir_init_entries(struct super_block *sb,
 /* adds a directory entry pointing to the inode. assumes the inode has
  * already been logged for consistency
  */
-int nova_add_dentry(struct dentry *dentry, u64 ino, int inc_link,
-	u64 tail, u64 *new_tail)
+int nova_add_dentry(struct dentry *dentry, u64 ino, u8 file_type,
+	int inc_link, u64 tail, u64 *new_tail)
 {
 	struct inode *dir = dentry->d_parent->d_inode;
 	struct super_block *sb = dir->i_sb;
@@ -295,11 +475,11 @@ int nova_add_dentry(struct dentry *dentry, u64 ino, int inc_link,
 
 	loglen = NOVA_DIR_LOG_REC_LEN(namelen);
 	curr_entry = nova_append_dir_inode_entry(sb, pidir, dir, ino,
-				dentry,	loglen, tail, inc_link,
+				file_type, dentry, loglen, tail, inc_link,
 				&curr_tail);
 
 	direntry = (struct nova_dentry *)nova_get_block(sb, curr_entry);
-	ret = nova_insert_dir_radix_tree(sb, sih, name, namelen, direntry);
+	ret = nova_insert_dir_index(sb, sih, name, namelen, direntry);
 	*new_tail = curr_tail;
 	NOVA_END_TIMING(add_dentry_t, add_dentry_time);
 	return ret;
@@ -332,10 +512,10 @@ int nova_remove_dentry(struct dentry *dentry, int dec_link, u64 tail,
 
 	loglen = NOVA_DIR_LOG_REC_LEN(entry->len);
 	curr_entry = nova_append_dir_inode_entry(sb, pidir, dir, 0,
-				dentry, loglen, tail, dec_link, &curr_tail);
+				0, dentry, loglen, tail, dec_link, &curr_tail);
 	*new_tail = curr_tail;
 
-	nova_remove_dir_radix_tree(sb, sih, entry->name, entry->len, 0);
+	nova_remove_dir_index(sb, sih, entry->name, entry->len, 0);
 	NOVA_END_TIMING(remove_dentry_t, remove_dentry_time);
 	return 0;
 }
@@ -347,7 +527,7 @@ inline int nova_replay_add_dentry(struct super_block *sb,
 		return -EINVAL;
 
 	nova_dbg_verbose("%s: add %s\n", __func__, entry->name);
-	return nova_insert_dir_radix_tree(sb, sih,
+	return nova_insert_dir_index(sb, sih,
 			entry->name, entry->name_len, entry);
 }
 
@@ -356,7 +536,7 @@ inline int nova_replay_remove_dentry(struct super_block *sb,
 	struct nova_dentry *entry)
 {
 	nova_dbg_verbose("%s: remove %s\n", __func__, entry->name);
-	nova_remove_dir_radix_tree(sb, sih, entry->name,
+	nova_remove_dir_index(sb, sih, entry->name,
 					entry->name_len, 1);
 	return 0;
 }
@@ -379,6 +559,7 @@ int nova_rebuild_dir_inode_tree(struct super_block *sb,
 {
 	struct nova_dentry *entry = NULL;
 	struct nova_setattr_logentry *attr_entry = NULL;
+	struct nova_setattr_logentry attr_buf;
 	struct nova_link_change_entry *link_change_entry = NULL;
 	struct nova_inode_log_page *curr_page;
 	u64 ino = pi->nova_ino;
@@ -420,20 +601,22 @@ int nova_rebuild_dir_inode_tree(struct super_block *sb,
 		type = nova_get_entry_type(addr);
 		switch (type) {
 			case SET_ATTR:
-				attr_entry =
-					(struct nova_setattr_logentry *)addr;
+			case SET_ATTR_COMPACT:
+				attr_entry = nova_read_setattr_entry(addr,
+								&attr_buf);
 				nova_apply_setattr_entry(sb, pi, sih,
 								attr_entry);
 				sih->last_setattr = curr_p;
-				curr_p += sizeof(struct nova_setattr_logentry);
+				curr_p += nova_setattr_entry_len(addr);
 				continue;
 			case LINK_CHANGE:
+			case LINK_CHANGE_COMPACT:
 				link_change_entry =
 					(struct nova_link_change_entry *)addr;
 				nova_apply_link_change_entry(pi,
 							link_change_entry);
 				sih->last_link_change = curr_p;
-				curr_p += sizeof(struct nova_link_change_entry);
+				curr_p += nova_link_change_entry_len(addr);
 				continue;
 			case DIR_LOG:
 				break;
@@ -492,100 +675,159 @@ int nova_rebuild_dir_inode_tree(struct super_block *sb,
 	return 0;
 }
 
-#if 0
-static int nova_readdir(struct file *file, struct dir_context *ctx)
+/* Dentries written before file_type was logged report DT_UNKNOWN */
+static u8 nova_dentry_file_type(struct super_block *sb,
+	struct nova_dentry *entry)
 {
-	struct inode *inode = file_inode(file);
-	struct super_block *sb = inode->i_sb;
-	struct nova_inode *pidir;
-	struct nova_inode_info *si = NOVA_I(inode);
-	struct nova_inode_info_header *sih = &si->header;
 	struct nova_inode *child_pi;
-	struct nova_dentry *entry;
-	struct nova_dentry *entries[FREE_BATCH];
-	int nr_entries;
 	u64 pi_addr;
-	unsigned long pos = 0;
-	ino_t ino;
-	int i;
-	int ret;
-	timing_t readdir_time;
 
-	NOVA_START_TIMING(readdir_t, readdir_time);
-	pidir = nova_get_inode(sb, inode);
-	nova_dbgv("%s: ino %llu, size %llu, pos %llu\n",
-			__func__, (u64)inode->i_ino,
-			pidir->i_size, ctx->pos);
+	if (entry->file_type != DT_UNKNOWN)
+		return entry->file_type;
 
-	if (!sih) {
-		nova_dbg("%s: inode %lu sih does not exist!\n",
-				__func__, inode->i_ino);
-		ctx->pos = READDIR_END;
-		return 0;
-	}
+	if (nova_get_inode_address(sb, le64_to_cpu(entry->ino), &pi_addr, 0))
+		return DT_UNKNOWN;
 
-	pos = ctx->pos;
-	if (pos == READDIR_END)
-		goto out;
+	child_pi = nova_get_block(sb, pi_addr);
+	return IF2DT(le16_to_cpu(child_pi->i_mode));
+}
 
-	do {
-		nr_entries = radix_tree_gang_lookup(&sih->tree,
-					(void **)entries, pos, FREE_BATCH);
-		for (i = 0; i < nr_entries; i++) {
-			entry = entries[i];
-			pos = BKDRHash(entry->name, entry->name_len);
-			ino = __le64_to_cpu(entry->ino);
-			if (ino == 0)
-				continue;
+/* Warm the child inode for the stat that usually follows */
+static inline void nova_prefetch_child(struct super_block *sb, u64 ino)
+{
+	u64 pi_addr;
 
-			ret = nova_get_inode_address(sb, ino, &pi_addr, 0);
-			if (ret) {
-				nova_dbg("%s: get child inode %lu address "
-					"failed %d\n", __func__, ino, ret);
-				ctx->pos = READDIR_END;
-				return ret;
-			}
+	if (nova_get_inode_address(sb, ino, &pi_addr, 0) == 0)
+		prefetch(nova_get_block(sb, pi_addr));
+}
 
-			child_pi = nova_get_block(sb, pi_addr);
-			nova_dbgv("ctx: ino %llu, name %s, "
-				"name_len %u, de_len %u\n",
-				(u64)ino, entry->name, entry->name_len,
-				entry->de_len);
-			if (!dir_emit(ctx, entry->name, entry->name_len,
-				ino, IF2DT(le16_to_cpu(child_pi->i_mode)))) {
-				nova_dbgv("Here: pos %llu\n", ctx->pos);
-				return 0;
-			}
-			ctx->pos = pos + 1;
-		}
-		pos++;
-	} while (nr_entries == FREE_BATCH);
+/*
+ * Compact copy of the index for readdir: hash, inode number, type and
+ * name of every entry in hash order, in one DRAM buffer. It is built on
+ * the first readdir and dropped whenever the index changes; both happen
+ * under the directory's i_mutex.
+ */
+static struct nova_readdir_cache *nova_get_readdir_cache(
+	struct super_block *sb, struct nova_inode_info_header *sih)
+{
+	struct nova_readdir_cache *cache;
+	struct nova_readdir_entry *rentry;
+	struct nova_dir_node *curr;
+	struct nova_dentry *entry;
+	struct rb_node *temp;
+	unsigned long count = 0;
+	size_t names = 0;
+	char *name;
+
+	if (sih->readdir_cache)
+		return sih->readdir_cache;
+
+	if (sih->num_dentries > READDIR_CACHE_MAX_DENTRIES)
+		return NULL;
+
+	for (temp = rb_first(&sih->dir_tree); temp; temp = rb_next(temp)) {
+		entry = nova_rb_dir_node(temp)->direntry;
+		if (is_dir_init_entry(sb, entry))
+			continue;
+		count++;
+		names += entry->name_len;
+	}
 
-out:
-	NOVA_END_TIMING(readdir_t, readdir_time);
-	return 0;
+	cache = nova_dir_zalloc(sizeof(struct nova_readdir_cache) +
+			count * sizeof(struct nova_readdir_entry) + names);
+	if (!cache)
+		return NULL;
+
+	name = (char *)&cache->entries[count];
+	rentry = cache->entries;
+	for (temp = rb_first(&sih->dir_tree); temp; temp = rb_next(temp)) {
+		curr = nova_rb_dir_node(temp);
+		entry = curr->direntry;
+		if (is_dir_init_entry(sb, entry))
+			continue;
+		rentry->hash = curr->hash;
+		rentry->ino = le64_to_cpu(entry->ino);
+		rentry->name_len = entry->name_len;
+		rentry->file_type = nova_dentry_file_type(sb, entry);
+		rentry->name = name;
+		memcpy(name, entry->name, entry->name_len);
+		name += entry->name_len;
+		rentry++;
+	}
+
+	cache->count = count;
+	sih->readdir_cache = cache;
+	NOVA_STATS_ADD(readdir_cache_builds, 1);
+	return cache;
 }
-#endif
 
-static u64 nova_find_next_dentry_addr(struct super_block *sb,
-	struct nova_inode_info_header *sih, u64 pos)
+/* First entry with hash >= pos */
+static unsigned long nova_readdir_cache_find(struct nova_readdir_cache *cache,
+	u64 pos)
 {
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_file_write_entry *entry = NULL;
-	struct nova_file_write_entry *entries[1];
-	int nr_entries;
-	u64 addr = 0;
-
-	nr_entries = radix_tree_gang_lookup(&sih->tree,
-					(void **)entries, pos, 1);
-	if (nr_entries == 1) {
-		entry = entries[0];
-		addr = nova_get_addr_off(sbi, entry);
+	unsigned long lo = 0, hi = cache->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cache->entries[mid].hash >= pos)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
 
-	return addr;
+	return lo;
 }
 
+static inline int nova_is_32bit_api(void)
+{
+#ifdef CONFIG_COMPAT
+	return is_compat_task();
+#else
+	return (BITS_PER_LONG == 32);
+#endif
+}
+
+/* 32-bit getdents and NFSv2 callers only keep 31 bits of the cookie */
+static int nova_readdir_32bit(struct file *file)
+{
+	if (file->f_mode & FMODE_32BITHASH)
+		return 1;
+	if (file->f_mode & FMODE_64BITHASH)
+		return 0;
+	return nova_is_32bit_api();
+}
+
+static inline loff_t nova_readdir_end(struct file *file)
+{
+	return nova_readdir_32bit(file) ? READDIR_END_32BIT : READDIR_END;
+}
+
+/*
+ * Fold a hash into a readdir position. The 31-bit form keeps the top bits
+ * of the hash, so positions stay in hash order and clear of "." and "..".
+ */
+static inline loff_t nova_hash2pos(struct file *file, u64 hash)
+{
+	if (!nova_readdir_32bit(file))
+		return hash;
+	return max_t(u64, hash >> READDIR_HASH_SHIFT_32BIT, 2);
+}
+
+/* Smallest hash that folds into position @pos */
+static inline u64 nova_pos2hash(struct file *file, loff_t pos)
+{
+	if (!nova_readdir_32bit(file) || pos <= 2)
+		return pos;
+	return (u64)pos << READDIR_HASH_SHIFT_32BIT;
+}
+
+/*
+ * Walk the index in hash order. ctx->pos is the hash of the next entry to
+ * emit, folded to 31 bits for 32-bit callers, so a resumed readdir finds
+ * its place in O(log n) no matter how the directory changed in between.
+ * Entries sharing a hash with the one that failed to emit may be returned
+ * twice.
+ */
 static int nova_readdir(struct file *file, struct dir_context *ctx)
 {
 	struct inode *inode = file_inode(file);
@@ -593,18 +835,14 @@ static int nova_readdir(struct file *file, struct dir_context *ctx)
 	struct nova_inode *pidir;
 	struct nova_inode_info *si = NOVA_I(inode);
 	struct nova_inode_info_header *sih = &si->header;
-	struct nova_inode *child_pi;
-	struct nova_inode *prev_child_pi = NULL;
-	struct nova_dentry *entry = NULL;
-	struct nova_dentry *prev_entry = NULL;
-	unsigned short de_len;
-	u64 pi_addr;
-	unsigned long pos = 0;
+	struct nova_readdir_cache *cache;
+	struct nova_readdir_entry *rentry;
+	struct nova_dir_node *curr;
+	struct nova_dentry *entry;
+	struct rb_node *temp;
+	unsigned long i;
 	ino_t ino;
-	void *addr;
-	u64 curr_p;
-	u8 type;
-	int ret;
+	int ret = 0;
 	timing_t readdir_time;
 
 	NOVA_START_TIMING(readdir_t, readdir_time);
@@ -613,108 +851,79 @@ static int nova_readdir(struct file *file, struct dir_context *ctx)
 			__func__, (u64)inode->i_ino,
 			pidir->i_size, ctx->pos);
 
-	if (pidir->log_head == 0) {
-		nova_err(sb, "Dir %lu log is NULL!\n", inode->i_ino);
-		BUG();
-		return -EINVAL;
-	}
-
-	pos = ctx->pos;
-
-	if (pos == 0) {
-		curr_p = pidir->log_head;
-	} else if (pos == READDIR_END) {
+	if (ctx->pos == nova_readdir_end(file))
 		goto out;
-	} else {
-		curr_p = nova_find_next_dentry_addr(sb, sih, pos);
-		if (curr_p == 0)
-			goto out;
-	}
 
-	while (curr_p != pidir->log_tail) {
-		if (goto_next_page(sb, curr_p)) {
-			curr_p = next_log_page(sb, curr_p);
-		}
-
-		if (curr_p == 0) {
-			nova_err(sb, "Dir %lu log is NULL!\n", inode->i_ino);
-			BUG();
-			return -EINVAL;
-		}
+	if (!dir_emit_dots(file, ctx))
+		goto out;
 
-		addr = (void *)nova_get_block(sb, curr_p);
-		type = nova_get_entry_type(addr);
-		switch (type) {
-			case SET_ATTR:
-				curr_p += sizeof(struct nova_setattr_logentry);
-				continue;
-			case LINK_CHANGE:
-				curr_p += sizeof(struct nova_link_change_entry);
-				continue;
-			case DIR_LOG:
-				break;
-			default:
-				nova_dbg("%s: unknown type %d, 0x%llx\n",
-							__func__, type, curr_p);
-			BUG();
-			return -EINVAL;
+	cache = nova_get_readdir_cache(sb, sih);
+	if (cache) {
+		i = nova_readdir_cache_find(cache,
+					nova_pos2hash(file, ctx->pos));
+		for (; i < cache->count; i++) {
+			rentry = &cache->entries[i];
+			ctx->pos = nova_hash2pos(file, rentry->hash);
+			if (!dir_emit(ctx, rentry->name, rentry->name_len,
+					rentry->ino, rentry->file_type))
+				goto out;
+			nova_prefetch_child(sb, rentry->ino);
 		}
+		ctx->pos = nova_readdir_end(file);
+		goto out;
+	}
 
-		entry = (struct nova_dentry *)nova_get_block(sb, curr_p);
-		nova_dbgv("curr_p: 0x%llx, type %d, ino %llu, "
-			"name %s, namelen %u, rec len %u\n", curr_p,
-			entry->entry_type, le64_to_cpu(entry->ino),
-			entry->name, entry->name_len,
-			le16_to_cpu(entry->de_len));
-
-		de_len = le16_to_cpu(entry->de_len);
-		if (entry->ino > 0 && entry->invalid == 0) {
-			ino = __le64_to_cpu(entry->ino);
-			pos = BKDRHash(entry->name, entry->name_len);
-
-			ret = nova_get_inode_address(sb, ino, &pi_addr, 0);
-			if (ret) {
-				nova_dbg("%s: get child inode %lu address "
-					"failed %d\n", __func__, ino, ret);
-				ctx->pos = READDIR_END;
-				return ret;
-			}
-
-			child_pi = nova_get_block(sb, pi_addr);
-			nova_dbgv("ctx: ino %llu, name %s, "
-				"name_len %u, de_len %u\n",
-				(u64)ino, entry->name, entry->name_len,
-				entry->de_len);
-			if (prev_entry && !dir_emit(ctx, prev_entry->name,
-				prev_entry->name_len, ino,
-				IF2DT(le16_to_cpu(prev_child_pi->i_mode)))) {
-				nova_dbgv("Here: pos %llu\n", ctx->pos);
-				return 0;
-			}
-			prev_entry = entry;
-			prev_child_pi = child_pi;
+	curr = nova_find_dir_node_from(sih, nova_pos2hash(file, ctx->pos));
+	for (; curr; curr = nova_rb_dir_node(temp)) {
+		temp = rb_next(&curr->node);
+		entry = curr->direntry;
+		if (is_dir_init_entry(sb, entry))
+			continue;
+
+		ino = __le64_to_cpu(entry->ino);
+		nova_dbgv("ctx: ino %llu, name %s, "
+			"name_len %u, de_len %u\n",
+			(u64)ino, entry->name, entry->name_len,
+			entry->de_len);
+		ctx->pos = nova_hash2pos(file, curr->hash);
+		if (!dir_emit(ctx, entry->name, entry->name_len, ino,
+				nova_dentry_file_type(sb, entry))) {
+			nova_dbgv("Here: pos %llu\n", ctx->pos);
+			goto out;
 		}
-		ctx->pos = pos;
-		curr_p += de_len;
+		nova_prefetch_child(sb, ino);
 	}
 
-	if (prev_entry && !dir_emit(ctx, prev_entry->name,
-			prev_entry->name_len, ino,
-			IF2DT(le16_to_cpu(prev_child_pi->i_mode))))
-		return 0;
-
-	ctx->pos = READDIR_END;
+	ctx->pos = nova_readdir_end(file);
 out:
 	NOVA_END_TIMING(readdir_t, readdir_time);
 	nova_dbgv("%s return\n", __func__);
+	return ret;
+}
+
+/* Positions are hashes, not byte offsets, so don't clamp them to i_size */
+static loff_t nova_dir_llseek(struct file *file, loff_t offset, int whence)
+{
+	loff_t end = nova_readdir_32bit(file) ? READDIR_END_32BIT : LLONG_MAX;
+
+	return generic_file_llseek_size(file, offset, whence, end, end);
+}
+
+static int nova_dir_fsync(struct file *file, loff_t start, loff_t end,
+	int datasync)
+{
+	struct inode *inode = file_inode(file);
+
+	/* Directory updates are durable once their lite journal commits */
+	nova_flush_lite_journals(inode->i_sb);
 	return 0;
 }
 
 const struct file_operations nova_dir_operations = {
-	.llseek		= generic_file_llseek,
+	.llseek		= nova_dir_llseek,
 	.read		= generic_read_dir,
 	.iterate	= nova_readdir,
-	.fsync		= noop_fsync,
+	.fsync		= nova_dir_fsync,
 	.unlocked_ioctl = nova_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= nova_compat_ioctl,
@@ -35,35 +35,26 @@ static inline int nova_can_set_blocksize_hint(struct inode *inode,
 	return 1;
 }
 
+/*
+ * Data blocks stay 4K; a file that is sized to 2M or more before any data
+ * is written is marked for 2M-aligned extents so its mmaps can use PMDs.
+ */
 int nova_set_blocksize_hint(struct super_block *sb, struct inode *inode,
 	struct nova_inode *pi, loff_t new_size)
 {
-	unsigned short block_type;
-
 	if (!nova_can_set_blocksize_hint(inode, pi, new_size))
 		return 0;
 
-	if (new_size >= 0x40000000) {   /* 1G */
-		block_type = NOVA_BLOCK_TYPE_1G;
-		goto hint_set;
-	}
-
-	if (new_size >= 0x200000) {     /* 2M */
-		block_type = NOVA_BLOCK_TYPE_2M;
-		goto hint_set;
-	}
-
-	/* defaulting to 4K */
-	block_type = NOVA_BLOCK_TYPE_4K;
+	if (new_size < PMD_SIZE ||
+			(le32_to_cpu(pi->i_flags) & NOVA_HUGE_FL))
+		return 0;
 
-hint_set:
-	nova_dbg_verbose(
-		"Hint: new_size 0x%llx, i_size 0x%llx\n",
-		new_size, pi->i_size);
-	nova_dbg_verbose("Setting the hint to 0x%x\n", block_type);
+	nova_dbg_verbose("Hint: new_size 0x%llx, i_size 0x%llx, "
+			"huge allocation\n", new_size, pi->i_size);
 	nova_memunlock_inode(sb, pi);
-	pi->i_blk_type = block_type;
+	pi->i_flags |= cpu_to_le32(NOVA_HUGE_FL);
 	nova_memlock_inode(sb, pi);
+	nova_flush_buffer(&pi->i_flags, sizeof(pi->i_flags), 1);
 	return 0;
 }
 
@@ -108,168 +99,6 @@ static loff_t nova_llseek(struct file *file, loff_t offset, int origin)
 	return offset;
 }
 
-#if 0
-static inline int nova_check_page_dirty(struct super_block *sb,
-	unsigned long addr)
-{
-	return IS_MAP_WRITE(addr);
-}
-
-static unsigned long nova_get_dirty_range(struct super_block *sb,
-	struct nova_inode *pi, struct nova_inode_info *si, loff_t *start,
-	loff_t end)
-{
-	unsigned long flush_bytes = 0;
-	unsigned long bytes;
-	unsigned long cache_addr = 0;
-	pgoff_t pgoff;
-	loff_t offset;
-	loff_t dirty_start;
-	loff_t temp = *start;
-
-	nova_dbgv("%s: inode %llu, start %llu, end %llu\n",
-			__func__, pi->nova_ino, *start, end);
-
-	dirty_start = temp;
-	while (temp < end) {
-		pgoff = temp >> PAGE_SHIFT;
-		offset = temp & ~PAGE_MASK;
-		bytes = sb->s_blocksize - offset;
-		if (bytes > (end - temp))
-			bytes = end - temp;
-
-		cache_addr = nova_get_cache_addr(sb, si, pgoff);
-		if (cache_addr && nova_check_page_dirty(sb, cache_addr)) {
-			if (flush_bytes == 0)
-				dirty_start = temp;
-			flush_bytes += bytes;
-		} else {
-			if (flush_bytes)
-				break;
-		}
-		temp += bytes;
-	}
-
-	if (flush_bytes == 0)
-		*start = end;
-	else
-		*start = dirty_start;
-
-	return flush_bytes;
-}
-
-static void nova_get_sync_range(struct nova_inode_info_header *sih,
-	loff_t *start, loff_t *end)
-{
-	unsigned long start_blk, end_blk;
-	unsigned long low_blk, high_blk;
-
-	start_blk = *start >> PAGE_SHIFT;
-	end_blk = *end >> PAGE_SHIFT;
-
-	low_blk = sih->low_dirty;
-	high_blk = sih->high_dirty;
-
-	if (start_blk < low_blk)
-		*start = low_blk << PAGE_SHIFT;
-	if (end_blk > high_blk)
-		*end = (high_blk + 1) << PAGE_SHIFT;
-}
-
-/* This function is called by both msync() and fsync().
- * TODO: Check if we can avoid calling nova_flush_buffer() for fsync. We use
- * movnti to write data to files, so we may want to avoid doing unnecessary
- * nova_flush_buffer() on fsync() */
-int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
-{
-	/* Sync from start to end[inclusive] */
-	struct address_space *mapping = file->f_mapping;
-	struct inode *inode = mapping->host;
-	struct nova_inode_info *si = NOVA_I(inode);
-	struct nova_inode_info_header *sih = &si->header;
-	struct super_block *sb = inode->i_sb;
-	struct nova_inode *pi;
-	unsigned long start_blk, end_blk;
-	u64 end_tail = 0, begin_tail = 0;
-	u64 begin_temp = 0, end_temp = 0;
-	int ret = 0;
-	loff_t sync_start, sync_end;
-	loff_t isize;
-	timing_t fsync_time;
-
-	NOVA_START_TIMING(fsync_t, fsync_time);
-	if (!mapping_mapped(mapping))
-		goto out;
-
-	mutex_lock(&inode->i_mutex);
-
-	/* Check the dirty range */
-	pi = nova_get_inode(sb, inode);
-
-	end += 1; /* end is inclusive. We like our indices normal please! */
-
-	isize = i_size_read(inode);
-
-	if ((unsigned long)end > (unsigned long)isize)
-		end = isize;
-	if (!isize || (start >= end))
-	{
-		nova_dbg_verbose("[%s:%d] : (ERR) isize(%llx), start(%llx),"
-			" end(%llx)\n", __func__, __LINE__, isize, start, end);
-		NOVA_END_TIMING(fsync_t, fsync_time);
-		mutex_unlock(&inode->i_mutex);
-		return 0;
-	}
-
-	nova_get_sync_range(sih, &start, &end);
-	start_blk = start >> PAGE_SHIFT;
-	end_blk = end >> PAGE_SHIFT;
-
-	nova_dbgv("%s: start %llu, end %llu, size %llu, "
-			" start_blk %lu, end_blk %lu\n",
-			__func__, start, end, isize, start_blk,
-			end_blk);
-
-	sync_start = start;
-	sync_end = end;
-	end_temp = pi->log_tail;
-
-	do {
-		unsigned long nr_flush_bytes = 0;
-
-		nr_flush_bytes = nova_get_dirty_range(sb, pi, si, &start, end);
-
-		nova_dbgv("start %llu, flush bytes %lu\n",
-				start, nr_flush_bytes);
-		if (nr_flush_bytes) {
-			nova_copy_to_nvmm(sb, inode, pi, start,
-				nr_flush_bytes, &begin_temp, &end_temp);
-			if (begin_tail == 0)
-				begin_tail = begin_temp;
-		}
-
-		start += nr_flush_bytes;
-	} while (start < end);
-
-	end_tail = end_temp;
-	if (begin_tail && end_tail && end_tail != pi->log_tail) {
-		nova_update_tail(pi, end_tail);
-
-		/* Free the overlap blocks after the write is committed */
-		ret = nova_reassign_file_tree(sb, pi, sih, begin_tail);
-
-		inode->i_blocks = le64_to_cpu(pi->i_blocks);
-	}
-
-	mutex_unlock(&inode->i_mutex);
-
-out:
-	NOVA_END_TIMING(fsync_t, fsync_time);
-
-	return ret;
-}
-#endif
-
 /* This function is called by both msync() and fsync().
  * TODO: Check if we can avoid calling nova_flush_buffer() for fsync. We use
  * movnti to write data to files, so we may want to avoid doing unnecessary
@@ -289,6 +118,9 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 
 	NOVA_START_TIMING(fsync_t, fsync_time);
 
+	/* Namespace operations on this file may sit in a group commit */
+	nova_flush_lite_journals(sb);
+
 	/* No need to flush if the file is not mmaped */
 	if (!mapping_mapped(mapping))
 		goto persist;
@@ -314,6 +146,7 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 		unsigned long nvmm;
 		unsigned long nr_flush_bytes = 0;
 		unsigned long avail_bytes = 0;
+		unsigned long num_pages;
 		void *dax_mem;
 		pgoff_t pgoff;
 		loff_t offset;
@@ -321,17 +154,17 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 		pgoff = start >> PAGE_SHIFT;
 		offset = start & ~PAGE_MASK;
 
-		entry = nova_get_write_entry(sb, si, pgoff);
+		entry = nova_find_extent(sih, pgoff, &num_pages);
 		if (unlikely(entry == NULL)) {
 			nova_dbgv("Found hole: pgoff %lu, inode size %lld\n",
 					pgoff, isize);
 
 			/* Jump the hole */
-			entry = nova_find_next_entry(sb, sih, pgoff);
+			entry = nova_find_next_extent(sih, pgoff, &pgoff,
+							&num_pages);
 			if (!entry)
 				goto persist;
 
-			pgoff = entry->pgoff;
 			start = pgoff << PAGE_SHIFT;
 			offset = 0;
 
@@ -351,11 +184,7 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 		}
 
 		/* Find contiguous blocks */
-		if (entry->invalid_pages == 0)
-			avail_bytes = (entry->num_pages - (pgoff - entry->pgoff))
-				* PAGE_SIZE - offset;
-		else
-			avail_bytes = PAGE_SIZE - offset;
+		avail_bytes = num_pages * PAGE_SIZE - offset;
 
 		if (nr_flush_bytes > avail_bytes)
 			nr_flush_bytes = avail_bytes;
@@ -394,9 +223,10 @@ const struct file_operations nova_dax_file_operations = {
 	.llseek			= nova_llseek,
 	.read			= nova_dax_file_read,
 	.write			= nova_dax_file_write,
-	.read_iter		= generic_file_read_iter,
-	.write_iter		= generic_file_write_iter,
+	.read_iter		= nova_dax_read_iter,
+	.write_iter		= nova_dax_write_iter,
 	.mmap			= nova_dax_file_mmap,
+	.fallocate		= nova_fallocate,
 	.open			= nova_open,
 	.fsync			= nova_fsync,
 	.flush			= nova_flush,
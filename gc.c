@@ -0,0 +1,260 @@
+/*
+ * NOVA background log cleaner.
+ *
+ * Writers only extend the inode log; inodes whose logs grow past the
+ * watermark are queued to a per-CPU cleaner thread, which runs fast and
+ * thorough GC under i_mutex.
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include "nova.h"
+
+/*
+ * Watermark: clean once the live entries seen by the last scan would fill
+ * less than gc_live_ratio percent of the current log. valid_bytes is only
+ * refreshed by GC, so a log that turned out mostly live must grow again
+ * before it is queued.
+ */
+static bool nova_log_needs_gc(struct nova_sb_info *sbi,
+	struct nova_inode_info_header *sih)
+{
+	unsigned long live_pages;
+
+	if (sih->log_pages < sbi->gc_min_pages)
+		return false;
+
+	live_pages = DIV_ROUND_UP(sih->valid_bytes, LAST_ENTRY);
+	return live_pages * 100 < sih->log_pages * sbi->gc_live_ratio;
+}
+
+/*
+ * Queue the inode to the local cleaner if its log needs cleaning.
+ * Returns -ENODEV if no cleaner is running and the caller should GC inline.
+ * Caller holds i_mutex.
+ */
+int nova_queue_log_gc(struct super_block *sb,
+	struct nova_inode_info_header *sih)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_cleaner *cleaner;
+	int cpu;
+
+	if (!sbi->log_cleaners)
+		return -ENODEV;
+
+	if (!list_empty(&sih->gc_list) || !nova_log_needs_gc(sbi, sih))
+		return 0;
+
+	cpu = get_cpu();
+	if (cpu >= sbi->cpus)
+		cpu = cpu % sbi->cpus;
+	cleaner = &sbi->log_cleaners[cpu];
+
+	spin_lock(&cleaner->lock);
+	if (list_empty(&sih->gc_list)) {
+		sih->gc_cpu = cpu;
+		list_add_tail(&sih->gc_list, &cleaner->queue);
+		cleaner->queued++;
+		NOVA_STATS_ADD(cleaner_queued, 1);
+	}
+	spin_unlock(&cleaner->lock);
+	put_cpu();
+
+	wake_up_interruptible(&cleaner->wait);
+	return 0;
+}
+
+/* Called from evict: the inode must not stay on a cleaner queue */
+void nova_dequeue_log_gc(struct super_block *sb,
+	struct nova_inode_info_header *sih)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_cleaner *cleaner;
+
+	if (list_empty(&sih->gc_list) || !sbi->log_cleaners)
+		return;
+
+	cleaner = &sbi->log_cleaners[sih->gc_cpu];
+	spin_lock(&cleaner->lock);
+	if (!list_empty(&sih->gc_list)) {
+		list_del_init(&sih->gc_list);
+		cleaner->queued--;
+	}
+	spin_unlock(&cleaner->lock);
+}
+
+/*
+ * Take the next queued inode. The reference is grabbed under the queue
+ * lock so that evict, which dequeues under the same lock, cannot free the
+ * inode in between. Inodes already being evicted are skipped.
+ */
+static struct inode *nova_log_cleaner_pop(struct nova_log_cleaner *cleaner)
+{
+	struct nova_inode_info_header *sih;
+	struct nova_inode_info *si;
+	struct inode *inode = NULL;
+
+	spin_lock(&cleaner->lock);
+	while (!list_empty(&cleaner->queue)) {
+		sih = list_first_entry(&cleaner->queue,
+				struct nova_inode_info_header, gc_list);
+		list_del_init(&sih->gc_list);
+		cleaner->queued--;
+
+		si = container_of(sih, struct nova_inode_info, header);
+		inode = igrab(&si->vfs_inode);
+		if (inode)
+			break;
+	}
+	spin_unlock(&cleaner->lock);
+
+	return inode;
+}
+
+static void nova_clean_inode_log(struct super_block *sb, struct inode *inode)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	struct nova_inode *pi;
+	timing_t clean_time;
+
+	NOVA_START_TIMING(log_cleaner_t, clean_time);
+	mutex_lock(&inode->i_mutex);
+
+	/* The log may have been freed or truncated since it was queued */
+	pi = nova_get_inode(sb, inode);
+	if (pi && pi->log_head && inode->i_nlink &&
+			nova_log_needs_gc(sbi, sih)) {
+		nova_dbgv("%s: inode %lu, log pages %lu, valid bytes %lu\n",
+			__func__, sih->ino, sih->log_pages, sih->valid_bytes);
+		nova_inode_log_fast_gc(sb, pi, sih);
+		NOVA_STATS_ADD(cleaner_inodes, 1);
+	}
+
+	mutex_unlock(&inode->i_mutex);
+	NOVA_END_TIMING(log_cleaner_t, clean_time);
+}
+
+static int nova_log_cleaner_func(void *data)
+{
+	struct nova_log_cleaner *cleaner = data;
+	struct super_block *sb = cleaner->sb;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode *inode;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(cleaner->wait,
+				!list_empty(&cleaner->queue) ||
+				kthread_should_stop());
+
+		inode = nova_log_cleaner_pop(cleaner);
+		if (!inode)
+			continue;
+
+		nova_clean_inode_log(sb, inode);
+		iput(inode);
+
+		if (sbi->gc_throttle)
+			msleep_interruptible(sbi->gc_throttle);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+int nova_start_log_cleaners(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_cleaner *cleaners, *cleaner;
+	int ret = 0;
+	int i;
+
+	cleaners = kcalloc(sbi->cpus, sizeof(struct nova_log_cleaner),
+							GFP_KERNEL);
+	if (!cleaners)
+		return -ENOMEM;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		cleaner = &cleaners[i];
+		cleaner->sb = sb;
+		spin_lock_init(&cleaner->lock);
+		INIT_LIST_HEAD(&cleaner->queue);
+		init_waitqueue_head(&cleaner->wait);
+
+		cleaner->task = kthread_create(nova_log_cleaner_func,
+					cleaner, "nova_gc/%d", i);
+		if (IS_ERR(cleaner->task)) {
+			ret = PTR_ERR(cleaner->task);
+			cleaner->task = NULL;
+			goto out;
+		}
+		kthread_bind(cleaner->task, i);
+	}
+
+	for (i = 0; i < sbi->cpus; i++)
+		wake_up_process(cleaners[i].task);
+
+	sbi->log_cleaners = cleaners;
+	return 0;
+
+out:
+	for (i = 0; i < sbi->cpus; i++)
+		if (cleaners[i].task)
+			kthread_stop(cleaners[i].task);
+	kfree(cleaners);
+	return ret;
+}
+
+/*
+ * Stop the cleaners before the VFS evicts inodes at unmount, since a
+ * cleaner holds an inode reference while it works. Queued inodes are
+ * simply dropped; their logs stay valid, just not compacted.
+ */
+void nova_stop_log_cleaners(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_cleaner *cleaners = sbi->log_cleaners;
+	struct nova_log_cleaner *cleaner;
+	struct nova_inode_info_header *sih;
+	int i;
+
+	if (!cleaners)
+		return;
+
+	for (i = 0; i < sbi->cpus; i++)
+		kthread_stop(cleaners[i].task);
+
+	for (i = 0; i < sbi->cpus; i++) {
+		cleaner = &cleaners[i];
+		spin_lock(&cleaner->lock);
+		while (!list_empty(&cleaner->queue)) {
+			sih = list_first_entry(&cleaner->queue,
+				struct nova_inode_info_header, gc_list);
+			list_del_init(&sih->gc_list);
+		}
+		cleaner->queued = 0;
+		spin_unlock(&cleaner->lock);
+	}
+
+	sbi->log_cleaners = NULL;
+	kfree(cleaners);
+}
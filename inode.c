@@ -24,6 +24,7 @@
 #include <linux/types.h>
 #include <linux/ratelimit.h>
 #include "nova.h"
+#include "nova_trace.h"
 
 unsigned int blk_type_to_shift[NOVA_BLOCK_TYPE_MAX] = {12, 21, 30};
 uint32_t blk_type_to_size[NOVA_BLOCK_TYPE_MAX] = {0x1000, 0x200000, 0x40000000};
@@ -89,7 +90,8 @@ int nova_init_inode_table(struct super_block *sb)
 		if (!inode_table)
 			return -EINVAL;
 
-		allocated = nova_new_log_blocks(sb, pi, &blocknr, 1, 1);
+		/* Place table i on the NUMA node of CPU i */
+		allocated = nova_new_log_blocks(sb, pi, &blocknr, 1, 1, i);
 		nova_dbg_verbose("%s: allocate log @ 0x%lx\n", __func__,
 							blocknr);
 		if (allocated != 1 || blocknr == 0)
@@ -104,57 +106,153 @@ int nova_init_inode_table(struct super_block *sb)
 	return 0;
 }
 
-int nova_get_inode_address(struct super_block *sb, u64 ino,
-	u64 *pi_addr, int extendable)
+/*
+ * DRAM index of the inode table superpages, so finding an inode does not
+ * follow the superpage chain in NVMM. Each CPU's table has a fixed array
+ * of chunk pointers sized for the whole device. Entries are only appended,
+ * under table_index_mutex, and published by bumping table_pages_num, so
+ * lookups need no lock.
+ */
+#define	INODE_INDEX_CHUNK_BITS	9
+#define	INODE_INDEX_CHUNK_SIZE	(1 << INODE_INDEX_CHUNK_BITS)
+#define	INODE_INDEX_CHUNK_MASK	(INODE_INDEX_CHUNK_SIZE - 1)
+
+int nova_alloc_inode_table_index(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_inode *pi;
+	struct inode_map *inode_map;
+	unsigned long superpages;
+	unsigned int chunks;
+	int i;
+
+	superpages = (sbi->num_blocks >> (PAGE_SHIFT_2M - PAGE_SHIFT)) + 1;
+	chunks = DIV_ROUND_UP(superpages, INODE_INDEX_CHUNK_SIZE);
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		mutex_init(&inode_map->table_index_mutex);
+		inode_map->table_pages = kcalloc(chunks, sizeof(u64 *),
+							GFP_KERNEL);
+		if (!inode_map->table_pages)
+			return -ENOMEM;
+		inode_map->table_chunks = chunks;
+		inode_map->table_pages_num = 0;
+	}
+
+	return 0;
+}
+
+void nova_free_inode_table_index(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map;
+	unsigned int j;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		if (!inode_map->table_pages)
+			continue;
+		for (j = 0; j < inode_map->table_chunks; j++)
+			kfree(inode_map->table_pages[j]);
+		kfree(inode_map->table_pages);
+		inode_map->table_pages = NULL;
+		inode_map->table_pages_num = 0;
+	}
+}
+
+static inline u64 nova_lookup_inode_table_page(struct inode_map *inode_map,
+	unsigned int n)
+{
+	if (n >= READ_ONCE(inode_map->table_pages_num))
+		return 0;
+
+	smp_rmb();
+	return inode_map->table_pages[n >> INODE_INDEX_CHUNK_BITS]
+				[n & INODE_INDEX_CHUNK_MASK];
+}
+
+/* Must hold table_index_mutex; @n is the next unrecorded superpage */
+static int nova_record_inode_table_page(struct inode_map *inode_map,
+	unsigned int n, u64 curr)
+{
+	u64 **chunk = &inode_map->table_pages[n >> INODE_INDEX_CHUNK_BITS];
+
+	if ((n >> INODE_INDEX_CHUNK_BITS) >= inode_map->table_chunks)
+		return -ENOSPC;
+
+	if (*chunk == NULL) {
+		*chunk = kzalloc(INODE_INDEX_CHUNK_SIZE * sizeof(u64),
+							GFP_KERNEL);
+		if (*chunk == NULL)
+			return -ENOMEM;
+	}
+
+	(*chunk)[n & INODE_INDEX_CHUNK_MASK] = curr;
+	smp_wmb();
+	WRITE_ONCE(inode_map->table_pages_num, n + 1);
+
+	return 0;
+}
+
+/*
+ * Walk the superpage chain of @cpuid from the last indexed superpage up to
+ * superpage @target, recording each one, and extending the chain if
+ * allowed. Returns the NVMM offset of superpage @target in @page.
+ */
+static int nova_index_inode_table(struct super_block *sb, int cpuid,
+	unsigned int target, int extendable, u64 *page)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map = &sbi->inode_maps[cpuid];
 	struct inode_table *inode_table;
-	unsigned int data_bits;
-	unsigned int num_inodes_bits;
-	u64 curr;
-	unsigned int superpage_count;
-	u64 internal_ino;
-	int cpuid;
-	unsigned int index;
-	unsigned int i = 0;
+	struct nova_inode *pi;
 	unsigned long blocknr;
 	unsigned long curr_addr;
+	unsigned int n;
 	int allocated;
+	u64 curr;
+	int ret = 0;
 
 	pi = nova_get_inode_by_ino(sb, NOVA_INODETABLE_INO);
-	data_bits = blk_type_to_shift[pi->i_blk_type];
-	num_inodes_bits = data_bits - NOVA_INODE_BITS;
-
-	cpuid = ino % sbi->cpus;
-	internal_ino = ino / sbi->cpus;
-
 	inode_table = nova_get_inode_table(sb, cpuid);
-	superpage_count = internal_ino >> num_inodes_bits;
-	index = internal_ino & ((1 << num_inodes_bits) - 1);
 
-	curr = inode_table->log_head;
-	if (curr == 0)
-		return -EINVAL;
+	mutex_lock(&inode_map->table_index_mutex);
+	n = inode_map->table_pages_num;
+	if (n == 0) {
+		curr = inode_table->log_head;
+		if (curr == 0) {
+			ret = -EINVAL;
+			goto out;
+		}
 
-	for (i = 0; i < superpage_count; i++) {
-		if (curr == 0)
-			return -EINVAL;
+		ret = nova_record_inode_table_page(inode_map, 0, curr);
+		if (ret)
+			goto out;
+		n = 1;
+	} else {
+		curr = nova_lookup_inode_table_page(inode_map, n - 1);
+	}
 
+	for (; n <= target; n++) {
 		curr_addr = (unsigned long)nova_get_block(sb, curr);
 		/* Next page pointer in the last 8 bytes of the superpage */
 		curr_addr += 2097152 - 8;
 		curr = *(u64 *)(curr_addr);
 
 		if (curr == 0) {
-			if (extendable == 0)
-				return -EINVAL;
+			if (extendable == 0) {
+				ret = -EINVAL;
+				goto out;
+			}
 
 			allocated = nova_new_log_blocks(sb, pi, &blocknr,
-							1, 1);
+							1, 1, cpuid);
 
-			if (allocated != 1)
-				return allocated;
+			if (allocated != 1) {
+				ret = allocated;
+				goto out;
+			}
 
 			curr = nova_get_block_off(sb, blocknr,
 						NOVA_BLOCK_TYPE_2M);
@@ -162,6 +260,60 @@ int nova_get_inode_address(struct super_block *sb, u64 ino,
 			nova_flush_buffer((void *)curr_addr,
 						NOVA_INODE_SIZE, 1);
 		}
+
+		ret = nova_record_inode_table_page(inode_map, n, curr);
+		if (ret)
+			goto out;
+	}
+
+	*page = curr;
+out:
+	mutex_unlock(&inode_map->table_index_mutex);
+	return ret;
+}
+
+/* Index every existing inode table superpage at mount */
+void nova_build_inode_table_index(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	u64 page;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++)
+		nova_index_inode_table(sb, i, UINT_MAX, 0, &page);
+}
+
+int nova_get_inode_address(struct super_block *sb, u64 ino,
+	u64 *pi_addr, int extendable)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi;
+	unsigned int data_bits;
+	unsigned int num_inodes_bits;
+	u64 curr;
+	unsigned int superpage_count;
+	u64 internal_ino;
+	int cpuid;
+	unsigned int index;
+	int ret;
+
+	pi = nova_get_inode_by_ino(sb, NOVA_INODETABLE_INO);
+	data_bits = blk_type_to_shift[pi->i_blk_type];
+	num_inodes_bits = data_bits - NOVA_INODE_BITS;
+
+	cpuid = ino % sbi->cpus;
+	internal_ino = ino / sbi->cpus;
+
+	superpage_count = internal_ino >> num_inodes_bits;
+	index = internal_ino & ((1 << num_inodes_bits) - 1);
+
+	curr = nova_lookup_inode_table_page(&sbi->inode_maps[cpuid],
+						superpage_count);
+	if (curr == 0) {
+		ret = nova_index_inode_table(sb, cpuid, superpage_count,
+						extendable, &curr);
+		if (ret)
+			return ret;
 	}
 
 	*pi_addr = curr + index * NOVA_INODE_SIZE;
@@ -169,13 +321,29 @@ int nova_get_inode_address(struct super_block *sb, u64 ino,
 	return 0;
 }
 
-static inline int nova_free_contiguous_data_blocks(struct super_block *sb,
-	struct nova_inode_info_header *sih, struct nova_inode *pi,
-	struct nova_file_write_entry *entry, unsigned long pgoff,
-	unsigned long num_pages, unsigned long *start_blocknr,
-	unsigned long *num_free)
+/*
+ * Blocks unmapped by nova_punch_extents(), in contiguous runs. They are
+ * only freed by nova_release_punched(), once the caller has committed
+ * the new mapping.
+ */
+struct nova_free_run {
+	unsigned long	blocknr;
+	unsigned long	num;
+};
+
+struct nova_punched {
+	struct nova_free_run *runs;
+	int		num_runs;
+	int		max_runs;
+};
+
+/* Invalidate the pages in @entry and queue their blocks in @punched */
+static void nova_punch_data_blocks(struct super_block *sb,
+	struct nova_inode_info_header *sih, struct nova_file_write_entry *entry,
+	unsigned long pgoff, unsigned long num_pages,
+	struct nova_punched *punched)
 {
-	int freed = 0;
+	struct nova_free_run *run;
 	unsigned long nvmm;
 
 	if (entry->num_pages < entry->invalid_pages + num_pages) {
@@ -184,32 +352,46 @@ static inline int nova_free_contiguous_data_blocks(struct super_block *sb,
 				__func__, sih->ino, entry->pgoff,
 				entry->num_pages, entry->invalid_pages,
 				num_pages, pgoff);
-		return freed;
+		return;
 	}
 
 	entry->invalid_pages += num_pages;
 	nvmm = get_nvmm(sb, sih, entry, pgoff);
 
-	if (*start_blocknr == 0) {
-		*start_blocknr = nvmm;
-		*num_free = num_pages;
-	} else {
-		if (nvmm == *start_blocknr + *num_free) {
-			(*num_free) += num_pages;
-		} else {
-			/* A new start */
-			nova_free_data_blocks(sb, pi, *start_blocknr,
-						*num_free);
-			freed = *num_free;
-			*start_blocknr = nvmm;
-			*num_free = num_pages;
-		}
+	run = punched->num_runs ? &punched->runs[punched->num_runs - 1] : NULL;
+	if (run && nvmm == run->blocknr + run->num) {
+		run->num += num_pages;
+		return;
 	}
 
+	/* One run per extent at most, see nova_punch_extents() */
+	if (WARN_ON(punched->num_runs == punched->max_runs))
+		return;
+	run = &punched->runs[punched->num_runs++];
+	run->blocknr = nvmm;
+	run->num = num_pages;
+}
+
+/* Free the blocks queued by nova_punch_extents(), returning how many */
+static int nova_release_punched(struct super_block *sb, struct nova_inode *pi,
+	struct nova_punched *punched)
+{
+	int freed = 0;
+	int i;
+
+	for (i = 0; i < punched->num_runs; i++) {
+		nova_defer_free_data_blocks(sb, pi, punched->runs[i].blocknr,
+					punched->runs[i].num);
+		freed += punched->runs[i].num;
+	}
+
+	kfree(punched->runs);
+	punched->runs = NULL;
+	punched->num_runs = 0;
 	return freed;
 }
 
-static int nova_free_contiguous_log_blocks(struct super_block *sb,
+int nova_free_contiguous_log_blocks(struct super_block *sb,
 	struct nova_inode *pi, u64 head)
 {
 	struct nova_inode_log_page *curr_page;
@@ -257,117 +439,337 @@ static int nova_free_contiguous_log_blocks(struct super_block *sb,
 	return freed;
 }
 
-static int nova_delete_cache_tree(struct super_block *sb,
-	struct nova_inode *pi, struct nova_inode_info_header *sih,
-	unsigned long start_blocknr, unsigned long last_blocknr)
-{
-	unsigned long addr;
-	unsigned long i;
-	int deleted = 0;
-	void *ret;
-
-	nova_dbgv("%s: inode %lu, mmap pages %lu, start %lu, last %lu\n",
-			__func__, sih->ino, sih->mmap_pages,
-			start_blocknr, last_blocknr);
-
-	for (i = start_blocknr; i <= last_blocknr; i++) {
-		addr = (unsigned long)radix_tree_lookup(&sih->cache_tree, i);
-		if (addr) {
-			ret = radix_tree_delete(&sih->cache_tree, i);
-			nova_free_data_blocks(sb, pi, addr >> PAGE_SHIFT, 1);
-			sih->mmap_pages--;
-			deleted++;
+/* ========================= File extent tree ============================= */
+
+/*
+ * Each file keeps a DRAM rbtree of extents. An extent maps a contiguous
+ * range of file pages [pgoff_low, pgoff_high] to the write entry that holds
+ * the latest data of those pages, so the tree size is proportional to the
+ * fragmentation of the file rather than its size.
+ * Writers are serialized by i_mutex; extent_sem protects lockless readers.
+ */
+static inline struct nova_extent_node *nova_rb_extent(struct rb_node *node)
+{
+	return node ? container_of(node, struct nova_extent_node, node) : NULL;
+}
+
+/*
+ * Return the extent containing pgoff. If there is no such extent and next is
+ * set, return the first extent after pgoff.
+ */
+static struct nova_extent_node *nova_search_extent(
+	struct nova_inode_info_header *sih, unsigned long pgoff, int next)
+{
+	struct nova_extent_node *curr, *found = NULL;
+	struct rb_node *temp;
+
+	temp = sih->extent_tree.rb_node;
+	while (temp) {
+		curr = container_of(temp, struct nova_extent_node, node);
+		if (pgoff < curr->pgoff_low) {
+			if (next)
+				found = curr;
+			temp = temp->rb_left;
+		} else if (pgoff > curr->pgoff_high) {
+			temp = temp->rb_right;
+		} else {
+			return curr;
 		}
 	}
 
-	nova_dbgv("%s: inode %lu, deleted mmap pages %d\n",
-			__func__, sih->ino, deleted);
+	return found;
+}
 
-	if (sih->mmap_pages == 0) {
-		sih->low_dirty = ULONG_MAX;
-		sih->high_dirty = 0;
+static int nova_insert_extent_node(struct nova_inode_info_header *sih,
+	struct nova_extent_node *new_node)
+{
+	struct nova_extent_node *curr;
+	struct rb_node **temp, *parent = NULL;
+
+	temp = &(sih->extent_tree.rb_node);
+	while (*temp) {
+		curr = container_of(*temp, struct nova_extent_node, node);
+		parent = *temp;
+
+		if (new_node->pgoff_high < curr->pgoff_low) {
+			temp = &((*temp)->rb_left);
+		} else if (new_node->pgoff_low > curr->pgoff_high) {
+			temp = &((*temp)->rb_right);
+		} else {
+			nova_dbg("%s: inode %lu, extent %lu - %lu overlaps "
+				"with %lu - %lu\n", __func__, sih->ino,
+				new_node->pgoff_low, new_node->pgoff_high,
+				curr->pgoff_low, curr->pgoff_high);
+			return -EINVAL;
+		}
 	}
 
+	rb_link_node(&new_node->node, parent, temp);
+	rb_insert_color(&new_node->node, &sih->extent_tree);
+	sih->num_extents++;
+
 	return 0;
 }
 
-static int nova_zero_cache_tree(struct super_block *sb,
-	struct nova_inode *pi, struct nova_inode_info_header *sih,
-	unsigned long start_blocknr)
+static void nova_erase_extent_node(struct nova_inode_info_header *sih,
+	struct nova_extent_node *curr)
 {
-	unsigned long block;
-	unsigned long i;
-	void *addr;
+	rb_erase(&curr->node, &sih->extent_tree);
+	sih->num_extents--;
+	nova_free_extent_node(curr);
+}
 
-	nova_dbgv("%s: inode %lu, mmap pages %lu, start %lu, last %lu, "
-			"size %lu", __func__, sih->ino, sih->mmap_pages,
-			start_blocknr, sih->high_dirty, sih->i_size);
+/* Returns the entry mapping pgoff, and the number of pages it maps from pgoff */
+struct nova_file_write_entry *nova_find_extent(
+	struct nova_inode_info_header *sih, unsigned long pgoff,
+	unsigned long *num_pages)
+{
+	struct nova_file_write_entry *entry = NULL;
+	struct nova_extent_node *curr;
 
-	for (i = start_blocknr; i <= sih->high_dirty; i++) {
-		block = (unsigned long)radix_tree_lookup(&sih->cache_tree, i);
-		if (block) {
-			addr = nova_get_block(sb, block);
-			memset(addr, 0, PAGE_SIZE);
+	down_read(&sih->extent_sem);
+	curr = nova_search_extent(sih, pgoff, 0);
+	if (curr) {
+		entry = curr->entry;
+		if (num_pages)
+			*num_pages = curr->pgoff_high - pgoff + 1;
+	}
+	up_read(&sih->extent_sem);
+
+	return entry;
+}
+
+/* Find the first mapped range at or after pgoff */
+struct nova_file_write_entry *nova_find_next_extent(
+	struct nova_inode_info_header *sih, unsigned long pgoff,
+	unsigned long *start_pgoff, unsigned long *num_pages)
+{
+	struct nova_file_write_entry *entry = NULL;
+	struct nova_extent_node *curr;
+	unsigned long start;
+
+	down_read(&sih->extent_sem);
+	curr = nova_search_extent(sih, pgoff, 1);
+	if (curr) {
+		entry = curr->entry;
+		start = curr->pgoff_low > pgoff ? curr->pgoff_low : pgoff;
+		if (start_pgoff)
+			*start_pgoff = start;
+		if (num_pages)
+			*num_pages = curr->pgoff_high - start + 1;
+	}
+	up_read(&sih->extent_sem);
+
+	return entry;
+}
+
+/*
+ * Split [pgoff, last] into up to @max runs for a read, in one walk over the
+ * extent tree. Neighbouring extents whose blocks are also neighbours in
+ * NVMM merge into one run, and so do holes and unwritten extents, which
+ * read as zeros. Returns the number of runs, which stop short of @last if
+ * @max is reached, or -EINVAL on an extent that lost its entry.
+ */
+int nova_find_read_runs(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long pgoff,
+	unsigned long last, struct nova_read_run *runs, int max)
+{
+	struct nova_file_write_entry *entry;
+	struct nova_extent_node *curr;
+	struct nova_read_run *run = NULL;
+	unsigned long end, nvmm;
+	int n = 0;
+
+	down_read(&sih->extent_sem);
+	curr = nova_search_extent(sih, pgoff, 1);
+	while (pgoff <= last) {
+		if (!curr || curr->pgoff_low > pgoff) {
+			end = curr ? min(curr->pgoff_low - 1, last) : last;
+			nvmm = 0;
+		} else {
+			entry = curr->entry;
+			if (pgoff < entry->pgoff || pgoff - entry->pgoff >=
+					entry->num_pages) {
+				nova_err(sb, "%s ERROR: %lu, entry pgoff %llu, "
+					"num %u\n", __func__, pgoff,
+					entry->pgoff, entry->num_pages);
+				n = -EINVAL;
+				break;
+			}
+			end = min(curr->pgoff_high, last);
+			nvmm = nova_entry_unwritten(entry) ? 0 :
+					get_nvmm(sb, sih, entry, pgoff);
+			curr = nova_rb_extent(rb_next(&curr->node));
+		}
+
+		/* A run is copied linearly from one device mapping */
+		if (run && (nvmm ? run->nvmm &&
+				run->nvmm + run->num_pages == nvmm &&
+				nova_same_device(NOVA_SB(sb),
+					(u64)run->nvmm << PAGE_SHIFT,
+					(u64)nvmm << PAGE_SHIFT) :
+				!run->nvmm)) {
+			run->num_pages += end - pgoff + 1;
+		} else {
+			if (n == max)
+				break;
+			run = &runs[n++];
+			run->pgoff = pgoff;
+			run->num_pages = end - pgoff + 1;
+			run->nvmm = nvmm;
 		}
+		pgoff = end + 1;
+	}
+	up_read(&sih->extent_sem);
+
+	return n;
+}
+
+/* Find the last page mapped by the extent tree */
+bool nova_find_last_extent(struct nova_inode_info_header *sih,
+	unsigned long *last_pgoff)
+{
+	struct nova_extent_node *curr;
+
+	down_read(&sih->extent_sem);
+	curr = nova_rb_extent(rb_last(&sih->extent_tree));
+	if (curr)
+		*last_pgoff = curr->pgoff_high;
+	up_read(&sih->extent_sem);
+
+	return curr != NULL;
+}
+
+/*
+ * Unmap [start, last] from the extent tree, splitting the extents on the
+ * boundaries. If @punched is set, the unmapped pages are invalidated in
+ * their write entries and their blocks queued in @punched, to be freed
+ * with nova_release_punched() once the caller's new mapping is in place.
+ * Blocks that new_entry maps at the same pages, i.e. preallocated blocks
+ * being written, are only invalidated.
+ *
+ * Everything that can fail is allocated first, so the tree is either left
+ * alone or the whole range is unmapped. Caller holds extent_sem for write.
+ */
+static int nova_punch_extents(struct super_block *sb, struct nova_inode *pi,
+	struct nova_inode_info_header *sih, unsigned long start,
+	unsigned long last, struct nova_file_write_entry *new_entry,
+	struct nova_punched *punched)
+{
+	struct nova_extent_node *curr, *next, *split = NULL;
+	unsigned long low, high;
+	int count = 0;
+
+	curr = nova_search_extent(sih, start, 1);
+	if (!curr || curr->pgoff_low > last)
+		return 0;
+
+	/* Only an extent covering both sides of the range splits in two */
+	if (curr->pgoff_low < start && curr->pgoff_high > last) {
+		split = nova_alloc_extent_node(sb);
+		if (!split)
+			return -ENOMEM;
+	}
+
+	if (punched) {
+		for (next = curr; next && next->pgoff_low <= last;
+				next = nova_rb_extent(rb_next(&next->node)))
+			count++;
+		punched->runs = kmalloc_array(count,
+				sizeof(struct nova_free_run), GFP_NOFS);
+		if (!punched->runs) {
+			if (split)
+				nova_free_extent_node(split);
+			return -ENOMEM;
+		}
+		punched->num_runs = 0;
+		punched->max_runs = count;
+	}
+
+	while (curr && curr->pgoff_low <= last) {
+		low = curr->pgoff_low > start ? curr->pgoff_low : start;
+		high = curr->pgoff_high < last ? curr->pgoff_high : last;
+		next = nova_rb_extent(rb_next(&curr->node));
+
+		if (punched && new_entry && get_nvmm(sb, sih, curr->entry,
+				low) == get_nvmm(sb, sih, new_entry, low))
+			curr->entry->invalid_pages += high - low + 1;
+		else if (punched)
+			nova_punch_data_blocks(sb, sih, curr->entry, low,
+					high - low + 1, punched);
+
+		if (curr->pgoff_low < low && curr->pgoff_high > high) {
+			/* Punch a hole in the middle of the extent */
+			split->pgoff_low = high + 1;
+			split->pgoff_high = curr->pgoff_high;
+			split->entry = curr->entry;
+			curr->pgoff_high = low - 1;
+			nova_insert_extent_node(sih, split);
+			split = NULL;
+		} else if (curr->pgoff_low < low) {
+			curr->pgoff_high = low - 1;
+		} else if (curr->pgoff_high > high) {
+			curr->pgoff_low = high + 1;
+		} else {
+			nova_erase_extent_node(sih, curr);
+		}
+
+		curr = next;
 	}
 
 	return 0;
 }
 
+/* Merge the extent with its neighbours if they map the same entry */
+static void nova_merge_extent(struct nova_inode_info_header *sih,
+	struct nova_extent_node *curr)
+{
+	struct nova_extent_node *prev, *next;
+
+	prev = nova_rb_extent(rb_prev(&curr->node));
+	if (prev && prev->entry == curr->entry &&
+			prev->pgoff_high + 1 == curr->pgoff_low) {
+		curr->pgoff_low = prev->pgoff_low;
+		nova_erase_extent_node(sih, prev);
+	}
+
+	next = nova_rb_extent(rb_next(&curr->node));
+	if (next && next->entry == curr->entry &&
+			curr->pgoff_high + 1 == next->pgoff_low) {
+		curr->pgoff_high = next->pgoff_high;
+		nova_erase_extent_node(sih, next);
+	}
+}
 
 int nova_delete_file_tree(struct super_block *sb,
 	struct nova_inode_info_header *sih, unsigned long start_blocknr,
-	unsigned long last_blocknr, bool delete_nvmm, bool delete_mmap)
+	unsigned long last_blocknr, bool delete_nvmm)
 {
-	struct nova_file_write_entry *entry;
+	struct nova_punched punched = { NULL, 0, 0 };
 	struct nova_inode *pi;
-	unsigned long free_blocknr = 0, num_free = 0;
-	unsigned long pgoff = start_blocknr;
 	timing_t delete_time;
 	int freed = 0;
-	void *ret;
+	int ret;
 
 	pi = (struct nova_inode *)nova_get_block(sb, sih->pi_addr);
 
 	NOVA_START_TIMING(delete_file_tree_t, delete_time);
 
-	if (delete_mmap && sih->mmap_pages)
-		nova_delete_cache_tree(sb, pi, sih, start_blocknr,
-						last_blocknr);
-
-	if (sih->mmap_pages && start_blocknr <= sih->high_dirty)
-		nova_zero_cache_tree(sb, pi, sih, start_blocknr);
-
-	pgoff = start_blocknr;
-	while (pgoff <= last_blocknr) {
-		entry = radix_tree_lookup(&sih->tree, pgoff);
-		if (entry) {
-			ret = radix_tree_delete(&sih->tree, pgoff);
-			BUG_ON(!ret || ret != entry);
-			if (delete_nvmm)
-				freed += nova_free_contiguous_data_blocks(sb,
-						sih, pi, entry, pgoff, 1,
-						&free_blocknr, &num_free);
-			pgoff++;
-		} else {
-			/* We are finding a hole. Jump to the next entry. */
-			entry = nova_find_next_entry(sb, sih, pgoff);
-			if (!entry)
-				break;
-			pgoff++;
-			pgoff = pgoff > entry->pgoff ? pgoff : entry->pgoff;
-		}
-	}
-
-	if (free_blocknr) {
-		nova_free_data_blocks(sb, pi, free_blocknr, num_free);
-		freed += num_free;
-	}
+	down_write(&sih->extent_sem);
+	ret = nova_punch_extents(sb, pi, sih, start_blocknr, last_blocknr,
+					NULL, delete_nvmm ? &punched : NULL);
+	if (ret == 0 && delete_nvmm)
+		freed = nova_release_punched(sb, pi, &punched);
+	up_write(&sih->extent_sem);
+	if (ret)
+		nova_err(sb, "%s: inode %lu, punch %lu - %lu failed %d\n",
+				__func__, sih->ino, start_blocknr,
+				last_blocknr, ret);
 
 	NOVA_END_TIMING(delete_file_tree_t, delete_time);
-	nova_dbgv("Inode %llu: delete file tree from pgoff %lu to %lu, "
+	nova_dbgv("Inode %lu: delete file tree from pgoff %lu to %lu, "
 			"%d blocks freed\n",
-			pi->nova_ino, start_blocknr, last_blocknr, freed);
+			sih->ino, start_blocknr, last_blocknr, freed);
 
 	return freed;
 }
@@ -384,7 +786,7 @@ static int nova_free_dram_resource(struct super_block *sb,
 	if (S_ISREG(sih->i_mode)) {
 		last_blocknr = nova_get_last_blocknr(sb, sih);
 		freed = nova_delete_file_tree(sb, sih, 0,
-						last_blocknr, false, true);
+						last_blocknr, false);
 	} else {
 		nova_delete_dir_tree(sb, sih);
 		freed = 1;
@@ -422,7 +824,7 @@ static void nova_truncate_file_blocks(struct inode *inode, loff_t start,
 		return;
 
 	freed = nova_delete_file_tree(sb, sih, first_blocknr,
-						last_blocknr, 1, 0);
+						last_blocknr, 1);
 
 	inode->i_blocks -= (freed * (1 << (data_bits -
 				sb->s_blocksize_bits)));
@@ -434,22 +836,7 @@ static void nova_truncate_file_blocks(struct inode *inode, loff_t start,
 	return;
 }
 
-struct nova_file_write_entry *nova_find_next_entry(struct super_block *sb,
-	struct nova_inode_info_header *sih, pgoff_t pgoff)
-{
-	struct nova_file_write_entry *entry = NULL;
-	struct nova_file_write_entry *entries[1];
-	int nr_entries;
-
-	nr_entries = radix_tree_gang_lookup(&sih->tree,
-					(void **)entries, pgoff, 1);
-	if (nr_entries == 1)
-		entry = entries[0];
-
-	return entry;
-}
-
-/* search the radix tree to find hole or data
+/* search the extent tree to find hole or data
  * in the specified range
  * Input:
  * first_blocknr: first block in the specified range
@@ -466,28 +853,27 @@ static int nova_lookup_hole_in_range(struct super_block *sb,
 	struct nova_file_write_entry *entry;
 	unsigned long blocks = 0;
 	unsigned long pgoff, old_pgoff;
+	unsigned long next_pgoff, num_pages;
 
 	pgoff = first_blocknr;
 	while (pgoff <= last_blocknr) {
 		old_pgoff = pgoff;
-		entry = radix_tree_lookup(&sih->tree, pgoff);
+		entry = nova_find_extent(sih, pgoff, &num_pages);
 		if (entry) {
 			*data_found = 1;
 			if (!hole)
 				goto done;
-			pgoff++;
+			pgoff += num_pages;
 		} else {
 			*hole_found = 1;
-			entry = nova_find_next_entry(sb, sih, pgoff);
-			pgoff++;
-			if (entry) {
-				pgoff = pgoff > entry->pgoff ?
-					pgoff : entry->pgoff;
-				if (pgoff > last_blocknr)
-					pgoff = last_blocknr + 1;
-			}
+			entry = nova_find_next_extent(sih, pgoff,
+						&next_pgoff, &num_pages);
+			pgoff = entry ? next_pgoff : last_blocknr + 1;
 		}
 
+		if (pgoff > last_blocknr)
+			pgoff = last_blocknr + 1;
+
 		if (!*hole_found || !hole)
 			blocks += pgoff - old_pgoff;
 	}
@@ -495,45 +881,72 @@ done:
 	return blocks;
 }
 
+/*
+ * Map the pages of a write entry in the extent tree, or unmap them for a
+ * hole entry. If free is set, the overwritten blocks are invalidated and
+ * freed.
+ */
 int nova_assign_write_entry(struct super_block *sb,
 	struct nova_inode *pi,
 	struct nova_inode_info_header *sih,
 	struct nova_file_write_entry *entry,
 	bool free)
 {
-	struct nova_file_write_entry *old_entry;
-	void **pentry;
-	unsigned long old_nvmm;
+	struct nova_punched punched = { NULL, 0, 0 };
+	struct nova_extent_node *new_node;
 	unsigned long start_pgoff = entry->pgoff;
 	unsigned int num = entry->num_pages;
-	unsigned long curr_pgoff;
-	int i;
 	int ret;
 	timing_t assign_time;
 
+	if (num == 0)
+		return 0;
+
 	NOVA_START_TIMING(assign_t, assign_time);
-	for (i = 0; i < num; i++) {
-		curr_pgoff = start_pgoff + i;
-
-		pentry = radix_tree_lookup_slot(&sih->tree, curr_pgoff);
-		if (pentry) {
-			old_entry = radix_tree_deref_slot(pentry);
-			old_nvmm = get_nvmm(sb, sih, old_entry, curr_pgoff);
-			if (free) {
-				old_entry->invalid_pages++;
-				nova_free_data_blocks(sb, pi, old_nvmm, 1);
-				pi->i_blocks--;
-			}
-			radix_tree_replace_slot(pentry, entry);
-		} else {
-			ret = radix_tree_insert(&sih->tree, curr_pgoff, entry);
-			if (ret) {
-				nova_dbg("%s: ERROR %d\n", __func__, ret);
-				goto out;
-			}
-		}
+	if (nova_entry_hole(entry)) {
+		down_write(&sih->extent_sem);
+		ret = nova_punch_extents(sb, pi, sih, start_pgoff,
+				start_pgoff + num - 1, NULL,
+				free ? &punched : NULL);
+		if (ret == 0 && free)
+			pi->i_blocks -= nova_release_punched(sb, pi, &punched);
+		up_write(&sih->extent_sem);
+		goto out;
+	}
+
+	new_node = nova_alloc_extent_node(sb);
+	if (!new_node) {
+		ret = -ENOMEM;
+		goto out;
 	}
 
+	new_node->pgoff_low = start_pgoff;
+	new_node->pgoff_high = start_pgoff + num - 1;
+	new_node->entry = entry;
+
+	down_write(&sih->extent_sem);
+	ret = nova_punch_extents(sb, pi, sih, new_node->pgoff_low,
+				new_node->pgoff_high, entry,
+				free ? &punched : NULL);
+	if (ret == 0) {
+		ret = nova_insert_extent_node(sih, new_node);
+		/* Never free blocks the tree may still reach */
+		if (free && ret == 0)
+			pi->i_blocks -= nova_release_punched(sb, pi, &punched);
+		else if (free)
+			kfree(punched.runs);
+	}
+
+	if (ret) {
+		up_write(&sih->extent_sem);
+		nova_dbg("%s: ERROR %d\n", __func__, ret);
+		nova_free_extent_node(new_node);
+		goto out;
+	}
+
+	nova_merge_extent(sih, new_node);
+	up_write(&sih->extent_sem);
+
 out:
 	NOVA_END_TIMING(assign_t, assign_time);
 
@@ -689,12 +1102,13 @@ static int nova_alloc_unused_inode(struct super_block *sb, int cpuid,
 	*ino = new_ino * sbi->cpus + cpuid;
 	sbi->s_inodes_used_count++;
 	inode_map->allocated++;
+	nova_ckpt_record_inode(sb, NOVA_DELTA_INODE_ALLOC, *ino);
 
 	nova_dbg_verbose("Alloc ino %lu\n", *ino);
 	return 0;
 }
 
-static int nova_free_inuse_inode(struct super_block *sb, unsigned long ino)
+int nova_free_inuse_inode(struct super_block *sb, unsigned long ino)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct inode_map *inode_map;
@@ -763,6 +1177,7 @@ err:
 block_found:
 	sbi->s_inodes_used_count--;
 	inode_map->freed++;
+	nova_ckpt_record_inode(sb, NOVA_DELTA_INODE_FREE, ino);
 	mutex_unlock(&inode_map->inode_table_mutex);
 	return ret;
 }
@@ -910,18 +1325,24 @@ void nova_evict_inode(struct inode *inode)
 
 	NOVA_START_TIMING(evict_inode_t, evict_time);
 	nova_dbg_verbose("%s: %lu\n", __func__, inode->i_ino);
+	nova_dequeue_log_gc(sb, sih);
 	if (!inode->i_nlink && !is_bad_inode(inode)) {
 		if (IS_APPEND(inode) || IS_IMMUTABLE(inode))
 			goto out;
 
 		destroy = 1;
+		/*
+		 * The unlink may still be in an open group transaction;
+		 * commit it before the inode and its blocks can be reused.
+		 */
+		nova_flush_lite_journals(sb);
 		/* We need the log to free the blocks from the b-tree */
 		switch (inode->i_mode & S_IFMT) {
 		case S_IFREG:
 			last_blocknr = nova_get_last_blocknr(sb, sih);
 			nova_dbgv("%s: file ino %lu\n", __func__, inode->i_ino);
 			freed = nova_delete_file_tree(sb, sih, 0,
-						last_blocknr, true, true);
+						last_blocknr, true);
 			break;
 		case S_IFDIR:
 			nova_dbgv("%s: dir ino %lu\n", __func__, inode->i_ino);
@@ -932,7 +1353,7 @@ void nova_evict_inode(struct inode *inode)
 			nova_dbgv("%s: symlink ino %lu\n",
 					__func__, inode->i_ino);
 			freed = nova_delete_file_tree(sb, sih, 0, 0,
-							true, true);
+							true);
 			break;
 		default:
 			nova_dbgv("%s: special ino %lu\n",
@@ -965,6 +1386,35 @@ out:
 	NOVA_END_TIMING(evict_inode_t, evict_time);
 }
 
+/*
+ * Round-robin over the inode maps whose inode table lives on the local
+ * NUMA node, so the new inode is written to near memory. Falls back to
+ * plain round-robin when no table is local.
+ */
+static int nova_pick_inode_map(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list *free_list;
+	int nid = numa_node_id();
+	int map_id;
+	int i;
+
+	map_id = sbi->map_id;
+	for (i = 0; i < sbi->cpus; i++) {
+		free_list = nova_get_free_list(sb,
+				nova_home_free_list(sb, map_id));
+		if (free_list->nid == nid)
+			break;
+		map_id = (map_id + 1) % sbi->cpus;
+	}
+
+	if (i == sbi->cpus)
+		map_id = sbi->map_id;
+
+	sbi->map_id = (map_id + 1) % sbi->cpus;
+	return map_id;
+}
+
 /* Returns 0 on failure */
 u64 nova_new_nova_inode(struct super_block *sb, u64 *pi_addr)
 {
@@ -977,8 +1427,7 @@ u64 nova_new_nova_inode(struct super_block *sb, u64 *pi_addr)
 	timing_t new_inode_time;
 
 	NOVA_START_TIMING(new_nova_inode_t, new_inode_time);
-	map_id = sbi->map_id;
-	sbi->map_id = (sbi->map_id + 1) % sbi->cpus;
+	map_id = nova_pick_inode_map(sb);
 
 	inode_map = &sbi->inode_maps[map_id];
 
@@ -1148,7 +1597,6 @@ static void nova_clear_last_page_tail(struct super_block *sb,
 	struct inode *inode, loff_t newsize)
 {
 	struct nova_inode_info *si = NOVA_I(inode);
-	struct nova_inode_info_header *sih = &si->header;
 	unsigned long offset = newsize & (sb->s_blocksize - 1);
 	unsigned long pgoff, length;
 	u64 nvmm;
@@ -1160,6 +1608,13 @@ static void nova_clear_last_page_tail(struct super_block *sb,
 	length = sb->s_blocksize - offset;
 	pgoff = newsize >> sb->s_blocksize_bits;
 
+	/* Never zero a block a clone still reads */
+	if (nova_unshare_block(sb, inode, pgoff, newsize)) {
+		nova_err(sb, "%s: inode %lu: cannot unshare block %lu\n",
+				__func__, inode->i_ino, pgoff);
+		return;
+	}
+
 	nvmm = nova_find_nvmm_block(sb, si, NULL, pgoff);
 	if (nvmm == 0)
 		return;
@@ -1167,17 +1622,6 @@ static void nova_clear_last_page_tail(struct super_block *sb,
 	nvmm_addr = (char *)nova_get_block(sb, nvmm);
 	memset(nvmm_addr + offset, 0, length);
 	nova_flush_buffer(nvmm_addr + offset, length, 0);
-
-	/* Clear mmap page */
-	if (sih->mmap_pages && pgoff <= sih->high_dirty &&
-			pgoff >= sih->low_dirty) {
-		nvmm = (unsigned long)radix_tree_lookup(&sih->cache_tree,
-							pgoff);
-		if (nvmm) {
-			nvmm_addr = nova_get_block(sb, nvmm);
-			memset(nvmm_addr + offset, 0, length);
-		}
-	}
 }
 
 static void nova_setsize(struct inode *inode, loff_t oldsize, loff_t newsize)
@@ -1203,6 +1647,10 @@ static void nova_setsize(struct inode *inode, loff_t oldsize, loff_t newsize)
 		sih->i_size = newsize;
 	}
 
+	/* Inline bytes past the new size must read as zeros if it grows */
+	if (newsize < sih->inline_len)
+		WRITE_ONCE(sih->inline_len, newsize);
+
 	/* FIXME: we should make sure that there is nobody reading the inode
 	 * before truncating it. Also we need to munmap the truncated range
 	 * from application address space, if mmapped. */
@@ -1253,6 +1701,109 @@ static void nova_update_setattr_entry(struct inode *inode,
 	nova_flush_buffer(entry, sizeof(struct nova_setattr_logentry), 0);
 }
 
+static inline u8 *nova_put_varint(u8 *p, u64 val)
+{
+	while (val >= 0x80) {
+		*p++ = (u8)val | 0x80;
+		val >>= 7;
+	}
+	*p++ = (u8)val;
+	return p;
+}
+
+static inline u8 *nova_get_varint(u8 *p, u64 *val)
+{
+	int shift = 0;
+	u64 v = 0;
+	u8 byte;
+
+	do {
+		byte = *p++;
+		v |= (u64)(byte & 0x7f) << shift;
+		shift += 7;
+	} while ((byte & 0x80) && shift < 64);
+
+	*val = v;
+	return p;
+}
+
+static inline u64 nova_zigzag(s64 val)
+{
+	return ((u64)val << 1) ^ (u64)(val >> 63);
+}
+
+static inline s64 nova_unzigzag(u64 val)
+{
+	return (s64)(val >> 1) ^ -(s64)(val & 1);
+}
+
+/* Encode the setattr snapshot of @inode into @buf, returning its length */
+static size_t nova_pack_setattr_entry(struct inode *inode,
+	struct iattr *attr, u8 *buf)
+{
+	struct nova_setattr_compact *entry = (struct nova_setattr_compact *)buf;
+	unsigned int attr_mask = ATTR_MODE | ATTR_UID | ATTR_GID | ATTR_SIZE |
+			ATTR_ATIME | ATTR_MTIME | ATTR_CTIME;
+	s64 ctime = (u32)inode->i_ctime.tv_sec;
+	loff_t size;
+	size_t len;
+	u8 *p;
+
+	size = (attr->ia_valid & ATTR_SIZE) ? attr->ia_size : inode->i_size;
+
+	memset(buf, 0, NOVA_SETATTR_COMPACT_MAX);
+	entry->entry_type = SET_ATTR_COMPACT;
+	entry->mode = cpu_to_le16(inode->i_mode);
+	entry->ctime = cpu_to_le32(ctime);
+	entry->attr = attr->ia_valid & attr_mask;
+
+	p = nova_put_varint(entry->data, i_uid_read(inode));
+	p = nova_put_varint(p, i_gid_read(inode));
+	p = nova_put_varint(p, size);
+	p = nova_put_varint(p, nova_zigzag(ctime -
+				(u32)inode->i_mtime.tv_sec));
+	p = nova_put_varint(p, nova_zigzag(ctime -
+				(u32)inode->i_atime.tv_sec));
+
+	len = round_up(p - buf, NOVA_ENTRY_ALIGN);
+	entry->length = len;
+	return len;
+}
+
+/*
+ * The setattr entry at @addr in the full layout: the entry itself, or a
+ * compact one decoded into @buf.
+ */
+struct nova_setattr_logentry *nova_read_setattr_entry(void *addr,
+	struct nova_setattr_logentry *buf)
+{
+	struct nova_setattr_compact *entry = addr;
+	u64 uid, gid, size, mdelta, adelta;
+	s64 ctime;
+	u8 *p;
+
+	if (entry->entry_type != SET_ATTR_COMPACT)
+		return addr;
+
+	p = nova_get_varint(entry->data, &uid);
+	p = nova_get_varint(p, &gid);
+	p = nova_get_varint(p, &size);
+	p = nova_get_varint(p, &mdelta);
+	nova_get_varint(p, &adelta);
+
+	ctime = le32_to_cpu(entry->ctime);
+	buf->entry_type = SET_ATTR;
+	buf->attr = entry->attr;
+	buf->mode = entry->mode;
+	buf->uid = cpu_to_le32(uid);
+	buf->gid = cpu_to_le32(gid);
+	buf->ctime = entry->ctime;
+	buf->mtime = cpu_to_le32(ctime - nova_unzigzag(mdelta));
+	buf->atime = cpu_to_le32(ctime - nova_unzigzag(adelta));
+	buf->size = cpu_to_le64(size);
+	return buf;
+}
+
 void nova_apply_setattr_entry(struct super_block *sb, struct nova_inode *pi,
 	struct nova_inode_info_header *sih,
 	struct nova_setattr_logentry *entry)
@@ -1272,6 +1823,9 @@ void nova_apply_setattr_entry(struct super_block *sb, struct nova_inode *pi,
 	pi->i_ctime	= entry->ctime;
 	pi->i_mtime	= entry->mtime;
 
+	if (sih->inline_len > le64_to_cpu(entry->size))
+		sih->inline_len = le64_to_cpu(entry->size);
+
 	if (pi->i_size > entry->size && S_ISREG(pi->i_mode)) {
 		start = entry->size;
 		end = pi->i_size;
@@ -1287,7 +1841,7 @@ void nova_apply_setattr_entry(struct super_block *sb, struct nova_inode *pi,
 			goto out;
 
 		freed = nova_delete_file_tree(sb, sih, first_blocknr,
-						last_blocknr, 0, 0);
+						last_blocknr, 0);
 	}
 out:
 	pi->i_size	= entry->size;
@@ -1303,6 +1857,7 @@ static u64 nova_append_setattr_entry(struct super_block *sb,
 	struct nova_inode_info *si = NOVA_I(inode);
 	struct nova_inode_info_header *sih = &si->header;
 	struct nova_setattr_logentry *entry;
+	u8 packed[NOVA_SETATTR_COMPACT_MAX];
 	u64 curr_p, new_tail = 0;
 	int extended = 0;
 	size_t size = sizeof(struct nova_setattr_logentry);
@@ -1312,13 +1867,24 @@ static u64 nova_append_setattr_entry(struct super_block *sb,
 	nova_dbg_verbose("%s: inode %lu attr change\n",
 				__func__, inode->i_ino);
 
+	/* inode is already updated with attr */
+	if (test_opt(sb, COMPACT_LOG))
+		size = nova_pack_setattr_entry(inode, attr, packed);
+
 	curr_p = nova_get_append_head(sb, pi, sih, tail, size, &extended);
 	if (curr_p == 0)
 		BUG();
 
 	entry = (struct nova_setattr_logentry *)nova_get_block(sb, curr_p);
-	/* inode is already updated with attr */
-	nova_update_setattr_entry(inode, entry, attr);
+	if (test_opt(sb, COMPACT_LOG)) {
+		memcpy(entry, packed, size);
+		nova_flush_buffer(entry, size, 0);
+		NOVA_STATS_ADD(compact_entries, 1);
+		NOVA_STATS_ADD(compact_saved_bytes,
+			sizeof(struct nova_setattr_logentry) - size);
+	} else {
+		nova_update_setattr_entry(inode, entry, attr);
+	}
 	new_tail = curr_p + size;
 	sih->last_setattr = curr_p;
 
@@ -1369,7 +1935,7 @@ int nova_notify_change(struct dentry *dentry, struct iattr *attr)
 	/* Only after log entry is committed, we can truncate size */
 	if ((ia_valid & ATTR_SIZE) && (attr->ia_size != oldsize ||
 			pi->i_flags & cpu_to_le32(NOVA_EOFBLOCKS_FL))) {
-//		nova_set_blocksize_hint(sb, inode, pi, attr->ia_size);
+		nova_set_blocksize_hint(sb, inode, pi, attr->ia_size);
 
 		/* now we can freely truncate the inode */
 		nova_setsize(inode, oldsize, attr->ia_size);
@@ -1515,7 +2081,7 @@ int nova_allocate_inode_log_pages(struct super_block *sb,
 	int ret_pages = 0;
 
 	allocated = nova_new_log_blocks(sb, pi, &new_inode_blocknr,
-					num_pages, 0);
+					num_pages, 0, ANY_CPU);
 
 	if (allocated <= 0) {
 		nova_err(sb, "ERROR: no inode log page available: %d %d\n",
@@ -1534,8 +2100,8 @@ int nova_allocate_inode_log_pages(struct super_block *sb,
 
 	/* Allocate remaining pages */
 	while (num_pages) {
-		allocated = nova_new_log_blocks(sb, pi,
-					&new_inode_blocknr, num_pages, 0);
+		allocated = nova_new_log_blocks(sb, pi, &new_inode_blocknr,
+					num_pages, 0, ANY_CPU);
 
 		nova_dbg_verbose("Alloc %d log blocks @ 0x%lx\n",
 					allocated, new_inode_blocknr);
@@ -1563,6 +2129,8 @@ static bool curr_log_entry_invalid(struct super_block *sb,
 	u64 curr_p, size_t *length)
 {
 	struct nova_setattr_logentry *setattr_entry;
+	struct nova_setattr_logentry attr_buf;
+	struct nova_inline_data_entry *inline_entry;
 	struct nova_file_write_entry *entry;
 	struct nova_dentry *dentry;
 	void *addr;
@@ -1573,18 +2141,20 @@ static bool curr_log_entry_invalid(struct super_block *sb,
 	type = nova_get_entry_type(addr);
 	switch (type) {
 		case SET_ATTR:
+		case SET_ATTR_COMPACT:
 			if (sih->last_setattr == curr_p)
 				ret = false;
 			/* Do not invalidate setsize entries */
-			setattr_entry = (struct nova_setattr_logentry *)addr;
+			setattr_entry = nova_read_setattr_entry(addr, &attr_buf);
 			if (setattr_entry->attr & ATTR_SIZE)
 				ret = false;
-			*length = sizeof(struct nova_setattr_logentry);
+			*length = nova_setattr_entry_len(addr);
 			break;
 		case LINK_CHANGE:
+		case LINK_CHANGE_COMPACT:
 			if (sih->last_link_change == curr_p)
 				ret = false;
-			*length = sizeof(struct nova_link_change_entry);
+			*length = nova_link_change_entry_len(addr);
 			break;
 		case FILE_WRITE:
 			entry = (struct nova_file_write_entry *)addr;
@@ -1592,6 +2162,13 @@ static bool curr_log_entry_invalid(struct super_block *sb,
 				ret = false;
 			*length = sizeof(struct nova_file_write_entry);
 			break;
+		case FILE_INLINE:
+			if (sih->inline_entry == curr_p)
+				ret = false;
+			inline_entry = (struct nova_inline_data_entry *)addr;
+			*length = NOVA_INLINE_ENTRY_LEN(
+					le16_to_cpu(inline_entry->data_len));
+			break;
 		case DIR_LOG:
 			dentry = (struct nova_dentry *)addr;
 			if (dentry->ino && dentry->invalid == 0)
@@ -1672,48 +2249,23 @@ int nova_gc_assign_file_entry(struct super_block *sb,
 	struct nova_file_write_entry *old_entry,
 	struct nova_file_write_entry *new_entry)
 {
-	struct nova_file_write_entry *temp;
-	void **pentry;
-	unsigned long start_pgoff = old_entry->pgoff;
-	unsigned int num = old_entry->num_pages;
-	unsigned long curr_pgoff;
-	int i;
+	struct nova_extent_node *curr;
+	unsigned long last_pgoff;
 	int ret = 0;
 
-	for (i = 0; i < num; i++) {
-		curr_pgoff = start_pgoff + i;
-
-		pentry = radix_tree_lookup_slot(&sih->tree, curr_pgoff);
-		if (pentry) {
-			temp = radix_tree_deref_slot(pentry);
-			if (temp == old_entry)
-				radix_tree_replace_slot(pentry, new_entry);
-		}
-	}
-
-	return ret;
-}
-
-static int nova_gc_assign_dentry(struct super_block *sb,
-	struct nova_inode_info_header *sih, struct nova_dentry *old_dentry,
-	struct nova_dentry *new_dentry)
-{
-	struct nova_dentry *temp;
-	void **pentry;
-	unsigned long hash;
-	int ret = 0;
+	if (old_entry->num_pages == 0)
+		return 0;
 
-	hash = BKDRHash(old_dentry->name, old_dentry->name_len);
-	nova_dbgv("%s: assign %s hash %lu\n", __func__,
-			old_dentry->name, hash);
+	last_pgoff = old_entry->pgoff + old_entry->num_pages - 1;
 
-	/* FIXME: hash collision ignored here */
-	pentry = radix_tree_lookup_slot(&sih->tree, hash);
-	if (pentry) {
-		temp = radix_tree_deref_slot(pentry);
-		if (temp == old_dentry)
-			radix_tree_replace_slot(pentry, new_dentry);
+	down_write(&sih->extent_sem);
+	curr = nova_search_extent(sih, old_entry->pgoff, 1);
+	while (curr && curr->pgoff_low <= last_pgoff) {
+		if (curr->entry == old_entry)
+			curr->entry = new_entry;
+		curr = nova_rb_extent(rb_next(&curr->node));
 	}
+	up_write(&sih->extent_sem);
 
 	return ret;
 }
@@ -1732,11 +2284,16 @@ static int nova_gc_assign_new_entry(struct super_block *sb,
 	type = nova_get_entry_type(addr);
 	switch (type) {
 		case SET_ATTR:
+		case SET_ATTR_COMPACT:
 			sih->last_setattr = new_curr;
 			break;
 		case LINK_CHANGE:
+		case LINK_CHANGE_COMPACT:
 			sih->last_link_change = new_curr;
 			break;
+		case FILE_INLINE:
+			WRITE_ONCE(sih->inline_entry, new_curr);
+			break;
 		case FILE_WRITE:
 			new_addr = (void *)nova_get_block(sb, new_curr);
 			old_entry = (struct nova_file_write_entry *)addr;
@@ -1748,8 +2305,8 @@ static int nova_gc_assign_new_entry(struct super_block *sb,
 			new_addr = (void *)nova_get_block(sb, new_curr);
 			old_dentry = (struct nova_dentry *)addr;
 			new_dentry = (struct nova_dentry *)new_addr;
-			ret = nova_gc_assign_dentry(sb, sih, old_dentry,
-							new_dentry);
+			ret = nova_replace_dir_index_entry(sb, sih,
+						old_dentry, new_dentry);
 			break;
 		default:
 			nova_dbg("%s: unknown type %d, 0x%llx\n",
@@ -1775,12 +2332,14 @@ static int nova_inode_log_thorough_gc(struct super_block *sb,
 	u64 old_head;
 	u64 new_head = 0;
 	u64 next;
+	unsigned long reclaimed = 0;
 	int allocated;
 	int extended = 0;
 	int ret;
 	timing_t gc_time;
 
 	NOVA_START_TIMING(thorough_gc_t, gc_time);
+	trace_nova_gc_start(sb, ino, sih->log_pages, 1);
 
 	curr_p = pi->log_head;
 	old_curr_p = curr_p;
@@ -1801,6 +2360,9 @@ static int nova_inode_log_thorough_gc(struct super_block *sb,
 		goto out;
 	}
 
+	/* The live entries are rewritten on behalf of the file's tenant */
+	nova_qos_charge_background(sb, pi, sih->valid_bytes);
+
 	new_curr = new_head;
 	while (curr_p != pi->log_tail) {
 		old_curr_p = curr_p;
@@ -1865,11 +2427,13 @@ static int nova_inode_log_thorough_gc(struct super_block *sb,
 	/* Step 4: Free the old log */
 	nova_free_contiguous_log_blocks(sb, pi, old_head);
 
+	reclaimed = checked_pages - blocks;
 	sih->log_pages = sih->log_pages + blocks - checked_pages;
-	NOVA_STATS_ADD(thorough_gc_pages, checked_pages - blocks);
+	NOVA_STATS_ADD(thorough_gc_pages, reclaimed);
 	NOVA_STATS_ADD(thorough_checked_pages, checked_pages);
 out:
 	NOVA_END_TIMING(thorough_gc_t, gc_time);
+	trace_nova_gc_end(sb, ino, checked_pages, reclaimed, 1);
 	return 0;
 }
 
@@ -1883,9 +2447,12 @@ static int need_thorough_gc(struct super_block *sb,
 	return 0;
 }
 
-static int nova_inode_log_fast_gc(struct super_block *sb,
-	struct nova_inode *pi, struct nova_inode_info_header *sih,
-	u64 curr_tail, u64 new_block, int num_pages)
+/*
+ * Free log pages that hold no live entries, then fall back to thorough GC
+ * if the remaining log is still mostly dead. Caller holds i_mutex.
+ */
+int nova_inode_log_fast_gc(struct super_block *sb,
+	struct nova_inode *pi, struct nova_inode_info_header *sih)
 {
 	u64 curr, next, possible_head = 0;
 	int found_head = 0;
@@ -1898,12 +2465,16 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 	int freed_pages = 0;
 	timing_t gc_time;
 
+	/* Never free pages an uncommitted log tail could roll back to */
+	nova_flush_lite_journals(sb);
+
 	NOVA_START_TIMING(fast_gc_t, gc_time);
+	trace_nova_gc_start(sb, sih->ino, sih->log_pages, 0);
 	curr = pi->log_head;
 	sih->valid_bytes = 0;
 
 	nova_dbg_verbose("%s: log head 0x%llx, tail 0x%llx\n",
-				__func__, curr, curr_tail);
+				__func__, curr, pi->log_tail);
 	while (1) {
 		if (curr >> PAGE_SHIFT == pi->log_tail >> PAGE_SHIFT) {
 			/* Don't recycle tail page */
@@ -1947,18 +2518,14 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 	NOVA_STATS_ADD(fast_checked_pages, checked_pages);
 	checked_pages -= freed_pages;
 
-	curr = BLOCK_OFF(curr_tail);
-	curr_page = (struct nova_inode_log_page *)nova_get_block(sb, curr);
-	nova_set_next_page_address(sb, curr_page, new_block, 1);
-
 	curr = pi->log_head;
 
 	pi->log_head = possible_head;
 	nova_dbg_verbose("%s: %d new head 0x%llx\n", __func__,
 					found_head, possible_head);
-	nova_dbg_verbose("Num pages %d, freed %d\n", num_pages, freed_pages);
-	sih->log_pages += num_pages - freed_pages;
-	pi->i_blocks += num_pages - freed_pages;
+	nova_dbg_verbose("Freed %d pages\n", freed_pages);
+	sih->log_pages -= freed_pages;
+	pi->i_blocks -= freed_pages;
 	/* Don't update log tail pointer here */
 	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 1);
 
@@ -1974,6 +2541,8 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 		blocks++;
 
 	NOVA_END_TIMING(fast_gc_t, gc_time);
+	trace_nova_gc_end(sb, sih->ino, checked_pages + freed_pages,
+				freed_pages, 0);
 
 	if (need_thorough_gc(sb, sih, blocks, checked_pages)) {
 		nova_dbgv("Thorough GC for inode %lu: checked pages %lu, "
@@ -1988,6 +2557,7 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 static u64 nova_extend_inode_log(struct super_block *sb, struct nova_inode *pi,
 	struct nova_inode_info_header *sih, u64 curr_p)
 {
+	struct nova_inode_log_page *curr_page;
 	u64 new_block;
 	int allocated;
 	unsigned long num_pages;
@@ -2024,8 +2594,17 @@ static u64 nova_extend_inode_log(struct super_block *sb, struct nova_inode *pi,
 			return 0;
 		}
 
-		nova_inode_log_fast_gc(sb, pi, sih, curr_p,
-						new_block, allocated);
+		/* Link the new pages after the current tail page */
+		curr_page = (struct nova_inode_log_page *)
+				nova_get_block(sb, BLOCK_OFF(curr_p));
+		nova_set_next_page_address(sb, curr_page, new_block, 1);
+		sih->log_pages += allocated;
+		pi->i_blocks += allocated;
+		nova_flush_buffer(&pi->i_blocks, CACHELINE_SIZE, 0);
+
+		/* Leave log cleaning to the background cleaners if we can */
+		if (nova_queue_log_gc(sb, sih))
+			nova_inode_log_fast_gc(sb, pi, sih);
 
 //		nova_dbg("After append log pages:\n");
 //		nova_print_inode_log_page(sb, inode);
@@ -2067,6 +2646,8 @@ static u64 nova_append_one_log_page(struct super_block *sb,
 u64 nova_get_append_head(struct super_block *sb, struct nova_inode *pi,
 	struct nova_inode_info_header *sih, u64 tail, size_t size, int *extended)
 {
+	/* Small compact entries must stay clear of the page end as well */
+	size_t space = max_t(size_t, size, NOVA_LOG_MIN_SPACE);
 	u64 curr_p;
 
 	if (tail)
@@ -2074,9 +2655,9 @@ u64 nova_get_append_head(struct super_block *sb, struct nova_inode *pi,
 	else
 		curr_p = pi->log_tail;
 
-	if (curr_p == 0 || (is_last_entry(curr_p, size) &&
+	if (curr_p == 0 || (is_last_entry(curr_p, space) &&
 				next_log_page(sb, curr_p) == 0)) {
-		if (is_last_entry(curr_p, size))
+		if (is_last_entry(curr_p, space))
 			nova_set_next_page_flag(sb, curr_p);
 
 		if (sih) {
@@ -2091,11 +2672,12 @@ u64 nova_get_append_head(struct super_block *sb, struct nova_inode *pi,
 			return 0;
 	}
 
-	if (is_last_entry(curr_p, size)) {
+	if (is_last_entry(curr_p, space)) {
 		nova_set_next_page_flag(sb, curr_p);
 		curr_p = next_log_page(sb, curr_p);
 	}
 
+	trace_nova_log_append(sb, pi->nova_ino, curr_p, size);
 	return  curr_p;
 }
 
@@ -2174,7 +2756,9 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 {
 	struct nova_file_write_entry *entry = NULL;
 	struct nova_setattr_logentry *attr_entry = NULL;
+	struct nova_setattr_logentry attr_buf;
 	struct nova_link_change_entry *link_change_entry = NULL;
+	struct nova_inline_data_entry *inline_entry;
 	struct nova_inode_log_page *curr_page;
 	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
 	u64 ino = pi->nova_ino;
@@ -2212,22 +2796,40 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 		type = nova_get_entry_type(addr);
 		switch (type) {
 			case SET_ATTR:
-				attr_entry =
-					(struct nova_setattr_logentry *)addr;
+			case SET_ATTR_COMPACT:
+				attr_entry = nova_read_setattr_entry(addr,
+								&attr_buf);
 				nova_apply_setattr_entry(sb, pi, sih,
 								attr_entry);
 				sih->last_setattr = curr_p;
-				curr_p += sizeof(struct nova_setattr_logentry);
+				curr_p += nova_setattr_entry_len(addr);
 				continue;
 			case LINK_CHANGE:
+			case LINK_CHANGE_COMPACT:
 				link_change_entry =
 					(struct nova_link_change_entry *)addr;
 				nova_apply_link_change_entry(pi,
 							link_change_entry);
 				sih->last_link_change = curr_p;
-				curr_p += sizeof(struct nova_link_change_entry);
+				curr_p += nova_link_change_entry_len(addr);
+				continue;
+			case FILE_INLINE:
+				inline_entry =
+					(struct nova_inline_data_entry *)addr;
+				sih->inline_entry = curr_p;
+				sih->inline_len =
+					le16_to_cpu(inline_entry->data_len);
+				pi->i_ctime = inline_entry->mtime;
+				pi->i_mtime = inline_entry->mtime;
+				pi->i_size = inline_entry->size;
+				sih->i_size = le64_to_cpu(pi->i_size);
+				curr_p += NOVA_INLINE_ENTRY_LEN(
+						sih->inline_len);
 				continue;
 			case FILE_WRITE:
+				/* Converted to blocks */
+				sih->inline_entry = 0;
+				sih->inline_len = 0;
 				break;
 			default:
 				nova_err(sb, "unknown type %d, 0x%llx\n",
@@ -2290,6 +2892,13 @@ unsigned long nova_find_region(struct inode *inode, loff_t *offset, int hole)
 	if (*offset >= inode->i_size)
 		return -ENXIO;
 
+	/* Inline files are data up to EOF */
+	if (sih->inline_entry) {
+		if (hole)
+			*offset = inode->i_size;
+		return 0;
+	}
+
 	if (!inode->i_blocks || !sih->i_size) {
 		if (hole)
 			return inode->i_size;
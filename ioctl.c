@@ -18,6 +18,7 @@
 #include <linux/sched.h>
 #include <linux/compat.h>
 #include <linux/mount.h>
+#include <linux/file.h>
 #include "nova.h"
 
 long nova_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
@@ -114,6 +115,62 @@ setversion_out:
 		mnt_drop_write_file(filp);
 		return ret;
 	}
+	case NOVA_SET_HUGE_ALLOC: {
+		int huge;
+
+		if (!S_ISREG(inode->i_mode))
+			return -EINVAL;
+		if (!inode_owner_or_capable(inode))
+			return -EPERM;
+		if (get_user(huge, (int __user *)arg))
+			return -EFAULT;
+
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+
+		/* Only affects blocks allocated from now on */
+		mutex_lock(&inode->i_mutex);
+		nova_memunlock_inode(sb, pi);
+		if (huge)
+			pi->i_flags |= cpu_to_le32(NOVA_HUGE_FL);
+		else
+			pi->i_flags &= ~cpu_to_le32(NOVA_HUGE_FL);
+		nova_memlock_inode(sb, pi);
+		nova_flush_buffer(&pi->i_flags, sizeof(pi->i_flags), 1);
+		mutex_unlock(&inode->i_mutex);
+
+		mnt_drop_write_file(filp);
+		return 0;
+	}
+	case FICLONE:
+	case FICLONERANGE: {
+		struct file_clone_range range = { 0 };
+		struct fd src;
+
+		if (cmd == FICLONE)
+			range.src_fd = (int)arg;
+		else if (copy_from_user(&range,
+				(struct file_clone_range __user *)arg,
+				sizeof(range)))
+			return -EFAULT;
+
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+
+		src = fdget(range.src_fd);
+		if (!src.file) {
+			ret = -EBADF;
+			goto clone_out;
+		}
+		ret = nova_clone_file_range(src.file, range.src_offset, filp,
+				range.dest_offset, range.src_length);
+		fdput(src);
+clone_out:
+		mnt_drop_write_file(filp);
+		return ret;
+	}
 	case NOVA_PRINT_TIMING: {
 		nova_print_timing_stats(sb);
 		return 0;
@@ -155,6 +212,9 @@ long nova_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case FS_IOC32_SETVERSION:
 		cmd = FS_IOC_SETVERSION;
 		break;
+	case FICLONE:
+	case FICLONERANGE:
+		break;
 	default:
 		return -ENOIOCTLCMD;
 	}
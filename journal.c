@@ -33,6 +33,7 @@
 #include <linux/sched.h>
 #include "nova.h"
 #include "journal.h"
+#include "nova_trace.h"
 
 /**************************** Lite journal ******************************/
 
@@ -81,53 +82,165 @@ void nova_print_lite_transaction(struct nova_lite_journal_entry *entry)
 				i, entry->addrs[i], entry->values[i]);
 }
 
+/* Journal slots in use between head and tail */
+static int nova_lite_journal_used(struct ptr_pair *pair)
+{
+	size_t size = sizeof(struct nova_lite_journal_entry);
+
+	return ((pair->journal_tail - pair->journal_head) &
+				(PAGE_SIZE - 1)) / size;
+}
+
+/* Make everything between head and tail durable. Holds journal lock. */
+static void nova_commit_lite_journal(struct super_block *sb, int cpu)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct ptr_pair *pair;
+
+	pair = nova_get_journal_pointers(sb, cpu);
+	pair->journal_head = pair->journal_tail;
+	nova_flush_buffer(&pair->journal_head, CACHELINE_SIZE, 1);
+	NOVA_STATS_ADD(lite_journal_commits, 1);
+	trace_nova_journal_commit(sb, cpu, sbi->journal_batched[cpu]);
+
+	if (sbi->journal_batched[cpu]) {
+		sbi->journal_batched[cpu] = 0;
+		atomic_dec(&sbi->journal_open_batches);
+	}
+}
+
+/*
+ * Append @entries undo records to the running transaction of @cpu and
+ * persist them before the caller touches the journaled fields. With group
+ * commit the records of earlier operations may still be there; they are
+ * committed first if the page would overflow.
+ */
 u64 nova_create_lite_transaction(struct super_block *sb,
-	struct nova_lite_journal_entry *dram_entry1,
-	struct nova_lite_journal_entry *dram_entry2,
-	int entries, int cpu)
+	struct nova_lite_journal_entry *dram_entries, int entries, int cpu)
 {
 	struct ptr_pair *pair;
 	struct nova_lite_journal_entry *entry;
 	size_t size = sizeof(struct nova_lite_journal_entry);
-	u64 new_tail, temp;;
+	u64 new_tail, temp;
+	int i;
 
 	pair = nova_get_journal_pointers(sb, cpu);
-	if (!pair || pair->journal_head == 0 ||
-			pair->journal_head != pair->journal_tail)
+	if (!pair || pair->journal_head == 0)
 		BUG();
 
-	temp = pair->journal_head;
-	entry = (struct nova_lite_journal_entry *)nova_get_block(sb,
-							temp);
+	if (entries <= 0 || entries > MAX_LITE_JOURNAL_ENTRIES) {
+		nova_err(sb, "%s: invalid number of entries %d\n",
+				__func__, entries);
+		BUG();
+	}
 
-//	nova_print_lite_transaction(dram_entry1);
-	memcpy_to_pmem_nocache(entry, dram_entry1, size);
+	if (nova_lite_journal_used(pair) + entries > MAX_LITE_JOURNAL_ENTRIES)
+		nova_commit_lite_journal(sb, cpu);
 
-	if (entries == 2) {
-		temp = next_lite_journal(temp);
+	temp = pair->journal_tail;
+	for (i = 0; i < entries; i++) {
 		entry = (struct nova_lite_journal_entry *)nova_get_block(sb,
 							temp);
-//		nova_print_lite_transaction(dram_entry2);
-		memcpy_to_pmem_nocache(entry, dram_entry2, size);
+//		nova_print_lite_transaction(&dram_entries[i]);
+		memcpy_to_pmem_nocache(entry, &dram_entries[i], size);
+		temp = next_lite_journal(temp);
 	}
 
-	new_tail = next_lite_journal(temp);
+	new_tail = temp;
 	pair->journal_tail = new_tail;
 	nova_flush_buffer(&pair->journal_head, CACHELINE_SIZE, 1);
+	NOVA_STATS_ADD(lite_journal_entries, entries);
+	trace_nova_journal_create(sb, cpu, entries, new_tail);
 
 	return new_tail;
 }
 
+/*
+ * Called once the journaled fields are persistent. Without group commit
+ * the transaction is committed right away. Otherwise it stays open until
+ * journal_batch operations have joined it, the commit timer fires, or
+ * someone calls nova_flush_lite_journals().
+ */
 void nova_commit_lite_transaction(struct super_block *sb, u64 tail, int cpu)
 {
+	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct ptr_pair *pair;
 
 	pair = nova_get_journal_pointers(sb, cpu);
 	if (!pair || pair->journal_tail != tail)
 		BUG();
 
-	pair->journal_head = tail;
-	nova_flush_buffer(&pair->journal_head, CACHELINE_SIZE, 1);
+	if (sbi->journal_batch <= 1 ||
+			sbi->journal_batched[cpu] + 1 >= sbi->journal_batch) {
+		nova_commit_lite_journal(sb, cpu);
+		return;
+	}
+
+	if (sbi->journal_batched[cpu]++ == 0) {
+		atomic_inc(&sbi->journal_open_batches);
+		schedule_delayed_work(&sbi->journal_commit_work,
+			msecs_to_jiffies(LITE_JOURNAL_COMMIT_MS));
+	}
+}
+
+/* Commit the open group transactions of all CPUs except @skip */
+static void nova_commit_lite_journals(struct super_block *sb, int skip)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int i;
+
+	if (atomic_read(&sbi->journal_open_batches) == 0)
+		return;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		if (i == skip || !sbi->journal_batched[i])
+			continue;
+		spin_lock(&sbi->journal_locks[i]);
+		if (sbi->journal_batched[i])
+			nova_commit_lite_journal(sb, i);
+		spin_unlock(&sbi->journal_locks[i]);
+	}
+}
+
+void nova_flush_lite_journals(struct super_block *sb)
+{
+	nova_commit_lite_journals(sb, INVALID_CPU);
+}
+
+static void nova_lite_journal_commit_work(struct work_struct *work)
+{
+	struct nova_sb_info *sbi = container_of(to_delayed_work(work),
+				struct nova_sb_info, journal_commit_work);
+
+	nova_flush_lite_journals(sbi->sb);
+}
+
+/*
+ * Start a lite transaction on the local CPU and return with its journal
+ * locked. Open group transactions elsewhere are committed first: they may
+ * hold operations this one depends on, and undoing those at recovery must
+ * not undo a later operation that was committed on another CPU. The
+ * transaction runs inside a single write protection window.
+ */
+int nova_lock_lite_journal(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int cpu;
+
+	cpu = smp_processor_id();
+	nova_commit_lite_journals(sb, cpu);
+	spin_lock(&sbi->journal_locks[cpu]);
+	nova_memunlock_window(sb);
+
+	return cpu;
+}
+
+void nova_unlock_lite_journal(struct super_block *sb, int cpu)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	nova_memlock_window(sb);
+	spin_unlock(&sbi->journal_locks[cpu]);
 }
 
 static void nova_undo_lite_journal_entry(struct super_block *sb,
@@ -146,18 +259,22 @@ static void nova_undo_lite_journal_entry(struct super_block *sb,
 	}
 }
 
+/*
+ * Undo @count uncommitted entries, newest first, so that a field journaled
+ * by several grouped operations ends up with its oldest saved value.
+ */
 static int nova_recover_lite_journal(struct super_block *sb,
-	struct ptr_pair *pair, int recover)
+	struct ptr_pair *pair, int count)
 {
 	struct nova_lite_journal_entry *entry;
 	u64 temp;
+	int i, j;
 
-	entry = (struct nova_lite_journal_entry *)nova_get_block(sb,
-							pair->journal_head);
-	nova_undo_lite_journal_entry(sb, entry);
+	for (i = count - 1; i >= 0; i--) {
+		temp = pair->journal_head;
+		for (j = 0; j < i; j++)
+			temp = next_lite_journal(temp);
 
-	if (recover == 2) {
-		temp = next_lite_journal(pair->journal_head);
 		entry = (struct nova_lite_journal_entry *)nova_get_block(sb,
 							temp);
 		nova_undo_lite_journal_entry(sb, entry);
@@ -173,6 +290,7 @@ int nova_lite_journal_soft_init(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct ptr_pair *pair;
+	int count;
 	int i;
 	u64 temp;
 
@@ -181,24 +299,33 @@ int nova_lite_journal_soft_init(struct super_block *sb)
 	if (!sbi->journal_locks)
 		return -ENOMEM;
 
+	sbi->journal_batched = kcalloc(sbi->cpus, sizeof(int), GFP_KERNEL);
+	if (!sbi->journal_batched) {
+		kfree(sbi->journal_locks);
+		sbi->journal_locks = NULL;
+		return -ENOMEM;
+	}
+
 	for (i = 0; i < sbi->cpus; i++)
 		spin_lock_init(&sbi->journal_locks[i]);
 
+	atomic_set(&sbi->journal_open_batches, 0);
+	INIT_DELAYED_WORK(&sbi->journal_commit_work,
+				nova_lite_journal_commit_work);
+
 	for (i = 0; i < sbi->cpus; i++) {
 		pair = nova_get_journal_pointers(sb, i);
 		if (pair->journal_head == pair->journal_tail)
 			continue;
 
-		/* We only allow up to two uncommited entries */
-		temp = next_lite_journal(pair->journal_head);
-		if (pair->journal_tail == temp) {
-			nova_recover_lite_journal(sb, pair, 1);
-			continue;
-		}
+		/* Count the uncommitted entries, at most one page of them */
+		temp = pair->journal_head;
+		for (count = 0; count < MAX_LITE_JOURNAL_ENTRIES &&
+				temp != pair->journal_tail; count++)
+			temp = next_lite_journal(temp);
 
-		temp = next_lite_journal(temp);
-		if (pair->journal_tail == temp) {
-			nova_recover_lite_journal(sb, pair, 2);
+		if (temp == pair->journal_tail) {
+			nova_recover_lite_journal(sb, pair, count);
 			continue;
 		}
 
@@ -230,7 +357,8 @@ int nova_lite_journal_hard_init(struct super_block *sb)
 		if (!pair)
 			return -EINVAL;
 
-		allocated = nova_new_log_blocks(sb, &fake_pi, &blocknr, 1, 1);
+		allocated = nova_new_log_blocks(sb, &fake_pi, &blocknr,
+							1, 1, i);
 		nova_dbg_verbose("%s: allocate log @ 0x%lx\n", __func__,
 							blocknr);
 		if (allocated != 1 || blocknr == 0)
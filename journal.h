@@ -30,11 +30,20 @@ struct nova_lite_journal_entry {
 	u64 values[4];
 };
 
+/* One 4K journal page per CPU; one slot stays free as head == tail is empty */
+#define	LITE_JOURNAL_SLOTS	\
+	(PAGE_SIZE / sizeof(struct nova_lite_journal_entry))
+#define	MAX_LITE_JOURNAL_ENTRIES	(LITE_JOURNAL_SLOTS - 1)
+
+/* Upper bound on how long a group transaction stays open */
+#define	LITE_JOURNAL_COMMIT_MS	5
+
 int nova_lite_journal_soft_init(struct super_block *sb);
 int nova_lite_journal_hard_init(struct super_block *sb);
+int nova_lock_lite_journal(struct super_block *sb);
+void nova_unlock_lite_journal(struct super_block *sb, int cpu);
 u64 nova_create_lite_transaction(struct super_block *sb,
-	struct nova_lite_journal_entry *dram_entry1,
-	struct nova_lite_journal_entry *dram_entry2,
-	int entries, int cpu);
+	struct nova_lite_journal_entry *dram_entries, int entries, int cpu);
 void nova_commit_lite_transaction(struct super_block *sb, u64 tail, int cpu);
+void nova_flush_lite_journals(struct super_block *sb);
 #endif    /* __NOVA_JOURNAL_H__ */
@@ -87,9 +87,8 @@ static void nova_lite_transaction_for_new_inode(struct super_block *sb,
 	entry.addrs[1] |= (u64)1 << 56;
 	entry.values[1] = pi->valid;
 
-	cpu = smp_processor_id();
-	spin_lock(&sbi->journal_locks[cpu]);
-	journal_tail = nova_create_lite_transaction(sb, &entry, NULL, 1, cpu);
+	cpu = nova_lock_lite_journal(sb);
+	journal_tail = nova_create_lite_transaction(sb, &entry, 1, cpu);
 
 	pidir->log_tail = pidir_tail;
 	nova_flush_buffer(&pidir->log_tail, CACHELINE_SIZE, 0);
@@ -98,7 +97,7 @@ static void nova_lite_transaction_for_new_inode(struct super_block *sb,
 	PERSISTENT_BARRIER();
 
 	nova_commit_lite_transaction(sb, journal_tail, cpu);
-	spin_unlock(&sbi->journal_locks[cpu]);
+	nova_unlock_lite_journal(sb, cpu);
 	NOVA_END_TIMING(create_trans_t, trans_time);
 }
 
@@ -133,7 +132,7 @@ static int nova_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 	if (ino == 0)
 		goto out_err;
 
-	err = nova_add_dentry(dentry, ino, 0, 0, &tail);
+	err = nova_add_dentry(dentry, ino, IF2DT(mode), 0, 0, &tail);
 	if (err)
 		goto out_err;
 
@@ -181,7 +180,7 @@ static int nova_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 
 	nova_dbgv("%s: %s\n", __func__, dentry->d_name.name);
 	nova_dbgv("%s: inode %llu, dir %lu\n", __func__, ino, dir->i_ino);
-	err = nova_add_dentry(dentry, ino, 0, 0, &tail);
+	err = nova_add_dentry(dentry, ino, IF2DT(mode), 0, 0, &tail);
 	if (err)
 		goto out_err;
 
@@ -234,7 +233,7 @@ static int nova_symlink(struct inode *dir, struct dentry *dentry,
 	nova_dbgv("%s: name %s, symname %s\n", __func__,
 				dentry->d_name.name, symname);
 	nova_dbgv("%s: inode %llu, dir %lu\n", __func__, ino, dir->i_ino);
-	err = nova_add_dentry(dentry, ino, 0, 0, &tail);
+	err = nova_add_dentry(dentry, ino, DT_LNK, 0, 0, &tail);
 	if (err)
 		goto out_fail1;
 
@@ -307,9 +306,8 @@ static void nova_lite_transaction_for_time_and_link(struct super_block *sb,
 		entry.values[2] = pi->valid;
 	}
 
-	cpu = smp_processor_id();
-	spin_lock(&sbi->journal_locks[cpu]);
-	journal_tail = nova_create_lite_transaction(sb, &entry, NULL, 1, cpu);
+	cpu = nova_lock_lite_journal(sb);
+	journal_tail = nova_create_lite_transaction(sb, &entry, 1, cpu);
 
 	pi->log_tail = pi_tail;
 	nova_flush_buffer(&pi->log_tail, CACHELINE_SIZE, 0);
@@ -322,7 +320,7 @@ static void nova_lite_transaction_for_time_and_link(struct super_block *sb,
 	PERSISTENT_BARRIER();
 
 	nova_commit_lite_transaction(sb, journal_tail, cpu);
-	spin_unlock(&sbi->journal_locks[cpu]);
+	nova_unlock_lite_journal(sb, cpu);
 	NOVA_END_TIMING(link_trans_t, trans_time);
 }
 
@@ -336,18 +334,24 @@ int nova_append_link_change_entry(struct super_block *sb,
 	u64 curr_p;
 	int extended = 0;
 	size_t size = sizeof(struct nova_link_change_entry);
+	u8 type = LINK_CHANGE;
 	timing_t append_time;
 
 	NOVA_START_TIMING(append_link_change_t, append_time);
 	nova_dbg_verbose("%s: inode %lu attr change\n",
 				__func__, inode->i_ino);
 
+	if (test_opt(sb, COMPACT_LOG)) {
+		size = NOVA_LINK_CHANGE_COMPACT_LEN;
+		type = LINK_CHANGE_COMPACT;
+	}
+
 	curr_p = nova_get_append_head(sb, pi, sih, tail, size, &extended);
 	if (curr_p == 0)
 		return -ENOMEM;
 
 	entry = (struct nova_link_change_entry *)nova_get_block(sb, curr_p);
-	entry->entry_type = LINK_CHANGE;
+	entry->entry_type = type;
 	entry->links = cpu_to_le16(inode->i_nlink);
 	entry->ctime = cpu_to_le32(inode->i_ctime.tv_sec);
 	entry->flags = cpu_to_le32(inode->i_flags);
@@ -355,6 +359,11 @@ int nova_append_link_change_entry(struct super_block *sb,
 	nova_flush_buffer(entry, size, 0);
 	*new_tail = curr_p + size;
 	sih->last_link_change = curr_p;
+	if (type == LINK_CHANGE_COMPACT) {
+		NOVA_STATS_ADD(compact_entries, 1);
+		NOVA_STATS_ADD(compact_saved_bytes,
+			sizeof(struct nova_link_change_entry) - size);
+	}
 
 	NOVA_END_TIMING(append_link_change_t, append_time);
 	return 0;
@@ -363,12 +372,16 @@ int nova_append_link_change_entry(struct super_block *sb,
 void nova_apply_link_change_entry(struct nova_inode *pi,
 	struct nova_link_change_entry *entry)
 {
-	if (entry->entry_type != LINK_CHANGE)
+	/* The compact form is the same layout without the tail padding */
+	if (entry->entry_type != LINK_CHANGE &&
+			entry->entry_type != LINK_CHANGE_COMPACT)
 		BUG();
 
 	pi->i_links_count	= entry->links;
 	pi->i_ctime		= entry->ctime;
-	pi->i_flags		= entry->flags;
+	/* The entry records VFS flags; keep the allocation hint */
+	pi->i_flags		= (entry->flags & ~cpu_to_le32(NOVA_HUGE_FL)) |
+				  (pi->i_flags & cpu_to_le32(NOVA_HUGE_FL));
 	pi->i_generation	= entry->generation;
 
 	/* Do not flush now */
@@ -403,7 +416,8 @@ static int nova_link(struct dentry *dest_dentry, struct inode *dir,
 			dentry->d_name.name, dest_dentry->d_name.name);
 	nova_dbgv("%s: inode %lu, dir %lu\n", __func__,
 			inode->i_ino, dir->i_ino);
-	err = nova_add_dentry(dentry, inode->i_ino, 0, 0, &pidir_tail);
+	err = nova_add_dentry(dentry, inode->i_ino, IF2DT(inode->i_mode),
+				0, 0, &pidir_tail);
 	if (err) {
 		iput(inode);
 		goto out;
@@ -499,7 +513,7 @@ static int nova_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	nova_dbgv("%s: name %s\n", __func__, dentry->d_name.name);
 	nova_dbgv("%s: inode %llu, dir %lu, link %d\n", __func__,
 				ino, dir->i_ino, dir->i_nlink);
-	err = nova_add_dentry(dentry, ino, 1, 0, &tail);
+	err = nova_add_dentry(dentry, ino, DT_DIR, 1, 0, &tail);
 	if (err) {
 		nova_dbg("failed to add dir entry\n");
 		goto out_err;
@@ -546,21 +560,16 @@ static int nova_empty_dir(struct inode *inode)
 	struct super_block *sb;
 	struct nova_inode_info *si = NOVA_I(inode);
 	struct nova_inode_info_header *sih = &si->header;
-	struct nova_dentry *entry;
-	unsigned long pos = 0;
-	struct nova_dentry *entries[4];
-	int nr_entries;
-	int i;
+	struct nova_dir_node *curr;
+	struct rb_node *temp;
 
 	sb = inode->i_sb;
-	nr_entries = radix_tree_gang_lookup(&sih->tree,
-					(void **)entries, pos, 4);
-	if (nr_entries > 2)
+	if (sih->num_dentries > 2)
 		return 0;
 
-	for (i = 0; i < nr_entries; i++) {
-		entry = entries[i];
-		if (!is_dir_init_entry(sb, entry))
+	for (temp = rb_first(&sih->dir_tree); temp; temp = rb_next(temp)) {
+		curr = rb_entry(temp, struct nova_dir_node, node);
+		if (!is_dir_init_entry(sb, curr->direntry))
 			return 0;
 	}
 
@@ -640,7 +649,7 @@ static int nova_rename(struct inode *old_dir,
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct nova_inode *old_pi = NULL, *new_pi = NULL;
 	struct nova_inode *new_pidir = NULL, *old_pidir = NULL;
-	struct nova_lite_journal_entry entry, entry1;
+	struct nova_lite_journal_entry entry[2];
 	struct nova_dentry *father_entry = NULL;
 	char *head_addr = NULL;
 	u64 old_tail = 0, new_tail = 0, new_pi_tail = 0, old_pi_tail = 0;
@@ -711,7 +720,8 @@ static int nova_rename(struct inode *old_dir,
 
 	/* link into the new directory. */
 	err = nova_add_dentry(new_dentry, old_inode->i_ino,
-				inc_link, new_tail, &new_tail);
+				IF2DT(old_inode->i_mode), inc_link,
+				new_tail, &new_tail);
 	if (err)
 		goto out;
 
@@ -746,52 +756,50 @@ static int nova_rename(struct inode *old_dir,
 	}
 
 	entries = 1;
-	memset(&entry, 0, sizeof(struct nova_lite_journal_entry));
+	memset(&entry[0], 0, sizeof(struct nova_lite_journal_entry));
 
-	entry.addrs[0] = (u64)nova_get_addr_off(sbi, &old_pi->log_tail);
-	entry.addrs[0] |= (u64)8 << 56;
-	entry.values[0] = old_pi->log_tail;
+	entry[0].addrs[0] = (u64)nova_get_addr_off(sbi, &old_pi->log_tail);
+	entry[0].addrs[0] |= (u64)8 << 56;
+	entry[0].values[0] = old_pi->log_tail;
 
-	entry.addrs[1] = (u64)nova_get_addr_off(sbi, &old_pidir->log_tail);
-	entry.addrs[1] |= (u64)8 << 56;
-	entry.values[1] = old_pidir->log_tail;
+	entry[0].addrs[1] = (u64)nova_get_addr_off(sbi, &old_pidir->log_tail);
+	entry[0].addrs[1] |= (u64)8 << 56;
+	entry[0].values[1] = old_pidir->log_tail;
 
 	if (old_dir != new_dir) {
-		entry.addrs[2] = (u64)nova_get_addr_off(sbi,
+		entry[0].addrs[2] = (u64)nova_get_addr_off(sbi,
 						&new_pidir->log_tail);
-		entry.addrs[2] |= (u64)8 << 56;
-		entry.values[2] = new_pidir->log_tail;
+		entry[0].addrs[2] |= (u64)8 << 56;
+		entry[0].values[2] = new_pidir->log_tail;
 
 		if (change_parent && father_entry) {
-			entry.addrs[3] = (u64)nova_get_addr_off(sbi,
+			entry[0].addrs[3] = (u64)nova_get_addr_off(sbi,
 						&father_entry->ino);
-			entry.addrs[3] |= (u64)8 << 56;
-			entry.values[3] = father_entry->ino;
+			entry[0].addrs[3] |= (u64)8 << 56;
+			entry[0].values[3] = father_entry->ino;
 		}
 	}
 
 	if (new_inode) {
 		entries++;
-		memset(&entry1, 0, sizeof(struct nova_lite_journal_entry));
+		memset(&entry[1], 0, sizeof(struct nova_lite_journal_entry));
 
-		entry1.addrs[0] = (u64)nova_get_addr_off(sbi,
+		entry[1].addrs[0] = (u64)nova_get_addr_off(sbi,
 						&new_pi->log_tail);
-		entry1.addrs[0] |= (u64)8 << 56;
-		entry1.values[0] = new_pi->log_tail;
+		entry[1].addrs[0] |= (u64)8 << 56;
+		entry[1].values[0] = new_pi->log_tail;
 
 		if (!new_inode->i_nlink) {
-			entry1.addrs[1] = (u64)nova_get_addr_off(sbi,
+			entry[1].addrs[1] = (u64)nova_get_addr_off(sbi,
 							&new_pi->valid);
-			entry1.addrs[1] |= (u64)1 << 56;
-			entry1.values[1] = new_pi->valid;
+			entry[1].addrs[1] |= (u64)1 << 56;
+			entry[1].values[1] = new_pi->valid;
 		}
 
 	}
 
-	cpu = smp_processor_id();
-	spin_lock(&sbi->journal_locks[cpu]);
-	journal_tail = nova_create_lite_transaction(sb, &entry, &entry1,
-							entries, cpu);
+	cpu = nova_lock_lite_journal(sb);
+	journal_tail = nova_create_lite_transaction(sb, entry, entries, cpu);
 
 	old_pi->log_tail = old_pi_tail;
 	nova_flush_buffer(&old_pi->log_tail, CACHELINE_SIZE, 0);
@@ -820,7 +828,7 @@ static int nova_rename(struct inode *old_dir,
 	PERSISTENT_BARRIER();
 
 	nova_commit_lite_transaction(sb, journal_tail, cpu);
-	spin_unlock(&sbi->journal_locks[cpu]);
+	nova_unlock_lite_journal(sb, cpu);
 
 	NOVA_END_TIMING(rename_t, rename_time);
 	return 0;
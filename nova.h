@@ -30,11 +30,13 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/rcupdate.h>
+#include <linux/srcu.h>
 #include <linux/types.h>
 #include <linux/rbtree.h>
 #include <linux/radix-tree.h>
 #include <linux/version.h>
 #include <linux/kthread.h>
+#include <linux/workqueue.h>
 #include <linux/buffer_head.h>
 #include <linux/uio.h>
 #include <asm/tlbflush.h>
@@ -107,8 +109,12 @@ extern unsigned int nova_dbgmask;
  * nova inode flags
  *
  * NOVA_EOFBLOCKS_FL	There are blocks allocated beyond eof
+ * NOVA_HUGE_FL		Allocate 2M-aligned data extents for PMD mappings;
+ *			internal, set with NOVA_SET_HUGE_ALLOC and kept in a
+ *			bit the generic FS_*_FL flags don't use
  */
 #define NOVA_EOFBLOCKS_FL      0x20000000
+#define NOVA_HUGE_FL           0x08000000
 /* Flags that should be inherited by new inodes from their parent. */
 #define NOVA_FL_INHERITED (FS_SECRM_FL | FS_UNRM_FL | FS_COMPR_FL | \
 			    FS_SYNC_FL | FS_NODUMP_FL | FS_NOATIME_FL |	\
@@ -127,11 +133,32 @@ extern unsigned int nova_dbgmask;
 #define	NOVA_PRINT_LOG_BLOCKNODE	0xBCD00014
 #define	NOVA_PRINT_LOG_PAGES		0xBCD00015
 #define	NOVA_PRINT_FREE_LISTS		0xBCD00018
+#define	NOVA_SET_HUGE_ALLOC		0xBCD00019
+
+/* Clone ioctls, not in the uapi headers of this kernel yet */
+#ifndef FICLONE
+struct file_clone_range {
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 src_length;
+	__u64 dest_offset;
+};
+
+#define	FICLONE		_IOW(0x94, 9, int)
+#define	FICLONERANGE	_IOW(0x94, 13, struct file_clone_range)
+#endif
 
 
 #define	READDIR_END			(ULONG_MAX)
+/*
+ * 31-bit readdir positions keep the top 30 bits of the 62-bit hash, so
+ * they never reach READDIR_END_32BIT
+ */
+#define	READDIR_END_32BIT		(0x7fffffff)
+#define	READDIR_HASH_SHIFT_32BIT	32
 #define	INVALID_CPU			(-1)
 #define	SHARED_CPU			(65536)
+#define	ANY_CPU				(65537)
 #define FREE_BATCH			(16)
 
 extern int measure_timing;
@@ -153,6 +180,9 @@ enum nova_entry_type {
 	SET_ATTR,
 	LINK_CHANGE,
 	NEXT_PAGE,
+	FILE_INLINE,
+	SET_ATTR_COMPACT,
+	LINK_CHANGE_COMPACT,
 };
 
 static inline u8 nova_get_entry_type(void *p)
@@ -177,6 +207,30 @@ struct nova_file_write_entry {
 	__le64	size;
 } __attribute((__packed__));
 
+/*
+ * Flags kept in the low bits of a write entry's block, above the entry
+ * type. UNWRITTEN extents own their blocks but read as zeros; HOLE entries
+ * map no blocks and unmap the pages they cover.
+ */
+#define NOVA_WRITE_UNWRITTEN	0x100
+#define NOVA_WRITE_HOLE		0x200
+#define NOVA_WRITE_SHARED	0x400	/* Blocks may have other owners */
+
+static inline bool nova_entry_unwritten(struct nova_file_write_entry *entry)
+{
+	return le64_to_cpu(entry->block) & NOVA_WRITE_UNWRITTEN;
+}
+
+static inline bool nova_entry_hole(struct nova_file_write_entry *entry)
+{
+	return le64_to_cpu(entry->block) & NOVA_WRITE_HOLE;
+}
+
+static inline bool nova_entry_shared(struct nova_file_write_entry *entry)
+{
+	return le64_to_cpu(entry->block) & NOVA_WRITE_SHARED;
+}
+
 struct nova_inode_page_tail {
 	__le64	padding1;
 	__le64	padding2;
@@ -212,6 +266,9 @@ struct nova_dentry {
 	char	name[NOVA_NAME_LEN + 1];	/* File name */
 } __attribute((__packed__));
 
+#define DT2IF(dt) (((dt) << 12) & S_IFMT)
+#define IF2DT(sif) (((sif) & S_IFMT) >> 12)
+
 #define NOVA_DIR_PAD			8	/* Align to 8 bytes boundary */
 #define NOVA_DIR_ROUND			(NOVA_DIR_PAD - 1)
 #define NOVA_DIR_LOG_REC_LEN(name_len)	(((name_len) + 29 + NOVA_DIR_ROUND) & \
@@ -241,15 +298,70 @@ struct nova_link_change_entry {
 	__le64	paddings[2];
 } __attribute((__packed__));
 
+/*
+ * Entries of the compact_log format. Every log entry stays a multiple of
+ * NOVA_ENTRY_ALIGN bytes, so the write entries after them keep their
+ * 8-byte fields aligned for in-place atomic updates.
+ */
+#define	NOVA_ENTRY_ALIGN	8
+
+/*
+ * Compact setattr: the same full snapshot as nova_setattr_logentry, but
+ * uid, gid, size and the distance of mtime and atime from ctime follow as
+ * varints, in that order. The time distances are zigzag coded.
+ */
+struct nova_setattr_compact {
+	u8	entry_type;
+	u8	length;		/* Bytes, padding included */
+	__le16	mode;
+	__le32	ctime;
+	u8	attr;
+	u8	data[0];
+} __attribute((__packed__));
+
+#define	NOVA_SETATTR_COMPACT_MAX	40
+
+/* Compact link change: a nova_link_change_entry without the padding */
+#define	NOVA_LINK_CHANGE_COMPACT_LEN	16
+
+static inline size_t nova_setattr_entry_len(void *entry)
+{
+	if (nova_get_entry_type(entry) == SET_ATTR_COMPACT)
+		return ((struct nova_setattr_compact *)entry)->length;
+	return sizeof(struct nova_setattr_logentry);
+}
+
+static inline size_t nova_link_change_entry_len(void *entry)
+{
+	if (nova_get_entry_type(entry) == LINK_CHANGE_COMPACT)
+		return NOVA_LINK_CHANGE_COMPACT_LEN;
+	return sizeof(struct nova_link_change_entry);
+}
+
+/*
+ * Whole contents of a small regular file, kept in the log instead of a
+ * data block. Only the newest inline entry of a file is live; the first
+ * write entry after it means the file was converted to blocks.
+ */
+struct nova_inline_data_entry {
+	u8	entry_type;
+	u8	padding;
+	__le16	data_len;		/* Bytes of data after the header */
+	__le32	mtime;			/* For both mtime and ctime */
+	__le64	size;			/* File size */
+	char	data[0];
+} __attribute((__packed__));
+
+#define	NOVA_INLINE_MAX		256
+/* Inline entries keep a 32-byte granularity */
+#define	NOVA_INLINE_ENTRY_LEN(len)	\
+	ALIGN(sizeof(struct nova_inline_data_entry) + (len), 32)
+
 enum alloc_type {
 	LOG = 1,
 	DATA,
 };
 
-#define	MMAP_WRITE_BIT	0x20UL	// mmaped for write
-#define	IS_MAP_WRITE(p)	((p) & (MMAP_WRITE_BIT))
-#define	MMAP_ADDR(p)	((p) & (PAGE_MASK))
-
 static inline void nova_update_tail(struct nova_inode *pi, u64 new_tail)
 {
 	timing_t update_time;
@@ -302,24 +414,88 @@ struct nova_range_node_lowhigh {
 
 struct nova_range_node {
 	struct rb_node node;
+	struct list_head size_list;	/* Free ranges: size class list */
 	unsigned long range_low;
 	unsigned long range_high;
 };
 
+/* Maps file pages [pgoff_low, pgoff_high] to a write entry */
+struct nova_extent_node {
+	struct rb_node node;
+	unsigned long pgoff_low;
+	unsigned long pgoff_high;
+	struct nova_file_write_entry *entry;
+};
+
+/* Pages [pgoff, pgoff + num_pages) of a read, contiguous in NVMM */
+struct nova_read_run {
+	unsigned long pgoff;
+	unsigned long num_pages;
+	unsigned long nvmm;		/* 0: hole or unwritten, reads zeros */
+};
+
+/*
+ * Directory index node. Hashed for lookup and kept in an rbtree sorted by
+ * hash, which doubles as the readdir cookie. Equal hashes are chained in
+ * both structures and told apart by name.
+ */
+struct nova_dir_node {
+	struct hlist_node hnode;
+	struct rb_node node;
+	u64 hash;
+	struct nova_dentry *direntry;
+};
+
+/* DRAM copy of a directory index for readdir */
+struct nova_readdir_entry {
+	u64	hash;
+	u64	ino;
+	char	*name;
+	u8	name_len;
+	u8	file_type;
+};
+
+struct nova_readdir_cache {
+	unsigned long	count;
+	struct nova_readdir_entry entries[0];	/* Names follow */
+};
+
+#define	READDIR_CACHE_MAX_DENTRIES	(1UL << 20)
+
+#define	DIR_INDEX_MIN_BITS	4
+#define	DIR_INDEX_MAX_BITS	24
+
 struct nova_inode_info_header {
-	struct radix_tree_root tree;	/* Dir name entry tree root */
-	struct radix_tree_root cache_tree;	/* Mmap cache tree root */
+	struct rb_root dir_tree;	/* Dir entries sorted by hash */
+	struct hlist_head *dir_buckets;	/* Dir entry hash table */
+	unsigned int dir_bits;		/* log2 of hash table size */
+	unsigned long num_dentries;	/* Num of indexed dir entries */
+	struct nova_readdir_cache *readdir_cache; /* Built by readdir */
+	struct rb_root extent_tree;	/* File extent tree root */
+	struct rw_semaphore extent_sem;	/* Protects extent tree */
+	unsigned long num_extents;	/* Num of extent nodes */
 	unsigned short i_mode;		/* Dir or file? */
 	unsigned long log_pages;	/* Num of log pages */
 	unsigned long i_size;
 	unsigned long ino;
 	unsigned long pi_addr;
-	unsigned long mmap_pages;	/* Num of mmap pages */
-	unsigned long low_dirty;	/* Mmap dirty low range */
-	unsigned long high_dirty;	/* Mmap dirty high range */
 	unsigned long valid_bytes;	/* For thorough GC */
 	u64 last_setattr;		/* Last setattr entry */
 	u64 last_link_change;		/* Last link change entry */
+	u64 inline_entry;		/* Live inline data entry */
+	unsigned long inline_len;	/* Valid bytes in it */
+	struct list_head gc_list;	/* On a log cleaner queue */
+	int gc_cpu;			/* Which cleaner queue */
+	spinlock_t range_lock;		/* Protects write_ranges */
+	struct list_head write_ranges;	/* Blocks of concurrent writes */
+	wait_queue_head_t range_wait;
+};
+
+/* Block range locked by a concurrent write */
+struct nova_write_range {
+	struct list_head list;
+	unsigned long first;
+	unsigned long last;
 };
 
 struct nova_inode_info {
@@ -344,14 +520,24 @@ struct scan_bitmap {
 	struct single_scan_bm scan_bm_1G;
 };
 
+/*
+ * Free ranges of [2^k, 2^(k+1)) blocks are also on size_class[k], so that
+ * a fit is found by size without walking the tree in address order.
+ */
+#define	NOVA_SIZE_CLASSES	BITS_PER_LONG
+#define	NOVA_CLASS_SCAN		8	/* Ranges tried in a partial class */
+
 struct free_list {
 	spinlock_t s_lock;
 	struct rb_root	block_free_tree;
 	struct nova_range_node *first_node;
+	struct list_head size_class[NOVA_SIZE_CLASSES];
+	unsigned long	size_class_map;	/* Non-empty classes */
 	unsigned long	block_start;
 	unsigned long	block_end;
 	unsigned long	num_free_blocks;
 	unsigned long	num_blocknode;
+	int		nid;		/* NUMA node backing this range */
 
 	/* Statistics */
 	unsigned long	alloc_log_count;
@@ -366,6 +552,98 @@ struct free_list {
 	u64		padding[8];	/* Cache line break */
 };
 
+/*
+ * Per-CPU cache of single 4K blocks in front of the free lists.
+ * Only accessed by the owning CPU with preemption disabled.
+ */
+#define	MAGAZINE_SIZE	(FREE_BATCH * 4)
+
+struct block_magazine {
+	unsigned long	blocks[MAGAZINE_SIZE];
+	int		count;
+
+	/* Statistics */
+	unsigned long	alloc_log_count;
+	unsigned long	alloc_data_count;
+	unsigned long	free_log_count;
+	unsigned long	free_data_count;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Per-CPU pool of zeroed log pages. Freed log pages wait in dirty[] until
+ * the refill thread zeroes them into clean[]; the thread also tops clean[]
+ * up from the free lists. Like magazine blocks, pooled pages are free as
+ * far as the checkpoint deltas are concerned.
+ */
+#define	LOG_POOL_SIZE	64
+#define	LOG_POOL_BATCH	16
+#define	LOG_POOL_LOW	16	/* Wake the thread below this many */
+#define	LOG_POOL_TARGET	32	/* Fresh pages are pulled up to this */
+
+struct nova_log_pool {
+	spinlock_t	lock;		/* Protects both arrays */
+	unsigned long	clean[LOG_POOL_SIZE];
+	unsigned long	dirty[LOG_POOL_SIZE];
+	int		num_clean;
+	int		num_dirty;
+
+	/* Statistics */
+	unsigned long	alloc_count;
+	unsigned long	free_count;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Data blocks unmapped by overwrites and truncates wait in per-CPU queues
+ * of page-sized batches until no DAX reader can still be copying from
+ * them, see dax_read_srcu. Ranges are in 4K blocks.
+ */
+struct nova_free_range {
+	unsigned long	blocknr;
+	unsigned long	num;
+};
+
+#define	DEFERRED_FREE_RANGES	254	/* Fills a page */
+#define	DEFERRED_FREE_DELAY	msecs_to_jiffies(10)
+/* Longest an allocation out of space waits for a drain */
+#define	DEFERRED_FREE_WAIT	msecs_to_jiffies(1000)
+
+struct nova_free_batch {
+	struct list_head	list;
+	int			num;
+	struct nova_free_range	ranges[DEFERRED_FREE_RANGES];
+};
+
+struct nova_free_queue {
+	spinlock_t		lock;	/* Protects open and full */
+	struct nova_free_batch	*open;
+	struct list_head	full;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Owner counts of data blocks shared by clones. Only blocks with two or
+ * more owners are in the tree; a block that is not is owned by the one
+ * file that maps it. At clean unmount the tree is saved in the log of
+ * NOVA_SHARED_INO as nova_shared_entry records.
+ */
+struct nova_shared_node {
+	struct rb_node	node;
+	unsigned long	range_low;
+	unsigned long	range_high;
+	unsigned long	owners;
+};
+
+struct nova_shared_entry {
+	__le64	range_low;
+	__le64	range_high;
+	__le64	owners;
+} __attribute((__packed__));
+
+/* Set in NOVA_SHARED_INO while any block may be shared */
+#define	NOVA_SHARED_BLOCKS_FL	0x1
+
+typedef int (*nova_release_fn)(struct super_block *sb, struct nova_inode *pi,
+	unsigned long blocknr, int num);
+
 /*
  * The first block contains super blocks and reserved inodes;
  * The second block contains pointers to journal pages.
@@ -373,6 +651,134 @@ struct free_list {
  */
 #define	RESERVED_BLOCKS	3
 
+/*
+ * Per-CPU background log cleaner. Writers queue inodes whose logs cross
+ * the GC watermark; the thread cleans them under i_mutex.
+ */
+struct nova_log_cleaner {
+	struct task_struct *task;
+	struct super_block *sb;
+	spinlock_t lock;		/* Protects queue */
+	struct list_head queue;
+	wait_queue_head_t wait;
+	unsigned long queued;
+} ____cacheline_aligned_in_smp;
+
+#define	GC_MIN_PAGES_DEFAULT	8
+#define	GC_LIVE_RATIO_DEFAULT	50
+
+/*
+ * Mount-time prefetch pool: rebuilds inodes reachable from the root in
+ * breadth-first order. queue holds inode numbers; [head, tail) is pending.
+ */
+struct nova_prefetch {
+	struct super_block *sb;
+	struct task_struct **tasks;
+	int num_tasks;
+	spinlock_t lock;		/* Protects queue and active */
+	unsigned long *queue;
+	unsigned long head;
+	unsigned long tail;
+	unsigned long limit;
+	int active;			/* Workers rebuilding an inode */
+	wait_queue_head_t wait;
+};
+
+#define	PREFETCH_THREADS	4
+#define	PREFETCH_MAX_INODES	(1UL << 24)
+
+/*
+ * Allocator checkpoints. A background thread periodically writes the free
+ * lists and inode maps as range logs, and every allocation and free since
+ * is appended to a small per-CPU delta area. Crash recovery loads the last
+ * committed checkpoint and replays the deltas instead of scanning all
+ * inode logs. Delta areas rotate over three generations, so the records
+ * leading up to the committed checkpoint are still there at recovery.
+ */
+enum nova_delta_op {
+	NOVA_DELTA_BLOCK_ALLOC = 1,
+	NOVA_DELTA_BLOCK_FREE,
+	NOVA_DELTA_INODE_ALLOC,
+	NOVA_DELTA_INODE_FREE,
+	NOVA_DELTA_OVERFLOW,		/* Area full, deltas are incomplete */
+};
+
+enum nova_delta_kind {
+	NOVA_DELTA_BLOCKS,		/* One area per CPU */
+	NOVA_DELTA_INODES,		/* One area per inode map */
+};
+
+/* Records never straddle a cacheline; gen tells stale ones apart */
+struct nova_delta_entry {
+	__le64	seq;			/* Global order of block records */
+	__le64	low;
+	__le64	high;
+	__le64	ino;			/* Owner of allocated blocks, or 0 */
+	__le32	op;
+	__le32	gen;
+	__le64	padding[3];
+} __attribute((__packed__));
+
+#define	DELTA_BLOCK_PAGES	128
+#define	DELTA_INODE_PAGES	8
+
+struct nova_ckpt_slot {
+	__le16	csum;			/* Over the rest of the slot */
+	__le16	padding;
+	__le32	num_block_nodes;
+	__le64	gen;			/* 0 if the slot is empty */
+	__le64	block_head;		/* Range log of free blocks */
+	__le64	block_tail;
+	__le64	inode_head;		/* Range log of used inodes */
+	__le64	inode_tail;
+	__le64	time;
+} __attribute((__packed__));
+
+#define	NOVA_CKPT_MAGIC		0x4e434b50	/* NCKP */
+
+/* Lives in the page at the checkpoint inode's log head */
+struct nova_ckpt_header {
+	__le32	magic;
+	__le32	cpus;
+	__le64	gen;			/* Highest generation handed out */
+	struct nova_ckpt_slot slot[2];
+	/* Delta area heads, indexed by nova_delta_index() */
+	__le64	areas[0];
+} __attribute((__packed__));
+
+#define	NOVA_CKPT_MAX_CPUS	((LAST_ENTRY - \
+		sizeof(struct nova_ckpt_header)) / (6 * sizeof(__le64)))
+
+struct nova_delta_area {
+	spinlock_t	lock;
+	u64		head;
+	u64		curr;		/* Where the next record goes */
+	unsigned long	count;
+	unsigned long	capacity;
+	int		full;
+};
+
+struct nova_checkpoint {
+	struct super_block *sb;
+	struct task_struct *task;
+	wait_queue_head_t wait;
+	int urgent;			/* A delta area is half full */
+	struct srcu_struct srcu;	/* Block ops in flight */
+	u64		gen;		/* Tag for new records */
+	u64		committed;	/* Generation of the last checkpoint */
+	atomic64_t	seq;
+	int		pause_magazines;
+	struct nova_delta_area *areas;
+	struct nova_range_node_lowhigh *buf;	/* Snapshot staging */
+	unsigned long	buf_size;
+};
+
+static inline int nova_delta_index(int cpus, u64 gen,
+	enum nova_delta_kind kind, int cpu)
+{
+	return (gen % 3) * 2 * cpus + kind * cpus + cpu;
+}
+
 struct inode_map {
 	struct mutex inode_table_mutex;
 	struct rb_root	inode_inuse_tree;
@@ -380,6 +786,53 @@ struct inode_map {
 	struct nova_range_node *first_inode_range;
 	int allocated;
 	int freed;
+	/* DRAM index of the inode table superpages */
+	struct mutex table_index_mutex;
+	u64		**table_pages;
+	unsigned int	table_chunks;
+	unsigned int	table_pages_num;
+};
+
+/*
+ * One pmem device of the instance. Devices are concatenated in order:
+ * device i holds blocks [start_block, start_block + num_blocks) and its
+ * own run of per-CPU free lists, so no free range or extent crosses a
+ * device boundary.
+ */
+struct nova_device {
+	struct block_device *bdev;
+	phys_addr_t	phys_addr;
+	void		*virt_addr;
+	unsigned long	size;		/* Bytes in use */
+	u64		start;		/* Block address of the first byte */
+	unsigned long	start_block;
+	unsigned long	num_blocks;
+	int		first_list;	/* Free lists on this device */
+	int		num_lists;
+	unsigned long	per_list_blocks;
+};
+
+/*
+ * QoS limits of one tenant, the group owning a file, see qos.c. Tokens
+ * are write bytes; background work may leave them in debt.
+ */
+#define	NOVA_QOS_TENANTS	16
+#define	NOVA_QOS_BURST_DIV	10	/* Burst is 1/10 s of the write limit */
+#define	NOVA_QOS_MAX_BPS	(1ULL << 40)
+
+struct nova_qos_tenant {
+	u32		gid;
+	int		active;
+	unsigned long	max_blocks;	/* Data block cap, 0 = none */
+	unsigned long	used_blocks;
+	u64		write_bps;	/* Bytes per second, 0 = none */
+	s64		tokens;
+	u64		last_refill;	/* ns */
+	u64		write_bytes;
+	u64		bg_bytes;
+	u64		throttled;
+	u64		throttle_ns;
+	u64		denied;
 };
 
 /*
@@ -398,6 +851,12 @@ struct nova_sb_info {
 
 	unsigned long	num_blocks;
 
+	/* Member devices; devs[0] is s_bdev and holds the super block */
+	struct nova_device devs[NOVA_MAX_DEVICES];
+	int		num_devs;
+	char		*dev_paths;	/* devices= option */
+	unsigned long	stripe_blocks;	/* Data stripe unit, 0 = off */
+
 	/*
 	 * Backing store option:
 	 * 1 = no load, 2 = no store,
@@ -430,6 +889,12 @@ struct nova_sb_info {
 	/* Per-CPU journal lock */
 	spinlock_t *journal_locks;
 
+	/* Lite journal group commit */
+	unsigned int journal_batch;	/* Max operations per commit */
+	int *journal_batched;		/* Per-CPU ops in open transaction */
+	atomic_t journal_open_batches;	/* CPUs with an open transaction */
+	struct delayed_work journal_commit_work;
+
 	/* Per-CPU inode map */
 	struct inode_map	*inode_maps;
 
@@ -439,6 +904,54 @@ struct nova_sb_info {
 	/* Per-CPU free block list */
 	struct free_list *free_lists;
 
+	/* Per-CPU block magazines */
+	struct block_magazine *magazines;
+
+	/* Per-CPU zeroed log page pools and their refill thread */
+	struct nova_log_pool *log_pools;
+	struct task_struct *log_pool_task;
+	wait_queue_head_t log_pool_wait;
+	int log_pool_kick;
+
+	/* Deferred data block frees and the readers they wait for */
+	struct nova_free_queue *free_queues;
+	struct srcu_struct dax_read_srcu;
+	struct delayed_work deferred_free_work;
+	struct mutex deferred_free_mutex;	/* Serializes drains */
+	atomic_long_t deferred_free_blocks;	/* Queued, not yet released */
+	unsigned long deferred_free_drains;	/* Finished drains */
+	wait_queue_head_t deferred_free_wait;
+
+	/* Owner counts of blocks shared by clones */
+	struct rb_root shared_tree;
+	struct mutex shared_mutex;
+	unsigned long shared_blocks;	/* Blocks in shared_tree */
+
+	/* Per-CPU home free list, chosen on the CPU's NUMA node */
+	int *cpu_free_list;
+
+	/* Per-CPU log cleaner threads and their watermark policy */
+	struct nova_log_cleaner *log_cleaners;
+	unsigned int gc_min_pages;	/* Don't clean smaller logs */
+	unsigned int gc_live_ratio;	/* Clean below this live percent */
+	unsigned int gc_throttle;	/* Cleaner pause per inode, in ms */
+
+	/* Mount-time inode prefetch */
+	struct nova_prefetch *prefetch;
+	unsigned long prefetch_inodes;	/* Max inodes to rebuild, 0 = off */
+
+	/* Allocator checkpoints and delta logs */
+	struct nova_checkpoint *ckpt;
+	unsigned int ckpt_interval;	/* Seconds, 0 = off */
+
+	/* Per-CPU hot inode tables, with the hot_inodes option */
+	struct nova_hot_inode *hot_inodes;
+
+	/* Tenant QoS limits, set through /proc */
+	spinlock_t qos_lock;
+	unsigned int qos_count;		/* Active tenants */
+	struct nova_qos_tenant qos[NOVA_QOS_TENANTS];
+
 	/* Shared free block list */
 	unsigned long per_list_blocks;
 	struct free_list shared_free_list;
@@ -470,21 +983,60 @@ static inline struct nova_super_block *nova_get_redund_super(struct super_block
 	return (struct nova_super_block *)(sbi->virt_addr + NOVA_SB_SIZE);
 }
 
+/* Member device holding block address @block */
+static inline struct nova_device *nova_block_device(struct nova_sb_info *sbi,
+	u64 block)
+{
+	int i = sbi->num_devs - 1;
+
+	while (i > 0 && block < sbi->devs[i].start)
+		i--;
+	return &sbi->devs[i];
+}
+
+/* Member devices are mapped apart, so a copy must not cross between them */
+static inline bool nova_same_device(struct nova_sb_info *sbi, u64 a, u64 b)
+{
+	if (likely(sbi->num_devs <= 1))
+		return true;
+	return nova_block_device(sbi, a) == nova_block_device(sbi, b);
+}
+
 /* If this is part of a read-modify-write of the block,
  * nova_memunlock_block() before calling! */
 static inline void *nova_get_block(struct super_block *sb, u64 block)
 {
-	struct nova_super_block *ps = nova_get_super(sb);
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_device *dev;
 
-	return block ? ((void *)ps + block) : NULL;
+	if (!block)
+		return NULL;
+	if (likely(sbi->num_devs <= 1))
+		return sbi->virt_addr + block;
+
+	dev = nova_block_device(sbi, block);
+	return dev->virt_addr + (block - dev->start);
 }
 
 static inline u64
 nova_get_addr_off(struct nova_sb_info *sbi, void *addr)
 {
-	NOVA_ASSERT((addr >= sbi->virt_addr) &&
-			(addr < (sbi->virt_addr + sbi->initsize)));
-	return (u64)(addr - sbi->virt_addr);
+	struct nova_device *dev;
+	int i;
+
+	if (likely(sbi->num_devs <= 1)) {
+		NOVA_ASSERT((addr >= sbi->virt_addr) &&
+				(addr < (sbi->virt_addr + sbi->initsize)));
+		return (u64)(addr - sbi->virt_addr);
+	}
+
+	for (i = 0; i < sbi->num_devs; i++) {
+		dev = &sbi->devs[i];
+		if (addr >= dev->virt_addr && addr < dev->virt_addr + dev->size)
+			return dev->start + (u64)(addr - dev->virt_addr);
+	}
+	NOVA_ASSERT(0);
+	return 0;
 }
 
 static inline u64
@@ -505,6 +1057,57 @@ struct free_list *nova_get_free_list(struct super_block *sb, int cpu)
 		return &sbi->shared_free_list;
 }
 
+/* Free list whose block range holds @blocknr */
+static inline int nova_free_list_id(struct nova_sb_info *sbi,
+	unsigned long blocknr)
+{
+	struct nova_device *dev;
+	int cpuid;
+
+	if (likely(sbi->num_devs <= 1)) {
+		cpuid = blocknr / sbi->per_list_blocks;
+		return cpuid >= sbi->cpus ? SHARED_CPU : cpuid;
+	}
+
+	/* The last list of a device takes the rounding remainder */
+	dev = nova_block_device(sbi, (u64)blocknr << PAGE_SHIFT);
+	cpuid = (blocknr - dev->start_block) / dev->per_list_blocks;
+	if (cpuid >= dev->num_lists)
+		cpuid = dev->num_lists - 1;
+	return dev->first_list + cpuid;
+}
+
+/* Checkpoints keep the magazines empty while they snapshot the free lists */
+static inline bool nova_magazines_paused(struct nova_sb_info *sbi)
+{
+	return sbi->ckpt && READ_ONCE(sbi->ckpt->pause_magazines);
+}
+
+/* 4K blocks in a PMD-mappable extent */
+#define	HUGE_PAGE_BLOCKS	(PMD_SIZE >> PAGE_SHIFT)
+
+/* Data of this file should go in 2M-aligned extents */
+static inline bool nova_huge_alloc(struct super_block *sb,
+	struct nova_inode *pi)
+{
+	return test_opt(sb, HUGEMMAP) ||
+		(le32_to_cpu(pi->i_flags) & NOVA_HUGE_FL);
+}
+
+/* Free list that serves allocations for @cpu, or the local CPU */
+static inline int nova_home_free_list(struct super_block *sb, int cpu)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (cpu == ANY_CPU)
+		cpu = smp_processor_id();
+
+	if (cpu < sbi->cpus && sbi->cpu_free_list)
+		return sbi->cpu_free_list[cpu];
+
+	return cpu;
+}
+
 struct ptr_pair {
 	__le64 journal_head;
 	__le64 journal_tail;
@@ -538,18 +1141,23 @@ struct inode_table *nova_get_inode_table(struct super_block *sb, int cpu)
 		NOVA_DEF_BLOCK_SIZE_4K * 2) + cpu * CACHELINE_SIZE);
 }
 
-// BKDR String Hash Function
-static inline unsigned long BKDRHash(const char *str, int length)
+/*
+ * 64-bit FNV-1a of a dentry name. The top two bits are dropped so the hash
+ * can serve as a readdir position and never collides with READDIR_END;
+ * positions 0 and 1 are reserved for "." and "..".
+ */
+static inline u64 nova_dentry_hash(const char *name, int length)
 {
-	unsigned int seed = 131; // 31 131 1313 13131 131313 etc..
-	unsigned long hash = 0;
+	u64 hash = 0xcbf29ce484222325ULL;
 	int i;
 
 	for (i = 0; i < length; i++) {
-		hash = hash * seed + (*str++);
+		hash ^= (u8)name[i];
+		hash *= 0x100000001b3ULL;
 	}
 
-	return hash;
+	hash >>= 2;
+	return hash < 2 ? 2 : hash;
 }
 
 /* uses CPU instructions to atomically write up to 8 bytes */
@@ -587,18 +1195,31 @@ static inline void nova_memcpy_atomic (void *dst, const void *src, u8 size)
 	}
 }
 
+/* Non-temporal kernels, chosen at module init */
+enum nova_nt_kernel_type {
+	NOVA_NT_MOVNTI = 0,
+	NOVA_NT_AVX2,
+	NOVA_NT_AVX512,
+};
+
+extern int nova_nt_kernel;
+
+/* pmem.c */
+void nova_init_persistence(void);
+void nova_memcpy_nt(void *dst, const void *src, size_t len);
+size_t nova_zero_nt(void *dst, size_t len);
+
+/* Durable at the next PERSISTENT_BARRIER; src is a kernel pointer */
 static inline int memcpy_to_pmem_nocache(void *dst, const void *src,
 	unsigned int size)
 {
-	int ret;
+	nova_memcpy_nt(dst, src, size);
 
-	ret = __copy_from_user_inatomic_nocache(dst, src, size);
-
-	return ret;
+	return 0;
 }
 
 /* assumes the length to be 4-byte aligned */
-static inline void memset_nt(void *dest, uint32_t dword, size_t length)
+static inline void __memset_nt(void *dest, uint32_t dword, size_t length)
 {
 	uint64_t dummy1, dummy2;
 	uint64_t qword = ((uint64_t)dword << 32) | dword;
@@ -634,16 +1255,34 @@ static inline void memset_nt(void *dest, uint32_t dword, size_t length)
 		: "=D"(dummy1), "=d" (dummy2) : "D" (dest), "a" (qword), "d" (length) : "memory", "rcx");
 }
 
+static inline void memset_nt(void *dest, uint32_t dword, size_t length)
+{
+	size_t done = 0;
+
+	if (dword == 0 && nova_nt_kernel != NOVA_NT_MOVNTI)
+		done = nova_zero_nt(dest, length);
+
+	if (done < length)
+		__memset_nt(dest + done, dword, length - done);
+}
+
+struct nova_file_write_entry *nova_find_extent(
+	struct nova_inode_info_header *sih, unsigned long pgoff,
+	unsigned long *num_pages);
+struct nova_file_write_entry *nova_find_next_extent(
+	struct nova_inode_info_header *sih, unsigned long pgoff,
+	unsigned long *start_pgoff, unsigned long *num_pages);
+bool nova_find_last_extent(struct nova_inode_info_header *sih,
+	unsigned long *last_pgoff);
+int nova_find_read_runs(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long pgoff,
+	unsigned long last, struct nova_read_run *runs, int max);
+
 static inline struct nova_file_write_entry *
 nova_get_write_entry(struct super_block *sb,
 	struct nova_inode_info *si, unsigned long blocknr)
 {
-	struct nova_inode_info_header *sih = &si->header;
-	struct nova_file_write_entry *entry;
-
-	entry = radix_tree_lookup(&sih->tree, blocknr);
-
-	return entry;
+	return nova_find_extent(&si->header, blocknr, NULL);
 }
 
 void nova_print_curr_log_page(struct super_block *sb, u64 curr);
@@ -694,18 +1333,6 @@ static inline u64 nova_find_nvmm_block(struct super_block *sb,
 	return nvmm << PAGE_SHIFT;
 }
 
-static inline unsigned long nova_get_cache_addr(struct super_block *sb,
-	struct nova_inode_info *si, unsigned long blocknr)
-{
-	struct nova_inode_info_header *sih = &si->header;
-	unsigned long addr;
-
-	addr = (unsigned long)radix_tree_lookup(&sih->cache_tree, blocknr);
-	nova_dbgv("%s: inode %lu, blocknr %lu, addr 0x%lx\n",
-		__func__, sih->ino, blocknr, addr);
-	return addr;
-}
-
 static inline unsigned int nova_inode_blk_shift (struct nova_inode *pi)
 {
 	return blk_type_to_shift[pi->i_blk_type];
@@ -772,7 +1399,14 @@ nova_get_blocknr(struct super_block *sb, u64 block, unsigned short btype)
 
 static inline unsigned long nova_get_pfn(struct super_block *sb, u64 block)
 {
-	return (NOVA_SB(sb)->phys_addr + block) >> PAGE_SHIFT;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_device *dev;
+
+	if (likely(sbi->num_devs <= 1))
+		return (sbi->phys_addr + block) >> PAGE_SHIFT;
+
+	dev = nova_block_device(sbi, block);
+	return (dev->phys_addr + (block - dev->start)) >> PAGE_SHIFT;
 }
 
 static inline int nova_is_mounting(struct super_block *sb)
@@ -817,6 +1451,13 @@ static inline void nova_set_next_page_address(struct super_block *sb,
 
 #define	CACHE_ALIGN(p)	((p) & ~(CACHELINE_SIZE - 1))
 
+/*
+ * No inode log entry starts in the last NOVA_LOG_MIN_SPACE bytes before
+ * the page tail, even one that would fit there, so walkers can tell the
+ * end of a page without reading past it. See nova_get_append_head().
+ */
+#define	NOVA_LOG_MIN_SPACE	32
+
 static inline bool is_last_entry(u64 curr_p, size_t size)
 {
 	unsigned int entry_end;
@@ -831,8 +1472,8 @@ static inline bool goto_next_page(struct super_block *sb, u64 curr_p)
 	void *addr;
 	u8 type;
 
-	/* Each kind of entry takes at least 32 bytes */
-	if (ENTRY_LOC(curr_p) + 32 > LAST_ENTRY)
+	/* Nothing starts in the reserved space, see NOVA_LOG_MIN_SPACE */
+	if (ENTRY_LOC(curr_p) + NOVA_LOG_MIN_SPACE > LAST_ENTRY)
 		return true;
 
 	addr = nova_get_block(sb, curr_p);
@@ -861,6 +1502,7 @@ extern void nova_error_mng(struct super_block *sb, const char *fmt, ...);
 
 /* balloc.c */
 int nova_alloc_block_free_lists(struct super_block *sb);
+void nova_init_size_classes(struct free_list *free_list);
 void nova_delete_free_lists(struct super_block *sb);
 inline struct nova_range_node *nova_alloc_blocknode(struct super_block *sb);
 inline struct nova_range_node *nova_alloc_inode_node(struct super_block *sb);
@@ -869,7 +1511,24 @@ inline void nova_free_blocknode(struct super_block *sb,
 	struct nova_range_node *bnode);
 inline void nova_free_inode_node(struct super_block *sb,
 	struct nova_range_node *bnode);
+inline struct nova_extent_node *nova_alloc_extent_node(struct super_block *sb);
+inline void nova_free_extent_node(struct nova_extent_node *node);
+inline struct nova_dir_node *nova_alloc_dir_node(struct super_block *sb);
+inline void nova_free_dir_node(struct nova_dir_node *node);
 extern void nova_init_blockmap(struct super_block *sb, int recovery);
+void nova_drain_block_magazines(struct super_block *sb);
+void nova_flush_block_magazines(struct super_block *sb);
+int nova_start_log_pool(struct super_block *sb);
+void nova_stop_log_pool(struct super_block *sb);
+void nova_flush_log_pools(struct super_block *sb);
+int nova_init_deferred_free(struct super_block *sb);
+void nova_destroy_deferred_free(struct super_block *sb);
+void nova_drain_deferred_frees(struct super_block *sb);
+unsigned long nova_count_deferred_free_blocks(struct super_block *sb);
+int nova_defer_free_data_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned long blocknr, int num);
+int nova_replay_block_delta(struct super_block *sb, unsigned long blocknr,
+	unsigned long num, int free);
 extern int nova_free_data_blocks(struct super_block *sb, struct nova_inode *pi,
 	unsigned long blocknr, int num);
 extern int nova_free_log_blocks(struct super_block *sb, struct nova_inode *pi,
@@ -878,7 +1537,10 @@ extern int nova_new_data_blocks(struct super_block *sb, struct nova_inode *pi,
 	unsigned long *blocknr, unsigned int num, unsigned long start_blk,
 	int zero, int cow);
 extern int nova_new_log_blocks(struct super_block *sb, struct nova_inode *pi,
-	unsigned long *blocknr, unsigned int num, int zero);
+	unsigned long *blocknr, unsigned int num, int zero, int cpuid);
+int nova_new_huge_data_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned long *blocknr, unsigned int num, unsigned long start_blk,
+	int zero);
 extern unsigned long nova_count_free_blocks(struct super_block *sb);
 inline int nova_search_inodetree(struct nova_sb_info *sbi,
 	unsigned long ino, struct nova_range_node **ret_node);
@@ -898,9 +1560,19 @@ int nova_rebuild_inode(struct super_block *sb, struct nova_inode_info *si,
 	u64 pi_addr);
 void nova_save_blocknode_mappings_to_log(struct super_block *sb);
 void nova_save_inode_list_to_log(struct super_block *sb);
+int nova_failure_insert_inodetree(struct super_block *sb,
+	unsigned long ino_low, unsigned long ino_high);
+int nova_load_blockmap_from_log(struct super_block *sb, u64 log_head,
+	u64 log_tail);
+int nova_load_inode_list_from_log(struct super_block *sb, u64 log_head,
+	u64 log_tail);
 void nova_init_header(struct super_block *sb,
 	struct nova_inode_info_header *sih, u16 i_mode);
+int nova_mark_logged_blocks(struct super_block *sb, u64 *inos, long num,
+	struct scan_bitmap *bm);
 int nova_recovery(struct super_block *sb);
+int nova_start_prefetch(struct super_block *sb);
+void nova_stop_prefetch(struct super_block *sb);
 
 /*
  * Inodes and files operations
@@ -910,19 +1582,37 @@ int nova_recovery(struct super_block *sb);
 int nova_reassign_file_tree(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode_info_header *sih,
 	u64 begin_tail);
+int nova_convert_inline_data(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode);
 ssize_t nova_dax_file_read(struct file *filp, char __user *buf, size_t len,
 			    loff_t *ppos);
 ssize_t nova_dax_file_write(struct file *filp, const char __user *buf,
 		size_t len, loff_t *ppos);
+ssize_t nova_dax_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t nova_dax_write_iter(struct kiocb *iocb, struct iov_iter *from);
 int nova_dax_get_block(struct inode *inode, sector_t iblock,
 	struct buffer_head *bh, int create);
 int nova_dax_file_mmap(struct file *file, struct vm_area_struct *vma);
+long nova_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
+
+/* device.c */
+int nova_map_device(struct super_block *sb, struct block_device *bdev,
+	struct nova_device *dev);
+int nova_open_devices(struct super_block *sb);
+void nova_close_devices(struct super_block *sb);
+void nova_format_devices(struct super_block *sb,
+	struct nova_super_block *super);
+int nova_check_devices(struct super_block *sb, struct nova_super_block *super);
+void nova_layout_device_lists(struct super_block *sb);
+void nova_device_list_range(struct super_block *sb, int list,
+	unsigned long *start, unsigned long *end);
+int nova_list_has_dev_header(struct super_block *sb, int list);
 
 /* dir.c */
 extern const struct file_operations nova_dir_operations;
 int nova_append_dir_init_entries(struct super_block *sb,
 	struct nova_inode *pi, u64 self_ino, u64 parent_ino);
-extern int nova_add_dentry(struct dentry *dentry, u64 ino,
+extern int nova_add_dentry(struct dentry *dentry, u64 ino, u8 file_type,
 	int inc_link, u64 tail, u64 *new_tail);
 extern int nova_remove_dentry(struct dentry *dentry, int dec_link, u64 tail,
 	u64 *new_tail);
@@ -933,6 +1623,9 @@ void nova_delete_dir_tree(struct super_block *sb,
 struct nova_dentry *nova_find_dentry(struct super_block *sb,
 	struct nova_inode *pi, struct inode *inode, const char *name,
 	unsigned long name_len);
+int nova_replace_dir_index_entry(struct super_block *sb,
+	struct nova_inode_info_header *sih, struct nova_dentry *old_dentry,
+	struct nova_dentry *new_dentry);
 int nova_rebuild_dir_inode_tree(struct super_block *sb,
 	struct nova_inode *pi, u64 pi_addr,
 	struct nova_inode_info_header *sih);
@@ -948,12 +1641,13 @@ int nova_init_inode_inuse_list(struct super_block *sb);
 extern int nova_init_inode_table(struct super_block *sb);
 unsigned long nova_get_last_blocknr(struct super_block *sb,
 	struct nova_inode_info_header *sih);
+int nova_alloc_inode_table_index(struct super_block *sb);
+void nova_free_inode_table_index(struct super_block *sb);
+void nova_build_inode_table_index(struct super_block *sb);
 int nova_get_inode_address(struct super_block *sb, u64 ino,
 	u64 *pi_addr, int extendable);
 int nova_set_blocksize_hint(struct super_block *sb, struct inode *inode,
 	struct nova_inode *pi, loff_t new_size);
-struct nova_file_write_entry *nova_find_next_entry(struct super_block *sb,
-	struct nova_inode_info_header *sih, pgoff_t pgoff);
 extern struct inode *nova_iget(struct super_block *sb, unsigned long ino);
 extern void nova_evict_inode(struct inode *inode);
 extern int nova_write_inode(struct inode *inode, struct writeback_control *wbc);
@@ -965,16 +1659,20 @@ extern void nova_set_inode_flags(struct inode *inode, struct nova_inode *pi,
 	unsigned int flags);
 extern unsigned long nova_find_region(struct inode *inode, loff_t *offset,
 		int hole);
+struct nova_setattr_logentry *nova_read_setattr_entry(void *addr,
+	struct nova_setattr_logentry *buf);
 void nova_apply_setattr_entry(struct super_block *sb, struct nova_inode *pi,
 	struct nova_inode_info_header *sih,
 	struct nova_setattr_logentry *entry);
 void nova_free_inode_log(struct super_block *sb, struct nova_inode *pi);
+int nova_free_contiguous_log_blocks(struct super_block *sb,
+	struct nova_inode *pi, u64 head);
 int nova_allocate_inode_log_pages(struct super_block *sb,
 	struct nova_inode *pi, unsigned long num_pages,
 	u64 *new_block);
 int nova_delete_file_tree(struct super_block *sb,
 	struct nova_inode_info_header *sih, unsigned long start_blocknr,
-	unsigned long last_blocknr, bool delete_nvmm, bool delete_mmap);
+	unsigned long last_blocknr, bool delete_nvmm);
 u64 nova_get_append_head(struct super_block *sb, struct nova_inode *pi,
 	struct nova_inode_info_header *sih, u64 tail, size_t size,
 	int *extended);
@@ -984,6 +1682,7 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 	struct nova_inode *pi, u64 pi_addr,
 	struct nova_inode_info_header *sih);
 u64 nova_new_nova_inode(struct super_block *sb, u64 *pi_addr);
+int nova_free_inuse_inode(struct super_block *sb, unsigned long ino);
 extern struct inode *nova_new_vfs_inode(enum nova_new_inode_type,
 	struct inode *dir, u64 pi_addr, u64 ino, umode_t mode,
 	size_t size, dev_t rdev, const struct qstr *qstr);
@@ -992,6 +1691,50 @@ int nova_assign_write_entry(struct super_block *sb,
 	struct nova_inode_info_header *sih,
 	struct nova_file_write_entry *entry,
 	bool free);
+int nova_inode_log_fast_gc(struct super_block *sb,
+	struct nova_inode *pi, struct nova_inode_info_header *sih);
+
+/* checkpoint.c */
+void nova_ckpt_record_blocks(struct super_block *sb, enum nova_delta_op op,
+	unsigned long blocknr, unsigned long num, u64 ino);
+void nova_ckpt_record_inode(struct super_block *sb, enum nova_delta_op op,
+	unsigned long ino);
+int nova_recover_from_checkpoint(struct super_block *sb);
+int nova_start_checkpoint(struct super_block *sb);
+void nova_stop_checkpoint(struct super_block *sb);
+
+/* reflink.c */
+static inline bool nova_has_shared_blocks(struct super_block *sb)
+{
+	return !RB_EMPTY_ROOT(&NOVA_SB(sb)->shared_tree);
+}
+
+int nova_put_shared_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned long blocknr, int num, nova_release_fn release);
+bool nova_blocks_shared(struct super_block *sb, unsigned long blocknr,
+	unsigned long num);
+bool nova_range_shared(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long pgoff,
+	unsigned long num);
+void nova_destroy_shared_blocks(struct super_block *sb);
+bool nova_shared_blocks_logged(struct super_block *sb);
+int nova_count_shared_blocks(struct super_block *sb, unsigned long blocknr,
+	unsigned long num);
+void nova_prune_shared_blocks(struct super_block *sb);
+void nova_save_shared_blocks(struct super_block *sb);
+int nova_load_shared_blocks(struct super_block *sb);
+int nova_unshare_block(struct super_block *sb, struct inode *inode,
+	unsigned long pgoff, loff_t size);
+long nova_clone_file_range(struct file *src_file, u64 off,
+	struct file *dst_file, u64 destoff, u64 len);
+
+/* gc.c */
+int nova_start_log_cleaners(struct super_block *sb);
+void nova_stop_log_cleaners(struct super_block *sb);
+int nova_queue_log_gc(struct super_block *sb,
+	struct nova_inode_info_header *sih);
+void nova_dequeue_log_gc(struct super_block *sb,
+	struct nova_inode_info_header *sih);
 
 /* ioctl.c */
 extern long nova_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
@@ -1009,6 +1752,19 @@ int nova_append_link_change_entry(struct super_block *sb,
 void nova_apply_link_change_entry(struct nova_inode *pi,
 	struct nova_link_change_entry *entry);
 
+/* qos.c */
+void nova_qos_throttle_write(struct super_block *sb, struct inode *inode,
+	size_t bytes);
+void nova_qos_charge_background(struct super_block *sb, struct nova_inode *pi,
+	size_t bytes);
+int nova_qos_charge_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned int num);
+void nova_qos_uncharge_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned long num);
+int nova_qos_show(struct seq_file *seq, void *v);
+ssize_t nova_qos_write(struct super_block *sb, const char __user *buf,
+	size_t len);
+
 /* super.c */
 extern struct super_block *nova_read_super(struct super_block *sb, void *data,
 	int silent);
@@ -1032,6 +1788,11 @@ void nova_sysfs_exit(struct super_block *sb);
 void nova_get_timing_stats(void);
 void nova_print_timing_stats(struct super_block *sb);
 void nova_clear_stats(void);
+u64 nova_get_latency_stats(int category, u64 *hist);
+u64 nova_latency_percentile(u64 *hist, u64 total, unsigned int permille);
+void nova_clear_latency_stats(void);
+void nova_update_hot_inode(struct super_block *sb, unsigned long ino,
+	size_t bytes, int write);
 void nova_print_inode_log(struct super_block *sb, struct inode *inode);
 void nova_print_inode_log_pages(struct super_block *sb, struct inode *inode);
 void nova_print_free_lists(struct super_block *sb);
@@ -43,6 +43,13 @@
 #define NOVA_MOUNT_HUGEIOREMAP 0x000100        /* Huge mappings with ioremap */
 #define NOVA_MOUNT_FORMAT      0x000200        /* was FS formatted on mount? */
 #define NOVA_MOUNT_MOUNTING    0x000400        /* FS currently being mounted */
+#define NOVA_MOUNT_INLINE_GC   0x000800        /* Clean logs on the write path */
+#define NOVA_MOUNT_APPEND_INPLACE 0x001000     /* Sub-block appends in place */
+#define NOVA_MOUNT_CONCURRENT_WRITE 0x002000   /* Copy data outside i_mutex */
+#define NOVA_MOUNT_HOT_INODES 0x004000         /* Track most accessed inodes */
+#define NOVA_MOUNT_FORCE_RECOVERY 0x008000     /* Mount as if after a crash */
+#define NOVA_MOUNT_INLINE_DATA 0x010000        /* Small files in the log */
+#define NOVA_MOUNT_COMPACT_LOG 0x020000        /* Compact log entries */
 
 /*
  * Maximal count of links to a file
@@ -117,6 +124,22 @@ struct nova_inode {
 
 #define NOVA_SB_SIZE 512       /* must be power of two */
 
+#define NOVA_MAX_DEVICES	16
+#define NOVA_DEV_MAGIC		0x4E4F5644	/* "NOVD" */
+#define NOVA_DEV_HEADER_BLOCKS	1
+
+/*
+ * Header in the first block of every member device after the first one of
+ * a multi-device instance. It ties the device to its super block and to
+ * its position in the address space.
+ */
+struct nova_dev_header {
+	__le32		h_magic;
+	__le32		h_index;	/* position in s_dev_size */
+	__le64		h_fs_id;	/* s_fs_id of the instance */
+	__le64		h_size;		/* bytes of the device in use */
+} __attribute((__packed__));
+
 
 /*
  * Structure of the super block in NOVA
@@ -149,8 +172,28 @@ struct nova_super_block {
 	__le32		s_wtime;            /* write time */
 	/* fields for fast mount support. Always keep them together */
 	__le64		s_num_free_blocks;
+
+	/*
+	 * Member devices concatenated into the block address space, in
+	 * address order. Zero devices means a single-device instance.
+	 */
+	__le32		s_num_devices;
+	__le32		s_padding_dev;
+	__le64		s_fs_id;
+	__le64		s_dev_size[NOVA_MAX_DEVICES];
+
+	/* Newest log entry format ever written, see NOVA_LOG_VERSION */
+	__le32		s_log_version;
 } __attribute((__packed__));
 
+/*
+ * Log entry formats in s_log_version. Images that predate the field read
+ * as 0 and hold fixed size entries only; a module refuses to mount an
+ * image with entries newer than it understands.
+ */
+#define NOVA_LOG_COMPACT	1	/* Compact setattr and link changes */
+#define NOVA_LOG_VERSION	NOVA_LOG_COMPACT
+
 #define NOVA_SB_STATIC_SIZE(ps) ((u64)&ps->s_start_dynamic - (u64)ps)
 
 /* the above fast mount fields take total 32 bytes in the super block */
@@ -163,6 +206,8 @@ struct nova_super_block {
 #define NOVA_INODELIST_INO	(4)
 #define NOVA_LITEJOURNAL_INO	(5)
 #define NOVA_INODELIST1_INO	(6)
+#define NOVA_CHECKPOINT_INO	(7)	/* Allocator checkpoint header */
+#define NOVA_SHARED_INO		(8)	/* Shared block owner counts */
 
 #define	NOVA_ROOT_INO_START	(NOVA_SB_SIZE * 2)
 
@@ -184,12 +229,18 @@ static inline bool arch_has_pcommit(void)
 	return static_cpu_has(X86_FEATURE_PCOMMIT);
 }
 
+static inline bool arch_has_clflushopt(void)
+{
+	return static_cpu_has(X86_FEATURE_CLFLUSHOPT);
+}
+
 static inline bool arch_has_clwb(void)
 {
 	return static_cpu_has(X86_FEATURE_CLWB);
 }
 
 extern int support_clwb;
+extern int support_clflushopt;
 extern int support_pcommit;
 
 #define _mm_clflush(addr)\
@@ -222,6 +273,9 @@ static inline void nova_flush_buffer(void *buf, uint32_t len, bool fence)
 	if (support_clwb) {
 		for (i = 0; i < len; i += CACHELINE_SIZE)
 			_mm_clwb(buf + i);
+	} else if (support_clflushopt) {
+		for (i = 0; i < len; i += CACHELINE_SIZE)
+			_mm_clflushopt(buf + i);
 	} else {
 		for (i = 0; i < len; i += CACHELINE_SIZE)
 			_mm_clflush(buf + i);
@@ -0,0 +1,264 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Tracepoints for the NOVA filesystem.
+ *
+ * The events sit on the allocation, log append, GC, journal, DAX fault and
+ * recovery paths. Each one is a static branch that is skipped until it is
+ * enabled through tracefs, perf or an eBPF program attached to
+ * tracepoint:nova:*, and everything derived from the arguments is computed
+ * in TP_fast_assign so a disabled event costs nothing beyond the branch.
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nova
+
+#if !defined(_NOVA_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _NOVA_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+
+#define show_alloc_type(type)					\
+	__print_symbolic(type, { 1, "log" }, { 2, "data" })
+
+DECLARE_EVENT_CLASS(nova_blocks_class,
+	TP_PROTO(struct super_block *sb, u64 ino, int atype,
+		unsigned long blocknr, unsigned int num, int ret),
+	TP_ARGS(sb, ino, atype, blocknr, num, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(int, atype)
+		__field(unsigned long, blocknr)
+		__field(unsigned int, num)
+		__field(int, ret)
+		__field(int, cpu)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->atype = atype;
+		__entry->blocknr = blocknr;
+		__entry->num = num;
+		__entry->ret = ret;
+		__entry->cpu = raw_smp_processor_id();
+	),
+
+	TP_printk("dev %d:%d ino %llu %s blocknr %lu num %u ret %d cpu %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		show_alloc_type(__entry->atype), __entry->blocknr,
+		__entry->num, __entry->ret, __entry->cpu)
+);
+
+/* @num is the request, @ret the number of blocks actually allocated */
+DEFINE_EVENT(nova_blocks_class, nova_new_blocks,
+	TP_PROTO(struct super_block *sb, u64 ino, int atype,
+		unsigned long blocknr, unsigned int num, int ret),
+	TP_ARGS(sb, ino, atype, blocknr, num, ret)
+);
+
+DEFINE_EVENT(nova_blocks_class, nova_free_blocks,
+	TP_PROTO(struct super_block *sb, u64 ino, int atype,
+		unsigned long blocknr, unsigned int num, int ret),
+	TP_ARGS(sb, ino, atype, blocknr, num, ret)
+);
+
+TRACE_EVENT(nova_log_append,
+	TP_PROTO(struct super_block *sb, u64 ino, u64 curr_p, size_t size),
+	TP_ARGS(sb, ino, curr_p, size),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(u64, curr_p)
+		__field(size_t, size)
+		__field(int, cpu)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->curr_p = curr_p;
+		__entry->size = size;
+		__entry->cpu = raw_smp_processor_id();
+	),
+
+	TP_printk("dev %d:%d ino %llu entry 0x%llx size %zu cpu %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		__entry->curr_p, __entry->size, __entry->cpu)
+);
+
+TRACE_EVENT(nova_gc_start,
+	TP_PROTO(struct super_block *sb, u64 ino, unsigned long log_pages,
+		int thorough),
+	TP_ARGS(sb, ino, log_pages, thorough),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(unsigned long, log_pages)
+		__field(int, thorough)
+		__field(int, cpu)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->log_pages = log_pages;
+		__entry->thorough = thorough;
+		__entry->cpu = raw_smp_processor_id();
+	),
+
+	TP_printk("dev %d:%d ino %llu %s log pages %lu cpu %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		__entry->thorough ? "thorough" : "fast",
+		__entry->log_pages, __entry->cpu)
+);
+
+TRACE_EVENT(nova_gc_end,
+	TP_PROTO(struct super_block *sb, u64 ino, unsigned long checked,
+		unsigned long reclaimed, int thorough),
+	TP_ARGS(sb, ino, checked, reclaimed, thorough),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(unsigned long, checked)
+		__field(unsigned long, reclaimed)
+		__field(int, thorough)
+		__field(int, cpu)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->checked = checked;
+		__entry->reclaimed = reclaimed;
+		__entry->thorough = thorough;
+		__entry->cpu = raw_smp_processor_id();
+	),
+
+	TP_printk("dev %d:%d ino %llu %s checked %lu reclaimed %lu cpu %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		__entry->thorough ? "thorough" : "fast",
+		__entry->checked, __entry->reclaimed, __entry->cpu)
+);
+
+TRACE_EVENT(nova_journal_create,
+	TP_PROTO(struct super_block *sb, int cpu, int entries, u64 tail),
+	TP_ARGS(sb, cpu, entries, tail),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(int, cpu)
+		__field(int, entries)
+		__field(u64, tail)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->cpu = cpu;
+		__entry->entries = entries;
+		__entry->tail = tail;
+	),
+
+	TP_printk("dev %d:%d journal %d entries %d tail 0x%llx",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->cpu,
+		__entry->entries, __entry->tail)
+);
+
+/* @batched counts the operations folded into this group commit */
+TRACE_EVENT(nova_journal_commit,
+	TP_PROTO(struct super_block *sb, int cpu, int batched),
+	TP_ARGS(sb, cpu, batched),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(int, cpu)
+		__field(int, batched)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->cpu = cpu;
+		__entry->batched = batched;
+	),
+
+	TP_printk("dev %d:%d journal %d batched %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->cpu,
+		__entry->batched)
+);
+
+TRACE_EVENT(nova_dax_fault,
+	TP_PROTO(struct inode *inode, struct vm_area_struct *vma,
+		unsigned long address, unsigned int flags, int pmd, int ret),
+	TP_ARGS(inode, vma, address, flags, pmd, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(pgoff_t, pgoff)
+		__field(unsigned int, flags)
+		__field(int, pmd)
+		__field(int, ret)
+		__field(int, cpu)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pgoff = linear_page_index(vma, address);
+		__entry->flags = flags;
+		__entry->pmd = pmd;
+		__entry->ret = ret;
+		__entry->cpu = raw_smp_processor_id();
+	),
+
+	TP_printk("dev %d:%d ino %lu pgoff %lu %s %s ret 0x%x cpu %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		(unsigned long)__entry->pgoff, __entry->pmd ? "2M" : "4K",
+		__entry->flags & FAULT_FLAG_WRITE ? "write" : "read",
+		__entry->ret, __entry->cpu)
+);
+
+/* Emitted as each recovery phase finishes; the deltas give its duration */
+TRACE_EVENT(nova_recovery_phase,
+	TP_PROTO(struct super_block *sb, const char *phase, int ret),
+	TP_ARGS(sb, phase, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__string(phase, phase)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__assign_str(phase, phase);
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d:%d phase %s ret %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __get_str(phase),
+		__entry->ret)
+);
+
+#endif /* _NOVA_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nova_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,271 @@
+/*
+ * NOVA persistence primitives.
+ *
+ * The cache flush instruction and the non-temporal copy and zero kernels
+ * are picked once at module init from the CPU features. The kernels never
+ * fence: like a clwb, their stores become durable at the next
+ * PERSISTENT_BARRIER, so a batch of copies before a log commit costs one
+ * sfence.
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/fs.h>
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#include "nova.h"
+
+int support_clwb = 0;
+int support_clflushopt = 0;
+int support_pcommit = 0;
+int nova_nt_kernel = NOVA_NT_MOVNTI;
+
+static const char *nova_nt_kernel_name[] = {
+	[NOVA_NT_MOVNTI]	= "movnti",
+	[NOVA_NT_AVX2]		= "avx2",
+	[NOVA_NT_AVX512]	= "avx512",
+};
+
+/* Saving the FPU state only pays off for whole blocks */
+#define	NT_FPU_MIN	PAGE_SIZE
+/* Bound the time spent with preemption off */
+#define	NT_FPU_CHUNK	(16 * PAGE_SIZE)
+
+void nova_init_persistence(void)
+{
+	if (arch_has_pcommit())
+		support_pcommit = 1;
+
+	if (arch_has_clwb())
+		support_clwb = 1;
+	else if (arch_has_clflushopt())
+		support_clflushopt = 1;
+
+#ifdef CONFIG_AS_AVX512
+	if (boot_cpu_has(X86_FEATURE_AVX512F) &&
+			cpu_has_xfeatures(XSTATE_SSE | XSTATE_YMM |
+				XSTATE_OPMASK | XSTATE_ZMM_Hi256 |
+				XSTATE_Hi16_ZMM, NULL))
+		nova_nt_kernel = NOVA_NT_AVX512;
+#endif
+#ifdef CONFIG_AS_AVX2
+	if (nova_nt_kernel == NOVA_NT_MOVNTI &&
+			boot_cpu_has(X86_FEATURE_AVX2) &&
+			cpu_has_xfeatures(XSTATE_SSE | XSTATE_YMM, NULL))
+		nova_nt_kernel = NOVA_NT_AVX2;
+#endif
+
+	nova_info("Arch new instructions support: PCOMMIT %s, flush %s, "
+			"non-temporal kernel %s\n",
+			support_pcommit ? "YES" : "NO",
+			support_clwb ? "clwb" :
+			support_clflushopt ? "clflushopt" : "clflush",
+			nova_nt_kernel_name[nova_nt_kernel]);
+}
+
+/* @len is a non-zero multiple of 64 and @dst is cacheline aligned */
+static void nova_copy_movnti(void *dst, const void *src, size_t len)
+{
+	asm volatile("1:\n"
+		"movq (%1), %%r8\n"
+		"movq 8(%1), %%r9\n"
+		"movq 16(%1), %%r10\n"
+		"movq 24(%1), %%r11\n"
+		"movnti %%r8, (%0)\n"
+		"movnti %%r9, 8(%0)\n"
+		"movnti %%r10, 16(%0)\n"
+		"movnti %%r11, 24(%0)\n"
+		"movq 32(%1), %%r8\n"
+		"movq 40(%1), %%r9\n"
+		"movq 48(%1), %%r10\n"
+		"movq 56(%1), %%r11\n"
+		"movnti %%r8, 32(%0)\n"
+		"movnti %%r9, 40(%0)\n"
+		"movnti %%r10, 48(%0)\n"
+		"movnti %%r11, 56(%0)\n"
+		"leaq 64(%0), %0\n"
+		"leaq 64(%1), %1\n"
+		"subq $64, %2\n"
+		"jnz 1b\n"
+		: "+r" (dst), "+r" (src), "+r" (len)
+		: : "memory", "r8", "r9", "r10", "r11");
+}
+
+#ifdef CONFIG_AS_AVX2
+static void nova_copy_avx2(void *dst, const void *src, size_t len)
+{
+	asm volatile("1:\n"
+		"vmovdqu (%1), %%ymm0\n"
+		"vmovdqu 32(%1), %%ymm1\n"
+		"vmovntdq %%ymm0, (%0)\n"
+		"vmovntdq %%ymm1, 32(%0)\n"
+		"leaq 64(%0), %0\n"
+		"leaq 64(%1), %1\n"
+		"subq $64, %2\n"
+		"jnz 1b\n"
+		: "+r" (dst), "+r" (src), "+r" (len) : : "memory");
+}
+
+static void nova_zero_avx2(void *dst, size_t len)
+{
+	asm volatile("vpxor %%ymm0, %%ymm0, %%ymm0\n"
+		"1:\n"
+		"vmovntdq %%ymm0, (%0)\n"
+		"vmovntdq %%ymm0, 32(%0)\n"
+		"leaq 64(%0), %0\n"
+		"subq $64, %1\n"
+		"jnz 1b\n"
+		: "+r" (dst), "+r" (len) : : "memory");
+}
+#endif
+
+#ifdef CONFIG_AS_AVX512
+static void nova_copy_avx512(void *dst, const void *src, size_t len)
+{
+	asm volatile("1:\n"
+		"vmovdqu64 (%1), %%zmm0\n"
+		"vmovntdq %%zmm0, (%0)\n"
+		"leaq 64(%0), %0\n"
+		"leaq 64(%1), %1\n"
+		"subq $64, %2\n"
+		"jnz 1b\n"
+		: "+r" (dst), "+r" (src), "+r" (len) : : "memory");
+}
+
+static void nova_zero_avx512(void *dst, size_t len)
+{
+	asm volatile("vpxorq %%zmm0, %%zmm0, %%zmm0\n"
+		"1:\n"
+		"vmovntdq %%zmm0, (%0)\n"
+		"leaq 64(%0), %0\n"
+		"subq $64, %1\n"
+		"jnz 1b\n"
+		: "+r" (dst), "+r" (len) : : "memory");
+}
+#endif
+
+static inline bool nova_nt_use_fpu(size_t len)
+{
+	return nova_nt_kernel != NOVA_NT_MOVNTI && len >= NT_FPU_MIN &&
+		irq_fpu_usable();
+}
+
+/* Copy whole cachelines to an aligned destination */
+static void nova_copy_lines_nt(void *dst, const void *src, size_t len)
+{
+	size_t chunk;
+
+	if (!nova_nt_use_fpu(len)) {
+		nova_copy_movnti(dst, src, len);
+		return;
+	}
+
+	while (len) {
+		chunk = min_t(size_t, len, NT_FPU_CHUNK);
+		kernel_fpu_begin();
+		switch (nova_nt_kernel) {
+#ifdef CONFIG_AS_AVX512
+		case NOVA_NT_AVX512:
+			nova_copy_avx512(dst, src, chunk);
+			break;
+#endif
+#ifdef CONFIG_AS_AVX2
+		case NOVA_NT_AVX2:
+			nova_copy_avx2(dst, src, chunk);
+			break;
+#endif
+		default:
+			nova_copy_movnti(dst, src, chunk);
+			break;
+		}
+		kernel_fpu_end();
+		dst += chunk;
+		src += chunk;
+		len -= chunk;
+	}
+}
+
+/*
+ * Copy from kernel memory to NVMM, bypassing the cache where possible.
+ * Partial cachelines at either end are copied and written back instead.
+ */
+void nova_memcpy_nt(void *dst, const void *src, size_t len)
+{
+	size_t head, body;
+
+	head = min_t(size_t, len,
+		CACHELINE_ALIGN((unsigned long)dst) - (unsigned long)dst);
+	if (head) {
+		memcpy(dst, src, head);
+		nova_flush_buffer(dst, head, 0);
+		dst += head;
+		src += head;
+		len -= head;
+	}
+
+	body = len & CACHELINE_MASK;
+	if (body) {
+		nova_copy_lines_nt(dst, src, body);
+		dst += body;
+		src += body;
+		len -= body;
+	}
+
+	if (len) {
+		memcpy(dst, src, len);
+		nova_flush_buffer(dst, len, 0);
+	}
+}
+
+/*
+ * Zero a large NVMM range with the vector kernels. Returns how many bytes
+ * were zeroed from @dst, which may be none; memset_nt() does the rest.
+ */
+size_t nova_zero_nt(void *dst, size_t len)
+{
+	size_t done = 0;
+	size_t chunk;
+
+	if (((unsigned long)dst & (CACHELINE_SIZE - 1)) ||
+			!nova_nt_use_fpu(len))
+		return 0;
+
+	len &= CACHELINE_MASK;
+	while (done < len) {
+		chunk = min_t(size_t, len - done, NT_FPU_CHUNK);
+		kernel_fpu_begin();
+		switch (nova_nt_kernel) {
+#ifdef CONFIG_AS_AVX512
+		case NOVA_NT_AVX512:
+			nova_zero_avx512(dst + done, chunk);
+			break;
+#endif
+#ifdef CONFIG_AS_AVX2
+		case NOVA_NT_AVX2:
+			nova_zero_avx2(dst + done, chunk);
+			break;
+#endif
+		default:
+			kernel_fpu_end();
+			return done;
+		}
+		kernel_fpu_end();
+		done += chunk;
+	}
+
+	return done;
+}
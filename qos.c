@@ -0,0 +1,291 @@
+/*
+ * NOVA tenant QoS.
+ *
+ * A tenant is the group owning a file. Each configured tenant gets a cap
+ * on the data blocks its files may allocate and a token bucket for the
+ * bytes they write. Foreground writes wait for tokens before the data
+ * copy; log cleaning takes its tokens without waiting, so the debt it
+ * leaves is paid by the next writes of the tenant whose log was cleaned.
+ *
+ * Tenants are set through /proc/fs/NOVA/<dev>/qos. Usage counts the
+ * blocks allocated and freed since the tenant was set; it is not
+ * persistent and not moved by chgrp.
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/capability.h>
+#include <linux/fs.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include "nova.h"
+
+/* Caller holds qos_lock */
+static struct nova_qos_tenant *nova_qos_find(struct nova_sb_info *sbi,
+	u32 gid)
+{
+	int i;
+
+	for (i = 0; i < NOVA_QOS_TENANTS; i++)
+		if (sbi->qos[i].active && sbi->qos[i].gid == gid)
+			return &sbi->qos[i];
+	return NULL;
+}
+
+/* Add the tokens earned since the last refill, up to the burst size */
+static void nova_qos_refill(struct nova_qos_tenant *t, u64 now)
+{
+	s64 burst = div_u64(t->write_bps, NOVA_QOS_BURST_DIV);
+	u64 delta_us = div_u64(now - t->last_refill, NSEC_PER_USEC);
+
+	if (delta_us > USEC_PER_SEC)
+		delta_us = USEC_PER_SEC;
+	t->tokens += div_u64(delta_us * t->write_bps, USEC_PER_SEC);
+	if (t->tokens > burst)
+		t->tokens = burst;
+	t->last_refill = now;
+}
+
+/*
+ * Take @bytes of write tokens from the tenant of @gid. Returns how long
+ * the caller should wait to bring the bucket out of debt, in ns.
+ */
+static u64 nova_qos_take_tokens(struct super_block *sb, u32 gid,
+	size_t bytes, int background)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_qos_tenant *t;
+	u64 wait = 0;
+
+	spin_lock(&sbi->qos_lock);
+	t = nova_qos_find(sbi, gid);
+	if (!t)
+		goto out;
+
+	if (background)
+		t->bg_bytes += bytes;
+	else
+		t->write_bytes += bytes;
+	if (t->write_bps == 0)
+		goto out;
+
+	nova_qos_refill(t, ktime_get_ns());
+	t->tokens -= bytes;
+	/* Keep background debt within a second of writes */
+	if (background && t->tokens < -(s64)t->write_bps)
+		t->tokens = -(s64)t->write_bps;
+	if (t->tokens < 0 && !background) {
+		wait = div64_u64((u64)-t->tokens * USEC_PER_SEC,
+					t->write_bps) * NSEC_PER_USEC;
+		t->throttled++;
+		t->throttle_ns += wait;
+	}
+out:
+	spin_unlock(&sbi->qos_lock);
+	return wait;
+}
+
+/* Wait for the tokens of a @bytes write to @inode, before the data copy */
+void nova_qos_throttle_write(struct super_block *sb, struct inode *inode,
+	size_t bytes)
+{
+	u64 wait;
+
+	if (!READ_ONCE(NOVA_SB(sb)->qos_count) || bytes == 0)
+		return;
+
+	wait = nova_qos_take_tokens(sb, i_gid_read(inode), bytes, 0);
+	if (wait == 0)
+		return;
+
+	NOVA_STATS_ADD(qos_throttles, 1);
+	set_current_state(TASK_KILLABLE);
+	schedule_timeout(nsecs_to_jiffies(wait) ?: 1);
+}
+
+/* Bill background work done for @pi, such as log cleaning, without waiting */
+void nova_qos_charge_background(struct super_block *sb, struct nova_inode *pi,
+	size_t bytes)
+{
+	if (!READ_ONCE(NOVA_SB(sb)->qos_count))
+		return;
+
+	nova_qos_take_tokens(sb, le32_to_cpu(pi->i_gid), bytes, 1);
+}
+
+/*
+ * Reserve up to @num data blocks for @pi under its tenant's cap. Returns
+ * the number reserved, which may be less than @num, or -EDQUOT when the
+ * tenant is at its cap. Give back what was not allocated with
+ * nova_qos_uncharge_blocks().
+ */
+int nova_qos_charge_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned int num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_qos_tenant *t;
+	int ret = num;
+
+	if (!READ_ONCE(sbi->qos_count))
+		return num;
+
+	spin_lock(&sbi->qos_lock);
+	t = nova_qos_find(sbi, le32_to_cpu(pi->i_gid));
+	if (!t || t->max_blocks == 0)
+		goto out;
+
+	if (t->used_blocks >= t->max_blocks) {
+		t->denied++;
+		ret = -EDQUOT;
+		goto out;
+	}
+	if (t->used_blocks + num > t->max_blocks)
+		ret = t->max_blocks - t->used_blocks;
+out:
+	if (t && ret > 0)
+		t->used_blocks += ret;
+	spin_unlock(&sbi->qos_lock);
+
+	if (ret < 0)
+		NOVA_STATS_ADD(qos_denied, 1);
+	return ret;
+}
+
+void nova_qos_uncharge_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned long num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_qos_tenant *t;
+
+	if (!READ_ONCE(sbi->qos_count) || num == 0)
+		return;
+
+	spin_lock(&sbi->qos_lock);
+	t = nova_qos_find(sbi, le32_to_cpu(pi->i_gid));
+	if (t) {
+		/* Blocks allocated before the tenant was set */
+		if (t->used_blocks < num)
+			t->used_blocks = 0;
+		else
+			t->used_blocks -= num;
+	}
+	spin_unlock(&sbi->qos_lock);
+}
+
+/* Set, update or with both limits 0 remove the tenant of @gid */
+static int nova_qos_set_tenant(struct super_block *sb, u32 gid,
+	unsigned long max_blocks, u64 write_bps)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_qos_tenant *t;
+	int i, ret = 0;
+
+	spin_lock(&sbi->qos_lock);
+	t = nova_qos_find(sbi, gid);
+	if (!max_blocks && !write_bps) {
+		if (t) {
+			t->active = 0;
+			sbi->qos_count--;
+		}
+		goto out;
+	}
+
+	if (!t) {
+		for (i = 0; i < NOVA_QOS_TENANTS; i++)
+			if (!sbi->qos[i].active)
+				break;
+		if (i == NOVA_QOS_TENANTS) {
+			ret = -ENOSPC;
+			goto out;
+		}
+		t = &sbi->qos[i];
+		memset(t, 0, sizeof(*t));
+		t->gid = gid;
+		t->active = 1;
+		t->last_refill = ktime_get_ns();
+		sbi->qos_count++;
+	}
+	t->max_blocks = max_blocks;
+	t->write_bps = write_bps;
+	t->tokens = div_u64(write_bps, NOVA_QOS_BURST_DIV);
+out:
+	spin_unlock(&sbi->qos_lock);
+	return ret;
+}
+
+int nova_qos_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_qos_tenant *t, copy;
+	int i;
+
+	seq_printf(seq, "======== NOVA tenant QoS ========\n");
+	for (i = 0; i < NOVA_QOS_TENANTS; i++) {
+		t = &sbi->qos[i];
+		spin_lock(&sbi->qos_lock);
+		copy = *t;
+		spin_unlock(&sbi->qos_lock);
+		if (!copy.active)
+			continue;
+
+		seq_printf(seq, "gid %u: blocks %lu, max blocks %lu, "
+			"write limit %llu B/s, written %llu, background %llu, "
+			"throttled %llu (%llu us), denied %llu\n",
+			copy.gid, copy.used_blocks, copy.max_blocks,
+			copy.write_bps, copy.write_bytes, copy.bg_bytes,
+			copy.throttled, div_u64(copy.throttle_ns,
+						NSEC_PER_USEC),
+			copy.denied);
+	}
+
+	return 0;
+}
+
+/* "<gid> <max blocks> <write bytes per second>", 0 is unlimited */
+ssize_t nova_qos_write(struct super_block *sb, const char __user *buf,
+	size_t len)
+{
+	char kbuf[64];
+	unsigned long max_blocks;
+	unsigned long long write_bps;
+	unsigned int gid;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (len == 0 || len >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, buf, len))
+		return -EFAULT;
+	kbuf[len] = '\0';
+
+	if (sscanf(kbuf, "%u %lu %llu", &gid, &max_blocks, &write_bps) != 3)
+		return -EINVAL;
+	if (write_bps > NOVA_QOS_MAX_BPS)
+		return -EINVAL;
+
+	ret = nova_qos_set_tenant(sb, gid, max_blocks, write_bps);
+	if (ret)
+		return ret;
+
+	nova_info("NOVA: tenant gid %u: max blocks %lu, write limit %llu B/s\n",
+			gid, max_blocks, write_bps);
+	return len;
+}
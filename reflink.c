@@ -0,0 +1,888 @@
+/*
+ * NOVA file clones.
+ *
+ * A clone shares the data blocks of a source range with the destination
+ * instead of copying them. The blocks are already immutable, so all it
+ * takes is log entries: the source re-maps the range with entries flagged
+ * NOVA_WRITE_SHARED, which only invalidates its old entries, and the
+ * destination maps the same blocks at its own offset with flagged entries
+ * too. Blocks owned by more than one file are counted in sbi->shared_tree;
+ * dropping a block returns it to the allocator only with its last owner.
+ *
+ * Shared blocks are never written in place. In-place appends fall back to
+ * COW, and partial block zeroing and mmap write faults first give the
+ * file its own copy of the block.
+ *
+ * The owner counts live in DRAM. They are saved in the log of
+ * NOVA_SHARED_INO at clean unmount, and after a crash the full scan
+ * rebuilds them by counting the flagged entries that are still live. An
+ * allocator checkpoint does not know about them, so checkpoint recovery
+ * is refused while NOVA_SHARED_BLOCKS_FL is set, from the first clone
+ * until an unmount finds nothing shared.
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include "nova.h"
+
+static inline struct nova_inode *nova_shared_inode(struct super_block *sb)
+{
+	return nova_get_inode_by_ino(sb, NOVA_SHARED_INO);
+}
+
+static inline struct nova_shared_node *nova_rb_shared(struct rb_node *node)
+{
+	return node ? rb_entry(node, struct nova_shared_node, node) : NULL;
+}
+
+static inline unsigned long nova_shared_len(struct nova_shared_node *node)
+{
+	return node->range_high - node->range_low + 1;
+}
+
+/* ========================= Owner counts ========================= */
+
+/* The first node that ends at or after blocknr */
+static struct nova_shared_node *nova_shared_search(struct nova_sb_info *sbi,
+	unsigned long blocknr)
+{
+	struct rb_node *temp = sbi->shared_tree.rb_node;
+	struct nova_shared_node *curr, *found = NULL;
+
+	while (temp) {
+		curr = nova_rb_shared(temp);
+		if (curr->range_high < blocknr) {
+			temp = temp->rb_right;
+		} else {
+			found = curr;
+			if (curr->range_low <= blocknr)
+				break;
+			temp = temp->rb_left;
+		}
+	}
+
+	return found;
+}
+
+static void nova_shared_insert(struct nova_sb_info *sbi,
+	struct nova_shared_node *new_node)
+{
+	struct rb_node **temp = &sbi->shared_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct nova_shared_node *curr;
+
+	while (*temp) {
+		curr = nova_rb_shared(*temp);
+		parent = *temp;
+		if (new_node->range_low < curr->range_low)
+			temp = &((*temp)->rb_left);
+		else
+			temp = &((*temp)->rb_right);
+	}
+
+	rb_link_node(&new_node->node, parent, temp);
+	rb_insert_color(&new_node->node, &sbi->shared_tree);
+	sbi->shared_blocks += nova_shared_len(new_node);
+}
+
+static void nova_shared_erase(struct nova_sb_info *sbi,
+	struct nova_shared_node *node)
+{
+	rb_erase(&node->node, &sbi->shared_tree);
+	sbi->shared_blocks -= nova_shared_len(node);
+	kfree(node);
+}
+
+/* Fold node into its predecessor if they touch and have equal counts */
+static void nova_shared_merge(struct nova_sb_info *sbi,
+	struct nova_shared_node *node)
+{
+	struct nova_shared_node *prev = nova_rb_shared(rb_prev(&node->node));
+
+	if (!prev || prev->range_high + 1 != node->range_low ||
+			prev->owners != node->owners)
+		return;
+
+	prev->range_high = node->range_high;
+	rb_erase(&node->node, &sbi->shared_tree);
+	kfree(node);
+}
+
+/* Cut node at blocknr and return the upper half */
+static struct nova_shared_node *nova_shared_split(struct nova_sb_info *sbi,
+	struct nova_shared_node *node, unsigned long blocknr,
+	struct nova_shared_node *spare)
+{
+	spare->range_low = blocknr;
+	spare->range_high = node->range_high;
+	spare->owners = node->owners;
+	node->range_high = blocknr - 1;
+	sbi->shared_blocks -= nova_shared_len(spare);
+	nova_shared_insert(sbi, spare);
+	return spare;
+}
+
+/*
+ * Allocate the nodes an update of [low, high] can consume: two for
+ * splitting the boundaries and, if gaps is set, one for each gap, so that
+ * the update itself cannot fail halfway. Caller holds shared_mutex.
+ */
+static struct nova_shared_node **nova_shared_reserve(struct nova_sb_info *sbi,
+	unsigned long low, unsigned long high, bool gaps, int *num)
+{
+	struct nova_shared_node **spares;
+	struct nova_shared_node *curr;
+	int needed = 2;
+	int i;
+
+	if (gaps) {
+		needed++;
+		curr = nova_shared_search(sbi, low);
+		while (curr && curr->range_low <= high) {
+			needed++;
+			curr = nova_rb_shared(rb_next(&curr->node));
+		}
+	}
+
+	spares = kmalloc_array(needed, sizeof(*spares), GFP_NOFS);
+	if (!spares)
+		return NULL;
+
+	for (i = 0; i < needed; i++) {
+		spares[i] = kmalloc(sizeof(struct nova_shared_node), GFP_NOFS);
+		if (!spares[i]) {
+			while (i--)
+				kfree(spares[i]);
+			kfree(spares);
+			return NULL;
+		}
+	}
+
+	*num = needed;
+	return spares;
+}
+
+static void nova_shared_unreserve(struct nova_shared_node **spares, int num)
+{
+	while (num--)
+		kfree(spares[num]);
+	kfree(spares);
+}
+
+/*
+ * Add delta to the owner count of every block in [low, high]. Blocks that
+ * are not in the tree have one owner: if gap_owners is set they enter it
+ * with that count, otherwise they are passed to release, having just lost
+ * their only owner. Nodes that drop to one owner leave the tree.
+ */
+static int nova_shared_update(struct super_block *sb, struct nova_inode *pi,
+	unsigned long low, unsigned long high, int delta,
+	unsigned long gap_owners, nova_release_fn release)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_shared_node **spares;
+	struct nova_shared_node *curr, *next;
+	unsigned long pos = low, end;
+	int num_spares;
+	int ret = 0, err;
+
+	spares = nova_shared_reserve(sbi, low, high, gap_owners != 0,
+					&num_spares);
+	if (!spares)
+		return -ENOMEM;
+
+	curr = nova_shared_search(sbi, low);
+	while (pos <= high) {
+		if (!curr || curr->range_low > pos) {
+			end = curr && curr->range_low <= high ?
+					curr->range_low - 1 : high;
+			if (gap_owners) {
+				next = spares[--num_spares];
+				next->range_low = pos;
+				next->range_high = end;
+				next->owners = gap_owners;
+				nova_shared_insert(sbi, next);
+				nova_shared_merge(sbi, next);
+			} else if (release) {
+				err = release(sb, pi, pos, end - pos + 1);
+				if (err && !ret)
+					ret = err;
+			}
+			pos = end + 1;
+			continue;
+		}
+
+		if (curr->range_low < pos)
+			curr = nova_shared_split(sbi, curr, pos,
+						spares[--num_spares]);
+		if (curr->range_high > high)
+			nova_shared_split(sbi, curr, high + 1,
+						spares[--num_spares]);
+
+		next = nova_rb_shared(rb_next(&curr->node));
+		pos = curr->range_high + 1;
+		curr->owners += delta;
+		if (delta < 0 && curr->owners <= 1)
+			nova_shared_erase(sbi, curr);
+		else
+			nova_shared_merge(sbi, curr);
+		curr = next;
+	}
+
+	nova_shared_unreserve(spares, num_spares);
+	return ret;
+}
+
+/* Add an owner to [blocknr, blocknr + num) */
+static int nova_share_blocks(struct super_block *sb, unsigned long blocknr,
+	unsigned long num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int ret;
+
+	mutex_lock(&sbi->shared_mutex);
+	ret = nova_shared_update(sb, NULL, blocknr, blocknr + num - 1, 1, 2,
+					NULL);
+	mutex_unlock(&sbi->shared_mutex);
+	return ret;
+}
+
+/*
+ * Drop one owner of [blocknr, blocknr + num) and pass the blocks that had
+ * no other owner to release. If the counts cannot be updated the blocks
+ * are leaked rather than freed under another owner.
+ */
+int nova_put_shared_blocks(struct super_block *sb, struct nova_inode *pi,
+	unsigned long blocknr, int num, nova_release_fn release)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int ret;
+
+	mutex_lock(&sbi->shared_mutex);
+	ret = nova_shared_update(sb, pi, blocknr, blocknr + num - 1, -1, 0,
+					release);
+	mutex_unlock(&sbi->shared_mutex);
+
+	if (ret == -ENOMEM)
+		nova_err(sb, "%s: leaking blocks %lu - %lu\n", __func__,
+				blocknr, blocknr + num - 1);
+	return ret;
+}
+
+/* Does any block in [blocknr, blocknr + num) have more than one owner? */
+bool nova_blocks_shared(struct super_block *sb, unsigned long blocknr,
+	unsigned long num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_shared_node *curr;
+	bool shared;
+
+	if (!nova_has_shared_blocks(sb))
+		return false;
+
+	mutex_lock(&sbi->shared_mutex);
+	curr = nova_shared_search(sbi, blocknr);
+	shared = curr && curr->range_low < blocknr + num;
+	mutex_unlock(&sbi->shared_mutex);
+
+	return shared;
+}
+
+/* Does the file map a shared block anywhere in [pgoff, pgoff + num)? */
+bool nova_range_shared(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long pgoff,
+	unsigned long num)
+{
+	struct nova_file_write_entry *entry;
+	unsigned long end = pgoff + num;
+	unsigned long start, num_pages;
+
+	if (!nova_has_shared_blocks(sb))
+		return false;
+
+	while (pgoff < end) {
+		entry = nova_find_next_extent(sih, pgoff, &start, &num_pages);
+		if (!entry || start >= end)
+			break;
+
+		num_pages = min(num_pages, end - start);
+		if (nova_entry_shared(entry) && nova_blocks_shared(sb,
+				get_nvmm(sb, sih, entry, start), num_pages))
+			return true;
+		pgoff = start + num_pages;
+	}
+
+	return false;
+}
+
+void nova_destroy_shared_blocks(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_shared_node *curr;
+	struct rb_node *temp;
+
+	mutex_lock(&sbi->shared_mutex);
+	temp = rb_first(&sbi->shared_tree);
+	while (temp) {
+		curr = nova_rb_shared(temp);
+		temp = rb_next(temp);
+		rb_erase(&curr->node, &sbi->shared_tree);
+		kfree(curr);
+	}
+	sbi->shared_blocks = 0;
+	mutex_unlock(&sbi->shared_mutex);
+}
+
+/* ====================== Persistent state ====================== */
+
+static inline bool nova_shared_flag(struct super_block *sb)
+{
+	return le32_to_cpu(nova_shared_inode(sb)->i_flags) &
+					NOVA_SHARED_BLOCKS_FL;
+}
+
+static void nova_set_shared_flag(struct super_block *sb, bool set)
+{
+	struct nova_inode *pi = nova_shared_inode(sb);
+	u32 flags = le32_to_cpu(pi->i_flags);
+
+	if (!!(flags & NOVA_SHARED_BLOCKS_FL) == set)
+		return;
+
+	if (set)
+		flags |= NOVA_SHARED_BLOCKS_FL;
+	else
+		flags &= ~NOVA_SHARED_BLOCKS_FL;
+
+	nova_memunlock_inode(sb, pi);
+	pi->i_flags = cpu_to_le32(flags);
+	nova_memlock_inode(sb, pi);
+	nova_flush_buffer(&pi->i_flags, sizeof(pi->i_flags), 1);
+}
+
+/* Can the allocator state be trusted without rebuilding the counts? */
+bool nova_shared_blocks_logged(struct super_block *sb)
+{
+	return nova_shared_flag(sb);
+}
+
+/*
+ * Failure recovery: count one more owner for [blocknr, blocknr + num),
+ * which a live shared entry maps. Blocks start with no owners here.
+ */
+int nova_count_shared_blocks(struct super_block *sb, unsigned long blocknr,
+	unsigned long num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int ret;
+
+	mutex_lock(&sbi->shared_mutex);
+	ret = nova_shared_update(sb, NULL, blocknr, blocknr + num - 1, 1, 1,
+					NULL);
+	mutex_unlock(&sbi->shared_mutex);
+
+	if (ret)
+		nova_err(sb, "%s: failed to count blocks %lu - %lu: %d\n",
+				__func__, blocknr, blocknr + num - 1, ret);
+	return ret;
+}
+
+/* After the scan: forget the blocks only one file still maps */
+void nova_prune_shared_blocks(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_shared_node *curr;
+	struct rb_node *temp;
+
+	mutex_lock(&sbi->shared_mutex);
+	temp = rb_first(&sbi->shared_tree);
+	while (temp) {
+		curr = nova_rb_shared(temp);
+		temp = rb_next(temp);
+		if (curr->owners <= 1)
+			nova_shared_erase(sbi, curr);
+		else
+			nova_shared_merge(sbi, curr);
+	}
+	mutex_unlock(&sbi->shared_mutex);
+
+	nova_set_shared_flag(sb, nova_has_shared_blocks(sb));
+	nova_dbg("%s: %lu shared blocks\n", __func__, sbi->shared_blocks);
+}
+
+/* Clean unmount: write the counts to the log of NOVA_SHARED_INO */
+void nova_save_shared_blocks(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_shared_inode(sb);
+	size_t size = sizeof(struct nova_shared_entry);
+	struct nova_shared_entry *entry;
+	struct nova_shared_node *curr;
+	struct rb_node *temp;
+	unsigned long num_nodes = 0;
+	unsigned long num_pages;
+	u64 new_block, curr_p;
+	int allocated;
+
+	for (temp = rb_first(&sbi->shared_tree); temp; temp = rb_next(temp))
+		num_nodes++;
+
+	if (num_nodes == 0) {
+		nova_set_shared_flag(sb, false);
+		return;
+	}
+
+	num_pages = DIV_ROUND_UP(num_nodes, LAST_ENTRY / size);
+	allocated = nova_allocate_inode_log_pages(sb, pi, num_pages,
+						&new_block);
+	if (allocated != num_pages) {
+		/* The flag stays set, so the next mount rebuilds the counts */
+		nova_dbg("Error saving shared blocks: %d\n", allocated);
+		return;
+	}
+
+	pi->log_head = new_block;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+
+	curr_p = new_block;
+	for (temp = rb_first(&sbi->shared_tree); temp; temp = rb_next(temp)) {
+		curr = nova_rb_shared(temp);
+		if (is_last_entry(curr_p, size))
+			curr_p = next_log_page(sb, curr_p);
+
+		entry = (struct nova_shared_entry *)nova_get_block(sb, curr_p);
+		entry->range_low = cpu_to_le64(curr->range_low);
+		entry->range_high = cpu_to_le64(curr->range_high);
+		entry->owners = cpu_to_le64(curr->owners);
+		nova_flush_buffer(entry, size, 0);
+		curr_p += size;
+	}
+
+	nova_update_tail(pi, curr_p);
+
+	nova_dbg("%s: %lu shared nodes, pi head 0x%llx, tail 0x%llx\n",
+		__func__, num_nodes, pi->log_head, pi->log_tail);
+}
+
+/* Clean mount: read the counts saved at unmount back and free their log */
+int nova_load_shared_blocks(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_shared_inode(sb);
+	size_t size = sizeof(struct nova_shared_entry);
+	struct nova_shared_entry *entry;
+	struct nova_shared_node *node;
+	u64 curr_p;
+	int ret = 0;
+
+	if (!nova_shared_flag(sb))
+		return 0;
+
+	if (pi->log_head == 0) {
+		nova_dbg("%s: pi head is 0!\n", __func__);
+		return -EINVAL;
+	}
+
+	curr_p = pi->log_head;
+	while (curr_p != pi->log_tail) {
+		if (is_last_entry(curr_p, size))
+			curr_p = next_log_page(sb, curr_p);
+
+		if (curr_p == 0) {
+			ret = -EINVAL;
+			break;
+		}
+
+		entry = (struct nova_shared_entry *)nova_get_block(sb, curr_p);
+		node = kmalloc(sizeof(struct nova_shared_node), GFP_KERNEL);
+		if (!node) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		node->range_low = le64_to_cpu(entry->range_low);
+		node->range_high = le64_to_cpu(entry->range_high);
+		node->owners = le64_to_cpu(entry->owners);
+		if (node->range_high < node->range_low || node->owners < 2 ||
+				node->range_high >= sbi->num_blocks) {
+			kfree(node);
+			ret = -EINVAL;
+			break;
+		}
+
+		nova_shared_insert(sbi, node);
+		curr_p += size;
+	}
+
+	nova_free_inode_log(sb, pi);
+	if (ret)
+		nova_destroy_shared_blocks(sb);
+
+	nova_dbg("%s: %lu shared blocks, ret %d\n", __func__,
+			sbi->shared_blocks, ret);
+	return ret;
+}
+
+/* ========================== Unsharing ========================== */
+
+/*
+ * Give the file its own copy of the block at pgoff if that block is
+ * shared, before it is changed in place. The new entry logs size as the
+ * file size. Caller holds i_mutex.
+ */
+int nova_unshare_block(struct super_block *sb, struct inode *inode,
+	unsigned long pgoff, loff_t size)
+{
+	struct nova_inode_info_header *sih = &NOVA_I(inode)->header;
+	struct nova_file_write_entry *entry;
+	struct nova_file_write_entry entry_data;
+	struct nova_inode *pi;
+	unsigned long nvmm, blocknr = 0;
+	u64 curr_entry;
+	int allocated;
+	int ret;
+
+	entry = nova_find_extent(sih, pgoff, NULL);
+	if (!entry || !nova_entry_shared(entry))
+		return 0;
+
+	nvmm = get_nvmm(sb, sih, entry, pgoff);
+	if (!nova_blocks_shared(sb, nvmm, 1))
+		return 0;
+
+	pi = nova_get_inode(sb, inode);
+	allocated = nova_new_data_blocks(sb, pi, &blocknr, 1, pgoff, 0, 1);
+	if (allocated <= 0)
+		return allocated ? allocated : -ENOSPC;
+
+	memcpy_to_pmem_nocache(nova_get_block(sb, blocknr << PAGE_SHIFT),
+			nova_get_block(sb, nvmm << PAGE_SHIFT), PAGE_SIZE);
+
+	entry_data.pgoff = cpu_to_le64(pgoff);
+	entry_data.num_pages = cpu_to_le32(1);
+	entry_data.invalid_pages = 0;
+	entry_data.block = cpu_to_le64(nova_get_block_off(sb, blocknr,
+							pi->i_blk_type));
+	nova_set_entry_type((void *)&entry_data, FILE_WRITE);
+	entry_data.mtime = cpu_to_le32(inode->i_mtime.tv_sec);
+	entry_data.padding = 0;
+	entry_data.size = cpu_to_le64(size);
+
+	curr_entry = nova_append_file_write_entry(sb, pi, inode,
+							&entry_data, 0);
+	if (curr_entry == 0) {
+		nova_free_data_blocks(sb, pi, blocknr, 1);
+		return -ENOSPC;
+	}
+
+	nova_memunlock_window(sb);
+	le64_add_cpu(&pi->i_blocks, 1);
+	nova_update_tail(pi, curr_entry + sizeof(entry_data));
+	nova_memlock_window(sb);
+
+	if (mapping_mapped(inode->i_mapping))
+		unmap_mapping_range(inode->i_mapping,
+				(loff_t)pgoff << PAGE_SHIFT, PAGE_SIZE, 0);
+
+	/* Drops this file's share of the old block */
+	ret = nova_reassign_file_tree(sb, pi, sih, curr_entry);
+	inode->i_blocks = le64_to_cpu(pi->i_blocks);
+
+	NOVA_STATS_ADD(unshared_pages, 1);
+	return ret;
+}
+
+/* =========================== Cloning =========================== */
+
+/* Drop the shares taken for the dst entries in [begin, end) */
+static void nova_unshare_logged_blocks(struct super_block *sb,
+	struct nova_inode *pi, u64 begin, u64 end)
+{
+	struct nova_file_write_entry *entry;
+	size_t entry_size = sizeof(struct nova_file_write_entry);
+	u64 curr_p = begin;
+
+	while (curr_p && curr_p != end) {
+		if (is_last_entry(curr_p, entry_size))
+			curr_p = next_log_page(sb, curr_p);
+
+		entry = (struct nova_file_write_entry *)
+					nova_get_block(sb, curr_p);
+		if (nova_get_entry_type(entry) == FILE_WRITE &&
+				nova_entry_shared(entry))
+			nova_put_shared_blocks(sb, pi, entry->block >>
+					PAGE_SHIFT, entry->num_pages, NULL);
+		curr_p += entry_size;
+	}
+}
+
+static void nova_fill_clone_entry(struct nova_file_write_entry *entry,
+	unsigned long pgoff, unsigned long num, u64 block, u32 time,
+	loff_t size)
+{
+	entry->pgoff = cpu_to_le64(pgoff);
+	entry->num_pages = cpu_to_le32(num);
+	entry->invalid_pages = 0;
+	entry->block = cpu_to_le64(block);
+	/* Set entry type after set block */
+	nova_set_entry_type((void *)entry, FILE_WRITE);
+	entry->mtime = cpu_to_le32(time);
+	entry->padding = 0;
+	entry->size = cpu_to_le64(size);
+}
+
+/*
+ * Map src pages [first, first + num) into dst at dfirst. Holes and
+ * unwritten extents of the source become holes in the destination. Runs
+ * are cut where either file's extents change, so that a run the
+ * destination already maps to the same blocks, as after an earlier clone,
+ * is recognized and skipped instead of counted twice. Caller holds both
+ * i_mutexes.
+ */
+static int nova_clone_blocks(struct super_block *sb, struct inode *src,
+	struct inode *dst, unsigned long first, unsigned long dfirst,
+	unsigned long num)
+{
+	struct nova_inode_info_header *src_sih = &NOVA_I(src)->header;
+	struct nova_inode_info_header *dst_sih = &NOVA_I(dst)->header;
+	struct nova_inode *src_pi = nova_get_inode(sb, src);
+	struct nova_inode *dst_pi = nova_get_inode(sb, dst);
+	struct nova_file_write_entry *entry, *dentry;
+	struct nova_file_write_entry entry_data;
+	size_t entry_size = sizeof(struct nova_file_write_entry);
+	unsigned long pgoff = first, end = first + num;
+	unsigned long dpgoff, n, num_pages, next_pgoff, nvmm = 0;
+	unsigned long shared = 0;
+	u64 src_tail = src_pi->log_tail, dst_tail = dst_pi->log_tail;
+	u64 src_begin = 0, dst_begin = 0, curr_entry, block;
+	u32 time = dst->i_mtime.tv_sec;
+	int ret = 0;
+
+	nova_set_shared_flag(sb, true);
+
+	while (pgoff < end) {
+		dpgoff = dfirst + pgoff - first;
+		n = end - pgoff;
+
+		entry = nova_find_extent(src_sih, pgoff, &num_pages);
+		if (entry)
+			n = min(n, num_pages);
+		else if (nova_find_next_extent(src_sih, pgoff, &next_pgoff,
+							NULL))
+			n = min(n, next_pgoff - pgoff);
+
+		dentry = nova_find_extent(dst_sih, dpgoff, &num_pages);
+		if (dentry)
+			n = min(n, num_pages);
+		else if (nova_find_next_extent(dst_sih, dpgoff, &next_pgoff,
+							NULL))
+			n = min(n, next_pgoff - dpgoff);
+
+		if (!entry || nova_entry_unwritten(entry)) {
+			if (!dentry)
+				goto next;
+			block = NOVA_WRITE_HOLE;
+			goto log_dst;
+		}
+
+		nvmm = get_nvmm(sb, src_sih, entry, pgoff);
+		if (dentry && !nova_entry_unwritten(dentry) &&
+				get_nvmm(sb, dst_sih, dentry, dpgoff) == nvmm)
+			goto next;
+
+		ret = nova_share_blocks(sb, nvmm, n);
+		if (ret)
+			goto out;
+
+		block = nova_get_block_off(sb, nvmm, NOVA_BLOCK_TYPE_4K) |
+					NOVA_WRITE_SHARED;
+		if (!nova_entry_shared(entry)) {
+			nova_fill_clone_entry(&entry_data, pgoff, n, block,
+					le32_to_cpu(entry->mtime), src->i_size);
+			curr_entry = nova_append_file_write_entry(sb, src_pi,
+						src, &entry_data, src_tail);
+			if (curr_entry == 0)
+				goto undo;
+			if (src_begin == 0)
+				src_begin = curr_entry;
+			src_tail = curr_entry + entry_size;
+		}
+		shared += n;
+
+log_dst:
+		nova_fill_clone_entry(&entry_data, dpgoff, n, block, time,
+					dst->i_size);
+		curr_entry = nova_append_file_write_entry(sb, dst_pi, dst,
+						&entry_data, dst_tail);
+		if (curr_entry == 0) {
+			if (!(block & NOVA_WRITE_SHARED))
+				goto nospc;
+			goto undo;
+		}
+		if (dst_begin == 0)
+			dst_begin = curr_entry;
+		dst_tail = curr_entry + entry_size;
+next:
+		pgoff += n;
+	}
+
+	/* The source owns the blocks it shares. Commit it first */
+	if (src_begin) {
+		nova_memunlock_window(sb);
+		nova_update_tail(src_pi, src_tail);
+		nova_memlock_window(sb);
+	}
+
+	if (dst_begin) {
+		nova_memunlock_window(sb);
+		le64_add_cpu(&dst_pi->i_blocks, shared);
+		nova_update_tail(dst_pi, dst_tail);
+		nova_memlock_window(sb);
+	}
+
+	/* Existing mappings may be writable: fault them in again */
+	if (src_begin && mapping_mapped(src->i_mapping))
+		unmap_mapping_range(src->i_mapping, (loff_t)first << PAGE_SHIFT,
+				(loff_t)num << PAGE_SHIFT, 0);
+	if (dst_begin && mapping_mapped(dst->i_mapping))
+		unmap_mapping_range(dst->i_mapping,
+				(loff_t)dfirst << PAGE_SHIFT,
+				(loff_t)num << PAGE_SHIFT, 0);
+
+	if (src_begin)
+		ret = nova_reassign_file_tree(sb, src_pi, src_sih, src_begin);
+	if (dst_begin && !ret)
+		ret = nova_reassign_file_tree(sb, dst_pi, dst_sih, dst_begin);
+	dst->i_blocks = le64_to_cpu(dst_pi->i_blocks);
+
+	NOVA_STATS_ADD(clone_pages, shared);
+	return ret;
+
+undo:
+	nova_put_shared_blocks(sb, dst_pi, nvmm, n, NULL);
+nospc:
+	ret = -ENOSPC;
+out:
+	/* Nothing was committed; the appended entries are dropped */
+	if (dst_begin)
+		nova_unshare_logged_blocks(sb, dst_pi, dst_begin, dst_tail);
+	return ret;
+}
+
+/*
+ * FICLONE / FICLONERANGE: share src [off, off + len) with dst at destoff.
+ * len 0 clones to the end of the source. Offsets must be block aligned,
+ * and so must len unless it ends at the source's EOF and reaches the
+ * destination's. A file cannot be cloned onto itself.
+ */
+long nova_clone_file_range(struct file *src_file, u64 off,
+	struct file *dst_file, u64 destoff, u64 len)
+{
+	struct inode *src = file_inode(src_file);
+	struct inode *dst = file_inode(dst_file);
+	struct super_block *sb = dst->i_sb;
+	struct nova_inode *src_pi, *dst_pi;
+	u64 mask = sb->s_blocksize - 1;
+	long ret;
+	timing_t clone_time;
+
+	if (src_file->f_path.mnt != dst_file->f_path.mnt)
+		return -EXDEV;
+	if (S_ISDIR(src->i_mode) || S_ISDIR(dst->i_mode))
+		return -EISDIR;
+	if (!S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode) || src == dst)
+		return -EINVAL;
+	if (!(src_file->f_mode & FMODE_READ) ||
+			!(dst_file->f_mode & FMODE_WRITE) ||
+			(dst_file->f_flags & O_APPEND))
+		return -EBADF;
+	if (IS_IMMUTABLE(dst) || IS_APPEND(dst))
+		return -EPERM;
+	if ((off | destoff) & mask)
+		return -EINVAL;
+
+	NOVA_START_TIMING(clone_t, clone_time);
+	sb_start_write(sb);
+	lock_two_nondirectories(src, dst);
+
+	src_pi = nova_get_inode(sb, src);
+	dst_pi = nova_get_inode(sb, dst);
+	if (!src_pi || !dst_pi) {
+		ret = -EACCES;
+		goto out;
+	}
+
+	/* The owner counts are kept in 4K blocks */
+	if (src_pi->i_blk_type != NOVA_BLOCK_TYPE_4K ||
+			dst_pi->i_blk_type != NOVA_BLOCK_TYPE_4K) {
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+
+	ret = -EINVAL;
+	if (off > src->i_size)
+		goto out;
+	if (len == 0)
+		len = src->i_size - off;
+	if (off + len < off || off + len > src->i_size ||
+			destoff + len < destoff ||
+			destoff + len > sb->s_maxbytes)
+		goto out;
+	if ((len & mask) && (off + len != src->i_size ||
+				destoff + len < dst->i_size))
+		goto out;
+
+	ret = 0;
+	if (len == 0)
+		goto out;
+
+	ret = nova_convert_inline_data(sb, src_pi, src);
+	if (ret)
+		goto out;
+	ret = nova_convert_inline_data(sb, dst_pi, dst);
+	if (ret)
+		goto out;
+
+	/* The size grows only once the clone has committed */
+	if (destoff + len > dst->i_size) {
+		ret = inode_newsize_ok(dst, destoff + len);
+		if (ret)
+			goto out;
+	}
+
+	dst->i_ctime = dst->i_mtime = CURRENT_TIME_SEC;
+	ret = nova_clone_blocks(sb, src, dst, off >> sb->s_blocksize_bits,
+			destoff >> sb->s_blocksize_bits,
+			(len + mask) >> sb->s_blocksize_bits);
+	if (ret == 0 && destoff + len > dst->i_size) {
+		struct iattr attr = {
+			.ia_valid = ATTR_SIZE,
+			.ia_size = destoff + len,
+		};
+
+		ret = nova_notify_change(dst_file->f_path.dentry, &attr);
+	}
+
+out:
+	unlock_two_nondirectories(src, dst);
+	sb_end_write(sb);
+	NOVA_END_TIMING(clone_t, clone_time);
+	return ret;
+}
@@ -46,6 +46,8 @@ const char *Timingstring[TIMING_NUM] =
 	"cow_write",
 	"copy_to_nvmm",
 	"dax_get_block",
+	"fallocate",
+	"clone",
 
 	"memcpy_read_nvmm",
 	"memcpy_write_nvmm",
@@ -56,11 +58,15 @@ const char *Timingstring[TIMING_NUM] =
 	"new_log_blocks",
 	"free_data_blocks",
 	"free_log_blocks",
+	"deferred_free",
 
 	"transaction_new_inode",
 	"transaction_link_change",
 	"update_tail",
 
+	"wprotect_open",
+	"wprotect_close",
+
 	"append_dir_entry",
 	"append_file_entry",
 	"append_link_change",
@@ -68,6 +74,8 @@ const char *Timingstring[TIMING_NUM] =
 	"log_fast_gc",
 	"log_thorough_gc",
 	"check_invalid_log",
+	"log_cleaner",
+	"checkpoint",
 
 	"find_cache_page",
 	"assign_blocks",
@@ -92,11 +100,14 @@ u64 Countstats[TIMING_NUM];
 DEFINE_PER_CPU(u64[TIMING_NUM], Countstats_percpu);
 u64 IOstats[STATS_NUM];
 DEFINE_PER_CPU(u64[STATS_NUM], IOstats_percpu);
+DEFINE_PER_CPU(u64[TIMING_NUM][LATENCY_BUCKETS], Latencystats_percpu);
 
 static void nova_print_alloc_stats(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct free_list *free_list;
+	struct block_magazine *magazine;
+	struct nova_log_pool *pool;
 	unsigned long alloc_log_count = 0;
 	unsigned long alloc_log_pages = 0;
 	unsigned long alloc_data_count = 0;
@@ -122,6 +133,15 @@ static void nova_print_alloc_stats(struct super_block *sb)
 		IOstats[thorough_checked_pages], IOstats[thorough_gc_pages],
 		Countstats[thorough_gc_t] ?
 			IOstats[thorough_gc_pages] / Countstats[thorough_gc_t] : 0);
+	printk("Log cleaner queued %llu, cleaned inodes %llu\n",
+		IOstats[cleaner_queued], IOstats[cleaner_inodes]);
+	printk("Mount prefetch inodes %llu\n", IOstats[prefetch_inodes]);
+	printk("Huge alloc blocks %llu, misses %llu\n",
+		IOstats[huge_alloc_blocks], IOstats[huge_alloc_miss]);
+	printk("Checkpoints %llu, delta records %llu, overflows %llu, "
+		"reclaimed blocks %llu\n",
+		Countstats[checkpoint_t], IOstats[ckpt_deltas],
+		IOstats[ckpt_overflows], IOstats[ckpt_reclaimed]);
 
 	for (i = 0; i < sbi->cpus; i++) {
 		free_list = nova_get_free_list(sb, i);
@@ -136,6 +156,28 @@ static void nova_print_alloc_stats(struct super_block *sb)
 		freed_data_pages += free_list->freed_data_pages;
 	}
 
+	for (i = 0; sbi->magazines && i < sbi->cpus; i++) {
+		magazine = &sbi->magazines[i];
+
+		alloc_log_count += magazine->alloc_log_count;
+		alloc_log_pages += magazine->alloc_log_count;
+		alloc_data_count += magazine->alloc_data_count;
+		alloc_data_pages += magazine->alloc_data_count;
+		free_log_count += magazine->free_log_count;
+		freed_log_pages += magazine->free_log_count;
+		free_data_count += magazine->free_data_count;
+		freed_data_pages += magazine->free_data_count;
+	}
+
+	for (i = 0; sbi->log_pools && i < sbi->cpus; i++) {
+		pool = &sbi->log_pools[i];
+
+		alloc_log_count += pool->alloc_count;
+		alloc_log_pages += pool->alloc_count;
+		free_log_count += pool->free_count;
+		freed_log_pages += pool->free_count;
+	}
+
 	printk("alloc log count %lu, allocated log pages %lu, "
 		"alloc data count %lu, allocated data pages %lu, "
 		"free log count %lu, freed log pages %lu, "
@@ -153,6 +195,12 @@ static void nova_print_IO_stats(struct super_block *sb)
 		Countstats[dax_read_t], IOstats[read_bytes],
 		Countstats[dax_read_t] ?
 			IOstats[read_bytes] / Countstats[dax_read_t] : 0);
+	printk("Streaming reads %llu, read runs %llu\n",
+		IOstats[stream_reads], IOstats[read_runs]);
+	printk("Compact log entries %llu, bytes saved %llu\n",
+		IOstats[compact_entries], IOstats[compact_saved_bytes]);
+	printk("QoS throttled writes %llu, denied allocations %llu\n",
+		IOstats[qos_throttles], IOstats[qos_denied]);
 	printk("COW write %llu, bytes %llu, average %llu, "
 		"write breaks %llu, average %llu\n",
 		Countstats[cow_write_t], IOstats[cow_write_bytes],
@@ -160,6 +208,37 @@ static void nova_print_IO_stats(struct super_block *sb)
 			IOstats[cow_write_bytes] / Countstats[cow_write_t] : 0,
 		IOstats[write_breaks], Countstats[cow_write_t] ?
 			IOstats[write_breaks] / Countstats[cow_write_t] : 0);
+	printk("Magazine alloc hit %llu, miss %llu, free hit %llu, "
+		"drain %llu\n",
+		IOstats[magazine_alloc_hit], IOstats[magazine_alloc_miss],
+		IOstats[magazine_free_hit], IOstats[magazine_drain]);
+	printk("Log pool hit %llu, miss %llu, recycled %llu\n",
+		IOstats[log_pool_hit], IOstats[log_pool_miss],
+		IOstats[log_pool_recycled]);
+	printk("Deferred free ranges %llu, freed runs %llu, drains %llu, "
+		"overflows %llu, ENOSPC waits %llu\n",
+		IOstats[deferred_free_ranges], IOstats[deferred_free_runs],
+		Countstats[deferred_free_t], IOstats[deferred_free_overflow],
+		IOstats[deferred_free_waits]);
+	printk("Lite journal transactions %llu, entries %llu, commits %llu\n",
+		Countstats[create_trans_t] + Countstats[link_trans_t] +
+		Countstats[rename_t], IOstats[lite_journal_entries],
+		IOstats[lite_journal_commits]);
+	printk("In-place appends %llu, saved bytes %llu, saved fences %llu\n",
+		IOstats[inplace_appends], IOstats[inplace_saved_bytes],
+		IOstats[inplace_saved_fences]);
+	printk("Write protect windows %llu, nested unlocks %llu\n",
+		Countstats[wprotect_open_t], IOstats[wprotect_nested]);
+	printk("Concurrent write commits %llu\n",
+		IOstats[range_write_commits]);
+	printk("Inline writes %llu, conversions %llu\n",
+		IOstats[inline_writes], IOstats[inline_conversions]);
+	printk("Clones %llu, shared pages %llu, unshared pages %llu\n",
+		Countstats[clone_t], IOstats[clone_pages],
+		IOstats[unshared_pages]);
+	printk("Striped data allocations %llu\n", IOstats[striped_allocs]);
+	printk("Readdir %llu, cache builds %llu\n",
+		Countstats[readdir_t], IOstats[readdir_cache_builds]);
 }
 
 void nova_get_timing_stats(void)
@@ -243,10 +322,99 @@ static void nova_clear_IO_stats(void)
 	}
 }
 
+/* Sum the per-CPU histogram of @category into @hist; returns the count */
+u64 nova_get_latency_stats(int category, u64 *hist)
+{
+	u64 total = 0;
+	int cpu;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		hist[i] = 0;
+		for_each_possible_cpu(cpu)
+			hist[i] += per_cpu(Latencystats_percpu[category][i],
+						cpu);
+		total += hist[i];
+	}
+
+	return total;
+}
+
+/* Upper bound in ns of the @permille-th permille of @hist */
+u64 nova_latency_percentile(u64 *hist, u64 total, unsigned int permille)
+{
+	u64 sum = 0;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		sum += hist[i];
+		if (sum * 1000 >= total * permille)
+			break;
+	}
+
+	if (i == 0)
+		return 0;
+	return i < LATENCY_BUCKETS ? 1ULL << i : 1ULL << (LATENCY_BUCKETS - 1);
+}
+
+void nova_clear_latency_stats(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&Latencystats_percpu, cpu), 0,
+			sizeof(u64) * TIMING_NUM * LATENCY_BUCKETS);
+}
+
 void nova_clear_stats(void)
 {
 	nova_clear_timing_stats();
 	nova_clear_IO_stats();
+	nova_clear_latency_stats();
+}
+
+/*
+ * Count an access in this CPU's hot inode table. When the table is full
+ * the least accessed slot is taken over and its count inherited, so an
+ * inode that stays hot cannot be pushed out by a stream of cold ones.
+ * Counts can be off by up to the inherited value.
+ */
+void nova_update_hot_inode(struct super_block *sb, unsigned long ino,
+	size_t bytes, int write)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_hot_inode *table, *slot, *victim = NULL;
+	int cpu;
+	int i;
+
+	if (!sbi->hot_inodes)
+		return;
+
+	cpu = get_cpu();
+	if (cpu >= sbi->cpus)
+		goto out;
+
+	table = &sbi->hot_inodes[cpu * HOT_INODE_SLOTS];
+	for (i = 0; i < HOT_INODE_SLOTS; i++) {
+		slot = &table[i];
+		if (slot->ino == ino)
+			goto found;
+		if (!victim || slot->ops < victim->ops)
+			victim = slot;
+	}
+
+	slot = victim;
+	slot->ino = ino;
+	slot->read_bytes = 0;
+	slot->write_bytes = 0;
+found:
+	slot->ops++;
+	if (write)
+		slot->write_bytes += bytes;
+	else
+		slot->read_bytes += bytes;
+out:
+	put_cpu();
 }
 
 static inline void nova_print_file_write_entry(struct super_block *sb,
@@ -259,9 +427,22 @@ static inline void nova_print_file_write_entry(struct super_block *sb,
 			entry->invalid_pages, entry->size);
 }
 
+static inline size_t nova_print_inline_data_entry(struct super_block *sb,
+	u64 curr, struct nova_inline_data_entry *entry)
+{
+	nova_dbg("inline data entry @ 0x%llx: data len %u, size %llu\n",
+			curr, le16_to_cpu(entry->data_len), entry->size);
+
+	return NOVA_INLINE_ENTRY_LEN(le16_to_cpu(entry->data_len));
+}
+
 static inline void nova_print_set_attr_entry(struct super_block *sb,
-	u64 curr, struct nova_setattr_logentry *entry)
+	u64 curr, void *addr)
 {
+	struct nova_setattr_logentry buf;
+	struct nova_setattr_logentry *entry;
+
+	entry = nova_read_setattr_entry(addr, &buf);
 	nova_dbg("set attr entry @ 0x%llx: mode %u, size %llu\n",
 			curr, entry->mode, entry->size);
 }
@@ -294,17 +475,22 @@ static u64 nova_print_log_entry(struct super_block *sb, u64 curr)
 	type = nova_get_entry_type(addr);
 	switch (type) {
 		case SET_ATTR:
+		case SET_ATTR_COMPACT:
 			nova_print_set_attr_entry(sb, curr, addr);
-			curr += sizeof(struct nova_setattr_logentry);
+			curr += nova_setattr_entry_len(addr);
 			break;
 		case LINK_CHANGE:
+		case LINK_CHANGE_COMPACT:
 			nova_print_link_change_entry(sb, curr, addr);
-			curr += sizeof(struct nova_link_change_entry);
+			curr += nova_link_change_entry_len(addr);
 			break;
 		case FILE_WRITE:
 			nova_print_file_write_entry(sb, curr, addr);
 			curr += sizeof(struct nova_file_write_entry);
 			break;
+		case FILE_INLINE:
+			curr += nova_print_inline_data_entry(sb, curr, addr);
+			break;
 		case DIR_LOG:
 			size = nova_print_dentry(sb, curr, addr);
 			curr += size;
@@ -360,12 +546,10 @@ void nova_print_nova_log(struct super_block *sb,
 	nova_dbg("Pi %lu: log head 0x%llx, tail 0x%llx\n",
 			sih->ino, curr, pi->log_tail);
 	while (curr != pi->log_tail) {
-		if ((curr & (PAGE_SIZE - 1)) == LAST_ENTRY) {
-			struct nova_inode_page_tail *tail =
-					nova_get_block(sb, curr);
+		if (goto_next_page(sb, curr)) {
 			nova_dbg("Log tail, curr 0x%llx, next page 0x%llx\n",
-					curr, tail->next_page);
-			curr = tail->next_page;
+					curr, next_log_page(sb, curr));
+			curr = next_log_page(sb, curr);
 		} else {
 			curr = nova_print_log_entry(sb, curr);
 		}
@@ -460,10 +644,12 @@ void nova_print_free_lists(struct super_block *sb)
 	for (i = 0; i < sbi->cpus; i++) {
 		free_list = nova_get_free_list(sb, i);
 		nova_dbg("Free list %d: block start %lu, block end %lu, "
-			"num_blocks %lu, num_free_blocks %lu, blocknode %lu\n",
+			"num_blocks %lu, num_free_blocks %lu, blocknode %lu, "
+			"node %d, size classes 0x%lx\n",
 			i, free_list->block_start, free_list->block_end,
 			free_list->block_end - free_list->block_start + 1,
-			free_list->num_free_blocks, free_list->num_blocknode);
+			free_list->num_free_blocks, free_list->num_blocknode,
+			free_list->nid, free_list->size_class_map);
 
 		nova_dbg("Free list %d: alloc log count %lu, "
 			"allocated log pages %lu, alloc data count %lu, "
@@ -47,6 +47,8 @@ enum timing_category {
 	cow_write_t,
 	copy_to_nvmm_t,
 	dax_get_block_t,
+	fallocate_t,
+	clone_t,
 
 	/* Memory operations */
 	memcpy_r_nvmm_t,
@@ -59,12 +61,17 @@ enum timing_category {
 	new_log_blocks_t,
 	free_data_t,
 	free_log_t,
+	deferred_free_t,
 
 	/* Transaction */
 	create_trans_t,
 	link_trans_t,
 	update_tail_t,
 
+	/* Write protection */
+	wprotect_open_t,
+	wprotect_close_t,
+
 	/* Logging */
 	append_dir_entry_t,
 	append_file_entry_t,
@@ -73,6 +80,8 @@ enum timing_category {
 	fast_gc_t,
 	thorough_gc_t,
 	check_invalid_t,
+	log_cleaner_t,
+	checkpoint_t,
 
 	/* Others */
 	find_cache_t,
@@ -104,11 +113,62 @@ enum stats_category {
 	thorough_checked_pages,
 	fast_gc_pages,
 	thorough_gc_pages,
+	magazine_alloc_hit,
+	magazine_alloc_miss,
+	magazine_free_hit,
+	magazine_drain,
+	log_pool_hit,
+	log_pool_miss,
+	log_pool_recycled,
+	deferred_free_ranges,
+	deferred_free_runs,
+	deferred_free_overflow,
+	deferred_free_waits,
+	cleaner_queued,
+	cleaner_inodes,
+	lite_journal_entries,
+	lite_journal_commits,
+	prefetch_inodes,
+	huge_alloc_blocks,
+	huge_alloc_miss,
+	inplace_appends,
+	inplace_saved_bytes,
+	inplace_saved_fences,
+	ckpt_deltas,
+	ckpt_overflows,
+	ckpt_reclaimed,
+	wprotect_nested,
+	readdir_cache_builds,
+	range_write_commits,
+	inline_writes,
+	inline_conversions,
+	clone_pages,
+	unshared_pages,
+	striped_allocs,
+	stream_reads,
+	read_runs,
+	compact_entries,
+	compact_saved_bytes,
+	qos_throttles,
+	qos_denied,
 
 	/* Sentinel */
 	STATS_NUM,
 };
 
+/* Latency histograms: bucket b counts times in [2^(b-1), 2^b) ns */
+#define	LATENCY_BUCKETS		32
+
+/* Per-CPU table of the most accessed inodes, see nova_update_hot_inode */
+#define	HOT_INODE_SLOTS		32
+
+struct nova_hot_inode {
+	unsigned long	ino;
+	u64		ops;
+	u64		read_bytes;
+	u64		write_bytes;
+};
+
 extern const char *Timingstring[TIMING_NUM];
 extern u64 Timingstats[TIMING_NUM];
 DECLARE_PER_CPU(u64[TIMING_NUM], Timingstats_percpu);
@@ -116,6 +176,14 @@ extern u64 Countstats[TIMING_NUM];
 DECLARE_PER_CPU(u64[TIMING_NUM], Countstats_percpu);
 extern u64 IOstats[STATS_NUM];
 DECLARE_PER_CPU(u64[STATS_NUM], IOstats_percpu);
+DECLARE_PER_CPU(u64[TIMING_NUM][LATENCY_BUCKETS], Latencystats_percpu);
+
+static inline int nova_latency_bucket(u64 ns)
+{
+	int bucket = fls64(ns);
+
+	return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
 
 typedef struct timespec timing_t;
 
@@ -125,10 +193,13 @@ typedef struct timespec timing_t;
 #define NOVA_END_TIMING(name, start) \
 	{if (measure_timing) { \
 		timing_t end; \
+		u64 delta; \
 		getrawmonotonic(&end); \
-		__this_cpu_add(Timingstats_percpu[name], \
-			(end.tv_sec - start.tv_sec) * 1000000000 + \
-			(end.tv_nsec - start.tv_nsec)); \
+		delta = (end.tv_sec - start.tv_sec) * 1000000000 + \
+			(end.tv_nsec - start.tv_nsec); \
+		__this_cpu_add(Timingstats_percpu[name], delta); \
+		__this_cpu_inc(Latencystats_percpu[name] \
+				[nova_latency_bucket(delta)]); \
 	} \
 	__this_cpu_add(Countstats_percpu[name], 1); \
 	}
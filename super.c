@@ -38,9 +38,10 @@
 #include <linux/list.h>
 #include "nova.h"
 
+#define CREATE_TRACE_POINTS
+#include "nova_trace.h"
+
 int measure_timing = 0;
-int support_clwb = 0;
-int support_pcommit = 0;
 
 module_param(measure_timing, int, S_IRUGO);
 MODULE_PARM_DESC(measure_timing, "Timing measurement");
@@ -49,6 +50,8 @@ static struct super_operations nova_sops;
 static const struct export_operations nova_export_ops;
 static struct kmem_cache *nova_inode_cachep;
 static struct kmem_cache *nova_range_node_cachep;
+static struct kmem_cache *nova_extent_node_cachep;
+static struct kmem_cache *nova_dir_node_cachep;
 
 /* FIXME: should the following variable be one per NOVA instance? */
 unsigned int nova_dbgmask = 0;
@@ -87,45 +90,18 @@ static void nova_set_blocksize(struct super_block *sb, unsigned long size)
 static int nova_get_block_info(struct super_block *sb,
 	struct nova_sb_info *sbi)
 {
-	void *virt_addr = NULL;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
-	pfn_t __pfn_t;
-#else
-	unsigned long pfn;
-#endif
-	long size;
-
-	if (!sb->s_bdev->bd_disk->fops->direct_access) {
-		nova_err(sb, "device does not support DAX\n");
-		return -EINVAL;
-	}
+	struct nova_device *dev = &sbi->devs[0];
+	int ret;
 
-	sbi->s_bdev = sb->s_bdev;
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
-	size = sb->s_bdev->bd_disk->fops->direct_access(sb->s_bdev,
-					0, &virt_addr, &__pfn_t);
-#else
-	size = sb->s_bdev->bd_disk->fops->direct_access(sb->s_bdev,
-					0, &virt_addr, &pfn);
-#endif
-
-	if (size <= 0) {
-		nova_err(sb, "direct_access failed\n");
-		return -EINVAL;
-	}
+	ret = nova_map_device(sb, sb->s_bdev, dev);
+	if (ret)
+		return ret;
 
-	sbi->virt_addr = virt_addr;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
-	sbi->phys_addr = pfn_t_to_pfn(__pfn_t) << PAGE_SHIFT;
-#else
-	sbi->phys_addr = pfn << PAGE_SHIFT;
-#endif
-	sbi->initsize = size;
-
-	nova_dbg("%s: dev %s, phys_addr 0x%llx, virt_addr %p, size %ld\n",
-		__func__, sbi->s_bdev->bd_disk->disk_name,
-		sbi->phys_addr, sbi->virt_addr, sbi->initsize);
+	sbi->s_bdev = sb->s_bdev;
+	sbi->num_devs = 1;
+	sbi->virt_addr = dev->virt_addr;
+	sbi->phys_addr = dev->phys_addr;
+	sbi->initsize = dev->size;
 
 	return 0;
 }
@@ -147,7 +123,12 @@ enum {
 	Opt_bpi, Opt_init, Opt_mode, Opt_uid,
 	Opt_gid, Opt_blocksize, Opt_wprotect,
 	Opt_err_cont, Opt_err_panic, Opt_err_ro,
-	Opt_dbgmask, Opt_err
+	Opt_dbgmask, Opt_inline_gc, Opt_gc_min_pages,
+	Opt_gc_live_ratio, Opt_gc_throttle, Opt_journal_batch, Opt_prefetch,
+	Opt_hugemmap, Opt_append_inplace, Opt_checkpoint,
+	Opt_concurrent_write, Opt_hot_inodes, Opt_force_recovery,
+	Opt_inline_data, Opt_devices, Opt_stripe,
+	Opt_compact_log, Opt_err
 };
 
 static const match_table_t tokens = {
@@ -161,6 +142,22 @@ static const match_table_t tokens = {
 	{ Opt_err_panic,     "errors=panic"	  },
 	{ Opt_err_ro,	     "errors=remount-ro"  },
 	{ Opt_dbgmask,	     "dbgmask=%u"	  },
+	{ Opt_inline_gc,     "inline_gc"	  },
+	{ Opt_gc_min_pages,  "gc_min_pages=%u"	  },
+	{ Opt_gc_live_ratio, "gc_live_ratio=%u"	  },
+	{ Opt_gc_throttle,   "gc_throttle=%u"	  },
+	{ Opt_journal_batch, "journal_batch=%u"	  },
+	{ Opt_prefetch,	     "prefetch=%u"	  },
+	{ Opt_hugemmap,	     "hugemmap"		  },
+	{ Opt_append_inplace, "append_inplace"	  },
+	{ Opt_checkpoint,    "checkpoint=%u"	  },
+	{ Opt_concurrent_write, "concurrent_write" },
+	{ Opt_hot_inodes,    "hot_inodes"	  },
+	{ Opt_force_recovery, "force_recovery"	  },
+	{ Opt_inline_data,   "inline_data"	  },
+	{ Opt_devices,	     "devices=%s"	  },
+	{ Opt_stripe,	     "stripe=%u"	  },
+	{ Opt_compact_log,   "compact_log"	  },
 	{ Opt_err,	     NULL		  },
 };
 
@@ -237,6 +234,87 @@ static int nova_parse_options(char *options, struct nova_sb_info *sbi,
 				goto bad_val;
 			nova_dbgmask = option;
 			break;
+		case Opt_inline_gc:
+			if (remount)
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, INLINE_GC);
+			break;
+		case Opt_gc_min_pages:
+			if (match_int(&args[0], &option) || option < 1)
+				goto bad_val;
+			sbi->gc_min_pages = option;
+			break;
+		case Opt_gc_live_ratio:
+			if (match_int(&args[0], &option) ||
+					option < 1 || option > 100)
+				goto bad_val;
+			sbi->gc_live_ratio = option;
+			break;
+		case Opt_gc_throttle:
+			if (match_int(&args[0], &option) || option < 0)
+				goto bad_val;
+			sbi->gc_throttle = option;
+			break;
+		case Opt_journal_batch:
+			if (match_int(&args[0], &option) || option < 1)
+				goto bad_val;
+			sbi->journal_batch = option;
+			break;
+		case Opt_prefetch:
+			if (remount)
+				goto bad_opt;
+			if (match_int(&args[0], &option) || option < 0 ||
+					option > PREFETCH_MAX_INODES)
+				goto bad_val;
+			sbi->prefetch_inodes = option;
+			break;
+		case Opt_hugemmap:
+			set_opt(sbi->s_mount_opt, HUGEMMAP);
+			break;
+		case Opt_append_inplace:
+			set_opt(sbi->s_mount_opt, APPEND_INPLACE);
+			break;
+		case Opt_checkpoint:
+			if (remount)
+				goto bad_opt;
+			if (match_int(&args[0], &option) || option < 0)
+				goto bad_val;
+			sbi->ckpt_interval = option;
+			break;
+		case Opt_concurrent_write:
+			set_opt(sbi->s_mount_opt, CONCURRENT_WRITE);
+			break;
+		case Opt_hot_inodes:
+			if (remount)
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, HOT_INODES);
+			break;
+		case Opt_force_recovery:
+			if (remount)
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, FORCE_RECOVERY);
+			break;
+		case Opt_inline_data:
+			set_opt(sbi->s_mount_opt, INLINE_DATA);
+			break;
+		case Opt_devices:
+			if (remount)
+				goto bad_opt;
+			kfree(sbi->dev_paths);
+			sbi->dev_paths = match_strdup(&args[0]);
+			if (!sbi->dev_paths)
+				return -ENOMEM;
+			break;
+		case Opt_stripe:
+			if (match_int(&args[0], &option) || option < 0)
+				goto bad_val;
+			sbi->stripe_blocks = option;
+			break;
+		case Opt_compact_log:
+			if (remount)
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, COMPACT_LOG);
+			break;
 		default: {
 			goto bad_opt;
 		}
@@ -329,6 +407,7 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	super->s_size = cpu_to_le64(size);
 	super->s_blocksize = cpu_to_le32(blocksize);
 	super->s_magic = cpu_to_le32(NOVA_SUPER_MAGIC);
+	nova_format_devices(sb, super);
 
 	nova_init_blockmap(sb, 0);
 
@@ -390,6 +469,13 @@ static struct nova_inode *nova_init(struct super_block *sb,
 static inline void set_default_opts(struct nova_sb_info *sbi)
 {
 	set_opt(sbi->s_mount_opt, HUGEIOREMAP);
+	sbi->gc_min_pages = GC_MIN_PAGES_DEFAULT;
+	sbi->gc_live_ratio = GC_LIVE_RATIO_DEFAULT;
+	sbi->gc_throttle = 0;
+	sbi->journal_batch = 1;
+	sbi->prefetch_inodes = 0;
+	sbi->ckpt_interval = 0;
+	sbi->stripe_blocks = HUGE_PAGE_BLOCKS;
 	set_opt(sbi->s_mount_opt, ERRORS_CONT);
 	sbi->reserved_blocks = RESERVED_BLOCKS;
 	sbi->cpus = num_online_cpus();
@@ -485,6 +571,9 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 		return -ENOMEM;
 	sb->s_fs_info = sbi;
 	sbi->sb = sb;
+	sbi->shared_tree = RB_ROOT;
+	mutex_init(&sbi->shared_mutex);
+	spin_lock_init(&sbi->qos_lock);
 
 	set_default_opts(sbi);
 
@@ -503,6 +592,7 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 
 	/* Init with default values */
 	sbi->shared_free_list.block_free_tree = RB_ROOT;
+	nova_init_size_classes(&sbi->shared_free_list);
 	spin_lock_init(&sbi->shared_free_list.s_lock);
 	sbi->mode = (S_IRUGO | S_IXUGO | S_IWUSR);
 	sbi->uid = current_fsuid();
@@ -526,6 +616,11 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 		inode_map->inode_inuse_tree = RB_ROOT;
 	}
 
+	if (nova_alloc_inode_table_index(sb)) {
+		retval = -ENOMEM;
+		goto out;
+	}
+
 	mutex_init(&sbi->s_lock);
 
 	sbi->zeroed_page = kzalloc(PAGE_SIZE, GFP_KERNEL);
@@ -537,6 +632,20 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 	if (nova_parse_options(data, sbi, 0))
 		goto out;
 
+	retval = nova_open_devices(sb);
+	if (retval)
+		goto out;
+	retval = -EINVAL;
+
+	if (test_opt(sb, HOT_INODES)) {
+		sbi->hot_inodes = kcalloc(sbi->cpus * HOT_INODE_SLOTS,
+				sizeof(struct nova_hot_inode), GFP_KERNEL);
+		if (!sbi->hot_inodes) {
+			retval = -ENOMEM;
+			goto out;
+		}
+	}
+
 	set_opt(sbi->s_mount_opt, MOUNTING);
 
 	if (nova_alloc_block_free_lists(sb)) {
@@ -544,6 +653,11 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 		goto out;
 	}
 
+	if (nova_init_deferred_free(sb)) {
+		retval = -ENOMEM;
+		goto out;
+	}
+
 	/* Init a new nova instance */
 	if (sbi->s_mount_opt & NOVA_MOUNT_FORMAT) {
 		root_pi = nova_init(sb, sbi->initsize);
@@ -564,6 +678,15 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 		goto out;
 	}
 
+	if (nova_check_devices(sb, super))
+		goto out;
+
+	if (le32_to_cpu(super->s_log_version) > NOVA_LOG_VERSION) {
+		nova_err(sb, "Log format %u is newer than supported %u\n",
+			le32_to_cpu(super->s_log_version), NOVA_LOG_VERSION);
+		goto out;
+	}
+
 	if (nova_lite_journal_soft_init(sb)) {
 		retval = -EINVAL;
 		printk(KERN_ERR "Lite journal initialization failed\n");
@@ -596,6 +719,8 @@ setup_sb:
 	if ((sbi->s_mount_opt & NOVA_MOUNT_FORMAT) == 0)
 		nova_recovery(sb);
 
+	nova_build_inode_table_index(sb);
+
 	root_i = nova_iget(sb, NOVA_ROOT_INO);
 	if (IS_ERR(root_i)) {
 		retval = PTR_ERR(root_i);
@@ -624,12 +749,41 @@ setup_sb:
 		PERSISTENT_BARRIER();
 	}
 
+	/* Older modules must not replay the compact entries we will write */
+	if (!(sb->s_flags & MS_RDONLY) && test_opt(sb, COMPACT_LOG) &&
+			le32_to_cpu(super->s_log_version) < NOVA_LOG_COMPACT) {
+		nova_memunlock_range(sb, &super->s_log_version, 4);
+		super->s_log_version = cpu_to_le32(NOVA_LOG_COMPACT);
+		nova_memlock_range(sb, &super->s_log_version, 4);
+
+		nova_flush_buffer(&super->s_log_version, 4, false);
+		PERSISTENT_MARK();
+		PERSISTENT_BARRIER();
+	}
+
+	if (!test_opt(sb, INLINE_GC) && !(sb->s_flags & MS_RDONLY) &&
+			nova_start_log_cleaners(sb))
+		nova_info("NOVA: failed to start log cleaners, "
+			"cleaning logs inline\n");
+
+	if (!(sb->s_flags & MS_RDONLY) && nova_start_checkpoint(sb))
+		nova_info("NOVA: failed to start allocator checkpoints\n");
+
+	if (!(sb->s_flags & MS_RDONLY) && nova_start_log_pool(sb))
+		nova_info("NOVA: failed to start log page pool\n");
+
+	if (nova_start_prefetch(sb))
+		nova_info("NOVA: failed to start inode prefetch\n");
+
 	clear_opt(sbi->s_mount_opt, MOUNTING);
 	retval = 0;
 
 	NOVA_END_TIMING(mount_t, mount_time);
 	return retval;
 out:
+	nova_destroy_deferred_free(sb);
+	nova_destroy_shared_blocks(sb);
+
 	if (sbi->zeroed_page) {
 		kfree(sbi->zeroed_page);
 		sbi->zeroed_page = NULL;
@@ -640,17 +794,36 @@ out:
 		sbi->free_lists = NULL;
 	}
 
+	if (sbi->magazines) {
+		kfree(sbi->magazines);
+		sbi->magazines = NULL;
+	}
+
+	if (sbi->cpu_free_list) {
+		kfree(sbi->cpu_free_list);
+		sbi->cpu_free_list = NULL;
+	}
+
 	if (sbi->journal_locks) {
+		cancel_delayed_work_sync(&sbi->journal_commit_work);
 		kfree(sbi->journal_locks);
 		sbi->journal_locks = NULL;
+		kfree(sbi->journal_batched);
+		sbi->journal_batched = NULL;
 	}
 
+	kfree(sbi->hot_inodes);
+	sbi->hot_inodes = NULL;
+
 	if (sbi->inode_maps) {
+		nova_free_inode_table_index(sb);
 		kfree(sbi->inode_maps);
 		sbi->inode_maps = NULL;
 	}
 
+	nova_close_devices(sb);
 	kfree(sbi);
+	sb->s_fs_info = NULL;
 	return retval;
 }
 
@@ -663,7 +836,8 @@ int nova_statfs(struct dentry *d, struct kstatfs *buf)
 	buf->f_bsize = sb->s_blocksize;
 
 	buf->f_blocks = sbi->num_blocks;
-	buf->f_bfree = buf->f_bavail = nova_count_free_blocks(sb);
+	buf->f_bfree = buf->f_bavail = nova_count_free_blocks(sb) +
+					nova_count_deferred_free_blocks(sb);
 	buf->f_files = LONG_MAX;
 	buf->f_ffree = LONG_MAX - sbi->s_inodes_used_count;
 	buf->f_namelen = NOVA_NAME_LEN;
@@ -700,6 +874,38 @@ static int nova_show_options(struct seq_file *seq, struct dentry *root)
 		seq_puts(seq, ",wprotect");
 	if (test_opt(root->d_sb, DAX))
 		seq_puts(seq, ",dax");
+	if (test_opt(root->d_sb, INLINE_GC))
+		seq_puts(seq, ",inline_gc");
+	if (sbi->gc_min_pages != GC_MIN_PAGES_DEFAULT)
+		seq_printf(seq, ",gc_min_pages=%u", sbi->gc_min_pages);
+	if (sbi->gc_live_ratio != GC_LIVE_RATIO_DEFAULT)
+		seq_printf(seq, ",gc_live_ratio=%u", sbi->gc_live_ratio);
+	if (sbi->gc_throttle)
+		seq_printf(seq, ",gc_throttle=%u", sbi->gc_throttle);
+	if (sbi->journal_batch > 1)
+		seq_printf(seq, ",journal_batch=%u", sbi->journal_batch);
+	if (sbi->prefetch_inodes)
+		seq_printf(seq, ",prefetch=%lu", sbi->prefetch_inodes);
+	if (test_opt(root->d_sb, HUGEMMAP))
+		seq_puts(seq, ",hugemmap");
+	if (test_opt(root->d_sb, APPEND_INPLACE))
+		seq_puts(seq, ",append_inplace");
+	if (sbi->ckpt_interval)
+		seq_printf(seq, ",checkpoint=%u", sbi->ckpt_interval);
+	if (test_opt(root->d_sb, CONCURRENT_WRITE))
+		seq_puts(seq, ",concurrent_write");
+	if (test_opt(root->d_sb, HOT_INODES))
+		seq_puts(seq, ",hot_inodes");
+	if (test_opt(root->d_sb, FORCE_RECOVERY))
+		seq_puts(seq, ",force_recovery");
+	if (test_opt(root->d_sb, INLINE_DATA))
+		seq_puts(seq, ",inline_data");
+	if (sbi->dev_paths)
+		seq_printf(seq, ",devices=%s", sbi->dev_paths);
+	if (sbi->num_devs > 1 && sbi->stripe_blocks != HUGE_PAGE_BLOCKS)
+		seq_printf(seq, ",stripe=%lu", sbi->stripe_blocks);
+	if (test_opt(root->d_sb, COMPACT_LOG))
+		seq_puts(seq, ",compact_log");
 
 	return 0;
 }
@@ -758,7 +964,19 @@ static void nova_put_super(struct super_block *sb)
 
 	/* It's unmount time, so unmap the nova memory */
 //	nova_print_free_lists(sb);
+	nova_stop_prefetch(sb);
+	nova_stop_log_cleaners(sb);
+	nova_stop_log_pool(sb);
+	nova_destroy_deferred_free(sb);
+	nova_stop_checkpoint(sb);
+	if (sbi->journal_locks) {
+		cancel_delayed_work_sync(&sbi->journal_commit_work);
+		nova_flush_lite_journals(sb);
+	}
 	if (sbi->virt_addr) {
+		/* Magazine blocks must be back in the free lists */
+		nova_drain_block_magazines(sb);
+		nova_save_shared_blocks(sb);
 		nova_save_inode_list_to_log(sb);
 		/* Save everything before blocknode mapping! */
 		nova_save_blocknode_mappings_to_log(sb);
@@ -766,11 +984,13 @@ static void nova_put_super(struct super_block *sb)
 	}
 
 	nova_delete_free_lists(sb);
+	nova_destroy_shared_blocks(sb);
 
 	kfree(sbi->zeroed_page);
 	nova_dbgmask = 0;
 	kfree(sbi->free_lists);
 	kfree(sbi->journal_locks);
+	kfree(sbi->journal_batched);
 
 	for (i = 0; i < sbi->cpus; i++) {
 		inode_map = &sbi->inode_maps[i];
@@ -778,10 +998,13 @@ static void nova_put_super(struct super_block *sb)
 			i, inode_map->allocated, inode_map->freed);
 	}
 
+	nova_free_inode_table_index(sb);
 	kfree(sbi->inode_maps);
 
 	nova_sysfs_exit(sb);
+	kfree(sbi->hot_inodes);
 
+	nova_close_devices(sb);
 	kfree(sbi);
 	sb->s_fs_info = NULL;
 }
@@ -822,6 +1045,32 @@ inline struct nova_range_node *nova_alloc_inode_node(struct super_block *sb)
 	return nova_alloc_range_node(sb);
 }
 
+inline struct nova_extent_node *nova_alloc_extent_node(struct super_block *sb)
+{
+	struct nova_extent_node *p;
+	p = (struct nova_extent_node *)
+		kmem_cache_alloc(nova_extent_node_cachep, GFP_NOFS);
+	return p;
+}
+
+inline void nova_free_extent_node(struct nova_extent_node *node)
+{
+	kmem_cache_free(nova_extent_node_cachep, node);
+}
+
+inline struct nova_dir_node *nova_alloc_dir_node(struct super_block *sb)
+{
+	struct nova_dir_node *p;
+	p = (struct nova_dir_node *)
+		kmem_cache_alloc(nova_dir_node_cachep, GFP_NOFS);
+	return p;
+}
+
+inline void nova_free_dir_node(struct nova_dir_node *node)
+{
+	kmem_cache_free(nova_dir_node_cachep, node);
+}
+
 static struct inode *nova_alloc_inode(struct super_block *sb)
 {
 	struct nova_inode_info *vi;
@@ -831,6 +1080,7 @@ static struct inode *nova_alloc_inode(struct super_block *sb)
 		return NULL;
 
 	vi->vfs_inode.i_version = 1;
+	INIT_LIST_HEAD(&vi->header.gc_list);
 
 	return &vi->vfs_inode;
 }
@@ -869,6 +1119,28 @@ static int __init init_rangenode_cache(void)
 	return 0;
 }
 
+static int __init init_extentnode_cache(void)
+{
+	nova_extent_node_cachep = kmem_cache_create("nova_extent_node_cache",
+					sizeof(struct nova_extent_node),
+					0, (SLAB_RECLAIM_ACCOUNT |
+					SLAB_MEM_SPREAD), NULL);
+	if (nova_extent_node_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+static int __init init_dirnode_cache(void)
+{
+	nova_dir_node_cachep = kmem_cache_create("nova_dir_node_cache",
+					sizeof(struct nova_dir_node),
+					0, (SLAB_RECLAIM_ACCOUNT |
+					SLAB_MEM_SPREAD), NULL);
+	if (nova_dir_node_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
 
 static int __init init_inodecache(void)
 {
@@ -896,6 +1168,16 @@ static void destroy_rangenode_cache(void)
 	kmem_cache_destroy(nova_range_node_cachep);
 }
 
+static void destroy_extentnode_cache(void)
+{
+	kmem_cache_destroy(nova_extent_node_cachep);
+}
+
+static void destroy_dirnode_cache(void)
+{
+	kmem_cache_destroy(nova_dir_node_cachep);
+}
+
 /*
  * the super block writes are all done "on the fly", so the
  * super block is never in a "dirty" state, so there's no need
@@ -919,11 +1201,24 @@ static struct dentry *nova_mount(struct file_system_type *fs_type,
 	return mount_bdev(fs_type, flags, dev_name, data, nova_fill_super);
 }
 
+static void nova_kill_sb(struct super_block *sb)
+{
+	/*
+	 * Cleaners and prefetch threads pin inodes; stop them before the
+	 * VFS evicts everything.
+	 */
+	if (NOVA_SB(sb)) {
+		nova_stop_prefetch(sb);
+		nova_stop_log_cleaners(sb);
+	}
+	kill_block_super(sb);
+}
+
 static struct file_system_type nova_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "NOVA",
 	.mount		= nova_mount,
-	.kill_sb	= kill_block_super,
+	.kill_sb	= nova_kill_sb,
 };
 
 static struct inode *nova_nfs_get_inode(struct super_block *sb,
@@ -979,15 +1274,7 @@ static int __init init_nova_fs(void)
 
 	NOVA_START_TIMING(init_t, init_time);
 	nova_dbg("%s: %d cpus online\n", __func__, num_online_cpus());
-	if (arch_has_pcommit())
-		support_pcommit = 1;
-
-	if (arch_has_clwb())
-		support_clwb = 1;
-
-	nova_info("Arch new instructions support: PCOMMIT %s, CLWB %s\n",
-			support_pcommit ? "YES" : "NO",
-			support_clwb ? "YES" : "NO");
+	nova_init_persistence();
 
 	nova_proc_root = proc_mkdir(proc_dirname, NULL);
 
@@ -1005,19 +1292,31 @@ static int __init init_nova_fs(void)
 	if (rc)
 		return rc;
 
-	rc = init_inodecache();
+	rc = init_extentnode_cache();
 	if (rc)
 		goto out1;
 
-	rc = register_filesystem(&nova_fs_type);
+	rc = init_dirnode_cache();
 	if (rc)
 		goto out2;
 
+	rc = init_inodecache();
+	if (rc)
+		goto out3;
+
+	rc = register_filesystem(&nova_fs_type);
+	if (rc)
+		goto out4;
+
 	NOVA_END_TIMING(init_t, init_time);
 	return 0;
 
-out2:
+out4:
 	destroy_inodecache();
+out3:
+	destroy_dirnode_cache();
+out2:
+	destroy_extentnode_cache();
 out1:
 	destroy_rangenode_cache();
 	return rc;
@@ -1028,6 +1327,8 @@ static void __exit exit_nova_fs(void)
 	unregister_filesystem(&nova_fs_type);
 	remove_proc_entry(proc_dirname, NULL);
 	destroy_inodecache();
+	destroy_dirnode_cache();
+	destroy_extentnode_cache();
 	destroy_rangenode_cache();
 }
 
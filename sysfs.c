@@ -18,6 +18,8 @@
  * warranty of any kind, whether express or implied.
  */
 
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
 #include "nova.h"
 
 const char *proc_dirname = "fs/NOVA";
@@ -70,6 +72,152 @@ static const struct file_operations nova_seq_timing_fops = {
 	.release	= single_release,
 };
 
+static int nova_seq_latency_show(struct seq_file *seq, void *v)
+{
+	u64 hist[LATENCY_BUCKETS];
+	u64 total;
+	int i;
+
+	seq_printf(seq, "======== NOVA kernel latency stats ========\n");
+	if (!measure_timing)
+		seq_printf(seq, "Timing measurement is off\n");
+
+	for (i = 0; i < TIMING_NUM; i++) {
+		total = nova_get_latency_stats(i, hist);
+		if (!total)
+			continue;
+		seq_printf(seq, "%s: count %llu, p50 %llu, p99 %llu, "
+			"p999 %llu ns\n", Timingstring[i], total,
+			nova_latency_percentile(hist, total, 500),
+			nova_latency_percentile(hist, total, 990),
+			nova_latency_percentile(hist, total, 999));
+	}
+
+	return 0;
+}
+
+static int nova_seq_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_seq_latency_show, PDE_DATA(inode));
+}
+
+static ssize_t nova_seq_clear_latency(struct file *filp,
+	const char __user *buf, size_t len, loff_t *ppos)
+{
+	nova_clear_latency_stats();
+	return len;
+}
+
+static const struct file_operations nova_seq_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_seq_latency_open,
+	.read		= seq_read,
+	.write		= nova_seq_clear_latency,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int nova_hot_inode_cmp(const void *a, const void *b)
+{
+	const struct nova_hot_inode *x = a, *y = b;
+
+	if (x->ops == y->ops)
+		return 0;
+	return x->ops < y->ops ? 1 : -1;
+}
+
+/* Merge the per-CPU tables and print the hottest inodes first */
+static int nova_seq_hot_inodes_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_hot_inode *merged, *slot;
+	unsigned long num = 0;
+	unsigned long i, j;
+
+	if (!sbi->hot_inodes) {
+		seq_printf(seq, "Mount with hot_inodes to track inodes\n");
+		return 0;
+	}
+
+	merged = vzalloc(sbi->cpus * HOT_INODE_SLOTS *
+				sizeof(struct nova_hot_inode));
+	if (!merged)
+		return -ENOMEM;
+
+	for (i = 0; i < sbi->cpus * HOT_INODE_SLOTS; i++) {
+		slot = &sbi->hot_inodes[i];
+		if (slot->ops == 0)
+			continue;
+		for (j = 0; j < num; j++)
+			if (merged[j].ino == slot->ino)
+				break;
+		if (j == num)
+			merged[num++].ino = slot->ino;
+		merged[j].ops += slot->ops;
+		merged[j].read_bytes += slot->read_bytes;
+		merged[j].write_bytes += slot->write_bytes;
+	}
+
+	sort(merged, num, sizeof(struct nova_hot_inode),
+			nova_hot_inode_cmp, NULL);
+
+	seq_printf(seq, "======== NOVA hot inodes ========\n");
+	for (i = 0; i < num && i < HOT_INODE_SLOTS; i++)
+		seq_printf(seq, "inode %lu: ops %llu, read bytes %llu, "
+			"write bytes %llu\n", merged[i].ino, merged[i].ops,
+			merged[i].read_bytes, merged[i].write_bytes);
+
+	vfree(merged);
+	return 0;
+}
+
+static int nova_seq_hot_inodes_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_seq_hot_inodes_show, PDE_DATA(inode));
+}
+
+static ssize_t nova_seq_clear_hot_inodes(struct file *filp,
+	const char __user *buf, size_t len, loff_t *ppos)
+{
+	struct super_block *sb = PDE_DATA(file_inode(filp));
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (sbi->hot_inodes)
+		memset(sbi->hot_inodes, 0, sbi->cpus * HOT_INODE_SLOTS *
+					sizeof(struct nova_hot_inode));
+	return len;
+}
+
+static const struct file_operations nova_seq_hot_inodes_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_seq_hot_inodes_open,
+	.read		= seq_read,
+	.write		= nova_seq_clear_hot_inodes,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int nova_seq_qos_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_qos_show, PDE_DATA(inode));
+}
+
+static ssize_t nova_seq_set_qos(struct file *filp, const char __user *buf,
+	size_t len, loff_t *ppos)
+{
+	return nova_qos_write(PDE_DATA(file_inode(filp)), buf, len);
+}
+
+static const struct file_operations nova_seq_qos_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_seq_qos_open,
+	.read		= seq_read,
+	.write		= nova_seq_set_qos,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 void nova_sysfs_init(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
@@ -81,6 +229,12 @@ void nova_sysfs_init(struct super_block *sb)
 	if (sbi->s_proc) {
 		proc_create_data("timing_stats", S_IRUGO, sbi->s_proc,
 				 &nova_seq_timing_fops, sb);
+		proc_create_data("latency_stats", S_IRUGO, sbi->s_proc,
+				 &nova_seq_latency_fops, sb);
+		proc_create_data("hot_inodes", S_IRUGO, sbi->s_proc,
+				 &nova_seq_hot_inodes_fops, sb);
+		proc_create_data("qos", S_IRUGO | S_IWUSR, sbi->s_proc,
+				 &nova_seq_qos_fops, sb);
 	}
 }
 
@@ -89,5 +243,8 @@ void nova_sysfs_exit(struct super_block *sb)
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 
 	remove_proc_entry("timing_stats", sbi->s_proc);
+	remove_proc_entry("latency_stats", sbi->s_proc);
+	remove_proc_entry("hot_inodes", sbi->s_proc);
+	remove_proc_entry("qos", sbi->s_proc);
 	remove_proc_entry(sbi->s_bdev->bd_disk->disk_name, nova_proc_root);
 }
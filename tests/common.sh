@@ -0,0 +1,40 @@
+#
+# Helpers for the NOVA regression tests. Each test reloads the module and
+# reformats $DEV, so nothing runs unless DEV names the pmem device to use.
+#
+# Environment:
+#   DEV		pmem device to reformat, required
+#   MNT		mount point (default /mnt/ramdisk)
+
+if [ -z "$DEV" ]; then
+	echo "DEV is not set; the tests reformat it, so name it explicitly" >&2
+	exit 2
+fi
+MNT=${MNT:-/mnt/ramdisk}
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+
+set -e
+
+nova_load() {
+	umount "$MNT" 2>/dev/null || true
+	rmmod nova 2>/dev/null || true
+	insmod "$TOP/nova.ko"
+}
+
+# Mount with the options in $1
+nova_mount() {
+	mount -t NOVA ${1:+-o "$1"} "$DEV" "$MNT"
+}
+
+nova_umount() {
+	umount "$MNT"
+}
+
+fail() {
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+pass() {
+	echo "PASS: $(basename "$0" .sh)"
+}
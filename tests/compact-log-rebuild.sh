@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Fill several log pages with compact setattr and link change entries of
+# varying sizes, so that some end in the last bytes before a page tail,
+# then check that a remount rebuilds the same attributes. Runs once after
+# a clean unmount and once with force_recovery.
+
+. "$(dirname "$0")/common.sh"
+
+F=$MNT/file
+N=2000
+
+snapshot() {
+	stat -c '%a %u %g %s %h %Y %X' "$F"
+}
+
+nova_load
+nova_mount init,compact_log
+
+: > "$F"
+i=0
+while [ $i -lt $N ]; do
+	chmod $(printf %o $((256 + i % 256))) "$F"
+	chown $((i % 70000)):$((i * 7 % 300)) "$F"
+	truncate -s $(((i * 4099) % 1000000)) "$F"
+	touch -m -d "@$((1000000000 + i * 37))" "$F"
+	if [ $((i % 5)) -eq 0 ]; then
+		ln "$F" "$F.link"
+		rm "$F.link"
+	fi
+	i=$((i + 1))
+done
+ln "$F" "$F.link"
+expected=$(snapshot)
+
+for opts in "" force_recovery; do
+	nova_umount
+	nova_mount "$opts"
+	got=$(snapshot)
+	[ "$got" = "$expected" ] ||
+		fail "mount '$opts': expected '$expected', got '$got'"
+done
+
+nova_umount
+pass
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Overwrite and truncate a file in a loop under a tenant capacity limit.
+# The overwritten blocks go through the deferred free path and must be
+# uncharged, so the tenant never hits its cap. A write past the cap must
+# fail.
+
+. "$(dirname "$0")/common.sh"
+
+GID=4242
+LIMIT=2048		# 8M of 4K blocks
+D=$MNT/tenant
+PROC=/proc/fs/NOVA/$(basename "$DEV")/qos
+
+used_blocks() {
+	sed -n "s/^gid $GID: blocks \([0-9]*\),.*/\1/p" "$PROC"
+}
+
+nova_load
+nova_mount init
+
+mkdir "$D"
+chgrp $GID "$D"
+chmod g+s "$D"
+echo "$GID $LIMIT 0" > "$PROC"
+
+i=0
+while [ $i -lt 200 ]; do
+	dd if=/dev/zero of="$D/file" bs=1M count=4 conv=notrunc 2>/dev/null ||
+		fail "overwrite $i failed, $(used_blocks) blocks charged"
+	if [ $((i % 10)) -eq 0 ]; then
+		truncate -s 0 "$D/file"
+	fi
+	i=$((i + 1))
+done
+
+used=$(used_blocks)
+[ "$used" -le 1024 ] || fail "$used blocks charged for a 4M file"
+
+if dd if=/dev/zero of="$D/big" bs=1M count=16 2>/dev/null; then
+	fail "16M write under an 8M cap succeeded"
+fi
+
+echo "$GID 0 0" > "$PROC"
+nova_umount
+pass
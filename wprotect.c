@@ -42,18 +42,39 @@ static inline void wprotect_enable(void)
 	write_cr0(cr0_val);
 }
 
-/* FIXME: Assumes that we are always called in the right order.
- * nova_writeable(vaddr, size, 1);
- * nova_writeable(vaddr, size, 0);
+/*
+ * Unlocked windows nest per CPU: only the outermost nova_writeable() pair
+ * saves the interrupt state and toggles CR0.WP, so a transaction can open
+ * one window around all of its protected stores. Interrupts stay off while
+ * a window is open, which keeps it on one CPU.
  */
+static DEFINE_PER_CPU(int, wprotect_depth);
+static DEFINE_PER_CPU(unsigned long, wprotect_flags);
+
 int nova_writeable(void *vaddr, unsigned long size, int rw)
 {
-	static unsigned long flags;
+	unsigned long flags;
+	timing_t wp_time;
+
 	if (rw) {
 		local_irq_save(flags);
+		if (__this_cpu_inc_return(wprotect_depth) > 1) {
+			NOVA_STATS_ADD(wprotect_nested, 1);
+			return 0;
+		}
+		NOVA_START_TIMING(wprotect_open_t, wp_time);
+		__this_cpu_write(wprotect_flags, flags);
 		wprotect_disable();
+		NOVA_END_TIMING(wprotect_open_t, wp_time);
 	} else {
+		if (WARN_ON_ONCE(__this_cpu_read(wprotect_depth) <= 0))
+			return -EINVAL;
+		if (__this_cpu_dec_return(wprotect_depth) > 0)
+			return 0;
+		NOVA_START_TIMING(wprotect_close_t, wp_time);
+		flags = __this_cpu_read(wprotect_flags);
 		wprotect_enable();
+		NOVA_END_TIMING(wprotect_close_t, wp_time);
 		local_irq_restore(flags);
 	}
 	return 0;
@@ -101,6 +101,22 @@ static inline void nova_memlock_range(struct super_block *sb, void *p,
 		__nova_memlock_range(p, len);
 }
 
+/*
+ * Scoped window for a transaction: the memunlock/memlock calls inside it
+ * nest and do not toggle protection again. Nothing in between may sleep.
+ */
+static inline void nova_memunlock_window(struct super_block *sb)
+{
+	if (nova_is_protected(sb))
+		__nova_memunlock_range(NULL, 0);
+}
+
+static inline void nova_memlock_window(struct super_block *sb)
+{
+	if (nova_is_protected(sb))
+		__nova_memlock_range(NULL, 0);
+}
+
 static inline void nova_memunlock_super(struct super_block *sb,
 					 struct nova_super_block *ps)
 {